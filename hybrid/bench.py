@@ -0,0 +1,243 @@
+#!/usr/bin/env python3
+# bench.py - repeatable benchmark of every relay topology
+#
+# Runs the in-process benchmark (hybrid mode 4) headlessly for each
+# topology and packet size: WARMUP runs that are thrown away, then REPEATS
+# measured runs. Reports the mean and a 95% confidence interval (Student's
+# t) of the delivered rate and the one-way latency percentiles, and writes
+#   <output>.json       summary, with the samples and the run's metadata
+#   <output>.csv        summary, one row per topology and size
+#   <output>_runs.csv   every measured run
+# With --baseline <earlier>.json each result is compared with the earlier
+# one. A change counts as a regression only when the two confidence
+# intervals do not overlap. Regressions make the exit status 1.
+#
+# Topologies:
+#   6rd     generator -> 6RD -> sink            (-H parallel)
+#   teredo  generator -> Teredo -> sink         (-I teredo)
+#   chain   generator -> 6RD -> Teredo -> sink  (-H udp, the default)
+#   fused   the chain with the ring hop         (-H fused)
+#
+# --preset picks the topologies and sizes of one comparison, and the
+# variants compared at each size: sets of extra hybrid options, each run
+# and reported on its own (e.g. --preset uring runs the chain with the
+# epoll engine per datagram and batched, and with io_uring).
+import argparse
+import csv
+import json
+import math
+import os
+import platform
+import shlex
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+TOPOLOGIES = {
+    '6rd': ['-H', 'parallel'],
+    'teredo': ['-I', 'teredo'],
+    'chain': ['-H', 'udp'],
+    'fused': ['-H', 'fused'],
+}
+
+PRESETS = {
+    # Fused ring hop vs the loopback UDP hop between the relays
+    'fused': {'topologies': ['chain', 'fused'], 'sizes': [64, 512, 1400, 9000]},
+    # UDP GSO/GRO offload off and on (-G)
+    'offload': {'topologies': ['chain'], 'sizes': [64, 512, 1400, 9000],
+                'variants': {'plain': '', 'offload': '-G'}},
+    # io_uring engine vs epoll per datagram (the old recvfrom/sendto
+    # pattern) and batched
+    'uring': {'topologies': ['chain'], 'sizes': [64, 9000],
+              'variants': {'epoll-b1': '-E epoll -b 1', 'epoll': '-E epoll', 'uring': '-E uring'}},
+    # 9000 B packets fragmented at each tunnel link MTU, then unlimited
+    'mtu': {'topologies': ['chain'], 'sizes': [9000],
+            'variants': {**{'mtu%d' % m: '-M 6rd:%d -M teredo:%d' % (m, m) for m in (1308, 1500, 4000, 9000)},
+                         'unlimited': ''}},
+    # SO_REUSEPORT workers per relay stage, 1 to the number of CPUs
+    'scaling': {'topologies': ['chain'], 'sizes': [64],
+                'variants': {'w%d' % n: '-w %d' % n for n in range(1, (os.cpu_count() or 1) + 1)}},
+}
+
+# Columns of hybrid's benchmark CSV that are summarised, and what a
+# regression of each looks like
+METRICS = {
+    'ReceivedPps': 'higher',
+    'SentPps': 'higher',
+    'DeliveredPct': 'higher',
+    'OneWayP50Us': 'lower',
+    'OneWayP99Us': 'lower',
+    'OneWayMaxUs': None,  # one outlier decides it; reported, never judged
+}
+
+# Two-sided 95% quantiles of Student's t for 1..30 degrees of freedom
+T95 = [12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+       2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+       2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042]
+
+
+def t95(df):
+    if df < 1:
+        return float('nan')
+    return T95[df - 1] if df <= len(T95) else 1.96
+
+
+def summarise(samples):
+    n = len(samples)
+    mean = statistics.fmean(samples)
+    stdev = statistics.stdev(samples) if n > 1 else 0.0
+    half = t95(n - 1) * stdev / math.sqrt(n) if n > 1 else float('nan')
+    return {'mean': mean, 'stdev': stdev, 'ci95': half, 'min': min(samples), 'max': max(samples),
+            'samples': samples}
+
+
+def run_once(hybrid, topology, variant, size, args):
+    """One benchmark run; returns its CSV row as a dict of floats."""
+    with tempfile.NamedTemporaryFile(suffix='.csv', delete=False) as f:
+        path = f.name
+    os.unlink(path)
+    cmd = [hybrid, '-v', '0', '-s', str(size), '-d', str(args.duration), '-w', str(args.workers),
+           '-b', str(args.batch), '-o', path] + TOPOLOGIES[topology] + shlex.split(args.extra) + \
+        shlex.split(args.variants[variant]) + ['4']
+    try:
+        proc = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True,
+                              timeout=args.duration + 60)
+        if proc.returncode != 0 or not os.path.exists(path):
+            sys.exit('bench: %s failed (%d):\n%s' % (' '.join(cmd), proc.returncode, proc.stderr))
+        with open(path, newline='') as f:
+            row = list(csv.DictReader(f))[-1]
+    finally:
+        if os.path.exists(path):
+            os.unlink(path)
+
+    sent = float(row['SentPps'])
+    received = float(row['ReceivedPps'])
+    row['DeliveredPct'] = round(100.0 * received / sent, 3) if sent > 0 else 0.0
+    return {k: float(row[k]) for k in METRICS}
+
+
+def metadata(args):
+    def git(*cmd):
+        try:
+            return subprocess.run(['git'] + list(cmd), stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                                  text=True, check=True).stdout.strip()
+        except (OSError, subprocess.CalledProcessError):
+            return None
+
+    return {
+        'commit': git('rev-parse', '--short', 'HEAD'),
+        'dirty': bool(git('status', '--porcelain', '--untracked-files=no')),
+        'date': time.strftime('%Y-%m-%dT%H:%M:%S%z'),
+        'kernel': platform.release(),
+        'cpus': os.cpu_count(),
+        'duration_s': args.duration,
+        'repeats': args.repeats,
+        'warmup': args.warmup,
+        'workers': args.workers,
+        'batch': args.batch,
+        'extra': args.extra,
+        'preset': args.preset,
+    }
+
+
+def compare(results, baseline_path):
+    """Print each result against the baseline; returns the regression count."""
+    with open(baseline_path) as f:
+        baseline = {(r['topology'], r.get('variant', ''), r['size']): r for r in json.load(f)['results']}
+
+    regressions = 0
+    print('\nAgainst %s:' % baseline_path)
+    for r in results:
+        old = baseline.get((r['topology'], r['variant'], r['size']))
+        if old is None:
+            continue
+        for metric, better in METRICS.items():
+            if better is None or metric not in old:
+                continue
+            new_m, old_m = r[metric], old[metric]
+            delta = 100.0 * (new_m['mean'] - old_m['mean']) / old_m['mean'] if old_m['mean'] else 0.0
+            new_ci = new_m['ci95'] if not math.isnan(new_m['ci95']) else 0.0
+            old_ci = old_m['ci95'] if not math.isnan(old_m['ci95']) else 0.0
+            if better == 'higher':
+                worse = new_m['mean'] + new_ci < old_m['mean'] - old_ci
+            else:
+                worse = new_m['mean'] - new_ci > old_m['mean'] + old_ci
+            regressions += worse
+            print('  %-16s %5d B %-13s %12.1f -> %12.1f (%+6.1f%%)%s' % (
+                label(r['topology'], r['variant']), r['size'], metric, old_m['mean'], new_m['mean'], delta,
+                '  REGRESSION' if worse else ''))
+    return regressions
+
+
+def label(topology, variant):
+    return topology + '/' + variant if variant else topology
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark every relay topology with confidence intervals.')
+    parser.add_argument('--hybrid', default='./hybrid', help='hybrid binary (default ./hybrid)')
+    parser.add_argument('--preset', choices=list(PRESETS),
+                        help='topologies, sizes and variants of one comparison')
+    parser.add_argument('--topologies', nargs='+', choices=list(TOPOLOGIES),
+                        help='default: all, or those of the preset')
+    parser.add_argument('--sizes', nargs='+', type=int, help='default: 64 1400, or those of the preset')
+    parser.add_argument('--repeats', type=int, default=5)
+    parser.add_argument('--warmup', type=int, default=1)
+    parser.add_argument('--duration', type=int, default=3, help='seconds per run')
+    parser.add_argument('--workers', type=int, default=1)
+    parser.add_argument('--batch', type=int, default=32)
+    parser.add_argument('--extra', default='', help='more hybrid options for every run, e.g. "-E uring"')
+    parser.add_argument('--output', default='bench_results', help='output file prefix')
+    parser.add_argument('--baseline', help='earlier JSON output to compare with')
+    args = parser.parse_args()
+    if args.repeats < 2:
+        parser.error('--repeats must be at least 2 for a confidence interval')
+    preset = PRESETS.get(args.preset, {})
+    args.topologies = args.topologies or preset.get('topologies', list(TOPOLOGIES))
+    args.sizes = args.sizes or preset.get('sizes', [64, 1400])
+    args.variants = preset.get('variants', {'': ''})
+
+    results, runs = [], []
+    for topology in args.topologies:
+        for size in args.sizes:
+            for variant in args.variants:
+                for _ in range(args.warmup):
+                    run_once(args.hybrid, topology, variant, size, args)
+                samples = []
+                for i in range(args.repeats):
+                    sample = run_once(args.hybrid, topology, variant, size, args)
+                    samples.append(sample)
+                    runs.append(dict(Topology=topology, Variant=variant, PacketSize=size, Run=i + 1, **sample))
+                result = {'topology': topology, 'variant': variant, 'size': size}
+                for metric in METRICS:
+                    result[metric] = summarise([s[metric] for s in samples])
+                results.append(result)
+                pps, p99 = result['ReceivedPps'], result['OneWayP99Us']
+                print('%-16s %5d B: %10.0f pps +- %7.0f, one-way p99 %8.1f us +- %6.1f, %5.1f%% delivered' % (
+                    label(topology, variant), size, pps['mean'], pps['ci95'], p99['mean'], p99['ci95'],
+                    result['DeliveredPct']['mean']), flush=True)
+
+    with open(args.output + '.json', 'w') as f:
+        json.dump({'meta': metadata(args), 'results': results}, f, indent=2)
+        f.write('\n')
+    with open(args.output + '.csv', 'w', newline='') as f:
+        w = csv.writer(f)
+        w.writerow(['Topology', 'Variant', 'PacketSize', 'Runs'] +
+                   [c for m in METRICS for c in (m + 'Mean', m + 'Ci95', m + 'Stdev')])
+        for r in results:
+            w.writerow([r['topology'], r['variant'], r['size'], args.repeats] +
+                       ['%.3f' % r[m][k] for m in METRICS for k in ('mean', 'ci95', 'stdev')])
+    with open(args.output + '_runs.csv', 'w', newline='') as f:
+        w = csv.DictWriter(f, fieldnames=['Topology', 'Variant', 'PacketSize', 'Run'] + list(METRICS))
+        w.writeheader()
+        w.writerows(runs)
+    print('Wrote %s.json, %s.csv and %s_runs.csv' % (args.output, args.output, args.output))
+
+    if args.baseline and compare(results, args.baseline) > 0:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
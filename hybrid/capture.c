@@ -0,0 +1,532 @@
+// capture.c - AF_PACKET (TPACKET_V3) and AF_XDP ingress for capture.h
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/if_xdp.h>
+
+#include "capture.h"
+#include "packet.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define TEREDO_UDP_PORT 3544
+
+// AF_PACKET ring: 64 blocks of 64 KB. Smaller blocks fill, and so reach
+// us, sooner; a block still holds any frame a relay buffer can take.
+#define CAPTURE_BLOCK_SIZE (1u << 16)
+#define CAPTURE_BLOCKS 64
+#define CAPTURE_FRAME_SIZE 2048   // nominal; TPACKET_V3 packs frames by their real size
+
+// AF_XDP: one UMEM frame per ring slot, every free frame on the fill ring
+#define XDP_FRAME_SIZE 4096
+#define XDP_RING_SIZE 2048
+#define XDP_MAX_FRAME (XDP_FRAME_SIZE - XDP_PACKET_HEADROOM)  // larger frames go to the kernel
+#define XDP_MAX_QUEUES 64
+
+// One AF_XDP ring, producer/consumer shared with the kernel
+struct xsk_ring {
+    _Atomic uint32_t *producer;
+    _Atomic uint32_t *consumer;
+    void *descs;
+    uint32_t mask;
+    void *map;
+    size_t map_len;
+};
+
+struct capture {
+    enum capture_mode mode;
+    int fd;
+    unsigned long frames;
+    unsigned long dropped;
+    // AF_PACKET
+    unsigned char *ring;
+    size_t ring_len;
+    unsigned block;               // next block to read
+    // AF_XDP
+    unsigned char *umem;
+    size_t umem_len;
+    struct xsk_ring rx, fill, comp;
+};
+
+// The XDP program and its socket map are shared by every capture on the
+// interface and detached when the last one closes
+static pthread_mutex_t xdp_lock = PTHREAD_MUTEX_INITIALIZER;
+static int xdp_ifindex = 0;
+static int xdp_map_fd = -1;
+static int xdp_link_fd = -1;
+static int xdp_users = 0;
+
+int capture_parse(const char *spec, enum capture_mode *mode, char *ifname, size_t ifname_len) {
+    const char *name;
+
+    if (strncmp(spec, "packet:", 7) == 0) {
+        *mode = CAPTURE_PACKET;
+        name = spec + 7;
+    } else if (strncmp(spec, "xdp:", 4) == 0) {
+        *mode = CAPTURE_XDP;
+        name = spec + 4;
+    } else {
+        return -1;
+    }
+    if (*name == '\0' || strlen(name) >= ifname_len || strlen(name) >= IF_NAMESIZE)
+        return -1;
+    strcpy(ifname, name);
+    return 0;
+}
+
+int capture_fd(const struct capture *c) {
+    return c->fd;
+}
+
+// --- AF_PACKET ---
+
+// Accept IPv4 protocol 41 and/or unfragmented UDP to port 3544. A
+// SOCK_DGRAM packet socket filters from the network header.
+static int packet_attach_filter(int fd, unsigned traffic) {
+    enum { ACCEPT = 8, REJECT = 9 };
+    struct sock_filter code[] = {
+        /* 0 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),                        // protocol
+        /* 1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_IPV6, 0, 0),
+        /* 2 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, REJECT - 3),
+        /* 3 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),                        // fragment offset
+        /* 4 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, REJECT - 5, 0),
+        /* 5 */ BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),                       // IPv4 header length
+        /* 6 */ BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),                        // UDP destination port
+        /* 7 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, TEREDO_UDP_PORT, ACCEPT - 8, REJECT - 8),
+        /* 8 */ BPF_STMT(BPF_RET | BPF_K, 0xffffffffu),
+        /* 9 */ BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+
+    code[1].jt = (traffic & CAPTURE_6RD) ? ACCEPT - 2 : REJECT - 2;
+    if (!(traffic & CAPTURE_TEREDO))
+        code[2].jt = REJECT - 3;
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+static int packet_open(struct capture *c, int ifindex, unsigned traffic, int fanout) {
+    int version = TPACKET_V3;
+    struct tpacket_req3 req = {
+        .tp_block_size = CAPTURE_BLOCK_SIZE,
+        .tp_block_nr = CAPTURE_BLOCKS,
+        .tp_frame_size = CAPTURE_FRAME_SIZE,
+        .tp_frame_nr = CAPTURE_BLOCK_SIZE / CAPTURE_FRAME_SIZE * CAPTURE_BLOCKS,
+        .tp_retire_blk_tov = CAPTURE_BLOCK_TIMEOUT_MS,
+    };
+    struct sockaddr_ll addr = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_IP),
+        .sll_ifindex = ifindex,
+    };
+
+    // Protocol 0 until bind, so nothing is queued before the filter is in place
+    c->fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0)
+        return -1;
+    if (packet_attach_filter(c->fd, traffic) < 0 ||
+        setsockopt(c->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+        setsockopt(c->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+        return -1;
+
+    c->ring_len = (size_t)CAPTURE_BLOCK_SIZE * CAPTURE_BLOCKS;
+    c->ring = mmap(NULL, c->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+    if (c->ring == MAP_FAILED) {
+        c->ring = NULL;
+        return -1;
+    }
+    if (bind(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        return -1;
+
+    if (fanout != 0) {
+        int arg = (fanout & 0xffff) | (PACKET_FANOUT_HASH << 16);
+        if (setsockopt(c->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Frames collected for one capture_fn call
+struct capture_batch {
+    const unsigned char *ipv4[CAPTURE_BATCH];
+    size_t len[CAPTURE_BATCH];
+    uint64_t rx_ns[CAPTURE_BATCH];
+    int n;
+};
+
+static void batch_add(struct capture_batch *b, const unsigned char *ipv4, size_t len, uint64_t rx_ns,
+                      capture_fn fn, void *arg) {
+    b->ipv4[b->n] = ipv4;
+    b->len[b->n] = len;
+    b->rx_ns[b->n] = rx_ns;
+    if (++b->n == CAPTURE_BATCH) {
+        fn(arg, b->ipv4, b->len, b->rx_ns, b->n);
+        b->n = 0;
+    }
+}
+
+static void batch_flush(struct capture_batch *b, capture_fn fn, void *arg) {
+    if (b->n > 0)
+        fn(arg, b->ipv4, b->len, b->rx_ns, b->n);
+    b->n = 0;
+}
+
+// Read every block the kernel has handed over, oldest first. A block's
+// frames are handed over before it goes back to the kernel.
+static int packet_poll(struct capture *c, capture_fn fn, void *arg) {
+    struct capture_batch batch;
+    int handed = 0;
+
+    batch.n = 0;
+
+    while (1) {
+        struct tpacket_block_desc *block = (void *)(c->ring + (size_t)c->block * CAPTURE_BLOCK_SIZE);
+        _Atomic uint32_t *status = (_Atomic uint32_t *)&block->hdr.bh1.block_status;
+        if (!(atomic_load_explicit(status, memory_order_acquire) & TP_STATUS_USER))
+            break;
+
+        uint32_t count = block->hdr.bh1.num_pkts;
+        struct tpacket3_hdr *frame = (void *)((unsigned char *)block + block->hdr.bh1.offset_to_first_pkt);
+        for (uint32_t i = 0; i < count; i++) {
+            // Frames larger than a block arrive truncated and are dropped
+            if (frame->tp_snaplen == frame->tp_len) {
+                uint64_t rx_ns = (uint64_t)frame->tp_sec * 1000000000ULL + frame->tp_nsec;
+                batch_add(&batch, (unsigned char *)frame + frame->tp_net, frame->tp_snaplen, rx_ns, fn, arg);
+                handed++;
+            } else {
+                c->dropped++;
+            }
+            frame = (void *)((unsigned char *)frame + frame->tp_next_offset);
+        }
+
+        batch_flush(&batch, fn, arg);
+        atomic_store_explicit(status, TP_STATUS_KERNEL, memory_order_release);
+        c->block = (c->block + 1) % CAPTURE_BLOCKS;
+    }
+    return handed;
+}
+
+// --- AF_XDP ---
+
+static int sys_bpf(int cmd, union bpf_attr *attr) {
+    return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define BPF_INSN(c, dst, src, o, i) \
+    ((struct bpf_insn){ .code = (c), .dst_reg = (dst), .src_reg = (src), .off = (o), .imm = (i) })
+
+// Redirect option-less, unfragmented IPv4 frames of the chosen traffic to
+// the socket of their receive queue; pass everything else (and frames too
+// large for a UMEM frame) on to the kernel. Halfwords are compared in
+// network byte order as loaded.
+static int xdp_load_program(int map_fd, unsigned traffic) {
+    enum { REDIRECT = 19, PASS = 25 };
+    struct bpf_insn insns[] = {
+        /*  0 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, 0, 0),   // data
+        /*  1 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, 4, 0),   // data_end
+        /*  2 */ BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+        /*  3 */ BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETH_HLEN + 24),
+        /*  4 */ BPF_INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, PASS - 5, 0),
+        /*  5 */ BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+        /*  6 */ BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, XDP_MAX_FRAME),
+        /*  7 */ BPF_INSN(BPF_JMP | BPF_JLT | BPF_X, BPF_REG_4, BPF_REG_3, PASS - 8, 0),
+        /*  8 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0),  // ethertype
+        /*  9 */ BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, PASS - 10, htons(ETH_P_IP)),
+        /* 10 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN, 0),
+        /* 11 */ BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, PASS - 12, 0x45),
+        /* 12 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + 6, 0),
+        /* 13 */ BPF_INSN(BPF_JMP | BPF_JSET | BPF_K, BPF_REG_5, 0, PASS - 14, htons(0x3fff)),
+        /* 14 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN + 9, 0),
+        /* 15 */ BPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, REDIRECT - 16, IPPROTO_IPV6),
+        /* 16 */ BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, PASS - 17, IPPROTO_UDP),
+        /* 17 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + 22, 0),
+        /* 18 */ BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, PASS - 19, htons(TEREDO_UDP_PORT)),
+        /* 19 */ BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, 16, 0),  // rx_queue_index
+        /* 20 */ BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+        /* 21 */ BPF_INSN(0, 0, 0, 0, 0),
+        /* 22 */ BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),   // if no socket
+        /* 23 */ BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        /* 24 */ BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        /* 25 */ BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+        /* 26 */ BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    union bpf_attr attr;
+
+    if (!(traffic & CAPTURE_6RD))
+        insns[15].off = 0;
+    if (!(traffic & CAPTURE_TEREDO))
+        insns[16] = BPF_INSN(BPF_JMP | BPF_JA, 0, 0, PASS - 17, 0);
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(uintptr_t)insns;
+    attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    attr.expected_attach_type = BPF_XDP;
+    return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+// Load and attach the XDP program to ifindex unless it already is.
+// Called with xdp_lock held.
+static int xdp_attach(int ifindex, unsigned traffic) {
+    union bpf_attr attr;
+
+    if (xdp_users > 0) {
+        if (ifindex != xdp_ifindex) {
+            errno = EBUSY;
+            return -1;
+        }
+        xdp_users++;
+        return 0;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = XDP_MAX_QUEUES;
+    xdp_map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (xdp_map_fd < 0)
+        return -1;
+
+    int prog_fd = xdp_load_program(xdp_map_fd, traffic);
+    if (prog_fd < 0)
+        goto fail;
+
+    // Through a link, so the program goes away with the process
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    xdp_link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+    int saved = errno;
+    close(prog_fd);
+    errno = saved;
+    if (xdp_link_fd < 0)
+        goto fail;
+
+    xdp_ifindex = ifindex;
+    xdp_users = 1;
+    return 0;
+
+fail:
+    saved = errno;
+    close(xdp_map_fd);
+    xdp_map_fd = -1;
+    errno = saved;
+    return -1;
+}
+
+static void xdp_detach(void) {
+    pthread_mutex_lock(&xdp_lock);
+    if (--xdp_users == 0) {
+        close(xdp_link_fd);
+        close(xdp_map_fd);
+        xdp_link_fd = xdp_map_fd = -1;
+    }
+    pthread_mutex_unlock(&xdp_lock);
+}
+
+static int xsk_map_ring(int fd, struct xsk_ring *ring, const struct xdp_ring_offset *off,
+                        size_t desc_size, off_t pgoff) {
+    ring->map_len = off->desc + XDP_RING_SIZE * desc_size;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        return -1;
+    }
+    ring->producer = (void *)((unsigned char *)ring->map + off->producer);
+    ring->consumer = (void *)((unsigned char *)ring->map + off->consumer);
+    ring->descs = (unsigned char *)ring->map + off->desc;
+    ring->mask = XDP_RING_SIZE - 1;
+    return 0;
+}
+
+static int xdp_open(struct capture *c, int ifindex, unsigned traffic, int queue) {
+    int size = XDP_RING_SIZE;
+    struct xdp_mmap_offsets off;
+    socklen_t off_len = sizeof(off);
+
+    if (queue >= XDP_MAX_QUEUES) {
+        errno = EINVAL;
+        return -1;
+    }
+    c->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (c->fd < 0)
+        return -1;
+
+    c->umem_len = (size_t)XDP_FRAME_SIZE * XDP_RING_SIZE;
+    c->umem = mmap(NULL, c->umem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (c->umem == MAP_FAILED) {
+        c->umem = NULL;
+        return -1;
+    }
+    struct xdp_umem_reg reg = {
+        .addr = (uint64_t)(uintptr_t)c->umem,
+        .len = c->umem_len,
+        .chunk_size = XDP_FRAME_SIZE,
+    };
+    if (setsockopt(c->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(c->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(c->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(c->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+        getsockopt(c->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len) < 0)
+        return -1;
+
+    if (xsk_map_ring(c->fd, &c->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 ||
+        xsk_map_ring(c->fd, &c->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+        xsk_map_ring(c->fd, &c->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0)
+        return -1;
+
+    // Every frame starts out on the fill ring
+    uint64_t *fill = c->fill.descs;
+    for (uint32_t i = 0; i < XDP_RING_SIZE; i++)
+        fill[i] = (uint64_t)i * XDP_FRAME_SIZE;
+    atomic_store_explicit(c->fill.producer, XDP_RING_SIZE, memory_order_release);
+
+    // Zero-copy where the driver supports it, copy mode otherwise
+    struct sockaddr_xdp addr = {
+        .sxdp_family = AF_XDP,
+        .sxdp_ifindex = (uint32_t)ifindex,
+        .sxdp_queue_id = (uint32_t)queue,
+    };
+    if (bind(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        return -1;
+
+    pthread_mutex_lock(&xdp_lock);
+    int attached = xdp_attach(ifindex, traffic);
+    pthread_mutex_unlock(&xdp_lock);
+    if (attached < 0)
+        return -1;
+
+    uint32_t key = (uint32_t)queue, value = (uint32_t)c->fd;
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)xdp_map_fd;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)&value;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        int saved = errno;
+        xdp_detach();
+        errno = saved;
+        return -1;
+    }
+    c->mode = CAPTURE_XDP;
+    return 0;
+}
+
+// Consume the RX ring, putting each frame straight back on the fill ring.
+// The kernel sees the fill ring entries only once the batch is handed over.
+static int xdp_poll(struct capture *c, capture_fn fn, void *arg) {
+    struct capture_batch batch;
+    const struct xdp_desc *descs = c->rx.descs;
+    uint64_t *fill = c->fill.descs;
+    uint32_t cons = atomic_load_explicit(c->rx.consumer, memory_order_relaxed);
+    uint32_t prod = atomic_load_explicit(c->rx.producer, memory_order_acquire);
+    uint32_t fill_prod = atomic_load_explicit(c->fill.producer, memory_order_relaxed);
+    uint64_t rx_ns = packet_now_ns();
+    int handed = 0;
+
+    batch.n = 0;
+    for (; cons != prod; cons++) {
+        const struct xdp_desc *desc = &descs[cons & c->rx.mask];
+        if (desc->len > ETH_HLEN) {
+            batch_add(&batch, c->umem + desc->addr + ETH_HLEN, desc->len - ETH_HLEN, rx_ns, fn, arg);
+            handed++;
+        }
+        fill[fill_prod++ & c->fill.mask] = desc->addr - desc->addr % XDP_FRAME_SIZE;
+    }
+    batch_flush(&batch, fn, arg);
+
+    atomic_store_explicit(c->rx.consumer, cons, memory_order_release);
+    atomic_store_explicit(c->fill.producer, fill_prod, memory_order_release);
+    return handed;
+}
+
+// --- Common ---
+
+struct capture *capture_open(enum capture_mode mode, const char *ifname, unsigned traffic,
+                             int fanout, int queue) {
+    int ifindex = (int)if_nametoindex(ifname);
+    if (ifindex == 0)
+        return NULL;
+
+    struct capture *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return NULL;
+    c->fd = -1;
+
+    int ret = mode == CAPTURE_XDP ? xdp_open(c, ifindex, traffic, queue)
+                                  : packet_open(c, ifindex, traffic, fanout);
+    if (ret < 0) {
+        int saved = errno;
+        capture_close(c);
+        errno = saved;
+        return NULL;
+    }
+    c->mode = mode;
+    return c;
+}
+
+static void unmap(void *addr, size_t len) {
+    if (addr != NULL)
+        munmap(addr, len);
+}
+
+void capture_close(struct capture *c) {
+    if (c == NULL)
+        return;
+    // xdp_open() sets mode only once the program holds a reference
+    if (c->mode == CAPTURE_XDP)
+        xdp_detach();
+    if (c->fd >= 0)
+        close(c->fd);
+    unmap(c->ring, c->ring_len);
+    unmap(c->rx.map, c->rx.map_len);
+    unmap(c->fill.map, c->fill.map_len);
+    unmap(c->comp.map, c->comp.map_len);
+    unmap(c->umem, c->umem_len);
+    free(c);
+}
+
+int capture_poll(struct capture *c, capture_fn fn, void *arg) {
+    int handed = c->mode == CAPTURE_XDP ? xdp_poll(c, fn, arg) : packet_poll(c, fn, arg);
+
+    c->frames += (unsigned long)handed;
+    return handed;
+}
+
+void capture_stats(struct capture *c, unsigned long *frames, unsigned long *dropped) {
+    if (c->mode == CAPTURE_XDP) {
+        struct xdp_statistics st;
+        socklen_t len = sizeof(st);
+        if (getsockopt(c->fd, SOL_XDP, XDP_STATISTICS, &st, &len) == 0)
+            c->dropped = st.rx_dropped + st.rx_ring_full;  // rx_dropped counts an empty fill ring
+    } else {
+        // Reading the counters resets them
+        struct tpacket_stats_v3 st;
+        socklen_t len = sizeof(st);
+        if (getsockopt(c->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+            c->dropped += st.tp_drops;
+    }
+    *frames = c->frames;
+    *dropped = c->dropped;
+}
@@ -0,0 +1,71 @@
+// capture.h - raw-frame ingress for the relays: AF_PACKET and AF_XDP
+//
+// A capture takes tunnelled IPv4 traffic straight off an interface instead
+// of through a UDP socket: 6RD packets (IPv4 protocol 41) and Teredo
+// packets (UDP to port 3544). The kernel filters frames before they reach
+// us, with a classic BPF program on the packet socket or an XDP program in
+// front of the AF_XDP socket, and frames are read in place from memory
+// shared with the kernel:
+//
+// - CAPTURE_PACKET: AF_PACKET with a TPACKET_V3 (PACKET_MMAP) receive ring.
+//   The kernel fills blocks of frames and hands over a block once it is
+//   full or CAPTURE_BLOCK_TIMEOUT_MS after its first frame. Several
+//   captures on one interface with the same fanout group share its traffic
+//   by flow hash.
+// - CAPTURE_XDP: an AF_XDP socket on one interface queue, fed by an XDP
+//   program the first capture on the interface loads and attaches (native
+//   mode where the driver supports it, generic mode elsewhere, loopback
+//   included). Every capture on the interface must take the same traffic;
+//   other frames continue to the kernel stack.
+//
+// Either fd is pollable; a capture belongs to one thread.
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CAPTURE_6RD 0x1     // IPv4 protocol 41
+#define CAPTURE_TEREDO 0x2  // IPv4 UDP to port 3544
+
+#define CAPTURE_BLOCK_TIMEOUT_MS 1  // longest a frame waits in a partly filled block
+
+enum capture_mode {
+    CAPTURE_PACKET,
+    CAPTURE_XDP,
+};
+
+#define CAPTURE_BATCH 64  // most frames handed over in one call
+
+// Called with up to CAPTURE_BATCH captured frames at a time, so their
+// headers can be checked together: frame i is the IPv4 packet ipv4[i],
+// len[i] bytes long. The packets point into the capture ring and are only
+// valid during the call. rx_ns[i] is the kernel's receive time
+// (CLOCK_REALTIME), or the time we read the frame when the kernel does not
+// stamp it (AF_XDP).
+typedef void (*capture_fn)(void *arg, const unsigned char *const *ipv4, const size_t *len, const uint64_t *rx_ns,
+                           int n);
+
+struct capture;
+
+// Parse "<packet|xdp>:<ifname>". Returns 0 on success, -1 if malformed.
+int capture_parse(const char *spec, enum capture_mode *mode, char *ifname, size_t ifname_len);
+
+// Open a capture of traffic (CAPTURE_* flags) on ifname. AF_PACKET captures
+// join fanout group fanout if it is non-zero; an AF_XDP capture binds to
+// interface queue queue. Returns NULL with errno set on failure.
+struct capture *capture_open(enum capture_mode mode, const char *ifname, unsigned traffic,
+                             int fanout, int queue);
+void capture_close(struct capture *c);
+
+int capture_fd(const struct capture *c);
+
+// Hand every frame ready in the ring to fn and give the ring space back
+// to the kernel. Returns the number of frames handed over.
+int capture_poll(struct capture *c, capture_fn fn, void *arg);
+
+// Frames handed over so far, and frames the kernel dropped because the
+// ring was full
+void capture_stats(struct capture *c, unsigned long *frames, unsigned long *dropped);
+
+#endif
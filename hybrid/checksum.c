@@ -0,0 +1,131 @@
+// checksum.c - vector Internet checksum kernels and their runtime choice
+//
+// The kernels add the data as 32-bit words into 64-bit lanes, as
+// csum_partial() does, so the folded sums agree bit for bit: every 32-bit
+// word of a 64-byte (AVX2) or 32-byte (SSE4.2) block is widened to 64 bits
+// by interleaving it with zeros and added into one of four accumulators.
+// A lane cannot overflow below 2^32 words, far beyond any packet. The tail
+// that does not fill a block is left to csum_partial().
+#include <immintrin.h>
+
+#include "checksum.h"
+
+static uint64_t csum_scalar(const void *data, size_t len, uint64_t sum) {
+    return csum_partial(data, len, sum);
+}
+
+__attribute__((target("sse4.2")))
+static uint64_t csum_sse42(const void *data, size_t len, uint64_t sum) {
+    const unsigned char *p = data;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+
+    while (len >= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+        acc2 = _mm_add_epi64(acc2, _mm_unpacklo_epi32(b, zero));
+        acc3 = _mm_add_epi64(acc3, _mm_unpackhi_epi32(b, zero));
+        p += 32;
+        len -= 32;
+    }
+    __m128i acc = _mm_add_epi64(_mm_add_epi64(acc0, acc1), _mm_add_epi64(acc2, acc3));
+    sum += (uint64_t)_mm_extract_epi64(acc, 0) + (uint64_t)_mm_extract_epi64(acc, 1);
+    return csum_partial(p, len, sum);
+}
+
+__attribute__((target("avx2")))
+static uint64_t csum_avx2(const void *data, size_t len, uint64_t sum) {
+    const unsigned char *p = data;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+
+    while (len >= 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+        acc2 = _mm256_add_epi64(acc2, _mm256_unpacklo_epi32(b, zero));
+        acc3 = _mm256_add_epi64(acc3, _mm256_unpackhi_epi32(b, zero));
+        p += 64;
+        len -= 64;
+    }
+    if (len >= 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+        p += 32;
+        len -= 32;
+    }
+    __m256i acc = _mm256_add_epi64(_mm256_add_epi64(acc0, acc1), _mm256_add_epi64(acc2, acc3));
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum += (uint64_t)_mm_extract_epi64(half, 0) + (uint64_t)_mm_extract_epi64(half, 1);
+    return csum_partial(p, len, sum);
+}
+
+static const struct {
+    const char *name;
+    uint64_t (*sum)(const void *data, size_t len, uint64_t sum);
+} impls[] = {
+    [CSUM_SCALAR] = { "scalar", csum_scalar },
+    [CSUM_SSE42] = { "sse4.2", csum_sse42 },
+    [CSUM_AVX2] = { "avx2", csum_avx2 },
+};
+
+static enum csum_impl current = CSUM_SCALAR;
+static uint64_t (*current_sum)(const void *data, size_t len, uint64_t sum) = csum_scalar;
+
+static int cpu_has(enum csum_impl impl) {
+    // __builtin_cpu_supports() needs a literal
+    switch (impl) {
+    case CSUM_SSE42:
+        return __builtin_cpu_supports("sse4.2");
+    case CSUM_AVX2:
+        return __builtin_cpu_supports("avx2");
+    default:
+        return 1;
+    }
+}
+
+// Pick the best kernel before main(), so the data path never checks
+__attribute__((constructor))
+static void csum_init(void) {
+    __builtin_cpu_init();
+    for (int impl = CSUM_AVX2; impl > CSUM_SCALAR; impl--) {
+        if (cpu_has(impl)) {
+            csum_set_impl(impl);
+            return;
+        }
+    }
+}
+
+enum csum_impl csum_get_impl(void) {
+    return current;
+}
+
+const char *csum_impl_name(enum csum_impl impl) {
+    return impl >= CSUM_SCALAR && impl <= CSUM_AVX2 ? impls[impl].name : "?";
+}
+
+int csum_set_impl(enum csum_impl impl) {
+    if (impl < CSUM_SCALAR || impl > CSUM_AVX2 || !cpu_has(impl))
+        return -1;
+    current = impl;
+    current_sum = impls[impl].sum;
+    return 0;
+}
+
+uint64_t csum_partial_bulk(const void *data, size_t len, uint64_t sum) {
+    return current_sum(data, len, sum);
+}
+
+void inet_checksum_batch(const struct iovec *iov, int n, uint16_t *out) {
+    uint64_t (*sum)(const void *, size_t, uint64_t) = current_sum;
+
+    for (int i = 0; i < n; i++) {
+        size_t len = iov[i].iov_len;
+        out[i] = csum_fold(len < CSUM_BULK_MIN ? csum_partial(iov[i].iov_base, len, 0)
+                                               : sum(iov[i].iov_base, len, 0));
+    }
+}
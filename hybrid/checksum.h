@@ -0,0 +1,121 @@
+// checksum.h - Internet checksum (RFC 1071) helpers
+//
+// The one's complement sum is byte-order independent, so data is summed
+// as native-endian words and the folded result can be stored as-is into a
+// network-order header field.
+//
+// csum_partial() is the portable sum, inlined for headers. Longer buffers
+// go through csum_partial_bulk() (checksum.c), which uses AVX2 or SSE4.2
+// kernels when the CPU has them, chosen once at start-up. Both give the
+// same sums.
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#define CSUM_BULK_MIN 64  // shorter buffers are summed inline
+
+enum csum_impl {
+    CSUM_SCALAR,
+    CSUM_SSE42,
+    CSUM_AVX2,
+};
+
+// The kernels in use, the best the CPU supports unless csum_set_impl()
+// chose otherwise
+enum csum_impl csum_get_impl(void);
+const char *csum_impl_name(enum csum_impl impl);
+
+// Use impl from now on, for comparisons. Returns -1 if the CPU lacks it.
+// Not thread-safe: call before the data path starts.
+int csum_set_impl(enum csum_impl impl);
+
+// csum_partial() with the vector kernels
+uint64_t csum_partial_bulk(const void *data, size_t len, uint64_t sum);
+
+// Add len bytes of data to a running (unfolded) sum
+static inline uint64_t csum_partial(const void *data, size_t len, uint64_t sum) {
+    const uint8_t *p = data;
+
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        sum += (w & 0xffffffffu) + (w >> 32);
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        sum += w;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t w;
+        memcpy(&w, p, 2);
+        sum += w;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        uint16_t w = 0;  // odd trailing byte, padded with zero
+        memcpy(&w, p, 1);
+        sum += w;
+    }
+    return sum;
+}
+
+// Fold a running sum to 16 bits and complement it
+static inline uint16_t csum_fold(uint64_t sum) {
+    sum = (sum & 0xffffffffu) + (sum >> 32);
+    sum = (sum & 0xffffffffu) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+static inline uint16_t inet_checksum(const void *data, size_t len) {
+    return csum_fold(len < CSUM_BULK_MIN ? csum_partial(data, len, 0) : csum_partial_bulk(data, len, 0));
+}
+
+// inet_checksum() of each of n buffers, e.g. a recvmmsg batch, into out
+void inet_checksum_batch(const struct iovec *iov, int n, uint16_t *out);
+
+// Incremental update (RFC 1624, eqn. 3) of a stored checksum check after
+// len bytes of the covered data changed from old to new, with len even and
+// the data 16-bit aligned within the checksummed area:
+// HC' = ~(~HC + ~m + m')
+static inline uint16_t csum_replace(uint16_t check, const void *old, const void *new, size_t len) {
+    uint64_t sum = (uint16_t)~check;
+    const uint8_t *o = old, *n = new;
+
+    for (size_t i = 0; i < len; i += 2) {
+        uint16_t a, b;
+        memcpy(&a, o + i, 2);
+        memcpy(&b, n + i, 2);
+        sum += (uint16_t)~a + (uint64_t)b;
+    }
+    return csum_fold(sum);
+}
+
+// The same for one rewritten 32-bit field, e.g. an IPv4 address
+static inline uint16_t csum_replace4(uint16_t check, uint32_t old, uint32_t new) {
+    uint64_t sum = (uint16_t)~check + (uint64_t)(~old & 0xffffffffu) + new;
+    return csum_fold(sum);
+}
+
+// Checksum of an option-less 20-byte IPv4 header, fully unrolled. With the
+// checksum field zeroed this is the value to store; over a received header
+// it is 0 when the header is intact.
+static inline uint16_t ipv4_header_checksum(const void *hdr) {
+    uint32_t w[5];
+    memcpy(w, hdr, sizeof(w));
+    uint64_t sum = (uint64_t)w[0] + w[1] + w[2] + w[3] + w[4];
+    return csum_fold(sum);
+}
+
+#endif
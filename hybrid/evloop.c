@@ -0,0 +1,194 @@
+// evloop.c - epoll loop, timerfd timers and shutdown for evloop.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "evloop.h"
+
+struct evloop_handler {
+    int fd;
+    int timer;      // fd is a timerfd created by the loop
+    evloop_fn fn;
+    void *arg;
+};
+
+struct evloop {
+    int epfd;
+    int stopping;
+    int handler_count;
+    struct evloop_handler handlers[EVLOOP_MAX_HANDLERS];
+};
+
+// Readable (and never drained) once shutdown is requested; every loop
+// watches it level-triggered
+static int shutdown_fd = -1;
+static _Atomic int shutdown_requested = 0;
+static pthread_once_t shutdown_once = PTHREAD_ONCE_INIT;
+
+static void create_shutdown_fd(void) {
+    shutdown_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shutdown_fd < 0)
+        perror("eventfd failed");
+}
+
+struct evloop *evloop_create(void) {
+    pthread_once(&shutdown_once, create_shutdown_fd);
+    if (shutdown_fd < 0)
+        return NULL;
+
+    struct evloop *loop = calloc(1, sizeof(*loop));
+    if (loop == NULL)
+        return NULL;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        free(loop);
+        return NULL;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, shutdown_fd, &ev) < 0) {
+        close(loop->epfd);
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+void evloop_destroy(struct evloop *loop) {
+    if (loop == NULL)
+        return;
+    for (int i = 0; i < loop->handler_count; i++) {
+        if (loop->handlers[i].timer)
+            close(loop->handlers[i].fd);
+    }
+    close(loop->epfd);
+    free(loop);
+}
+
+static int add_handler(struct evloop *loop, int fd, int timer, uint32_t events, evloop_fn fn, void *arg) {
+    if (loop->handler_count == EVLOOP_MAX_HANDLERS)
+        return -1;
+
+    struct evloop_handler *h = &loop->handlers[loop->handler_count];
+    h->fd = fd;
+    h->timer = timer;
+    h->fn = fn;
+    h->arg = arg;
+
+    struct epoll_event ev = { .events = events, .data.ptr = h };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return -1;
+    return loop->handler_count++;
+}
+
+int evloop_add_fd(struct evloop *loop, int fd, evloop_fn fn, void *arg) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+    return add_handler(loop, fd, 0, EPOLLIN | EPOLLET, fn, arg) < 0 ? -1 : 0;
+}
+
+static int set_timer(int fd, long delay_us, long interval_us) {
+    struct itimerspec spec = {
+        .it_interval = { interval_us / 1000000L, (interval_us % 1000000L) * 1000L },
+        .it_value = { delay_us / 1000000L, (delay_us % 1000000L) * 1000L },
+    };
+    return timerfd_settime(fd, 0, &spec, NULL);
+}
+
+int evloop_add_timer(struct evloop *loop, long interval_us, evloop_fn fn, void *arg) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    int timer = add_handler(loop, fd, 1, EPOLLIN, fn, arg);
+    if (timer < 0 || (interval_us > 0 && set_timer(fd, interval_us, interval_us) < 0)) {
+        close(fd);
+        if (timer >= 0)
+            loop->handler_count--;
+        return -1;
+    }
+    return timer;
+}
+
+int evloop_arm_timer(struct evloop *loop, int timer, long delay_us) {
+    if (timer < 0 || timer >= loop->handler_count || !loop->handlers[timer].timer)
+        return -1;
+    return set_timer(loop->handlers[timer].fd, delay_us, 0);
+}
+
+void evloop_run(struct evloop *loop) {
+    struct epoll_event events[EVLOOP_MAX_EVENTS];
+
+    loop->stopping = 0;
+    while (!loop->stopping && !atomic_load_explicit(&shutdown_requested, memory_order_relaxed)) {
+        int n = epoll_wait(loop->epfd, events, EVLOOP_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct evloop_handler *h = events[i].data.ptr;
+            if (h == NULL) {
+                loop->stopping = 1;
+                continue;
+            }
+            if (h->timer) {
+                // Consume the expirations; a disarmed timer may still have one queued
+                uint64_t expirations;
+                if (read(h->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                    continue;
+            }
+            h->fn(h->arg);
+        }
+    }
+}
+
+void evloop_stop(struct evloop *loop) {
+    loop->stopping = 1;
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    evloop_shutdown();
+}
+
+int evloop_init_signals(void) {
+    struct sigaction sa;
+
+    pthread_once(&shutdown_once, create_shutdown_fd);
+    if (shutdown_fd < 0)
+        return -1;
+
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    if (sigaction(SIGINT, &sa, NULL) < 0 || sigaction(SIGTERM, &sa, NULL) < 0)
+        return -1;
+    return 0;
+}
+
+void evloop_shutdown(void) {
+    uint64_t one = 1;
+
+    atomic_store(&shutdown_requested, 1);
+    if (shutdown_fd >= 0 && write(shutdown_fd, &one, sizeof(one)) < 0) {
+        // Already signalled; nothing else is safe to do from a handler
+    }
+}
+
+int evloop_shutting_down(void) {
+    return atomic_load_explicit(&shutdown_requested, memory_order_relaxed);
+}
@@ -0,0 +1,55 @@
+// evloop.h - epoll event loop with timers and signal-driven shutdown
+//
+// One loop per thread. Sockets are registered edge-triggered and made
+// non-blocking, so a read handler must drain its socket until EAGAIN.
+// Timers are timerfds on the same epoll set; a timer's handler runs once
+// per wakeup however many intervals have passed.
+//
+// Shutdown is process wide: evloop_shutdown(), or SIGINT/SIGTERM once
+// evloop_init_signals() has run, makes every loop's evloop_run() return
+// after the handlers of its current wakeup.
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#define EVLOOP_MAX_HANDLERS 32   // fds and timers per loop
+#define EVLOOP_MAX_EVENTS 64     // events taken per epoll_wait
+
+typedef void (*evloop_fn)(void *arg);
+
+struct evloop;
+
+// Returns NULL on failure
+struct evloop *evloop_create(void);
+
+// Close every timer the loop created and the loop itself. Registered
+// sockets are left to their owners.
+void evloop_destroy(struct evloop *loop);
+
+// Make fd non-blocking and call fn(arg) whenever it becomes readable.
+// Returns 0 on success, -1 on failure.
+int evloop_add_fd(struct evloop *loop, int fd, evloop_fn fn, void *arg);
+
+// Create a timer that calls fn(arg). It fires every interval_us, or only
+// when armed with evloop_arm_timer() if interval_us is 0. Returns a timer
+// id, or -1 on failure.
+int evloop_add_timer(struct evloop *loop, long interval_us, evloop_fn fn, void *arg);
+
+// Fire timer once after delay_us; 0 disarms it
+int evloop_arm_timer(struct evloop *loop, int timer, long delay_us);
+
+// Dispatch events until evloop_stop() or a process-wide shutdown
+void evloop_run(struct evloop *loop);
+
+// Make evloop_run() return. Only from the loop's own thread (a handler).
+void evloop_stop(struct evloop *loop);
+
+// Install SIGINT/SIGTERM handlers that call evloop_shutdown(). Returns 0
+// on success, -1 on failure.
+int evloop_init_signals(void);
+
+// Ask every loop in the process to stop; async-signal-safe
+void evloop_shutdown(void);
+
+int evloop_shutting_down(void);
+
+#endif
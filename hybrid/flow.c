@@ -0,0 +1,164 @@
+// flow.c - flow table slow paths, expiry and route table
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+
+#include "flow.h"
+
+#define FLOW_FULL_EXPIRE_BUDGET 4096  // slots scanned before giving up on a full table
+
+void route_init(struct route_table *rt, const struct sockaddr_in *default_hop) {
+    memset(rt, 0, sizeof(*rt));
+    rt->routes[0].next_hop = *default_hop;
+    rt->count = 1;
+}
+
+int route_add(struct route_table *rt, const char *spec) {
+    char prefix[INET_ADDRSTRLEN], hop[INET_ADDRSTRLEN];
+    int len, port;
+    struct in_addr prefix_addr, hop_addr;
+
+    if (rt->count == MAX_ROUTES)
+        return -1;
+    if (sscanf(spec, "%15[0-9.]/%d=%15[0-9.]:%d", prefix, &len, hop, &port) != 4 ||
+        len < 0 || len > 32 || port < 1 || port > 65535 ||
+        inet_pton(AF_INET, prefix, &prefix_addr) != 1 || inet_pton(AF_INET, hop, &hop_addr) != 1)
+        return -1;
+
+    struct route *r = &rt->routes[rt->count++];
+    r->mask = len == 0 ? 0 : 0xffffffffu << (32 - len);
+    r->prefix = ntohl(prefix_addr.s_addr) & r->mask;
+    memset(&r->next_hop, 0, sizeof(r->next_hop));
+    r->next_hop.sin_family = AF_INET;
+    r->next_hop.sin_addr = hop_addr;
+    r->next_hop.sin_port = htons((uint16_t)port);
+    return 0;
+}
+
+int route_resolve(const struct route_table *rt, uint32_t src_ip) {
+    uint32_t ip = ntohl(src_ip);
+    int best = 0;
+
+    for (int i = 1; i < rt->count; i++) {
+        const struct route *r = &rt->routes[i];
+        if ((ip & r->mask) == r->prefix && r->mask >= rt->routes[best].mask)
+            best = i;
+    }
+    return best;
+}
+
+struct flow_table *flow_table_create(uint32_t max_flows, uint32_t idle_timeout,
+                                     enum flow_key_mode key_mode, const struct route_table *routes) {
+    struct flow_table *t = calloc(1, sizeof(*t));
+    uint64_t slots = 2;
+
+    if (t == NULL || max_flows == 0)
+        goto fail;
+    // Keep the load factor at or below 3/4 so probe chains stay short
+    while (slots * 3 < (uint64_t)max_flows * 4)
+        slots <<= 1;
+    if (slots > ((uint64_t)1 << 31))
+        goto fail;
+
+    // Anonymous mappings are zeroed lazily and page aligned, so the table
+    // costs only the pages flows actually touch
+    t->bytes = slots * sizeof(struct flow_entry);
+    t->slots = mmap(NULL, t->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (t->slots == MAP_FAILED)
+        goto fail;
+    madvise(t->slots, t->bytes, MADV_HUGEPAGE);
+
+    t->mask = (uint32_t)(slots - 1);
+    t->max_flows = max_flows;
+    t->idle_timeout = idle_timeout;
+    t->key_mode = key_mode;
+    t->routes = routes;
+    return t;
+
+fail:
+    free(t);
+    return NULL;
+}
+
+void flow_table_destroy(struct flow_table *t) {
+    if (t == NULL)
+        return;
+    munmap(t->slots, t->bytes);
+    free(t);
+}
+
+uint32_t flow_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
+// Remove the entry at index and shift later members of its probe chain back
+// so lookups never need tombstones
+static void flow_remove(struct flow_table *t, uint32_t index) {
+    uint32_t hole = index;
+    uint32_t next = (index + 1) & t->mask;
+
+    for (;;) {
+        struct flow_entry *e = &t->slots[next];
+        if (!(e->meta & FLOW_META_USED))
+            break;
+        uint32_t home = flow_hash(e->addrs, e->meta) & t->mask;
+        // Move e into the hole unless its home slot lies cyclically in (hole, next]
+        if (((next - home) & t->mask) >= ((next - hole) & t->mask)) {
+            t->slots[hole] = *e;
+            hole = next;
+        }
+        next = (next + 1) & t->mask;
+    }
+    memset(&t->slots[hole], 0, sizeof(struct flow_entry));
+    t->count--;
+}
+
+int flow_expire(struct flow_table *t, uint32_t now, int budget) {
+    int evicted = 0;
+
+    if (t->count == 0)
+        return 0;
+    while (budget-- > 0) {
+        uint32_t index = t->expire_cursor;
+        struct flow_entry *e = &t->slots[index];
+        if ((e->meta & FLOW_META_USED) && now - e->last_seen > t->idle_timeout) {
+            // An entry shifted into this slot gets examined on the next step
+            flow_remove(t, index);
+            evicted++;
+            continue;
+        }
+        t->expire_cursor = (index + 1) & t->mask;
+    }
+    t->stats.evictions += evicted;
+    return evicted;
+}
+
+struct flow_entry *flow_insert(struct flow_table *t, uint64_t addrs, uint64_t meta,
+                               uint32_t index, uint32_t now) {
+    if (t->count >= t->max_flows) {
+        // Full: reclaim idle flows; the probe position may have moved
+        if (flow_expire(t, now, FLOW_FULL_EXPIRE_BUDGET) == 0) {
+            t->stats.insert_failed++;
+            return NULL;
+        }
+        index = flow_hash(addrs, meta) & t->mask;
+        while (t->slots[index].meta & FLOW_META_USED)
+            index = (index + 1) & t->mask;
+    }
+
+    uint32_t src_ip = (uint32_t)addrs;
+    struct flow_entry *e = &t->slots[index];
+    e->addrs = addrs;
+    e->meta = meta | ((uint64_t)route_resolve(t->routes, src_ip) << 48);
+    e->last_seen = now;
+    e->packets = 0;
+    e->bytes = 0;
+    t->count++;
+    t->stats.misses++;
+    return e;
+}
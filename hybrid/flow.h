@@ -0,0 +1,155 @@
+// flow.h - per-worker flow table with cached next-hop resolution
+//
+// Open-addressed (linear probing, backward-shift deletion) table of 32-byte
+// entries, two per cache line. Each relay worker owns its own table, so
+// nothing here is locked. A flow's route is resolved once, when the flow
+// is created; after that the forwarding path is one hash lookup. Idle
+// flows are evicted incrementally by flow_expire().
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define MAX_ROUTES 64
+#define FLOW_DEFAULT_MAX 65536
+#define FLOW_DEFAULT_IDLE_TIMEOUT 30  // seconds
+#define FLOW_EXPIRE_BUDGET 16         // slots examined per flow_expire() call
+
+enum flow_key_mode {
+    FLOW_KEY_5TUPLE,    // source/destination address and port, protocol
+    FLOW_KEY_ENDPOINT,  // tunnel endpoint only: source IPv4 and protocol
+};
+
+// Addresses and ports in network byte order
+struct flow_key {
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t proto;
+};
+
+// A route sends flows whose source IPv4 matches prefix/mask to next_hop.
+// Routes are matched longest prefix first; entry 0 is the 0/0 default.
+struct route {
+    uint32_t prefix;  // host order
+    uint32_t mask;    // host order
+    struct sockaddr_in next_hop;
+};
+
+struct route_table {
+    struct route routes[MAX_ROUTES];
+    int count;
+};
+
+// The key is packed into two words so a probe compares 16 bytes in two
+// instructions: addrs = src_ip | dst_ip << 32 and meta = src_port |
+// dst_port << 16 | proto << 32 | in-use << 40 | route << 48.
+struct flow_entry {
+    uint64_t addrs;
+    uint64_t meta;
+    uint32_t last_seen;  // seconds, flow_now()
+    uint32_t packets;
+    uint64_t bytes;
+};
+
+#define FLOW_META_USED ((uint64_t)1 << 40)
+#define FLOW_META_KEY_MASK (((uint64_t)1 << 48) - 1)
+#define FLOW_ROUTE(entry) ((int)((entry)->meta >> 48))
+
+struct flow_stats {
+    unsigned long lookups;
+    unsigned long misses;        // new flows created
+    unsigned long evictions;     // idle flows removed
+    unsigned long insert_failed; // table full, packet routed uncached
+};
+
+struct flow_table {
+    struct flow_entry *slots;
+    uint32_t mask;         // slot count - 1
+    uint32_t count;        // flows in the table
+    uint32_t max_flows;
+    uint32_t idle_timeout;
+    uint32_t expire_cursor;
+    enum flow_key_mode key_mode;
+    const struct route_table *routes;
+    size_t bytes;          // size of the slot array
+    struct flow_stats stats;
+};
+
+// Route table setup. route_init installs default_hop as the 0/0 route.
+void route_init(struct route_table *rt, const struct sockaddr_in *default_hop);
+// Add "a.b.c.d/len=ip:port". Returns 0 on success, -1 if malformed or full.
+int route_add(struct route_table *rt, const char *spec);
+// Longest-prefix match on a source IPv4 (network order); returns the index
+int route_resolve(const struct route_table *rt, uint32_t src_ip);
+
+// Create a table that holds up to max_flows flows in bounded memory (slot
+// count is the next power of two at or above 4/3 max_flows)
+struct flow_table *flow_table_create(uint32_t max_flows, uint32_t idle_timeout,
+                                     enum flow_key_mode key_mode, const struct route_table *routes);
+void flow_table_destroy(struct flow_table *t);
+
+// Coarse monotonic clock in seconds, for last_seen
+uint32_t flow_now(void);
+
+// Slow path of flow_lookup: insert the key at slot index, resolving its route
+struct flow_entry *flow_insert(struct flow_table *t, uint64_t addrs, uint64_t meta,
+                               uint32_t index, uint32_t now);
+
+// Examine up to budget slots for flows idle longer than the timeout.
+// Returns the number evicted.
+int flow_expire(struct flow_table *t, uint32_t now, int budget);
+
+static inline uint32_t flow_hash(uint64_t addrs, uint64_t meta) {
+    uint64_t h = addrs * 0x9e3779b97f4a7c15ull ^ (meta & FLOW_META_KEY_MASK) * 0xc2b2ae3d27d4eb4full;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 32;
+    return (uint32_t)h;
+}
+
+// Find the flow for key, creating it on a miss. Returns NULL only when the
+// table is full; the caller then falls back to route_resolve().
+static inline struct flow_entry *flow_lookup(struct flow_table *t, const struct flow_key *key,
+                                             uint32_t now) {
+    uint64_t addrs, meta;
+
+    if (t->key_mode == FLOW_KEY_ENDPOINT) {
+        addrs = key->src_ip;
+        meta = ((uint64_t)key->proto << 32) | FLOW_META_USED;
+    } else {
+        addrs = key->src_ip | ((uint64_t)key->dst_ip << 32);
+        meta = key->src_port | ((uint64_t)key->dst_port << 16) | ((uint64_t)key->proto << 32) |
+               FLOW_META_USED;
+    }
+
+    t->stats.lookups++;
+    uint32_t index = flow_hash(addrs, meta) & t->mask;
+    for (;;) {
+        struct flow_entry *e = &t->slots[index];
+        if (!(e->meta & FLOW_META_USED))
+            return flow_insert(t, addrs, meta, index, now);
+        if (e->addrs == addrs && (e->meta & FLOW_META_KEY_MASK) == meta) {
+            e->last_seen = now;
+            return e;
+        }
+        index = (index + 1) & t->mask;
+    }
+}
+
+static inline void flow_account(struct flow_entry *flow, int bytes) {
+    flow->packets++;
+    flow->bytes += (uint64_t)bytes;
+}
+
+// Next hop for a flow, or for an uncached packet from src_ip
+static inline const struct sockaddr_in *flow_next_hop(const struct flow_table *t,
+                                                      const struct flow_entry *flow, uint32_t src_ip) {
+    int route = flow != NULL ? FLOW_ROUTE(flow) : route_resolve(t->routes, src_ip);
+    return &t->routes->routes[route].next_hop;
+}
+
+#endif
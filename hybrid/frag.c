@@ -0,0 +1,321 @@
+// frag.c - IPv6 fragmentation and the reassembly cache
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#include "frag.h"
+
+#define FRAG_PROBE 8          // slots after its home slot a partial packet may sit in
+#define FRAG_ID_RANGE_BITS 24 // identifications each thread draws before wrapping
+#define IPV6_NEXT_HOP_BY_HOP 0
+#define IPV6_NEXT_ROUTING 43
+
+// A partial packet. Its bytes live in the cache's data area: the first
+// fragment's fixed header, then the payload at its final offsets.
+struct frag_entry {
+    unsigned char addrs[32];  // source and destination address
+    uint32_t id;
+    uint8_t used;
+    uint8_t next_header;      // from the first fragment's Fragment header
+    uint32_t received;        // payload bytes in place
+    uint32_t total;           // payload bytes of the whole packet, 0 until the last fragment is in
+    uint32_t end;             // furthest payload byte of any fragment so far
+    uint64_t deadline;        // ms
+};
+
+struct frag_cache {
+    struct frag_entry *entries;
+    unsigned char *data;      // IPV6_HEADER_LEN + max_payload bytes per entry
+    uint64_t *blocks;         // block_words bitmap words per entry, one bit per 8 payload bytes
+    unsigned char *atomic;    // an atomic fragment (offset 0, no more) is rebuilt here
+    uint32_t mask;            // slot count - 1
+    uint32_t max_payload;
+    uint32_t block_words;
+    uint32_t timeout_ms;
+    uint32_t expire_cursor;
+    size_t stride;
+    struct frag_stats stats;
+};
+
+static _Atomic uint32_t frag_id_ranges;
+static __thread uint32_t frag_id_base;
+static __thread uint32_t frag_id_count;
+static __thread int frag_id_ready;
+
+uint32_t frag_next_id(void) {
+    if (!frag_id_ready) {
+        frag_id_base = atomic_fetch_add(&frag_id_ranges, 1) << FRAG_ID_RANGE_BITS;
+        frag_id_ready = 1;
+    }
+    return frag_id_base | (frag_id_count++ & ((1u << FRAG_ID_RANGE_BITS) - 1));
+}
+
+int frag_split(const unsigned char *pkt, size_t len, size_t mtu, uint32_t id,
+               unsigned char *out, size_t stride, size_t *lens, int max) {
+    const unsigned char *payload = pkt + IPV6_HEADER_LEN;
+    size_t payload_len = len - IPV6_HEADER_LEN;
+    uint8_t next_header = pkt[6];
+    uint32_t base = 0, more = 0, id_be = htonl(id);
+
+    if (len <= mtu)
+        return 0;
+    if (next_header == IPV6_NEXT_HOP_BY_HOP || next_header == IPV6_NEXT_ROUTING ||
+        mtu < IPV6_HEADER_LEN + IPV6_FRAG_HEADER_LEN + 8)
+        return -1;
+
+    // Splitting a fragment: its pieces keep its place in the original
+    if (next_header == IPV6_NEXT_FRAGMENT) {
+        uint16_t offset;
+        if (payload_len < IPV6_FRAG_HEADER_LEN)
+            return -1;
+        memcpy(&offset, payload + 2, sizeof(offset));
+        next_header = payload[0];
+        base = ntohs(offset) & 0xfff8;
+        more = ntohs(offset) & 1;
+        memcpy(&id_be, payload + 4, sizeof(id_be));
+        payload += IPV6_FRAG_HEADER_LEN;
+        payload_len -= IPV6_FRAG_HEADER_LEN;
+    }
+
+    // Every fragment but the last carries a multiple of 8 bytes
+    size_t chunk = (mtu - IPV6_HEADER_LEN - IPV6_FRAG_HEADER_LEN) & ~(size_t)7;
+    int count = (int)((payload_len + chunk - 1) / chunk);
+    if (count > max || base + payload_len > 0xffff)
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        size_t off = (size_t)i * chunk;
+        size_t n = payload_len - off < chunk ? payload_len - off : chunk;
+        unsigned char *f = out + (size_t)i * stride;
+        uint16_t plen = htons((uint16_t)(IPV6_FRAG_HEADER_LEN + n));
+        uint16_t offset = htons((uint16_t)((base + off) | (i < count - 1 ? 1 : more)));
+
+        memcpy(f, pkt, IPV6_HEADER_LEN);
+        memcpy(f + 4, &plen, sizeof(plen));
+        f[6] = IPV6_NEXT_FRAGMENT;
+        f[IPV6_HEADER_LEN] = next_header;
+        f[IPV6_HEADER_LEN + 1] = 0;
+        memcpy(f + IPV6_HEADER_LEN + 2, &offset, sizeof(offset));
+        memcpy(f + IPV6_HEADER_LEN + 4, &id_be, sizeof(id_be));
+        memcpy(f + IPV6_HEADER_LEN + IPV6_FRAG_HEADER_LEN, payload + off, n);
+        lens[i] = IPV6_HEADER_LEN + IPV6_FRAG_HEADER_LEN + n;
+    }
+    return count;
+}
+
+struct frag_cache *frag_cache_create(uint32_t max_packets, size_t max_len, uint32_t timeout_ms) {
+    struct frag_cache *c = calloc(1, sizeof(*c));
+    uint64_t slots = 1;
+
+    if (c == NULL || max_packets == 0 || max_len <= IPV6_HEADER_LEN || max_len > IPV6_HEADER_LEN + 0xffff)
+        goto fail;
+    while (slots < max_packets)
+        slots <<= 1;
+    c->mask = (uint32_t)(slots - 1);
+    c->max_payload = (uint32_t)(max_len - IPV6_HEADER_LEN);
+    c->block_words = (c->max_payload / 8 + 63) / 64 + 1;
+    c->timeout_ms = timeout_ms;
+    c->stride = max_len;
+    c->entries = calloc(slots, sizeof(*c->entries));
+    c->data = malloc(slots * c->stride);
+    c->blocks = calloc(slots * c->block_words, sizeof(uint64_t));
+    c->atomic = malloc(max_len);
+    if (c->entries == NULL || c->data == NULL || c->blocks == NULL || c->atomic == NULL)
+        goto fail;
+    return c;
+
+fail:
+    frag_cache_destroy(c);
+    return NULL;
+}
+
+void frag_cache_destroy(struct frag_cache *c) {
+    if (c == NULL)
+        return;
+    free(c->entries);
+    free(c->data);
+    free(c->blocks);
+    free(c->atomic);
+    free(c);
+}
+
+static inline uint32_t frag_hash(const unsigned char *addrs, uint32_t id) {
+    uint64_t h = id;
+
+    for (int i = 0; i < 4; i++) {
+        uint64_t w;
+        memcpy(&w, addrs + 8 * i, sizeof(w));
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+    }
+    return (uint32_t)(h >> 32);
+}
+
+static inline uint64_t *frag_blocks(struct frag_cache *c, const struct frag_entry *e) {
+    return c->blocks + (size_t)(e - c->entries) * c->block_words;
+}
+
+static inline unsigned char *frag_data(struct frag_cache *c, const struct frag_entry *e) {
+    return c->data + (size_t)(e - c->entries) * c->stride;
+}
+
+// The partial packet for (addrs, id), started if there is none. Partial
+// packets in the probe window that have timed out are freed on the way;
+// if the window is full, its oldest packet is evicted.
+static struct frag_entry *frag_find(struct frag_cache *c, const unsigned char *addrs, uint32_t id,
+                                    uint64_t now) {
+    uint32_t home = frag_hash(addrs, id);
+    struct frag_entry *match = NULL, *free_slot = NULL, *oldest = NULL;
+    int probes = c->mask + 1 < FRAG_PROBE ? (int)c->mask + 1 : FRAG_PROBE;
+
+    for (int p = 0; p < probes; p++) {
+        struct frag_entry *e = &c->entries[(home + p) & c->mask];
+        if (e->used && now >= e->deadline) {
+            c->stats.timed_out++;
+            e->used = 0;
+        }
+        if (!e->used) {
+            if (free_slot == NULL)
+                free_slot = e;
+        } else if (e->id == id && memcmp(e->addrs, addrs, sizeof(e->addrs)) == 0) {
+            match = e;
+        } else if (oldest == NULL || e->deadline < oldest->deadline) {
+            oldest = e;
+        }
+    }
+    if (match != NULL)
+        return match;
+    if (free_slot == NULL) {
+        c->stats.evicted++;
+        free_slot = oldest;
+    }
+
+    struct frag_entry *e = free_slot;
+    memcpy(e->addrs, addrs, sizeof(e->addrs));
+    e->id = id;
+    e->used = 1;
+    e->received = e->total = e->end = 0;
+    e->deadline = now + c->timeout_ms;
+    memset(frag_blocks(c, e), 0, c->block_words * sizeof(uint64_t));
+    return e;
+}
+
+// Mark blocks [first, end) as received. Returns -1, marking nothing, if
+// any of them already was.
+static int frag_claim(uint64_t *map, uint32_t first, uint32_t end) {
+    uint32_t last = end - 1;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t w = first / 64; w <= last / 64; w++) {
+            uint64_t bits = ~0ULL;
+            if (w == first / 64)
+                bits &= ~0ULL << (first % 64);
+            if (w == last / 64)
+                bits &= ~0ULL >> (63 - last % 64);
+            if (pass == 0 && (map[w] & bits) != 0)
+                return -1;
+            if (pass == 1)
+                map[w] |= bits;
+        }
+    }
+    return 0;
+}
+
+long frag_reassemble(struct frag_cache *c, const unsigned char *pkt, size_t len, uint64_t now_ms,
+                     const unsigned char **out) {
+    long total = ipv6_parse_header(pkt, len);
+
+    if (total < 0 || pkt[6] != IPV6_NEXT_FRAGMENT) {
+        *out = pkt;
+        return (long)len;
+    }
+    c->stats.fragments++;
+    if (total < IPV6_HEADER_LEN + IPV6_FRAG_HEADER_LEN) {
+        c->stats.invalid++;
+        return -1;
+    }
+
+    const unsigned char *frag = pkt + IPV6_HEADER_LEN;
+    const unsigned char *payload = frag + IPV6_FRAG_HEADER_LEN;
+    uint32_t n = (uint32_t)total - IPV6_HEADER_LEN - IPV6_FRAG_HEADER_LEN;
+    uint16_t offset_be;
+    uint32_t id_be;
+    memcpy(&offset_be, frag + 2, sizeof(offset_be));
+    memcpy(&id_be, frag + 4, sizeof(id_be));
+    uint32_t offset = ntohs(offset_be) & 0xfff8;
+    int more = ntohs(offset_be) & 1;
+    uint16_t plen;
+
+    // An atomic fragment is a whole packet (RFC 6946)
+    if (offset == 0 && !more) {
+        if (n > c->max_payload) {
+            c->stats.invalid++;
+            return -1;
+        }
+        plen = htons((uint16_t)n);
+        memcpy(c->atomic, pkt, IPV6_HEADER_LEN);
+        memcpy(c->atomic + 4, &plen, sizeof(plen));
+        c->atomic[6] = frag[0];
+        memcpy(c->atomic + IPV6_HEADER_LEN, payload, n);
+        c->stats.reassembled++;
+        *out = c->atomic;
+        return IPV6_HEADER_LEN + (long)n;
+    }
+
+    if (n == 0 || (more && n % 8 != 0) || offset + n > c->max_payload) {
+        c->stats.invalid++;
+        return -1;
+    }
+
+    struct frag_entry *e = frag_find(c, pkt + 8, ntohl(id_be), now_ms);
+    uint32_t end = offset + n;
+    if ((!more && (e->total != 0 || e->end > end)) || (e->total != 0 && end > e->total) ||
+        frag_claim(frag_blocks(c, e), offset / 8, (end + 7) / 8) < 0) {
+        // Overlapping or inconsistent: the whole packet goes (RFC 5722)
+        c->stats.invalid++;
+        e->used = 0;
+        return -1;
+    }
+
+    unsigned char *data = frag_data(c, e);
+    memcpy(data + IPV6_HEADER_LEN + offset, payload, n);
+    if (offset == 0) {
+        memcpy(data, pkt, IPV6_HEADER_LEN);
+        e->next_header = frag[0];
+    }
+    if (!more)
+        e->total = end;
+    if (end > e->end)
+        e->end = end;
+    e->received += n;
+    if (e->total == 0 || e->received != e->total)
+        return 0;
+
+    plen = htons((uint16_t)e->total);
+    memcpy(data + 4, &plen, sizeof(plen));
+    data[6] = e->next_header;
+    e->used = 0;
+    c->stats.reassembled++;
+    *out = data;
+    return IPV6_HEADER_LEN + (long)e->total;
+}
+
+void frag_expire(struct frag_cache *c, uint64_t now_ms, int budget) {
+    for (int i = 0; i < budget && (uint32_t)i <= c->mask; i++) {
+        struct frag_entry *e = &c->entries[c->expire_cursor];
+        if (e->used && now_ms >= e->deadline) {
+            c->stats.timed_out++;
+            e->used = 0;
+        }
+        c->expire_cursor = (c->expire_cursor + 1) & c->mask;
+    }
+}
+
+int frag_expire_budget(const struct frag_cache *c, uint32_t period_ms) {
+    uint64_t slots = (uint64_t)c->mask + 1;
+    return (int)(slots * period_ms / ((uint64_t)c->timeout_ms + 1)) + FRAG_EXPIRE_BUDGET;
+}
+
+void frag_cache_stats(const struct frag_cache *c, struct frag_stats *stats) {
+    *stats = c->stats;
+}
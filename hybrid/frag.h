@@ -0,0 +1,103 @@
+// frag.h - tunnel MTU model and IPv6 fragmentation/reassembly
+//
+// A tunnel carries an inner IPv6 packet behind its own outer headers, so
+// the largest inner packet it takes in one piece is the MTU of the link it
+// runs over minus that overhead. Larger inner packets are split into IPv6
+// fragments (RFC 8200 section 4.5) that each fit, and put back together by
+// a reassembly cache at the far end.
+//
+// The cache holds a fixed number of partial packets, each in a buffer of
+// its own with a bitmap of the 8-byte blocks received so far. A fragment
+// is placed with one hash lookup and one copy to its offset, whatever the
+// number of fragments already held. Overlapping fragments drop the packet
+// (RFC 5722). Partial packets are given up after a timeout, or evicted
+// oldest first when a new packet finds no free slot. A cache belongs to
+// one thread; nothing here is locked.
+//
+// Only the fixed 40-byte header is treated as unfragmentable: packets with
+// a hop-by-hop or routing header are not fragmented, and fragments whose
+// Fragment header does not directly follow the fixed header pass through
+// reassembly untouched.
+#ifndef FRAG_H
+#define FRAG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ip.h"
+
+#define IPV6_NEXT_FRAGMENT 44
+#define IPV6_FRAG_HEADER_LEN 8
+#define IPV6_MIN_MTU 1280  // every IPv6 link must carry packets this large
+
+// Encapsulation overhead in front of the inner IPv6 packet
+#define TUNNEL_6RD_OVERHEAD IPV4_HEADER_LEN          // RFC 5969: IPv4, protocol 41
+#define TUNNEL_TEREDO_OVERHEAD (IPV4_HEADER_LEN + 8) // RFC 4380: IPv4 and UDP
+
+#define FRAG_DEFAULT_PACKETS 1024    // partial packets held per cache
+#define FRAG_DEFAULT_TIMEOUT_MS 1000 // shorter than RFC 8200's 60 s, so lost fragments free slots quickly
+#define FRAG_EXPIRE_BUDGET 16        // slots examined per frag_expire() call at least
+
+// MTU of one tunnel: the link it runs over and what its headers take
+struct tunnel_mtu {
+    int link_mtu;  // 0 = not limited
+    int overhead;
+};
+
+// Largest inner IPv6 packet the tunnel carries in one piece, 0 if unlimited
+static inline int tunnel_inner_mtu(const struct tunnel_mtu *t) {
+    return t->link_mtu > 0 ? t->link_mtu - t->overhead : 0;
+}
+
+// A fresh Fragment header identification. Each thread draws from its own
+// range, so threads fragmenting packets between the same addresses do not
+// collide at the reassembler.
+uint32_t frag_next_id(void);
+
+// Split the IPv6 packet at pkt (len bytes, as checked by ipv6_parse_header)
+// into fragments of at most mtu bytes, each with its own copy of the fixed
+// header and a Fragment header with identification id. Fragment i is
+// written to out + i * stride and its length stored in lens[i]. A packet
+// that is already a fragment is split further, keeping its identification
+// and offsets. Returns the number of fragments, 0 if the packet fits in
+// mtu as it is, or -1 if it cannot be fragmented (an extension header in
+// the way, mtu too small, or more than max fragments needed).
+int frag_split(const unsigned char *pkt, size_t len, size_t mtu, uint32_t id,
+               unsigned char *out, size_t stride, size_t *lens, int max);
+
+struct frag_stats {
+    unsigned long fragments;    // fragments taken in
+    unsigned long reassembled;  // packets completed
+    unsigned long timed_out;    // partial packets given up after the timeout
+    unsigned long evicted;      // partial packets pushed out by a full cache
+    unsigned long invalid;      // fragments dropped: malformed, overlapping or too large
+};
+
+struct frag_cache;
+
+// A cache for up to max_packets partial packets (rounded up to a power of
+// two) of up to max_len bytes each, given up timeout_ms after their first
+// fragment. Returns NULL if allocation fails.
+struct frag_cache *frag_cache_create(uint32_t max_packets, size_t max_len, uint32_t timeout_ms);
+void frag_cache_destroy(struct frag_cache *c);
+
+// Take the IPv6 packet at pkt (len bytes). A packet that is not a fragment
+// is handed straight back. A fragment is stored; if it completes its
+// packet, the reassembled packet is handed back. The packet is returned in
+// *out, valid until the next call, and its length is the return value.
+// Returns 0 if the fragment was stored and the packet is still incomplete,
+// -1 if the fragment was dropped. now_ms is any millisecond clock.
+long frag_reassemble(struct frag_cache *c, const unsigned char *pkt, size_t len, uint64_t now_ms,
+                     const unsigned char **out);
+
+// Give up on partial packets past their timeout, examining up to budget
+// slots from where the previous call stopped
+void frag_expire(struct frag_cache *c, uint64_t now_ms, int budget);
+
+// Expiry budget that sweeps the whole cache about once per timeout when
+// frag_expire() runs every period_ms
+int frag_expire_budget(const struct frag_cache *c, uint32_t period_ms);
+
+void frag_cache_stats(const struct frag_cache *c, struct frag_stats *stats);
+
+#endif
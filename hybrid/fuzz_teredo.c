@@ -0,0 +1,265 @@
+// fuzz_teredo.c - fuzz target for the Teredo packet parser
+//
+// Every input goes through teredo_parse and, when it parses, through the
+// functions a relay or server then applies to it. A parse must account for
+// every byte it claims: the authentication encapsulation, origin indication
+// and IPv6 packet lie back to back inside the input, and rebuilding the
+// Teredo headers from the parsed fields with the teredo_build_* functions
+// gives the same bytes. A failed check aborts, so that the sanitizers and
+// libFuzzer report it like a crash.
+//
+// Built with -DFUZZ_LIBFUZZER this is a libFuzzer target (make
+// fuzz_teredo_libfuzzer, with clang). Otherwise main() replays the files
+// given on the command line, or runs -n inputs: valid packets of each kind
+// with random bytes flipped, overwritten, truncated or appended, and fully
+// random ones.
+//
+//   fuzz_teredo [-n inputs] [-s seed] [file...]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "teredo.h"
+#include "ip.h"
+
+#define FUZZ_MAX_LEN 2048
+
+#define CHECK(cond)                                                                   \
+    do {                                                                              \
+        if (!(cond)) {                                                                \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            abort();                                                                  \
+        }                                                                             \
+    } while (0)
+
+static const unsigned char fuzz_nonce[TEREDO_NONCE_LEN] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+static void check_address(const unsigned char *field) {
+    struct in6_addr addr;
+    struct teredo_addr fields;
+
+    memcpy(&addr, field, sizeof(addr));
+    if (teredo_addr_decode(&addr, &fields)) {
+        struct in6_addr again;
+        teredo_addr_encode(&fields, &again);
+        CHECK(memcmp(&again, &addr, sizeof(addr)) == 0);
+    }
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size) {
+    // An exact-size copy, so that ASan sees any read past the end
+    unsigned char *buf = malloc(size > 0 ? size : 1);
+    struct teredo_packet pkt;
+
+    if (buf == NULL)
+        return 0;
+    memcpy(buf, data, size);
+    if (teredo_parse(buf, size, &pkt) < 0) {
+        free(buf);
+        return 0;
+    }
+
+    // The parts lie back to back, and the IPv6 packet is well formed
+    size_t off = 0;
+    if (pkt.auth != NULL) {
+        CHECK(pkt.auth == buf && buf[0] == 0x00 && buf[1] == 0x01);
+        CHECK(pkt.id_len == buf[2] && pkt.auth_len == buf[3]);
+        CHECK(pkt.client_id == buf + 4 && pkt.auth_value == pkt.client_id + pkt.id_len);
+        CHECK(pkt.nonce == pkt.auth_value + pkt.auth_len);
+        off = TEREDO_AUTH_MIN_LEN + pkt.id_len + pkt.auth_len;
+        CHECK(pkt.confirmation == buf[off - 1]);
+    }
+    if (pkt.has_origin)
+        off += TEREDO_ORIGIN_LEN;
+    CHECK(pkt.ipv6 == buf + off);
+    CHECK(pkt.ipv6_len >= IPV6_HEADER_LEN && pkt.ipv6_len <= size - off);
+    CHECK(pkt.ipv6[0] >> 4 == 6);
+    CHECK(pkt.ipv6_len == IPV6_HEADER_LEN + ((size_t)pkt.ipv6[4] << 8 | pkt.ipv6[5]));
+
+    // Rebuilt from the parsed fields, the Teredo headers come out the same
+    unsigned char rebuilt[TEREDO_AUTH_MIN_LEN + 2 * 255 + TEREDO_ORIGIN_LEN];
+    size_t len = 0;
+    if (pkt.auth != NULL)
+        len = teredo_build_auth(rebuilt, pkt.client_id, pkt.id_len, pkt.auth_value, pkt.auth_len,
+                                pkt.nonce, pkt.confirmation);
+    if (pkt.has_origin)
+        len += teredo_build_origin(rebuilt + len, pkt.origin_port, pkt.origin_ipv4);
+    CHECK(len == off && memcmp(rebuilt, buf, len) == 0);
+
+    // What the server and client do with a parsed packet
+    int cone;
+    struct teredo_qualification q;
+    check_address(pkt.ipv6 + 8);
+    check_address(pkt.ipv6 + 24);
+    if (teredo_is_bubble(&pkt))
+        CHECK(pkt.ipv6_len == IPV6_HEADER_LEN);
+    if (teredo_is_rs(&pkt, &cone)) {
+        unsigned char ra[256];
+        struct teredo_packet reply;
+        size_t ra_len = teredo_build_ra(ra, &pkt, htonl(0xc0000201), htons(4096), htonl(0xc6336401));
+        CHECK(ra_len <= sizeof(ra));
+        CHECK(teredo_parse(ra, ra_len, &reply) == 0 && reply.ipv6_len + (size_t)(reply.ipv6 - ra) == ra_len);
+        if (pkt.auth != NULL) {
+            CHECK(teredo_parse_ra(&reply, pkt.nonce, &q) == 0);
+            CHECK(q.mapped_port == htons(4096) && q.mapped_ipv4 == htonl(0xc6336401));
+        }
+    }
+    if (teredo_parse_ra(&pkt, fuzz_nonce, &q) == 0)
+        CHECK(pkt.auth != NULL && pkt.has_origin && q.mapped_port == pkt.origin_port);
+
+    free(buf);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+static uint64_t rng_state;
+
+static uint64_t fuzz_random(void) {
+    uint64_t x = rng_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rng_state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+// A valid packet of one of the kinds the parser takes: plain IPv6, behind
+// an origin indication, behind authentication (with and without an
+// origin indication), a bubble, a router solicitation or advertisement
+static size_t fuzz_seed_packet(unsigned char *buf, int kind) {
+    struct in6_addr src, dst;
+    struct teredo_addr client = { htonl(0xc0000201), TEREDO_FLAG_CONE, htons(4096), htonl(0xc6336401) };
+    unsigned char id[16], value[24];
+    size_t off = 0;
+    uint16_t payload = (uint16_t)(fuzz_random() % 256);
+
+    if (kind == 5)
+        return teredo_build_rs(buf, fuzz_nonce, (int)(fuzz_random() & 1));
+    if (kind == 6) {
+        struct teredo_packet rs;
+        unsigned char solicit[128];
+        teredo_parse(solicit, teredo_build_rs(solicit, fuzz_nonce, 0), &rs);
+        return teredo_build_ra(buf, &rs, htonl(0xc0000201), htons(4096), htonl(0xc6336401));
+    }
+    if (kind == 2 || kind == 3) {
+        for (size_t i = 0; i < sizeof(id); i++)
+            id[i] = (unsigned char)fuzz_random();
+        for (size_t i = 0; i < sizeof(value); i++)
+            value[i] = (unsigned char)fuzz_random();
+        off = teredo_build_auth(buf, id, (uint8_t)(fuzz_random() % sizeof(id)), value,
+                                (uint8_t)(fuzz_random() % sizeof(value)), fuzz_nonce, 0);
+    }
+    if (kind == 1 || kind == 3)
+        off += teredo_build_origin(buf + off, htons(4096), htonl(0xc6336401));
+    teredo_addr_encode(&client, &src);
+    memset(&dst, 0, sizeof(dst));
+    dst.s6_addr[0] = 0x20;
+    dst.s6_addr[1] = 0x01;
+    dst.s6_addr[15] = 1;
+    if (kind == 4)
+        return off + ipv6_build_header(buf + off, &src, &dst, IPV6_NEXT_NONE, 0, 64);
+    off += ipv6_build_header(buf + off, &src, &dst, 17, payload, 64);
+    for (int i = 0; i < payload; i++)
+        buf[off++] = (unsigned char)fuzz_random();
+    return off;
+}
+
+// A valid packet with random damage, or random bytes
+static size_t fuzz_mutate(unsigned char *buf) {
+    size_t len;
+
+    if (fuzz_random() % 16 == 0) {
+        len = fuzz_random() % 128;
+        for (size_t i = 0; i < len; i++)
+            buf[i] = (unsigned char)fuzz_random();
+        return len;
+    }
+    len = fuzz_seed_packet(buf, (int)(fuzz_random() % 7));
+    int edits = (int)(fuzz_random() % 4);
+    for (int e = 0; e < edits && len > 0; e++) {
+        size_t at = fuzz_random() % len;
+        switch (fuzz_random() % 5) {
+        case 0:  // flip a bit
+            buf[at] ^= (unsigned char)(1u << (fuzz_random() % 8));
+            break;
+        case 1:  // overwrite a byte in the headers
+            at = fuzz_random() % (len < 64 ? len : 64);
+            buf[at] = (unsigned char)fuzz_random();
+            break;
+        case 2:  // truncate
+            len = at;
+            break;
+        case 3:  // append
+            for (size_t n = fuzz_random() % 32; n > 0 && len < FUZZ_MAX_LEN; n--)
+                buf[len++] = (unsigned char)fuzz_random();
+            break;
+        default:  // an interesting value
+            buf[at] = (unsigned char[]){ 0x00, 0x01, 0x60, 0xff }[fuzz_random() % 4];
+            break;
+        }
+    }
+    return len;
+}
+
+static int run_file(const char *path) {
+    static unsigned char buf[1 << 16];
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    size_t len = fread(buf, 1, sizeof(buf), file);
+    fclose(file);
+    LLVMFuzzerTestOneInput(buf, len);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static unsigned char buf[FUZZ_MAX_LEN];
+    long inputs = 1000000;
+    int opt;
+
+    rng_state = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            inputs = atol(optarg);
+            break;
+        case 's':
+            rng_state = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n inputs] [-s seed] [file...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (rng_state == 0)
+        rng_state = 1;
+
+    if (optind < argc) {
+        for (int i = optind; i < argc; i++) {
+            if (run_file(argv[i]) < 0)
+                return 1;
+        }
+        printf("%d files replayed, no findings\n", argc - optind);
+        return 0;
+    }
+
+    uint64_t seed = rng_state;
+    long parsed = 0;
+    for (long i = 0; i < inputs; i++) {
+        size_t len = fuzz_mutate(buf);
+        struct teredo_packet pkt;
+        parsed += teredo_parse(buf, len, &pkt) == 0;
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+    printf("%ld inputs (seed %#llx), %ld parsed, no findings\n", inputs, (unsigned long long)seed, parsed);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,173 @@
+// gen.c - size mixes, pacing and file limits for gen.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "gen.h"
+
+#define CDF_MAX_POINTS 1024
+
+struct cdf_point {
+    int size;
+    double p;   // cumulative, not yet scaled
+};
+
+// Fill the quantile table from points in increasing order: quantile q
+// takes the first size whose cumulative probability reaches it
+static void fill_table(struct gen_sizes *s, const struct cdf_point *points, int n, int min_size, int max_size) {
+    double total = points[n - 1].p, sum = 0.0;
+    int j = 0;
+
+    s->min = max_size;
+    s->max = min_size;
+    for (int i = 0; i < GEN_SIZE_QUANTILES; i++) {
+        double q = (i + 0.5) / GEN_SIZE_QUANTILES * total;
+        while (j < n - 1 && points[j].p < q)
+            j++;
+        int size = points[j].size < min_size ? min_size : points[j].size > max_size ? max_size : points[j].size;
+        s->table[i] = (uint16_t)size;
+        sum += size;
+        if (size < s->min)
+            s->min = size;
+        if (size > s->max)
+            s->max = size;
+    }
+    s->mean = sum / GEN_SIZE_QUANTILES;
+}
+
+static int read_cdf(const char *path, struct cdf_point *points) {
+    char line[256];
+    int n = 0, lineno = 0;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *p = line + strspn(line, " \t");
+        int size;
+        double cum;
+
+        lineno++;
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        if (sscanf(p, "%d %lf", &size, &cum) != 2 || size < 1 || size > UINT16_MAX || cum < 0 ||
+            (n > 0 && (size <= points[n - 1].size || cum < points[n - 1].p))) {
+            fprintf(stderr, "%s:%d: expected \"<size> <cumulative probability>\", both increasing\n",
+                    path, lineno);
+            fclose(file);
+            return -1;
+        }
+        if (n == CDF_MAX_POINTS) {
+            fprintf(stderr, "%s: more than %d points\n", path, CDF_MAX_POINTS);
+            fclose(file);
+            return -1;
+        }
+        points[n].size = size;
+        points[n].p = cum;
+        n++;
+    }
+    fclose(file);
+    if (n == 0 || points[n - 1].p <= 0) {
+        fprintf(stderr, "%s: no probability mass\n", path);
+        return -1;
+    }
+    return n;
+}
+
+int gen_sizes_parse(struct gen_sizes *s, const char *spec, int fixed_size, int min_size, int max_size) {
+    static const struct { int size, weight; } imix[] = GEN_IMIX;
+    struct cdf_point points[CDF_MAX_POINTS];
+    int n = 0;
+
+    memset(s, 0, sizeof(*s));
+    if (strcmp(spec, "fixed") == 0 || strncmp(spec, "fixed:", 6) == 0) {
+        int size = spec[5] == ':' ? atoi(spec + 6) : fixed_size;
+        if (size < 1) {
+            fprintf(stderr, "Invalid size mix: %s\n", spec);
+            return -1;
+        }
+        points[n++] = (struct cdf_point){ size, 1.0 };
+        snprintf(s->name, sizeof(s->name), "fixed:%d", size);
+    } else if (strcmp(spec, GEN_IMIX_NAME) == 0) {
+        double cum = 0.0;
+        for (size_t i = 0; i < sizeof(imix) / sizeof(imix[0]); i++) {
+            cum += imix[i].weight;
+            points[n++] = (struct cdf_point){ imix[i].size, cum };
+        }
+        snprintf(s->name, sizeof(s->name), "%s", GEN_IMIX_NAME);
+    } else if (strncmp(spec, "cdf:", 4) == 0) {
+        if ((n = read_cdf(spec + 4, points)) < 0)
+            return -1;
+        snprintf(s->name, sizeof(s->name), "%s", spec);
+    } else {
+        fprintf(stderr, "Invalid size mix: %s (fixed[:<n>], imix or cdf:<file>)\n", spec);
+        return -1;
+    }
+    fill_table(s, points, n, min_size, max_size);
+    return 0;
+}
+
+int gen_pacing_parse(const char *name, enum gen_pacing *mode) {
+    if (strcmp(name, "constant") == 0)
+        *mode = GEN_PACE_CONSTANT;
+    else if (strcmp(name, "poisson") == 0)
+        *mode = GEN_PACE_POISSON;
+    else
+        return -1;
+    return 0;
+}
+
+const char *gen_pacing_name(enum gen_pacing mode) {
+    return mode == GEN_PACE_POISSON ? "poisson" : "constant";
+}
+
+int gen_reserve_fds(long n) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+        return -1;
+    // Room for the sockets on top of what the process already uses
+    rlim_t want = (rlim_t)n + 256;
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < want) {
+        if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < want)
+            return -1;
+        limit.rlim_cur = want;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+uint64_t gen_seed(int id) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t seed = ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec) ^
+                    ((uint64_t)getpid() << 32) ^ ((uint64_t)(id + 1) * 0x9e3779b97f4a7c15ULL);
+    return seed != 0 ? seed : 1;
+}
+
+void gen_pacer_init(struct gen_pacer *p, enum gen_pacing mode, double pps, uint64_t start_ns) {
+    p->mode = mode;
+    p->gap_ns = pps > 0 ? 1e9 / pps : 0.0;
+    p->start_ns = start_ns;
+    p->offset_ns = 0.0;
+}
+
+void gen_pacer_advance(struct gen_pacer *p, uint64_t *rng) {
+    if (p->gap_ns == 0.0)
+        return;
+    if (p->mode == GEN_PACE_POISSON) {
+        // Inverse transform of a uniform in (0, 1]
+        double u = ((gen_random(rng) >> 11) + 1) * (1.0 / 9007199254740992.0);
+        p->offset_ns += -log(u) * p->gap_ns;
+    } else {
+        p->offset_ns += p->gap_ns;
+    }
+}
@@ -0,0 +1,96 @@
+// gen.h - traffic mix for the load generators: packet sizes, pacing, flows
+//
+// A size mix is fixed, IMIX, or an empirical CDF read from a file. Every
+// mix is turned into a table of GEN_SIZE_QUANTILES sizes at evenly spaced
+// quantiles, so drawing a size is one random number and one load whatever
+// the mix; probabilities are kept to 1/GEN_SIZE_QUANTILES.
+//
+// A CDF file has one "<size> <cumulative probability>" pair per line, in
+// increasing order; blank lines and lines starting with '#' are skipped.
+// P(size <= s) = p, so a size is drawn with the probability step up to
+// it. Probabilities are scaled so that the last one is 1, which also
+// accepts cumulative counts.
+//
+// The pacer spaces packets at a target rate, evenly or as a Poisson
+// process (exponential gaps). Several paced threads at rate / n each add
+// up to the same process at the full rate.
+#ifndef GEN_H
+#define GEN_H
+
+#include <stdint.h>
+
+#define GEN_SIZE_QUANTILES 4096
+#define GEN_IMIX_NAME "imix"
+
+// Simple IMIX: 7 x 40, 4 x 576, 1 x 1500 byte IP packets
+#define GEN_IMIX { { 40, 7 }, { 576, 4 }, { 1500, 1 } }
+
+struct gen_sizes {
+    char name[64];          // "fixed:64", "imix", "cdf:<file>"
+    int min;
+    int max;
+    double mean;            // of the table, i.e. what the generator will send
+    uint16_t table[GEN_SIZE_QUANTILES];
+};
+
+enum gen_pacing {
+    GEN_PACE_CONSTANT,
+    GEN_PACE_POISSON,
+};
+
+struct gen_pacer {
+    enum gen_pacing mode;
+    double gap_ns;          // mean gap; 0 = unpaced
+    uint64_t start_ns;
+    double offset_ns;       // of the next packet from start_ns
+};
+
+// Parse a size mix: "fixed[:<n>]" (n defaults to fixed_size), "imix" or
+// "cdf:<file>". Sizes are clamped to [min_size, max_size]. Returns 0, or
+// -1 with a message on stderr.
+int gen_sizes_parse(struct gen_sizes *s, const char *spec, int fixed_size, int min_size, int max_size);
+
+// "constant" or "poisson"; returns -1 for anything else
+int gen_pacing_parse(const char *name, enum gen_pacing *mode);
+
+const char *gen_pacing_name(enum gen_pacing mode);
+
+// Raise the soft limit on open files so that n more sockets fit. Returns
+// 0, or -1 if the hard limit is too low.
+int gen_reserve_fds(long n);
+
+// xorshift64*: per-thread state, any non-zero seed
+static inline uint64_t gen_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+// Seed for thread id, different on every run
+uint64_t gen_seed(int id);
+
+static inline int gen_size(const struct gen_sizes *s, uint64_t *rng) {
+    return s->table[gen_random(rng) >> 52];  // top 12 bits: GEN_SIZE_QUANTILES
+}
+
+// Uniform in [0, n)
+static inline uint32_t gen_pick(uint64_t *rng, uint32_t n) {
+    return (uint32_t)(((gen_random(rng) >> 32) * n) >> 32);
+}
+
+// Pace pps packets per second from start_ns; pps <= 0 leaves it unpaced
+void gen_pacer_init(struct gen_pacer *p, enum gen_pacing mode, double pps, uint64_t start_ns);
+
+// When the next packet is due (start_ns for every packet if unpaced)
+static inline uint64_t gen_pacer_due(const struct gen_pacer *p) {
+    return p->start_ns + (uint64_t)p->offset_ns;
+}
+
+// Schedule the packet after the one just sent. A generator that falls
+// behind sends the backlog as fast as it can rather than skipping it.
+void gen_pacer_advance(struct gen_pacer *p, uint64_t *rng);
+
+#endif
@@ -0,0 +1,55 @@
+// hist.c - latency histogram reset, merge and percentile queries
+#include <string.h>
+
+#include "hist.h"
+
+void hist_reset(struct hist *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src) {
+    if (src->count == 0)
+        return;
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+}
+
+// Largest value that falls into a bucket (inverse of hist_bucket)
+static uint64_t bucket_ceiling(int bucket) {
+    if (bucket < HIST_SUB_BUCKETS)
+        return (uint64_t)bucket;
+    int shift = bucket / HIST_SUB_BUCKETS - 1;
+    uint64_t sub = (uint64_t)(bucket % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS);
+    return ((sub + 1) << shift) - 1;
+}
+
+uint64_t hist_percentile(const struct hist *h, double p) {
+    if (h->count == 0)
+        return 0;
+    // Rank of the sample we want, 1-based, rounded up
+    double exact = p / 100.0 * (double)h->count;
+    uint64_t rank = (uint64_t)exact;
+    if ((double)rank < exact)
+        rank++;
+    if (rank < 1)
+        rank = 1;
+    if (rank > h->count)
+        rank = h->count;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_ceiling(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,191 +9,2966 @@
 #include <pthread.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <time.h>
+#include <getopt.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <net/if.h>
+#include <netinet/udp.h>
+
+#include "packet.h"
+#include "metrics.h"
+#include "log.h"
+#include "flow.h"
+#include "hist.h"
+#include "pool.h"
+#include "ring.h"
+#include "evloop.h"
+#include "uring.h"
+#include "capture.h"
+#include "sixrd.h"
+#include "teredo.h"
+#include "checksum.h"
+#include "frag.h"
+#include "path.h"
+#include "gen.h"
 
-#define BUFFER_SIZE 9000
 #define SIXRD_PORT 8001
-#define TEREDO_PORT 8002
+#define TEREDO_RELAY_PORT 8002    // the relay stage; TEREDO_PORT is the protocol's 3544
 #define RECEIVER_PORT 8003
+#define MAX_BATCH 256
+#define DEFAULT_FLUSH_US 50
+#define BENCH_TX_BATCH 64
+#define BENCH_FLOWS_PER_SENDER 4
+#define GEN_DEFAULT_FLOWS 1024     // source sockets of the traffic generator (-n)
+#define GEN_MAX_FLOWS 65536
+#define GEN_SLEEP_MAX_US 100000    // longest sleep between paced sends, so a stop is seen
+#define MAX_WORKERS 64
+#define FUSED_RING_SIZE 512        // packets queued between a fused 6RD/Teredo pair
+#define FUSED_DRAIN_BURSTS 64      // ring bursts per doorbell before yielding the loop
+#define FLOW_EXPIRE_MS 100         // flow expiry timer period
+#define RECEIVER_BATCH 64
+#define URING_BUFFERS 256          // provided receive buffers per io_uring relay stage
+#define URING_BGID 0
+#define URING_RECV 1               // user_data kinds, above the 16-bit buffer id
+#define URING_SEND 2
+#define GRO_BUFFER_SIZE 65536      // receive buffer for a UDP_GRO train of datagrams
+#define GSO_MAX_SEGMENTS 64        // datagrams per UDP_SEGMENT send
+#define FWD_HANDED_OFF -1          // left as fragments or through the fused ring, not in a tx slot
+// Bit of a segment in a train; the kernel merges at most 64 into one GRO
+// datagram, and any beyond share the last bit
+#define TRAIN_BIT(seg) (1ULL << ((seg) < 63 ? (seg) : 63))
+#define MAX_FRAGMENTS 8            // a BUFFER_SIZE payload split at IPV6_MIN_MTU
+#define PATH_SENDER_FLOWS 16       // flows of the path-selecting sender (mode 2 -P)
+#define PATH_SENDER_TEREDO_FLOWS 4 // of them to Teredo peers, the rest to native destinations
+#define PATH_SEND_INTERVAL_US 1000 // one packet per flow per interval
+#define RECEIVER_FLOWS 256         // flows the receiver tracks delivery gaps for
+#define RECEIVER_FLOW_PROBE 8      // slots after its home slot a tracked flow may sit in
+#define RECEIVER_GAP_REPORT_MS 20  // gaps long enough for a line of their own
+// 6RD domain of the capture front-end: 2001:db8::/32 with whole IPv4
+// addresses embedded, so every CE gets a /64
+#define SIXRD_DOMAIN_PREFIX "2001:db8::"
+#define SIXRD_DOMAIN_PREFIX_LEN 32
+#define SIXRD_DOMAIN_BR "192.0.2.1"
+
+enum io_engine {
+    ENGINE_EPOLL,   // recvmmsg/sendmmsg from evloop readiness
+    ENGINE_URING,   // multishot recvmsg + sendmsg SQEs, falls back to epoll
+};
+
+// Runtime options, set from the command line
+static int batch_size = 1;                      // 1 = forward every datagram as it is read
+static int relay_workers = 1;                   // SO_REUSEPORT workers per relay stage
+static uint32_t max_flows = FLOW_DEFAULT_MAX;   // flow table size per worker
+static uint32_t flow_idle_timeout = FLOW_DEFAULT_IDLE_TIMEOUT;
+static enum flow_key_mode flow_key_mode = FLOW_KEY_5TUPLE;
+static struct route_table sixrd_routes;         // next hops out of the 6RD stage
+static struct route_table teredo_routes;        // next hops out of the Teredo stage
+static long flush_timeout_us = DEFAULT_FLUSH_US; // max wait to fill a partial batch
+static int summary_interval = 1;                // seconds between summary lines
+static int bench_seconds = 5;
+static int bench_size = 64;
+static const char *bench_csv = NULL;            // append benchmark results here
+static int fused_hop = 0;                       // 1 = 6RD hands packets to Teredo through a ring
+static int shared_threads = 0;                  // 1 = one thread per 6RD/Teredo worker pair
+static enum io_engine io_engine = ENGINE_EPOLL;  // relay socket I/O
+static int udp_offload = 0;                     // 1 = UDP_GRO receive, UDP_SEGMENT send (-G)
+static int capture_enabled = 0;                 // 1 = raw-frame ingress on capture_ifname (-C)
+static enum capture_mode capture_mode = CAPTURE_PACKET;
+static char capture_ifname[IF_NAMESIZE];
+static struct sixrd_config sixrd_domain;        // for decapsulating captured 6RD traffic
+static const char *tunnel_target = "127.0.0.1"; // where mode 5 sends tunnelled traffic
+static struct tunnel_mtu sixrd_mtu = { 0, TUNNEL_6RD_OVERHEAD };     // -M 6rd:<mtu>
+static struct tunnel_mtu teredo_mtu = { 0, TUNNEL_TEREDO_OVERHEAD }; // -M teredo:<mtu>
+static int parallel_paths = 0;                  // 1 = both relays forward to the receiver (-H parallel)
+static int path_sender = 0;                     // 1 = mode 2 picks a path per flow (-P)
+static int bench_ingress_port = SIXRD_PORT;     // stage the load generator feeds (-I)
+static int gen_enabled = 0;                     // 1 = modes 4 and 6 send a flow and size mix (-n -z -r -p)
+static int gen_flows = GEN_DEFAULT_FLOWS;       // sockets over all generator threads
+static const char *gen_size_spec = "fixed";     // fixed at -s unless -z
+static struct gen_sizes gen_sizes;
+static double gen_rate = 0;                     // packets/s over all threads, 0 = as fast as possible
+static enum gen_pacing gen_pacing = GEN_PACE_CONSTANT;
+static enum path_policy path_policy = PATH_POLICY_HYBRID;
+
+// A stage that drops everything it receives for a while, to fail a path
+// on purpose (-X). Offsets from the start of the relays.
+struct stage_outage {
+    long after_us;
+    long for_us;  // 0 = no outage
+};
+
+static struct stage_outage sixrd_outage, teredo_outage;
+
+// Kernel receive timestamp and GRO segment size of one datagram, aligned
+// for cmsghdr
+union rx_control {
+    char buf[CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+};
+
+// GSO segment size of one send
+union tx_control {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+};
+
+// A packet queued from a fused 6RD worker to its Teredo worker
+struct fused_entry {
+    struct pbuf *buf;            // the datagram, header included, as received
+    struct sockaddr_in client;   // who sent it to the 6RD stage
+    uint64_t enqueue_ns;         // when it entered the ring
+};
+
+// Fused mode: 6RD worker i -> Teredo worker i. The consumer sleeps in its
+// event loop on the doorbell eventfd once the ring is empty.
+struct fused_link {
+    struct spsc_ring ring;
+    int doorbell;
+    _Atomic int consumer_idle;   // set by the consumer, cleared by whoever rings
+};
+
+// Receive and transmit vectors of one relay stage
+struct relay_batch {
+    struct pbuf *bufs[MAX_BATCH];
+    struct packet *pkts[MAX_BATCH];
+    struct sockaddr_in client_addrs[MAX_BATCH];
+    union rx_control controls[MAX_BATCH];
+    struct mmsghdr rx[MAX_BATCH], tx[MAX_BATCH];
+    struct iovec rx_iov[MAX_BATCH], tx_iov[MAX_BATCH];
+    union tx_control tx_controls[MAX_BATCH];
+    struct fused_entry entries[MAX_BATCH];
+    int fwd_index[MAX_BATCH], fwd_length[MAX_BATCH];  // rx slot and payload length per forwarded datagram
+    int fwd_tx[MAX_BATCH];      // tx slot of each, or FWD_HANDED_OFF
+    uint64_t fwd_segments[MAX_BATCH];  // TRAIN_BIT of each segment that left
+    uint64_t rx_ns[MAX_BATCH];
+    int gro_size[MAX_BATCH];    // segment size of a UDP_GRO train, 0 for a single datagram
+    unsigned char *gro_area;    // GRO_BUFFER_SIZE receive buffers, with -G
+    // Fragments of one packet over the stage's tunnel MTU (-M)
+    unsigned char *frag_area;   // MAX_FRAGMENTS wire packets of up to the MTU
+    struct mmsghdr frag_tx[MAX_FRAGMENTS];
+    struct iovec frag_iov[MAX_FRAGMENTS];
+    struct fused_entry frag_entries[MAX_FRAGMENTS];
+    size_t frag_lens[MAX_FRAGMENTS];
+};
+
+// Send state of one io_uring receive buffer, from its recvmsg completion
+// to its sendmsg completion
+struct uring_slot {
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_in dest;
+    struct sockaddr_in client;
+    uint64_t rx_ns;
+    long oneway;
+    int length;
+};
+
+// io_uring engine state of one relay stage
+struct relay_uring {
+    struct uring ring;
+    struct uring_buf_ring bufs;
+    struct msghdr recv_msg;     // name/control layout of every receive buffer
+    struct pbuf *pbufs[URING_BUFFERS];
+    struct uring_slot slots[URING_BUFFERS];
+    int recv_armed;             // multishot recvmsg outstanding
+    int recycled;               // buffers returned in the current pass
+    int disabled;               // recvmsg failed, the stage fell back to epoll
+};
+
+// One worker of a relay stage, served by a relay thread's event loop
+struct relay_worker {
+    int id;         // index within the stage
+    char name[16];  // "6RD", or "6RD-<id>" with several workers
+    int port;       // listening port of the stage
+    int mtu;        // largest IPv6 packet the stage's tunnel carries whole, 0 = unlimited
+    const char *metrics_file;
+    struct flow_table *flows;
+    struct pool_cache *cache;  // packet buffers, created by the worker's thread
+    struct fused_link *link;   // fused mode only
+    // Event loop state, owned by the worker's thread
+    struct evloop *loop;
+    int sockfd;                // listening socket, -1 behind a fused ring
+    int egress_fd;
+    int flush_timer;           // fires when a partial batch has waited flush_timeout_us
+    int flush_armed;
+    int filled;                // datagrams waiting in the receive batch
+    int expire_budget;         // flow table slots examined per expiry tick
+    int packet_count;
+    struct relay_batch *batch;
+    struct relay_uring *uring;  // io_uring engine only
+    struct metrics_stream *metrics;
+    struct log_stats *stats;
+    // Fused mode counters, written by the 6RD worker only
+    _Atomic unsigned long ring_queued;
+    _Atomic unsigned long ring_waits;    // bursts that found the ring full
+    _Atomic unsigned long ring_dropped;  // no pool buffer to copy into
+    // Tunnel MTU counters, read once the worker has stopped
+    unsigned long fragmented;      // packets split into fragments
+    unsigned long fragments_sent;
+    unsigned long too_big;         // over the MTU but not fragmentable, dropped
+    unsigned long send_dropped;    // messages that failed to send, mostly on a full socket buffer
+    // Injected outage (-X), monotonic microseconds; end 0 = none
+    long outage_start_us;
+    long outage_end_us;
+    unsigned long outage_dropped;  // read once the worker has stopped
+};
+
+// A thread running one event loop for one or two relay stages
+struct relay_thread {
+    pthread_t thread;
+    int cpu;        // CPU the thread is pinned to, -1 for none
+    struct relay_worker *stages[2];
+    int stage_count;
+    // Raw-frame ingress (-C) feeding the stages above
+    struct capture *capture;
+    struct relay_worker *sixrd;     // takes protocol-41 frames, NULL if not on this thread
+    struct relay_worker *teredo;    // takes UDP/3544 frames, NULL if not on this thread
+    unsigned long undecapsulated;   // captured frames that failed decapsulation
+};
+
+// Every stage of every worker registers a pool cache, a metrics stream and
+// a log stats block, and the benchmark adds a pool cache for each worker's
+// sender (or generator) and sink, so -w up to MAX_WORKERS must fit
+_Static_assert(POOL_MAX_CACHES >= 4 * MAX_WORKERS, "pool caches for the benchmark at MAX_WORKERS");
+_Static_assert(METRICS_MAX_STREAMS >= 2 * MAX_WORKERS, "metrics streams for MAX_WORKERS");
+_Static_assert(LOG_MAX_STATS >= 2 * MAX_WORKERS, "log stats blocks for MAX_WORKERS");
+
+static struct pool *pkt_pool;                   // packet buffers for every thread
+static struct relay_worker sixrd_workers[MAX_WORKERS];
+static struct relay_worker teredo_workers[MAX_WORKERS];
+static struct fused_link fused_links[MAX_WORKERS];
+static struct relay_thread relay_threads[2 * MAX_WORKERS];
+static int relay_thread_count = 0;
+
+// Function to handle errors
+void handle_error(const char *message) {
+    perror(message);
+    exit(1);
+}
+
+// handle_error() for failures that leave no errno behind
+static void fatal_error(const char *message) {
+    fprintf(stderr, "%s\n", message);
+    exit(1);
+}
+
+// Pin the calling thread to one CPU
+static void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        fprintf(stderr, "Failed to pin thread to CPU %d\n", cpu);
+}
+
+// Monotonic clock in microseconds
+static long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// A pool buffer big enough for any datagram, for a thread's receive path.
+// Running out here is a start-up sizing error, not a packet-path event.
+static struct pbuf *alloc_rx_buffer(struct pool_cache *cache) {
+    struct pbuf *buf = cache != NULL ? pbuf_alloc(cache, sizeof(struct packet)) : NULL;
+    if (buf == NULL)
+        fatal_error("Packet buffer allocation failed");
+    return buf;
+}
+
+static inline struct packet *pbuf_packet(struct pbuf *buf) {
+    return (struct packet *)buf->data;
+}
+
+// Ask the kernel to timestamp every datagram received on sockfd
+static void enable_rx_timestamps(int sockfd) {
+    int opt = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &opt, sizeof(opt)) < 0)
+        perror("setsockopt SO_TIMESTAMPNS failed");
+}
+
+// Kernel receive time of a datagram read with recvmsg, or the current
+// time if the kernel did not attach one
+static uint64_t rx_timestamp(struct msghdr *msg) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+        }
+    }
+    return packet_now_ns();
+}
+
+// Let the kernel hand trains of same-size datagrams to sockfd as one
+// UDP_GRO datagram, with the segment size in a control message
+static void enable_udp_gro(int sockfd) {
+    int opt = 1;
+    if (setsockopt(sockfd, SOL_UDP, UDP_GRO, &opt, sizeof(opt)) < 0)
+        perror("setsockopt UDP_GRO failed");
+}
+
+// Segment size of a datagram the kernel coalesced with UDP_GRO, 0 if it
+// arrived on its own
+static int rx_gro_size(struct msghdr *msg) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return size;
+        }
+    }
+    return 0;
+}
+
+// Make msg a UDP_SEGMENT send: the kernel splits it into size-byte
+// datagrams (the last may be shorter) after one trip through the stack
+static void set_gso_size(struct msghdr *msg, union tx_control *control, int size) {
+    uint16_t segment = (uint16_t)size;
+
+    msg->msg_control = control;
+    msg->msg_controllen = CMSG_SPACE(sizeof(segment));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(segment));
+    memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+}
+
+// Check each segment of a datagram of n bytes that arrived as a train of
+// size-byte datagrams. Returns the number of segments, or -1 if any of
+// them is malformed.
+static int packet_validate_train(const unsigned char *data, int n, int size) {
+    int segments = 0;
+
+    for (int off = 0; off < n; off += size) {
+        int len = n - off < size ? n - off : size;
+        if (packet_validate((const struct packet *)(data + off), len) < 0)
+            return -1;
+        segments++;
+    }
+    return segments;
+}
+
+// Nanoseconds from one wall-clock reading to a later one, 0 if the clock
+// stepped backwards in between
+static inline long elapsed_ns(uint64_t from, uint64_t to) {
+    return to > from ? (long)(to - from) : 0;
+}
+
+// One-way latency from the sender's timestamp to our kernel receive
+// timestamp, -1 if the packet is not stamped
+static inline long oneway_ns(const struct packet *pkt, int length, uint64_t rx_ns) {
+    uint64_t sent = packet_timestamp(pkt, length);
+    return sent != 0 ? elapsed_ns(sent, rx_ns) : -1;
+}
+
+// Test payload of size bytes: an IPv6 packet (No Next Header) between two
+// documentation addresses, so a relay can fragment it for its tunnel MTU.
+// Payloads too short for the header and a tail stamp are plain bytes.
+static void packet_fill(struct packet *pkt, int size) {
+    struct in6_addr src, dst;
+
+    memset(pkt->data, 'A', size);
+    if (size >= IPV6_HEADER_LEN + PKT_TIMESTAMP_LEN) {
+        inet_pton(AF_INET6, "2001:db8::1", &src);
+        inet_pton(AF_INET6, "2001:db8::2", &dst);
+        ipv6_build_header(pkt->data, &src, &dst, IPV6_NEXT_NONE, (uint16_t)(size - IPV6_HEADER_LEN), 64);
+    }
+    packet_set_header(pkt, size, PKT_TYPE_IPV6);
+}
+
+// Stamp a packet_fill() payload with the send time, at its tail when the
+// head is an IPv6 header
+static void packet_stamp_payload(struct packet *pkt, uint64_t ns) {
+    if (packet_payload_len(pkt) >= IPV6_HEADER_LEN + PKT_TIMESTAMP_LEN)
+        packet_stamp_tail(pkt, ns);
+    else
+        packet_stamp(pkt, ns);
+}
+
+// Run a received packet through a reassembly cache. Returns the length of
+// a whole payload, now at *payload (pkt's own, or a reassembled IPv6
+// packet), 0 if a fragment was held back, -1 if it was dropped. *sent is
+// the sender's timestamp, 0 if unknown; a reassembled packet carries it in
+// the tail of its last fragment.
+static long packet_reassemble(struct frag_cache *c, const struct packet *pkt, int length, uint64_t rx_ns,
+                              const unsigned char **payload, uint64_t *sent) {
+    long n = frag_reassemble(c, (const unsigned char *)pkt->data, (size_t)length, rx_ns / 1000000, payload);
+    uint64_t be;
+
+    *sent = 0;
+    if (n > 0 && *payload == (const unsigned char *)pkt->data) {
+        *sent = packet_timestamp(pkt, length);
+    } else if (n >= PKT_TIMESTAMP_LEN && (pkt->hdr.flags & PKT_FLAG_TIMESTAMP_TAIL)) {
+        memcpy(&be, *payload + n - PKT_TIMESTAMP_LEN, sizeof(be));
+        *sent = be64toh(be);
+    }
+    return n;
+}
+
+// Account a datagram from client to its flow, creating the flow on first
+// sight, and return the next hop cached for it
+static inline const struct sockaddr_in *relay_next_hop(struct relay_worker *worker,
+                                                       const struct sockaddr_in *client,
+                                                       int length, uint32_t now) {
+    struct flow_key key = { client->sin_addr.s_addr, 0, client->sin_port, htons(worker->port), IPPROTO_UDP };
+    struct flow_entry *flow = flow_lookup(worker->flows, &key, now);
+
+    if (flow != NULL)
+        flow_account(flow, length);
+    return flow_next_hop(worker->flows, flow, key.src_ip);
+}
+
+// Returns 1, counting n datagrams dropped, if the stage is inside its
+// injected outage (-X)
+static inline int relay_in_outage(struct relay_worker *worker, int n) {
+    if (worker->outage_end_us == 0)
+        return 0;
+    long now = now_us();
+    if (now < worker->outage_start_us || now >= worker->outage_end_us)
+        return 0;
+    worker->outage_dropped += n;
+    return 1;
+}
+
+#define WORKER_COUNTER_ADD(counter, n) \
+    atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), \
+                          memory_order_relaxed)
+
+// handle_error() with the worker's name in front of the message
+static void worker_error(const struct relay_worker *worker, const char *what) {
+    char message[64];
+    snprintf(message, sizeof(message), "%s %s", worker->name, what);
+    handle_error(message);
+}
+
+// fatal_error() with the worker's name in front of the message
+static void worker_fatal(const struct relay_worker *worker, const char *what) {
+    fprintf(stderr, "%s %s\n", worker->name, what);
+    exit(1);
+}
+
+// In fused mode, traffic for the Teredo stage on loopback stays in process
+static inline int fused_next_hop(const struct relay_worker *worker, const struct sockaddr_in *hop) {
+    return worker->link != NULL && hop->sin_port == htons(TEREDO_RELAY_PORT) &&
+           hop->sin_addr.s_addr == htonl(INADDR_LOOPBACK);
+}
+
+// Copy a received datagram into a pool buffer of the class that fits it, so
+// the receive buffer stays in place and a small packet does not pin a 9 KB
+// buffer while it waits in the ring. Returns -1 if the pool is dry.
+static int fused_stage(struct relay_worker *worker, const struct packet *pkt, int n,
+                       const struct sockaddr_in *client, struct fused_entry *entry) {
+    struct pbuf *buf = pbuf_alloc(worker->cache, (uint32_t)n);
+    if (buf == NULL) {
+        WORKER_COUNTER_ADD(worker->ring_dropped, 1);
+        return -1;
+    }
+    memcpy(buf->data, pkt, n);
+    buf->len = (uint32_t)n;
+    entry->buf = buf;
+    entry->client = *client;
+    return 0;
+}
+
+// Wake the consumer if it has gone back to its event loop. The fence
+// orders our ring update before the idle check; fused_drain() does the
+// mirror image, so one side always sees the other.
+static void fused_notify(struct fused_link *link) {
+    uint64_t one = 1;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&link->consumer_idle, memory_order_relaxed) &&
+        atomic_exchange(&link->consumer_idle, 0) &&
+        write(link->doorbell, &one, sizeof(one)) < 0)
+        perror("fused doorbell write failed");
+}
+
+// Queue staged packets to the Teredo worker. While the ring is full we wait
+// instead of dropping: that stops us reading our socket, so overload backs
+// up into the kernel's receive queue, as it would with the UDP hop. Only
+// shutdown makes us give up and free what is left.
+static void fused_enqueue(struct relay_worker *worker, struct fused_entry *entries, int n) {
+    struct fused_link *link = worker->link;
+    uint64_t now = packet_now_ns();
+    int queued = 0;
+
+    for (int i = 0; i < n; i++)
+        entries[i].enqueue_ns = now;
+    while (queued < n) {
+        queued += (int)spsc_ring_push_burst(&link->ring, entries + queued, (uint32_t)(n - queued));
+        fused_notify(link);
+        if (queued < n) {
+            if (evloop_shutting_down())
+                break;
+            WORKER_COUNTER_ADD(worker->ring_waits, 1);
+            sched_yield();
+        }
+    }
+    for (int i = queued; i < n; i++)
+        pbuf_free(worker->cache, entries[i].buf);
+    WORKER_COUNTER_ADD(worker->ring_queued, queued);
+}
+
+// Account one forwarded datagram in the metrics and the log
+static void relay_account(struct relay_worker *worker, const struct packet *pkt, int length,
+                          const struct sockaddr_in *client, long forward_ns, long oneway) {
+    worker->packet_count++;
+    metrics_record(worker->metrics, worker->packet_count, length, forward_ns, oneway);
+    log_packet(worker->stats, length, forward_ns / 1000);
+
+    if (LOG_ENABLED(LOG_PACKET) && log_ratelimit(worker->stats)) {
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client->sin_addr, client_ip, INET_ADDRSTRLEN);
+
+        log_msg(LOG_PACKET, "%s Server forwarded %d bytes from %s (Forwarding: %.1f us, One-way: %.1f us)\n",
+                worker->name, length, client_ip, forward_ns / 1e3, oneway / 1e3);
+        if (LOG_ENABLED(LOG_DEBUG))
+            log_hexdump(pkt->data, length);
+    }
+}
+
+// Send count prepared messages through the worker's egress socket;
+// sendmmsg may stop short, so resume from there. A full socket buffer
+// drops the remainder, as a blocking send would not. Returns the number
+// sent, always the first ones.
+static int relay_send(struct relay_worker *worker, struct mmsghdr *msgs, int count) {
+    int sent = 0;
+
+    while (sent < count) {
+        int n = sendmmsg(worker->egress_fd, msgs + sent, count - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("sendmmsg failed");
+            break;
+        }
+        sent += n;
+    }
+    worker->send_dropped += count - sent;
+    return sent;
+}
+
+// Pass a wire packet on to next_hop in pieces that fit the stage's tunnel
+// MTU: a payload over it is split into IPv6 fragments, each a wire packet
+// of its own, that go out with one sendmmsg or through the fused ring.
+// Only the first fragment keeps a head timestamp and only the last a tail
+// one. A payload that is not IPv6, or needs more than MAX_FRAGMENTS
+// pieces, is dropped, as a tunnel drops what it cannot carry. Returns the
+// number of pieces sent or staged for the ring, 0 if none left.
+static int relay_fragment(struct relay_worker *worker, const struct packet *pkt,
+                           const struct sockaddr_in *client, const struct sockaddr_in *next_hop) {
+    struct relay_batch *b = worker->batch;
+    const struct packet *frags[MAX_FRAGMENTS] = { pkt };
+    size_t stride = sizeof(struct wire_header) + (size_t)worker->mtu;
+    int length = packet_payload_len(pkt);
+    int count = 1;
+
+    if (length > worker->mtu) {
+        count = -1;
+        if (ipv6_parse_header(pkt->data, length) == length)
+            count = frag_split((const unsigned char *)pkt->data, length, worker->mtu, frag_next_id(),
+                               b->frag_area + sizeof(struct wire_header), stride, b->frag_lens,
+                               MAX_FRAGMENTS);
+        if (count <= 0) {
+            worker->too_big++;
+            return 0;
+        }
+        for (int k = 0; k < count; k++) {
+            struct packet *frag = (struct packet *)(b->frag_area + k * stride);
+            frag->hdr = pkt->hdr;
+            frag->hdr.length = htons((uint16_t)b->frag_lens[k]);
+            if (k > 0)
+                frag->hdr.flags &= ~PKT_FLAG_TIMESTAMP;
+            if (k < count - 1)
+                frag->hdr.flags &= ~PKT_FLAG_TIMESTAMP_TAIL;
+            frags[k] = frag;
+        }
+    }
+
+    // Pieces the pool or a full socket buffer drops are counted there
+    int left = 0;
+    if (fused_next_hop(worker, next_hop)) {
+        for (int k = 0; k < count; k++) {
+            if (fused_stage(worker, frags[k], packet_wire_len(frags[k]), client, &b->frag_entries[left]) == 0)
+                left++;
+        }
+        fused_enqueue(worker, b->frag_entries, left);
+    } else {
+        for (int k = 0; k < count; k++) {
+            b->frag_iov[k].iov_base = (void *)frags[k];
+            b->frag_iov[k].iov_len = packet_wire_len(frags[k]);
+            b->frag_tx[k].msg_hdr.msg_name = (void *)next_hop;
+        }
+        left = relay_send(worker, b->frag_tx, count);
+    }
+    if (length > worker->mtu && left > 0) {
+        worker->fragmented++;
+        worker->fragments_sent += left;
+    }
+    return left;
+}
+
+// Reset the receive slots from index first on for the next recvmmsg
+static void relay_reset_rx(struct relay_worker *worker, int first) {
+    struct relay_batch *b = worker->batch;
+
+    for (int i = first; i < batch_size; i++) {
+        b->rx[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        b->rx[i].msg_hdr.msg_controllen = sizeof(union rx_control);
+    }
+}
+
+// Forward the datagrams collected in the receive batch with one sendmmsg,
+// or queue them to the fused ring when their next hop is the in-process
+// Teredo stage. Datagrams over the stage's tunnel MTU go as fragments.
+// Datagrams leave through egress_fd, which may be the listening socket
+// itself, to the next hop cached in each one's flow. Only the segments
+// that left (sent, staged, or at least one fragment out) are accounted.
+// A UDP_GRO train comes from one flow and goes on as one UDP_SEGMENT send
+// (or segment by segment into the ring); a malformed segment drops it.
+// Forwarding time runs from each datagram's kernel receive timestamp to
+// the end of sendmmsg (or the hand-off), so it includes the time spent
+// waiting for the batch to fill.
+static void relay_flush(struct relay_worker *worker) {
+    struct relay_batch *b = worker->batch;
+    int filled = worker->filled;
+    uint32_t now = flow_now();
+
+    // An injected outage drops the whole batch
+    if (relay_in_outage(worker, filled))
+        filled = 0;
+
+    // Queue every well-formed datagram for forwarding, exactly as received
+    int out = 0, fused = 0, forwarded = 0;
+    for (int i = 0; i < filled; i++) {
+        unsigned char *data = (unsigned char *)b->pkts[i];
+        int n = (int)b->rx[i].msg_len;
+        int size = b->gro_size[i] > 0 ? b->gro_size[i] : n;
+        int segments = packet_validate_train(data, n, size);
+        if (segments < 0)
+            continue;
+
+        const struct sockaddr_in *next_hop = NULL;
+        for (int off = 0; off < n; off += size)
+            next_hop = relay_next_hop(worker, &b->client_addrs[i],
+                                      packet_payload_len((struct packet *)(data + off)), now);
+        uint64_t left = 0;
+        int tx = FWD_HANDED_OFF;
+        if (worker->mtu > 0 && size - (int)sizeof(struct wire_header) > worker->mtu) {
+            // Over the tunnel MTU: fragmented segment by segment, after
+            // what is already staged for the ring
+            if (fused > 0) {
+                fused_enqueue(worker, b->entries, fused);
+                fused = 0;
+            }
+            for (int off = 0, seg = 0; off < n; off += size, seg++) {
+                if (relay_fragment(worker, (struct packet *)(data + off), &b->client_addrs[i], next_hop) > 0)
+                    left |= TRAIN_BIT(seg);
+            }
+        } else if (fused_next_hop(worker, next_hop)) {
+            for (int off = 0, seg = 0; off < n; off += size, seg++) {
+                int len = n - off < size ? n - off : size;
+                if (fused_stage(worker, (struct packet *)(data + off), len, &b->client_addrs[i],
+                                &b->entries[fused]) < 0)
+                    continue;
+                left |= TRAIN_BIT(seg);
+                if (++fused == MAX_BATCH) {
+                    fused_enqueue(worker, b->entries, fused);
+                    fused = 0;
+                }
+            }
+        } else {
+            left = ~0ULL;
+            tx = out;
+            b->tx_iov[out].iov_base = data;
+            b->tx_iov[out].iov_len = n;
+            b->tx[out].msg_hdr.msg_name = (void *)next_hop;
+            if (segments > 1) {
+                set_gso_size(&b->tx[out].msg_hdr, &b->tx_controls[out], size);
+            } else {
+                b->tx[out].msg_hdr.msg_control = NULL;
+                b->tx[out].msg_hdr.msg_controllen = 0;
+            }
+            out++;
+        }
+
+        // Only what left is accounted as forwarded
+        if (left != 0) {
+            b->fwd_index[forwarded] = i;
+            b->fwd_tx[forwarded] = tx;
+            b->fwd_segments[forwarded++] = left;
+        }
+    }
+
+    if (fused > 0)
+        fused_enqueue(worker, b->entries, fused);
+
+    int sent = relay_send(worker, b->tx, out);
+    uint64_t egress_ns = packet_now_ns();
+
+    for (int j = 0; j < forwarded; j++) {
+        int i = b->fwd_index[j];
+        unsigned char *data = (unsigned char *)b->pkts[i];
+        int n = (int)b->rx[i].msg_len;
+        int size = b->gro_size[i] > 0 ? b->gro_size[i] : n;
+        long forward_ns = elapsed_ns(b->rx_ns[i], egress_ns);
+
+        if (b->fwd_tx[j] >= sent)
+            continue;  // dropped by a full socket buffer
+        for (int off = 0, seg = 0; off < n; off += size, seg++) {
+            struct packet *pkt = (struct packet *)(data + off);
+            if (!(b->fwd_segments[j] & TRAIN_BIT(seg)))
+                continue;
+            int length = packet_payload_len(pkt);
+            relay_account(worker, pkt, length, &b->client_addrs[i], forward_ns,
+                          oneway_ns(pkt, length, b->rx_ns[i]));
+        }
+    }
+
+    worker->filled = 0;
+    relay_reset_rx(worker, 0);
+    if (worker->flush_armed) {
+        evloop_arm_timer(worker->loop, worker->flush_timer, 0);
+        worker->flush_armed = 0;
+    }
+}
+
+// A partial batch waits for more datagrams or the flush timer, armed when
+// its first datagram arrived
+static void relay_flush_later(struct relay_worker *worker) {
+    if (worker->filled > 0 && !worker->flush_armed) {
+        if (flush_timeout_us == 0) {
+            relay_flush(worker);
+        } else {
+            evloop_arm_timer(worker->loop, worker->flush_timer, flush_timeout_us);
+            worker->flush_armed = 1;
+        }
+    }
+}
+
+// Listening socket readable: drain it into the receive batch, forwarding
+// every time the batch fills
+static void relay_readable(void *arg) {
+    struct relay_worker *worker = arg;
+    struct relay_batch *b = worker->batch;
+
+    while (1) {
+        int n = recvmmsg(worker->sockfd, b->rx + worker->filled,
+                         batch_size - worker->filled, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("recvmmsg failed");
+            break;
+        }
+        for (int i = worker->filled; i < worker->filled + n; i++) {
+            b->rx_ns[i] = rx_timestamp(&b->rx[i].msg_hdr);
+            b->gro_size[i] = udp_offload ? rx_gro_size(&b->rx[i].msg_hdr) : 0;
+        }
+        worker->filled += n;
+        if (worker->filled == batch_size)
+            relay_flush(worker);
+    }
+    relay_flush_later(worker);
+}
+
+// Flush timer: forward a partial batch that did not fill in time
+static void relay_flush_expired(void *arg) {
+    struct relay_worker *worker = arg;
+
+    worker->flush_armed = 0;
+    if (worker->filled > 0)
+        relay_flush(worker);
+}
+
+// Flow expiry timer: examine a slice of the flow table per tick so the
+// whole table is swept about once per idle timeout
+static void relay_expire_flows(void *arg) {
+    struct relay_worker *worker = arg;
+
+    flow_expire(worker->flows, flow_now(), worker->expire_budget);
+}
+
+// Forward a burst popped from the fused ring with one sendmmsg to the
+// next hop cached in each packet's flow. Forwarding time runs from the
+// enqueue to the end of sendmmsg, i.e. ring wait plus Teredo work, and
+// one-way latency is taken at the enqueue, where a socket hop would have
+// received the packet.
+static void fused_forward(struct relay_worker *worker, struct fused_entry *entries, int filled) {
+    struct relay_batch *b = worker->batch;
+    uint32_t now = flow_now();
+
+    if (relay_in_outage(worker, filled)) {
+        for (int i = 0; i < filled; i++)
+            pbuf_free(worker->cache, entries[i].buf);
+        return;
+    }
+
+    // The 6RD stage validated these already
+    int out = 0;
+    for (int i = 0; i < filled; i++) {
+        struct packet *pkt = (struct packet *)entries[i].buf->data;
+        b->fwd_length[i] = packet_payload_len(pkt);
+        const struct sockaddr_in *next_hop = relay_next_hop(worker, &entries[i].client, b->fwd_length[i], now);
+        if (worker->mtu > 0 && b->fwd_length[i] > worker->mtu) {
+            if (relay_fragment(worker, pkt, &entries[i].client, next_hop) == 0)
+                b->fwd_length[i] = -1;  // not forwarded
+            b->fwd_tx[i] = FWD_HANDED_OFF;
+            continue;
+        }
+        b->fwd_tx[i] = out;
+        b->tx_iov[out].iov_base = pkt;
+        b->tx_iov[out].iov_len = entries[i].buf->len;
+        b->tx[out].msg_hdr.msg_name = (void *)next_hop;
+        b->tx[out].msg_hdr.msg_control = NULL;
+        b->tx[out].msg_hdr.msg_controllen = 0;
+        out++;
+    }
+
+    int sent = relay_send(worker, b->tx, out);
+    uint64_t egress_ns = packet_now_ns();
+
+    for (int i = 0; i < filled; i++) {
+        struct packet *pkt = (struct packet *)entries[i].buf->data;
+        int length = b->fwd_length[i];
+        long forward_ns = elapsed_ns(entries[i].enqueue_ns, egress_ns);
+
+        if (length >= 0 && b->fwd_tx[i] < sent)
+            relay_account(worker, pkt, length, &entries[i].client, forward_ns,
+                          oneway_ns(pkt, length, entries[i].enqueue_ns));
+        pbuf_free(worker->cache, entries[i].buf);
+    }
+}
+
+// Doorbell of the fused ring: drain it in bursts of up to MAX_BATCH, then
+// announce that we are idle and re-check before going back to the loop.
+// After FUSED_DRAIN_BURSTS bursts we ring our own doorbell and yield the
+// loop to the timers.
+static void fused_drain(void *arg) {
+    struct relay_worker *worker = arg;
+    struct fused_link *link = worker->link;
+    uint64_t count;
+
+    if (read(link->doorbell, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("fused doorbell read failed");
+
+    for (int bursts = 0; bursts < FUSED_DRAIN_BURSTS; bursts++) {
+        int filled = (int)spsc_ring_pop_burst(&link->ring, worker->batch->entries, MAX_BATCH);
+        if (filled > 0) {
+            fused_forward(worker, worker->batch->entries, filled);
+            continue;
+        }
+        if (atomic_load_explicit(&link->consumer_idle, memory_order_relaxed))
+            return;
+        atomic_store(&link->consumer_idle, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+
+    count = 1;
+    if (write(link->doorbell, &count, sizeof(count)) < 0)
+        perror("fused doorbell write failed");
+}
+
+// Receive slots and the partial-batch flush timer, shared by the recvmmsg
+// path and the capture front-end. With -G a slot must hold a whole GRO
+// train, more than the pool's largest class, so the slots get their own
+// GRO_BUFFER_SIZE buffers.
+static void relay_setup_batch(struct relay_worker *worker) {
+    struct relay_batch *b = worker->batch;
+    size_t room = udp_offload ? GRO_BUFFER_SIZE : sizeof(struct packet);
+
+    if (b->pkts[0] != NULL)
+        return;
+    if (udp_offload) {
+        b->gro_area = malloc((size_t)batch_size * GRO_BUFFER_SIZE);
+        if (b->gro_area == NULL)
+            worker_error(worker, "GRO buffer allocation failed");
+    }
+    for (int i = 0; i < batch_size; i++) {
+        if (udp_offload) {
+            b->pkts[i] = (struct packet *)(b->gro_area + (size_t)i * GRO_BUFFER_SIZE);
+        } else {
+            b->bufs[i] = alloc_rx_buffer(worker->cache);
+            b->pkts[i] = pbuf_packet(b->bufs[i]);
+        }
+        b->rx_iov[i].iov_base = b->pkts[i];
+        b->rx_iov[i].iov_len = room;
+        b->rx[i].msg_hdr.msg_iov = &b->rx_iov[i];
+        b->rx[i].msg_hdr.msg_iovlen = 1;
+        b->rx[i].msg_hdr.msg_name = &b->client_addrs[i];
+        b->rx[i].msg_hdr.msg_control = &b->controls[i];
+    }
+    relay_reset_rx(worker, 0);
+
+    worker->flush_timer = evloop_add_timer(worker->loop, 0, relay_flush_expired, worker);
+    if (worker->flush_timer < 0)
+        worker_error(worker, "flush timer failed");
+}
+
+// Serve the stage's socket with recvmmsg batches from evloop readiness
+static void relay_setup_epoll(struct relay_worker *worker) {
+    relay_setup_batch(worker);
+    if (evloop_add_fd(worker->loop, worker->sockfd, relay_readable, worker) < 0)
+        worker_error(worker, "event registration failed");
+}
+
+// Return buffer bid to the stage's buffer ring; visible at the next publish
+static void relay_uring_recycle(struct relay_uring *u, uint16_t bid) {
+    struct pbuf *buf = u->pbufs[bid];
+
+    uring_buf_ring_add(&u->bufs, buf->room, buf->size, bid);
+    u->recycled++;
+}
+
+// An SQE, submitting what is queued first if the SQ is full
+static struct io_uring_sqe *relay_uring_sqe(struct relay_uring *u) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+
+    if (sqe == NULL && uring_submit(&u->ring) >= 0)
+        sqe = uring_get_sqe(&u->ring);
+    return sqe;
+}
+
+static void relay_uring_arm(struct relay_worker *worker) {
+    struct relay_uring *u = worker->uring;
+    struct io_uring_sqe *sqe = relay_uring_sqe(u);
+
+    if (sqe == NULL)
+        return;
+    uring_prep_recvmsg_multishot(sqe, worker->sockfd, &u->recv_msg, URING_BGID, URING_RECV << 16);
+    u->recv_armed = 1;
+}
+
+// A datagram landed in buffer bid. Queue a sendmsg of it, straight from
+// the buffer, to the flow's next hop, or copy it to the fused ring; entries
+// collects what goes to the ring. Returns 1 if an entry was staged.
+static int relay_uring_received(struct relay_worker *worker, uint16_t bid, int res, uint32_t now,
+                                struct fused_entry *entry) {
+    struct relay_uring *u = worker->uring;
+    struct uring_slot *slot = &u->slots[bid];
+    struct msghdr control = { 0 };
+    void *name, *payload;
+
+    int n = uring_recvmsg_parse(u->pbufs[bid]->room, res, &u->recv_msg, &name, &control, &payload);
+    struct packet *pkt = payload;
+    int length = n < 0 ? -1 : packet_validate(pkt, n);
+    if (length < 0 || relay_in_outage(worker, 1)) {
+        relay_uring_recycle(u, bid);
+        return 0;
+    }
+
+    memcpy(&slot->client, name, sizeof(slot->client));
+    slot->rx_ns = rx_timestamp(&control);
+    slot->oneway = oneway_ns(pkt, length, slot->rx_ns);
+    slot->length = length;
+
+    const struct sockaddr_in *next_hop = relay_next_hop(worker, &slot->client, length, now);
+    if (worker->mtu > 0 && length > worker->mtu) {
+        // Fragments are copies, sent right away
+        if (relay_fragment(worker, pkt, &slot->client, next_hop) > 0)
+            relay_account(worker, pkt, length, &slot->client, elapsed_ns(slot->rx_ns, packet_now_ns()),
+                          slot->oneway);
+        relay_uring_recycle(u, bid);
+        return 0;
+    }
+    if (fused_next_hop(worker, next_hop)) {
+        // Copied out, so the receive buffer goes straight back to the kernel
+        int staged = fused_stage(worker, pkt, n, &slot->client, entry) == 0;
+        if (staged)
+            relay_account(worker, pkt, length, &slot->client, elapsed_ns(slot->rx_ns, packet_now_ns()),
+                          slot->oneway);
+        relay_uring_recycle(u, bid);
+        return staged;
+    }
+
+    struct io_uring_sqe *sqe = relay_uring_sqe(u);
+    if (sqe == NULL) {
+        worker->send_dropped++;
+        relay_uring_recycle(u, bid);
+        return 0;
+    }
+    slot->dest = *next_hop;
+    slot->iov.iov_base = pkt;
+    slot->iov.iov_len = n;
+    uring_prep_sendmsg(sqe, worker->egress_fd, &slot->msg, (URING_SEND << 16) | bid);
+    return 0;
+}
+
+// The sendmsg of buffer bid completed with res: account the datagram if
+// it went out, forwarding time ending at the completion, else count it
+// dropped; either way give the buffer back
+static void relay_uring_sent(struct relay_worker *worker, uint16_t bid, int res, uint64_t egress_ns) {
+    struct relay_uring *u = worker->uring;
+    struct uring_slot *slot = &u->slots[bid];
+
+    if (res < 0) {
+        // Dropped, as relay_send() drops on a full socket buffer
+        if (res != -EAGAIN && res != -EWOULDBLOCK)
+            fprintf(stderr, "%s io_uring sendmsg failed: %s\n", worker->name, strerror(-res));
+        worker->send_dropped++;
+    } else {
+        relay_account(worker, slot->iov.iov_base, slot->length, &slot->client,
+                      elapsed_ns(slot->rx_ns, egress_ns), slot->oneway);
+    }
+    relay_uring_recycle(u, bid);
+}
+
+// Ring fd readable: reap every completion, queue the resulting sends and
+// buffer returns, and submit them with one io_uring_enter per pass. Passes
+// repeat while submitting produced completions of its own.
+static void relay_uring_ready(void *arg) {
+    struct relay_worker *worker = arg;
+    struct relay_uring *u = worker->uring;
+    struct fused_entry *entries = worker->batch->entries;
+
+    while (1) {
+        struct io_uring_cqe *cqe;
+        uint32_t now = flow_now();
+        uint64_t egress_ns = packet_now_ns();
+        int seen = 0, fused = 0;
+
+        u->recycled = 0;
+        while ((cqe = uring_peek_cqe(&u->ring)) != NULL) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+
+            uring_cqe_seen(&u->ring);
+            seen++;
+            if ((data >> 16) == URING_SEND) {
+                relay_uring_sent(worker, (uint16_t)data, res, egress_ns);
+                continue;
+            }
+
+            if (!(flags & IORING_CQE_F_MORE))
+                u->recv_armed = 0;
+            if (res < 0) {
+                // Out of buffers: re-armed once some come back
+                if (res != -ENOBUFS && !u->disabled) {
+                    fprintf(stderr, "%s io_uring recvmsg failed (%s), falling back to epoll\n",
+                            worker->name, strerror(-res));
+                    u->disabled = 1;
+                    relay_setup_epoll(worker);
+                }
+                continue;
+            }
+            if (flags & IORING_CQE_F_BUFFER) {
+                uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+                fused += relay_uring_received(worker, bid, res, now, &entries[fused]);
+                if (fused == MAX_BATCH) {
+                    fused_enqueue(worker, entries, fused);
+                    fused = 0;
+                }
+            }
+        }
+        if (fused > 0)
+            fused_enqueue(worker, entries, fused);
+        if (seen == 0)
+            break;
+
+        if (u->recycled > 0)
+            uring_buf_ring_publish(&u->bufs);
+        if (!u->recv_armed && !u->disabled && u->recycled > 0)
+            relay_uring_arm(worker);
+        if (uring_submit(&u->ring) < 0)
+            perror("io_uring submit failed");
+    }
+}
+
+// Serve the stage's socket with multishot recvmsg into a ring of
+// URING_BUFFERS pool buffers. Returns -1, leaving the stage to the epoll
+// path, if io_uring or provided-buffer rings are unavailable.
+static int relay_setup_uring(struct relay_worker *worker) {
+    struct relay_uring *u = calloc(1, sizeof(*u));
+
+    if (u == NULL)
+        return -1;
+    if (uring_init(&u->ring, URING_BUFFERS) < 0)
+        goto unavailable;
+    if (uring_buf_ring_init(&u->ring, &u->bufs, URING_BUFFERS, URING_BGID) < 0) {
+        int saved = errno;
+        uring_exit(&u->ring);
+        errno = saved;
+        goto unavailable;
+    }
+
+    u->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    u->recv_msg.msg_controllen = sizeof(union rx_control);
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        struct uring_slot *slot = &u->slots[i];
+        u->pbufs[i] = alloc_rx_buffer(worker->cache);
+        slot->msg.msg_name = &slot->dest;
+        slot->msg.msg_namelen = sizeof(slot->dest);
+        slot->msg.msg_iov = &slot->iov;
+        slot->msg.msg_iovlen = 1;
+        relay_uring_recycle(u, (uint16_t)i);
+    }
+    uring_buf_ring_publish(&u->bufs);
+
+    worker->uring = u;
+    if (evloop_add_fd(worker->loop, u->ring.fd, relay_uring_ready, worker) < 0)
+        worker_error(worker, "io_uring registration failed");
+    relay_uring_arm(worker);
+    if (uring_submit(&u->ring) < 0)
+        worker_error(worker, "io_uring submit failed");
+    return 0;
+
+unavailable:
+    fprintf(stderr, "%s io_uring unavailable (%s), using epoll\n", worker->name, strerror(errno));
+    free(u);
+    return -1;
+}
+
+static void relay_teardown_uring(struct relay_worker *worker) {
+    struct relay_uring *u = worker->uring;
+
+    uring_buf_ring_exit(&u->ring, &u->bufs);
+    uring_exit(&u->ring);
+    for (int i = 0; i < URING_BUFFERS; i++)
+        pbuf_free(worker->cache, u->pbufs[i]);
+    free(u);
+    worker->uring = NULL;
+}
+
+// Socket bound to the worker's stage port, shared with the stage's other
+// workers through SO_REUSEPORT
+static int relay_listen(struct relay_worker *worker) {
+    struct sockaddr_in server_addr;
+    int opt = 1;
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+        worker_error(worker, "Socket creation failed");
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(worker->port);
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+        worker_error(worker, "setsockopt failed");
+
+    // Every worker binds its own socket to the port; the kernel spreads
+    // incoming flows across them by 4-tuple hash
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+        worker_error(worker, "setsockopt SO_REUSEPORT failed");
+
+    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        worker_error(worker, "Bind failed");
+
+    enable_rx_timestamps(sockfd);
+    if (udp_offload)
+        enable_udp_gro(sockfd);
+    return sockfd;
+}
+
+// Open the stage's sockets and register its handlers on loop. The consumer
+// of a fused ring has no listening socket: its packets come off the ring.
+static void relay_setup(struct relay_worker *worker, struct evloop *loop) {
+    struct relay_batch *b = calloc(1, sizeof(*b));
+
+    if (b == NULL)
+        worker_error(worker, "batch buffer allocation failed");
+    worker->loop = loop;
+    worker->batch = b;
+    worker->cache = pool_cache_create(pkt_pool, worker->name);
+    if (worker->cache == NULL)
+        worker_fatal(worker, "has no pool cache: too many threads");
+    worker->metrics = metrics_open(worker->metrics_file);
+    if (worker->metrics == NULL)
+        worker_fatal(worker, "metrics stream failed");
+    worker->stats = log_register(worker->name);
+    if (worker->stats == NULL)
+        worker_fatal(worker, "has no log stats block: too many threads");
+    worker->sockfd = -1;
+
+    for (int i = 0; i < MAX_BATCH; i++) {
+        b->tx[i].msg_hdr.msg_iov = &b->tx_iov[i];
+        b->tx[i].msg_hdr.msg_iovlen = 1;
+        b->tx[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    if (worker->mtu > 0) {
+        b->frag_area = malloc(MAX_FRAGMENTS * (sizeof(struct wire_header) + (size_t)worker->mtu));
+        if (b->frag_area == NULL)
+            worker_error(worker, "fragment buffer allocation failed");
+        for (int i = 0; i < MAX_FRAGMENTS; i++) {
+            b->frag_tx[i].msg_hdr.msg_iov = &b->frag_iov[i];
+            b->frag_tx[i].msg_hdr.msg_iovlen = 1;
+            b->frag_tx[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+    }
+
+    // Sweep the table once per idle timeout, a slice every FLOW_EXPIRE_MS
+    uint64_t slots = (uint64_t)worker->flows->mask + 1;
+    worker->expire_budget = (int)(slots * FLOW_EXPIRE_MS / (flow_idle_timeout * 1000ULL + 1)) + FLOW_EXPIRE_BUDGET;
+    if (evloop_add_timer(loop, FLOW_EXPIRE_MS * 1000L, relay_expire_flows, worker) < 0)
+        worker_error(worker, "flow expiry timer failed");
+
+    if (worker->link != NULL && worker->port == TEREDO_RELAY_PORT) {
+        worker->egress_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (worker->egress_fd < 0)
+            worker_error(worker, "egress socket creation failed");
+        if (evloop_add_fd(loop, worker->link->doorbell, fused_drain, worker) < 0)
+            worker_error(worker, "doorbell registration failed");
+        printf("%s Server is running fused behind the 6RD stage...\n", worker->name);
+        return;
+    }
+
+    worker->sockfd = relay_listen(worker);
+
+    // With several workers, forward from a per-worker ephemeral port so the
+    // next stage's SO_REUSEPORT hash sees one flow per worker, not one in total
+    worker->egress_fd = worker->sockfd;
+    if (relay_workers > 1) {
+        worker->egress_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (worker->egress_fd < 0)
+            worker_error(worker, "egress socket creation failed");
+    }
+
+    if (io_engine == ENGINE_URING && relay_setup_uring(worker) == 0) {
+        printf("%s Server is running on port %d (io_uring)...\n", worker->name, worker->port);
+        return;
+    }
+    relay_setup_epoll(worker);
+    printf("%s Server is running on port %d...\n", worker->name, worker->port);
+}
+
+// Close the stage's sockets and give its buffers back to the pool
+static void relay_teardown(struct relay_worker *worker) {
+    struct relay_batch *b = worker->batch;
+
+    if (worker->uring != NULL)
+        relay_teardown_uring(worker);
+    if (worker->egress_fd != worker->sockfd)
+        close(worker->egress_fd);
+    if (worker->sockfd >= 0)
+        close(worker->sockfd);
+    for (int i = 0; i < batch_size; i++) {
+        if (b->bufs[i] != NULL)
+            pbuf_free(worker->cache, b->bufs[i]);
+    }
+    // Packets still queued on a fused ring are dropped with the consumer
+    if (worker->link != NULL && worker->sockfd < 0) {
+        int n;
+        while ((n = (int)spsc_ring_pop_burst(&worker->link->ring, b->entries, MAX_BATCH)) > 0) {
+            for (int i = 0; i < n; i++)
+                pbuf_free(worker->cache, b->entries[i].buf);
+        }
+    }
+    pool_cache_flush(worker->cache);
+    if (worker->outage_dropped > 0)
+        printf("%s dropped %lu datagrams during its outage\n", worker->name, worker->outage_dropped);
+    free(b->gro_area);
+    free(b->frag_area);
+    free(b);
+    worker->batch = NULL;
+}
+
+// Queue an IPv6 packet decapsulated by the capture front-end into the
+// stage's receive batch as a wire packet, as if it had arrived on the
+// stage's socket from client
+static void relay_ingest(struct relay_worker *worker, const unsigned char *ipv6, long len,
+                         const struct sockaddr_in *client, uint64_t rx_ns) {
+    struct relay_batch *b = worker->batch;
+    int i = worker->filled;
+    struct packet *pkt = b->pkts[i];
+
+    memcpy(pkt->data, ipv6, len);
+    packet_set_header(pkt, (int)len, PKT_TYPE_IPV6);
+    b->rx[i].msg_len = (unsigned)packet_wire_len(pkt);
+    b->client_addrs[i] = *client;
+    b->rx_ns[i] = rx_ns;
+    b->gro_size[i] = 0;
+    if (++worker->filled == batch_size)
+        relay_flush(worker);
+}
+
+// Payload of the UDP datagram in a captured IPv4 packet whose header
+// (header_len bytes) was validated, with its source in *client. Returns the
+// payload length, or -1. The UDP checksum is left alone: loopback and
+// offloading NICs hand us partial ones.
+static long udp_payload(const unsigned char *ipv4, size_t header_len, struct sockaddr_in *client,
+                        const unsigned char **payload) {
+    struct udphdr udp;
+    size_t total = ((size_t)ipv4[2] << 8) | ipv4[3];
+
+    if (ipv4[9] != IPPROTO_UDP || total < header_len + sizeof(udp))
+        return -1;
+    memcpy(&udp, ipv4 + header_len, sizeof(udp));
+    size_t udp_len = ntohs(udp.len);
+    if (udp_len < sizeof(udp) || udp_len > total - header_len)
+        return -1;
+
+    memcpy(&client->sin_addr.s_addr, ipv4 + 12, sizeof(client->sin_addr.s_addr));
+    client->sin_port = udp.source;
+    *payload = ipv4 + header_len + sizeof(udp);
+    return (long)(udp_len - sizeof(udp));
+}
+
+// A batch of captured frames: check every outer IPv4 header at once, then
+// decapsulate 6RD or Teredo and queue each IPv6 packet to the stage that
+// relays it. The flow is keyed on the outer source.
+static void relay_captured(void *arg, const unsigned char *const *frames, const size_t *lens,
+                           const uint64_t *rx_ns, int n) {
+    struct relay_thread *t = arg;
+    uint8_t header_len[CAPTURE_BATCH];
+
+    ipv4_header_valid_batch(frames, lens, n, header_len);
+    for (int i = 0; i < n; i++) {
+        const unsigned char *ipv4 = frames[i];
+        struct sockaddr_in client = { .sin_family = AF_INET };
+        const unsigned char *inner;
+        long len = -1;
+
+        if (header_len[i] == 0) {
+            t->undecapsulated++;
+            continue;
+        }
+        if (ipv4[9] == IPPROTO_6RD && t->sixrd != NULL) {
+            len = sixrd_decap_valid(&sixrd_domain, ipv4, header_len[i], &inner);
+            if (len >= 0 && len <= BUFFER_SIZE) {
+                memcpy(&client.sin_addr.s_addr, ipv4 + 12, sizeof(client.sin_addr.s_addr));
+                relay_ingest(t->sixrd, inner, len, &client, rx_ns[i]);
+                continue;
+            }
+        } else if (t->teredo != NULL) {
+            const unsigned char *payload;
+            struct teredo_packet pkt;
+            len = udp_payload(ipv4, header_len[i], &client, &payload);
+            // Bubbles carry no data and go no further than the Teredo stage
+            if (len >= 0 && teredo_parse(payload, (size_t)len, &pkt) == 0 && pkt.ipv6_len <= BUFFER_SIZE) {
+                if (!teredo_is_bubble(&pkt))
+                    relay_ingest(t->teredo, pkt.ipv6, (long)pkt.ipv6_len, &client, rx_ns[i]);
+                continue;
+            }
+        }
+        t->undecapsulated++;
+    }
+}
+
+// Capture fd readable: take every frame the kernel has ready, then flush
+// or time the partial batches as relay_readable() does
+static void relay_capture_readable(void *arg) {
+    struct relay_thread *t = arg;
+
+    capture_poll(t->capture, relay_captured, t);
+    if (t->sixrd != NULL)
+        relay_flush_later(t->sixrd);
+    if (t->teredo != NULL)
+        relay_flush_later(t->teredo);
+}
+
+// Open the thread's capture for the traffic of the stages it serves, next
+// to their sockets. Stage workers sharing the interface split its traffic
+// by flow: AF_PACKET through a fanout group per kind of traffic, AF_XDP by
+// worker i taking interface queue i. AF_XDP has one socket per queue for
+// both kinds, so it needs both stages on one thread (-S); without them, or
+// if AF_XDP is unavailable, the capture falls back to AF_PACKET.
+static void relay_setup_capture(struct relay_thread *t, struct evloop *loop) {
+    struct relay_worker *first = t->stages[0];
+    enum capture_mode mode = capture_mode;
+    unsigned traffic = 0;
+
+    for (int i = 0; i < t->stage_count; i++) {
+        struct relay_worker *worker = t->stages[i];
+        if (worker->port == SIXRD_PORT) {
+            t->sixrd = worker;
+            traffic |= CAPTURE_6RD;
+        } else {
+            t->teredo = worker;
+            traffic |= CAPTURE_TEREDO;
+        }
+        relay_setup_batch(worker);
+    }
+
+    if (mode == CAPTURE_XDP && traffic != (CAPTURE_6RD | CAPTURE_TEREDO)) {
+        fprintf(stderr, "%s AF_XDP capture needs both stages on one thread (-S), using AF_PACKET\n", first->name);
+        mode = CAPTURE_PACKET;
+    }
+    int fanout = relay_workers > 1 ? (int)(((unsigned)getpid() << 2 | traffic) & 0xffff) : 0;
+    t->capture = capture_open(mode, capture_ifname, traffic, fanout, first->id);
+    if (t->capture == NULL && mode == CAPTURE_XDP) {
+        fprintf(stderr, "%s AF_XDP unavailable on %s (%s), using AF_PACKET\n", first->name, capture_ifname,
+                strerror(errno));
+        mode = CAPTURE_PACKET;
+        t->capture = capture_open(mode, capture_ifname, traffic, fanout, first->id);
+    }
+    if (t->capture == NULL)
+        worker_error(first, "capture failed");
+    if (evloop_add_fd(loop, capture_fd(t->capture), relay_capture_readable, t) < 0)
+        worker_error(first, "capture registration failed");
+
+    printf("%s capturing %s%s%s on %s (%s)...\n", first->name, traffic & CAPTURE_6RD ? "6RD" : "",
+           traffic == (CAPTURE_6RD | CAPTURE_TEREDO) ? " and " : "", traffic & CAPTURE_TEREDO ? "Teredo" : "",
+           capture_ifname, mode == CAPTURE_XDP ? "AF_XDP" : "AF_PACKET");
+}
+
+static void relay_teardown_capture(struct relay_thread *t) {
+    unsigned long frames, dropped;
+
+    capture_stats(t->capture, &frames, &dropped);
+    printf("%s capture on %s: %lu frames, %lu not decapsulated, %lu dropped by the kernel\n",
+           t->stages[0]->name, capture_ifname, frames, t->undecapsulated, dropped);
+    capture_close(t->capture);
+    t->capture = NULL;
+}
+
+// One relay thread: an event loop serving every stage assigned to it
+// until shutdown
+static void *relay_thread(void *arg) {
+    struct relay_thread *t = arg;
+    struct evloop *loop = evloop_create();
+
+    if (loop == NULL)
+        handle_error("Failed to create relay event loop");
+    pin_to_cpu(t->cpu);
+    for (int i = 0; i < t->stage_count; i++)
+        relay_setup(t->stages[i], loop);
+    if (capture_enabled)
+        relay_setup_capture(t, loop);
+
+    evloop_run(loop);
+
+    if (t->capture != NULL)
+        relay_teardown_capture(t);
+    for (int i = 0; i < t->stage_count; i++)
+        relay_teardown(t->stages[i]);
+    evloop_destroy(loop);
+    return NULL;
+}
+
+static void init_worker(struct relay_worker *worker, const char *stage, int id, int port,
+                        const struct route_table *routes, const struct tunnel_mtu *mtu,
+                        const struct stage_outage *outage, const char *metrics_file) {
+    worker->id = id;
+    worker->port = port;
+    worker->mtu = tunnel_inner_mtu(mtu);
+    if (outage->for_us > 0) {
+        worker->outage_start_us = now_us() + outage->after_us;
+        worker->outage_end_us = worker->outage_start_us + outage->for_us;
+    }
+    worker->metrics_file = metrics_file;
+    worker->flows = flow_table_create(max_flows, flow_idle_timeout, flow_key_mode, routes);
+    if (worker->flows == NULL)
+        handle_error("Failed to allocate flow table");
+    if (relay_workers > 1)
+        snprintf(worker->name, sizeof(worker->name), "%s-%d", stage, id);
+    else
+        snprintf(worker->name, sizeof(worker->name), "%s", stage);
+}
+
+// Start relay_workers workers per relay stage. Each stage worker gets its
+// own thread, or with -S each 6RD/Teredo pair shares one. With more than
+// one worker per stage, threads are pinned round-robin across the online
+// CPUs, 6RD workers first and Teredo workers after them.
+static void start_relays(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (sixrd_mtu.link_mtu > 0)
+        printf("6RD tunnel MTU %d: IPv6 packets over %d bytes are fragmented\n", sixrd_mtu.link_mtu,
+               tunnel_inner_mtu(&sixrd_mtu));
+    if (teredo_mtu.link_mtu > 0)
+        printf("Teredo tunnel MTU %d: IPv6 packets over %d bytes are fragmented\n", teredo_mtu.link_mtu,
+               tunnel_inner_mtu(&teredo_mtu));
+    if (parallel_paths)
+        printf("Parallel paths: 6RD and Teredo both forward to the receiver\n");
+    if (sixrd_outage.for_us > 0)
+        printf("6RD outage: dropping everything from %.1f s for %.1f s\n", sixrd_outage.after_us / 1e6,
+               sixrd_outage.for_us / 1e6);
+    if (teredo_outage.for_us > 0)
+        printf("Teredo outage: dropping everything from %.1f s for %.1f s\n", teredo_outage.after_us / 1e6,
+               teredo_outage.for_us / 1e6);
+
+    for (int i = 0; i < relay_workers; i++) {
+        struct relay_worker *sixrd = &sixrd_workers[i];
+        struct relay_worker *teredo = &teredo_workers[i];
+
+        init_worker(sixrd, "6RD", i, SIXRD_PORT, &sixrd_routes, &sixrd_mtu, &sixrd_outage, "metrics_6rd.csv");
+        init_worker(teredo, "Teredo", i, TEREDO_RELAY_PORT, &teredo_routes, &teredo_mtu, &teredo_outage,
+                    "metrics_teredo.csv");
+        if (fused_hop) {
+            struct fused_link *link = &fused_links[i];
+            if (spsc_ring_init(&link->ring, FUSED_RING_SIZE, sizeof(struct fused_entry)) < 0)
+                handle_error("Failed to allocate fused ring");
+            link->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (link->doorbell < 0)
+                handle_error("Failed to create fused doorbell");
+            atomic_init(&link->consumer_idle, 1);
+            sixrd->link = teredo->link = link;
+        }
 
-// Structure for packet data
-struct packet {
-    char data[BUFFER_SIZE];
-    int length;
-    int type;  // 0 for IPv4, 1 for IPv6
-};
+        if (shared_threads) {
+            struct relay_thread *t = &relay_threads[relay_thread_count++];
+            t->cpu = relay_workers > 1 ? (int)(i % cpus) : -1;
+            t->stages[0] = sixrd;
+            t->stages[1] = teredo;
+            t->stage_count = 2;
+        } else {
+            struct relay_thread *t = &relay_threads[relay_thread_count++];
+            t->cpu = relay_workers > 1 ? (int)(i % cpus) : -1;
+            t->stages[0] = sixrd;
+            t->stage_count = 1;
+            t = &relay_threads[relay_thread_count++];
+            t->cpu = relay_workers > 1 ? (int)((relay_workers + i) % cpus) : -1;
+            t->stages[0] = teredo;
+            t->stage_count = 1;
+        }
+    }
 
-// Function to handle errors
-void handle_error(const char *message) {
-    perror(message);
-    exit(1);
+    for (int i = 0; i < relay_thread_count; i++) {
+        if (pthread_create(&relay_threads[i].thread, NULL, relay_thread, &relay_threads[i]) != 0)
+            handle_error("Failed to create relay thread");
+    }
+}
+
+// Stop every relay loop and wait for the threads to close their sockets
+static void stop_relays(void) {
+    evloop_shutdown();
+    for (int i = 0; i < relay_thread_count; i++)
+        pthread_join(relay_threads[i].thread, NULL);
+    relay_thread_count = 0;
+}
+
+// Main thread's loop timers
+static void summary_tick(void *arg) {
+    (void)arg;
+    log_summary();
+}
+
+static void stop_loop(void *arg) {
+    evloop_stop(arg);
+}
+
+// Event loop for the main thread, printing a summary line per stats block
+// every summary_interval seconds
+static struct evloop *create_main_loop(void) {
+    struct evloop *loop = evloop_create();
+
+    if (loop == NULL)
+        handle_error("Failed to create event loop");
+    if (LOG_ENABLED(LOG_SUMMARY)) {
+        log_summary();
+        if (evloop_add_timer(loop, summary_interval * 1000000L, summary_tick, NULL) < 0)
+            handle_error("Failed to create summary timer");
+    }
+    return loop;
 }
 
-// Function to calculate time difference in microseconds
-long calculate_latency(struct timeval start, struct timeval end) {
-    return (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
+// Flow table counters of every worker, printed when a benchmark ends
+static void print_flow_stats(void) {
+    for (int i = 0; i < relay_workers; i++) {
+        struct relay_worker *stage[2] = { &sixrd_workers[i], &teredo_workers[i] };
+        for (int j = 0; j < 2; j++) {
+            struct flow_table *t = stage[j]->flows;
+            printf("%s flows: %u active, %lu lookups, %lu created, %lu evicted, %lu uncached, %zu KB table\n",
+                   stage[j]->name, t->count, t->stats.lookups, t->stats.misses,
+                   t->stats.evictions, t->stats.insert_failed, t->bytes / 1024);
+        }
+    }
 }
 
-// Function to log metrics
-void log_metrics(const char *filename, int packet_count, long latency, double throughput) {
-    FILE *file = fopen(filename, "a");
-    if (file == NULL) {
-        perror("Failed to open metrics file");
+// Fused ring counters of every 6RD worker, printed when a benchmark ends
+static void print_ring_stats(void) {
+    if (!fused_hop)
         return;
+    for (int i = 0; i < relay_workers; i++) {
+        struct relay_worker *w = &sixrd_workers[i];
+        printf("%s ring: %lu queued, %lu full waits, %lu dropped (no buffer)\n", w->name,
+               atomic_load(&w->ring_queued), atomic_load(&w->ring_waits), atomic_load(&w->ring_dropped));
     }
-    fprintf(file, "%d,%ld,%.2f\n", packet_count, latency, throughput);
-    fclose(file);
 }
 
-// Simulated 6RD Server
-void *sixrd_server(void *arg) {
-    int sockfd;
-    struct sockaddr_in server_addr;
-    int packet_count = 0;
+// Tunnel MTU and send drop counters of every worker, printed when a
+// benchmark ends
+static void print_frag_stats(void) {
+    for (int i = 0; i < relay_workers; i++) {
+        struct relay_worker *stage[2] = { &sixrd_workers[i], &teredo_workers[i] };
+        for (int j = 0; j < 2; j++) {
+            struct relay_worker *w = stage[j];
+            if (w->mtu > 0)
+                printf("%s MTU: %lu packets split into %lu fragments, %lu too big to split\n", w->name,
+                       w->fragmented, w->fragments_sent, w->too_big);
+            if (w->send_dropped > 0)
+                printf("%s: %lu messages dropped on send (full socket buffer)\n", w->name, w->send_dropped);
+        }
+    }
+}
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) 
-        handle_error("6RD Socket creation failed");
+// Reassembly counters: share of fragmented packets that came out whole,
+// and of those evicted for room, in percent
+static double frag_hit_pct(const struct frag_stats *s) {
+    unsigned long started = s->reassembled + s->timed_out + s->evicted;
+    return started > 0 ? 100.0 * s->reassembled / started : 0.0;
+}
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SIXRD_PORT);
+static double frag_evict_pct(const struct frag_stats *s) {
+    unsigned long started = s->reassembled + s->timed_out + s->evicted;
+    return started > 0 ? 100.0 * s->evicted / started : 0.0;
+}
 
-    int opt = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) 
-        handle_error("6RD setsockopt failed");
+static void print_reassembly_stats(const char *who, const struct frag_stats *s) {
+    printf("%s reassembly: %lu fragments, %lu packets reassembled (%.1f%% hit), %lu timed out, "
+           "%lu evicted (%.1f%%), %lu invalid\n", who, s->fragments, s->reassembled, frag_hit_pct(s),
+           s->timed_out, s->evicted, frag_evict_pct(s), s->invalid);
+}
 
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-        handle_error("6RD Bind failed");
+// Benchmark state shared between the load generators and the sinks
+static volatile int bench_stop = 0;
+static _Atomic long bench_sent = 0;
+static _Atomic long bench_received = 0;
+static _Atomic long bench_received_bytes = 0;
 
-    printf("6RD Server is running on port %d...\n", SIXRD_PORT);
+// What one sink measured, merged after the run
+struct bench_sink_result {
+    struct hist oneway;
+    struct frag_stats reassembly;
+    long invalid;   // segments that failed validation, not counted as received
+};
+static struct bench_sink_result bench_sinks[MAX_WORKERS];
 
-    while (1) {
-        struct packet pkt;
-        struct sockaddr_in client_addr;
-        socklen_t len = sizeof(client_addr);
-        struct timeval start, end;
+// Benchmark load generator: blasts bench_size-byte IPv6 packets at the
+// ingress stage (6RD unless -I teredo), rotating over several source
+// sockets so SO_REUSEPORT has flows to spread.
+// With -G each message is a UDP_SEGMENT train of up to GSO_MAX_SEGMENTS
+// copies of the datagram.
+void *bench_sender(void *arg) {
+    struct sockaddr_in ingress_addr;
+    struct pool_cache *cache = pool_cache_create(pkt_pool, "Sender");
+    struct pbuf *buf = cache != NULL ? pbuf_alloc(cache, sizeof(struct wire_header) + bench_size) : NULL;
+    unsigned char *train = NULL;
+    union tx_control control;
+    struct mmsghdr msgs[BENCH_TX_BATCH];
+    struct iovec iov;
+    int socks[BENCH_FLOWS_PER_SENDER];
+    long sent = 0;
 
-        // Receive data
-        gettimeofday(&start, NULL);
-        int n = recvfrom(sockfd, &pkt, sizeof(pkt), 0, (struct sockaddr *)&client_addr, &len);
-        gettimeofday(&end, NULL);
+    (void)arg;
+    for (int i = 0; i < BENCH_FLOWS_PER_SENDER; i++) {
+        socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (socks[i] < 0)
+            handle_error("Bench sender socket creation failed");
+    }
 
-        if (n < 0) continue;
+    memset(&ingress_addr, 0, sizeof(ingress_addr));
+    ingress_addr.sin_family = AF_INET;
+    ingress_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    ingress_addr.sin_port = htons(bench_ingress_port);
 
-        // Get the IP of the client
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-        
-        // Calculate latency
-        long latency = calculate_latency(start, end);
+    // Only bench_size bytes of payload are ever touched, so the buffer comes
+    // from the smallest size class that holds them
+    if (buf == NULL)
+        fatal_error("Bench sender buffer allocation failed");
+    struct packet *pkt = pbuf_packet(buf);
+    packet_fill(pkt, bench_size);
+
+    int wire_len = packet_wire_len(pkt);
+    int segments = 1;
+    iov.iov_base = pkt;
+    iov.iov_len = wire_len;
+    if (udp_offload) {
+        segments = (GRO_BUFFER_SIZE - 1024) / wire_len;
+        if (segments > GSO_MAX_SEGMENTS)
+            segments = GSO_MAX_SEGMENTS;
+        train = malloc((size_t)segments * wire_len);
+        if (train == NULL)
+            handle_error("Bench sender train allocation failed");
+        iov.iov_base = train;
+        iov.iov_len = (size_t)segments * wire_len;
+    }
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BENCH_TX_BATCH; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &ingress_addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(ingress_addr);
+        if (segments > 1)
+            set_gso_size(&msgs[i].msg_hdr, &control, wire_len);
+    }
+
+    // The whole batch shares one send timestamp, so one-way latency includes
+    // the time sendmmsg takes to get to each datagram
+    for (int flow = 0; !bench_stop; flow = (flow + 1) % BENCH_FLOWS_PER_SENDER) {
+        packet_stamp_payload(pkt, packet_now_ns());
+        for (int i = 0; train != NULL && i < segments; i++)
+            memcpy(train + (size_t)i * wire_len, pkt, wire_len);
+        int n = sendmmsg(socks[flow], msgs, BENCH_TX_BATCH, 0);
+        if (n > 0)
+            sent += (long)n * segments;
+    }
+    bench_sent += sent;
+
+    for (int i = 0; i < BENCH_FLOWS_PER_SENDER; i++)
+        close(socks[i]);
+    free(train);
+    pbuf_free(cache, buf);
+    pool_cache_flush(cache);
+    return NULL;
+}
+
+// Benchmark sink: counts packets arriving at the receiver port and
+// records their one-way latency from the load generator. With -G it
+// takes GRO trains and counts every datagram in them. Fragments from a
+// relay's tunnel MTU (-M) count once their packet is reassembled.
+void *bench_sink(void *arg) {
+    struct bench_sink_result *result = arg;
+    struct hist *oneway = &result->oneway;
+    struct sockaddr_in receiver_addr;
+    struct pool_cache *cache = pool_cache_create(pkt_pool, "Sink");
+    struct pbuf *bufs[BENCH_TX_BATCH];
+    struct packet *pkts[BENCH_TX_BATCH];
+    union rx_control controls[BENCH_TX_BATCH];
+    struct mmsghdr msgs[BENCH_TX_BATCH];
+    struct iovec iovs[BENCH_TX_BATCH];
+    unsigned char *gro_area = NULL;
+    size_t room = sizeof(struct packet);
+    long received = 0, received_bytes = 0, invalid = 0;
+
+    hist_reset(oneway);
+    struct frag_cache *reassembly = frag_cache_create(FRAG_DEFAULT_PACKETS, BUFFER_SIZE, FRAG_DEFAULT_TIMEOUT_MS);
+    if (reassembly == NULL)
+        handle_error("Bench sink reassembly cache allocation failed");
+    if (udp_offload) {
+        room = GRO_BUFFER_SIZE;
+        gro_area = malloc(BENCH_TX_BATCH * room);
+        if (gro_area == NULL)
+            handle_error("Bench sink GRO buffer allocation failed");
+    }
+    for (int i = 0; i < BENCH_TX_BATCH; i++) {
+        bufs[i] = udp_offload ? NULL : alloc_rx_buffer(cache);
+        pkts[i] = udp_offload ? (struct packet *)(gro_area + i * room) : pbuf_packet(bufs[i]);
+    }
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+        handle_error("Bench sink socket creation failed");
+
+    memset(&receiver_addr, 0, sizeof(receiver_addr));
+    receiver_addr.sin_family = AF_INET;
+    receiver_addr.sin_addr.s_addr = INADDR_ANY;
+    receiver_addr.sin_port = htons(RECEIVER_PORT);
+
+    int opt = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+        handle_error("Bench sink setsockopt failed");
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+        handle_error("Bench sink setsockopt SO_REUSEPORT failed");
+
+    struct timeval tv = { 0, 100000 };  // wake up to notice bench_stop
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (bind(sockfd, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) < 0)
+        handle_error("Bench sink Bind failed");
+
+    enable_rx_timestamps(sockfd);
+    if (udp_offload)
+        enable_udp_gro(sockfd);
 
-        // Calculate throughput in KBps
-        double throughput = (pkt.length / (latency / 1e6)) / 1024.0;  // in KBps
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BENCH_TX_BATCH; i++) {
+        iovs[i].iov_base = pkts[i];
+        iovs[i].iov_len = room;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = &controls[i];
+    }
 
-        packet_count++;
-        printf("6RD Server received from %s: %s (Latency: %ld us, Throughput: %.2f KBps)\n", 
-               client_ip, pkt.data, latency, throughput);
-        log_metrics("metrics.txt", packet_count, latency, throughput);
+    while (!bench_stop) {
+        for (int i = 0; i < BENCH_TX_BATCH; i++)
+            msgs[i].msg_hdr.msg_controllen = sizeof(union rx_control);
 
-        // Forward to Teredo server
-        struct sockaddr_in teredo_addr;
-        memset(&teredo_addr, 0, sizeof(teredo_addr));
-        teredo_addr.sin_family = AF_INET;
-        teredo_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-        teredo_addr.sin_port = htons(TEREDO_PORT);
+        int n = recvmmsg(sockfd, msgs, BENCH_TX_BATCH, MSG_WAITFORONE, NULL);
+        for (int i = 0; i < n; i++) {
+            int len = (int)msgs[i].msg_len;
+            int size = udp_offload ? rx_gro_size(&msgs[i].msg_hdr) : 0;
+            uint64_t rx_ns = rx_timestamp(&msgs[i].msg_hdr);
 
-        sendto(sockfd, &pkt, sizeof(pkt), 0, (struct sockaddr *)&teredo_addr, sizeof(teredo_addr));
+            received_bytes += len;
+            if (size <= 0)
+                size = len;
+            for (int off = 0; off < len; off += size) {
+                struct packet *pkt = (struct packet *)((unsigned char *)pkts[i] + off);
+                int length = packet_validate(pkt, len - off < size ? len - off : size);
+                const unsigned char *payload;
+                uint64_t sent;
+                if (length < 0) {
+                    invalid++;
+                    continue;
+                }
+                if (packet_reassemble(reassembly, pkt, length, rx_ns, &payload, &sent) == 0)
+                    continue;
+                received++;
+                if (sent != 0)
+                    hist_record(oneway, (uint64_t)elapsed_ns(sent, rx_ns));
+            }
+        }
+        frag_expire(reassembly, packet_now_ns() / 1000000, FRAG_EXPIRE_BUDGET);
     }
+    frag_cache_stats(reassembly, &result->reassembly);
+    frag_cache_destroy(reassembly);
+    result->invalid = invalid;
+    bench_received += received;
+    bench_received_bytes += received_bytes;
     close(sockfd);
+    for (int i = 0; i < BENCH_TX_BATCH; i++) {
+        if (bufs[i] != NULL)
+            pbuf_free(cache, bufs[i]);
+    }
+    free(gro_area);
+    pool_cache_flush(cache);
+    return NULL;
+}
+
+// One thread of the traffic generator, merged after the run
+struct gen_thread {
+    int id;
+    int flows;
+    double pps;
+    pthread_t thread;
+    long sent;
+    long failed;            // sends the kernel refused
+    unsigned long bytes;    // on the wire, header included
+};
+static struct gen_thread gen_threads[MAX_WORKERS];
+static int gen_thread_count = 0;
+
+// Wait for a paced send, sleeping for most of the wait and yielding for
+// the rest, so a relay sharing the core keeps running. Sleeps are capped
+// so a stop is noticed.
+static void gen_wait(uint64_t due) {
+    uint64_t now = now_ns();
+
+    while (now < due && !bench_stop) {
+        if (due - now > 100000) {
+            uint64_t sleep_ns = due - now - 50000;
+            if (sleep_ns > GEN_SLEEP_MAX_US * 1000ULL)
+                sleep_ns = GEN_SLEEP_MAX_US * 1000ULL;
+            struct timespec ts = { (time_t)(sleep_ns / 1000000000ULL), (long)(sleep_ns % 1000000000ULL) };
+            nanosleep(&ts, NULL);
+        } else {
+            sched_yield();
+        }
+        now = now_ns();
+    }
+}
+
+// Traffic generator: packets with sizes drawn from gen_sizes, each from
+// one of the thread's flows, to the ingress stage at tunnel_target. A flow
+// is a socket of its own, so a source port and a 5-tuple the relays' flow
+// tables and SO_REUSEPORT see. Flows are picked at random per packet. The
+// generator is open loop: paced packets go out on schedule whatever
+// happens to the earlier ones, and a backlog is sent at once.
+static void *gen_sender(void *arg) {
+    struct gen_thread *t = arg;
+    struct sockaddr_in ingress;
+    struct pool_cache *cache = pool_cache_create(pkt_pool, "Generator");
+    struct pbuf *buf = cache != NULL ? pbuf_alloc(cache, sizeof(struct wire_header) + gen_sizes.max) : NULL;
+    int *socks = calloc(t->flows, sizeof(*socks));
+    uint64_t rng = gen_seed(t->id);
+    struct gen_pacer pacer;
+
+    if (buf == NULL || socks == NULL)
+        fatal_error("Generator allocation failed");
+    for (int i = 0; i < t->flows; i++) {
+        socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (socks[i] < 0)
+            handle_error("Generator socket creation failed");
+    }
+
+    memset(&ingress, 0, sizeof(ingress));
+    ingress.sin_family = AF_INET;
+    inet_pton(AF_INET, tunnel_target, &ingress.sin_addr);
+    ingress.sin_port = htons(bench_ingress_port);
+
+    struct packet *pkt = pbuf_packet(buf);
+    gen_pacer_init(&pacer, gen_pacing, t->pps, now_ns());
+    while (!bench_stop) {
+        gen_wait(gen_pacer_due(&pacer));
+        int size = gen_size(&gen_sizes, &rng);
+        int flow = (int)gen_pick(&rng, (uint32_t)t->flows);
+
+        packet_fill(pkt, size);
+        packet_stamp_payload(pkt, packet_now_ns());
+        int wire_len = packet_wire_len(pkt);
+        if (sendto(socks[flow], pkt, wire_len, 0, (struct sockaddr *)&ingress, sizeof(ingress)) < 0) {
+            t->failed++;
+        } else {
+            t->sent++;
+            t->bytes += wire_len;
+        }
+        gen_pacer_advance(&pacer, &rng);
+    }
+    bench_sent += t->sent;
+
+    for (int i = 0; i < t->flows; i++)
+        close(socks[i]);
+    free(socks);
+    pbuf_free(cache, buf);
+    pool_cache_flush(cache);
     return NULL;
 }
 
-// Simulated Teredo Server
-void *teredo_server(void *arg) {
+// Start threads generator threads, splitting the flows and the rate
+// between them
+static void start_generators(int threads) {
+    for (int i = 0; i < threads; i++) {
+        struct gen_thread *t = &gen_threads[i];
+
+        memset(t, 0, sizeof(*t));
+        t->id = i;
+        t->flows = gen_flows / threads + (i < gen_flows % threads);
+        t->pps = gen_rate / threads;
+        if (pthread_create(&t->thread, NULL, gen_sender, t) != 0)
+            handle_error("Failed to create generator thread");
+    }
+    gen_thread_count = threads;
+}
+
+// Wait for the generator threads and print what they sent in elapsed s
+static void stop_generators(double elapsed) {
+    long sent = 0, failed = 0;
+    unsigned long bytes = 0;
+    char rate[32];
+
+    for (int i = 0; i < gen_thread_count; i++) {
+        pthread_join(gen_threads[i].thread, NULL);
+        sent += gen_threads[i].sent;
+        failed += gen_threads[i].failed;
+        bytes += gen_threads[i].bytes;
+    }
+    if (gen_rate > 0)
+        snprintf(rate, sizeof(rate), "%.0f pps", gen_rate);
+    else
+        snprintf(rate, sizeof(rate), "full speed");
+    printf("Generator: %d flows over %d threads, sizes %s (%d-%d B, mean %.0f B), %s pacing at %s: "
+           "sent %.0f pps, %.2f Mbps, %.0f B/packet, %ld sends failed\n",
+           gen_flows, gen_thread_count, gen_sizes.name, gen_sizes.min, gen_sizes.max, gen_sizes.mean,
+           gen_pacing_name(gen_pacing), rate, sent / elapsed, bytes * 8.0 / elapsed / 1e6,
+           sent > 0 ? (double)bytes / sent : 0.0, failed);
+    gen_thread_count = 0;
+}
+
+// Mode 6: the generator on its own, against relays (mode 1) and a
+// receiver (mode 3) running elsewhere, for bench_seconds or until
+// SIGINT/SIGTERM
+static void run_generator(void) {
+    struct in_addr target;
+    struct evloop *loop = evloop_create();
+
+    if (inet_pton(AF_INET, tunnel_target, &target) != 1) {
+        fprintf(stderr, "Invalid generator target: %s\n", tunnel_target);
+        return;
+    }
+    int duration = loop != NULL ? evloop_add_timer(loop, 0, stop_loop, loop) : -1;
+    if (duration < 0)
+        handle_error("Failed to create generator timer");
+
+    printf("Generating traffic to %s:%d for %d s...\n", tunnel_target, bench_ingress_port, bench_seconds);
+    long start = now_us();
+    start_generators(relay_workers);
+    evloop_arm_timer(loop, duration, bench_seconds * 1000000L);
+    evloop_run(loop);
+    bench_stop = 1;
+    stop_generators((now_us() - start) / 1e6);
+    evloop_destroy(loop);
+}
+
+// Benchmark topology: the relays the load generator's packets cross on
+// their way to the sink
+static const char *bench_topology(void) {
+    if (bench_ingress_port == TEREDO_RELAY_PORT)
+        return "teredo";  // straight into Teredo; 6RD idles
+    if (parallel_paths)
+        return "6rd";     // 6RD forwards to the sink itself
+    return fused_hop ? "fused" : "chain";
+}
+
+// Runs both relays plus a load generator and sink in one process and
+// reports the packet rate that makes it through the topology. The run
+// ends after bench_seconds, or early on SIGINT/SIGTERM.
+void run_benchmark(void) {
+    pthread_t sender_threads[MAX_WORKERS], sink_threads[MAX_WORKERS];
+
+    if (metrics_start() < 0)
+        handle_error("Failed to start metrics writer");
+    struct evloop *loop = create_main_loop();
+    int duration = evloop_add_timer(loop, 0, stop_loop, loop);
+    if (duration < 0)
+        handle_error("Failed to create benchmark timer");
+
+    // One load generator and one sink per worker so offered load and
+    // sink capacity scale with the relays under test
+    start_relays();
+    for (int i = 0; i < relay_workers; i++) {
+        if (pthread_create(&sink_threads[i], NULL, bench_sink, &bench_sinks[i]) != 0)
+            handle_error("Failed to create sink thread");
+    }
+
+    usleep(200000);  // let every socket bind before traffic starts
+
+    long start = now_us();
+    if (gen_enabled) {
+        start_generators(relay_workers);
+    } else {
+        for (int i = 0; i < relay_workers; i++) {
+            if (pthread_create(&sender_threads[i], NULL, bench_sender, NULL) != 0)
+                handle_error("Failed to create sender thread");
+        }
+    }
+
+    evloop_arm_timer(loop, duration, bench_seconds * 1000000L);
+    evloop_run(loop);
+    bench_stop = 1;
+    if (gen_enabled)
+        stop_generators((now_us() - start) / 1e6);
+    for (int i = 0; i < relay_workers; i++) {
+        if (!gen_enabled)
+            pthread_join(sender_threads[i], NULL);
+        pthread_join(sink_threads[i], NULL);
+    }
+    double elapsed = (now_us() - start) / 1e6;
+    stop_relays();
+    evloop_destroy(loop);
+    metrics_stop();
+    print_flow_stats();
+    print_ring_stats();
+    print_frag_stats();
+    pool_print_stats(pkt_pool, stderr);
+
+    double sent_pps = bench_sent / elapsed;
+    double received_pps = bench_received / elapsed;
+    double throughput = (bench_received_bytes * 8.0) / elapsed / 1e6;  // wire Mbps at the sink
+    double wire_bytes = bench_received > 0 ? (double)bench_received_bytes / bench_received : 0.0;
+
+    // Sender-to-sink one-way latency over every sink
+    static struct hist oneway;
+    hist_reset(&oneway);
+    struct frag_stats reassembly = { 0 };
+    long invalid = 0;
+    for (int i = 0; i < relay_workers; i++) {
+        struct frag_stats *s = &bench_sinks[i].reassembly;
+        hist_merge(&oneway, &bench_sinks[i].oneway);
+        invalid += bench_sinks[i].invalid;
+        reassembly.fragments += s->fragments;
+        reassembly.reassembled += s->reassembled;
+        reassembly.timed_out += s->timed_out;
+        reassembly.evicted += s->evicted;
+        reassembly.invalid += s->invalid;
+    }
+    double p50_us = hist_percentile(&oneway, 50) / 1e3;
+    double p99_us = hist_percentile(&oneway, 99) / 1e3;
+    double max_us = oneway.max / 1e3;
+    if (reassembly.fragments > 0)
+        print_reassembly_stats("Sink", &reassembly);
+    if (invalid > 0)
+        printf("Sink: %ld invalid packets, not counted as received\n", invalid);
+
+    // What the load generator offered: the fixed-size sender's flows, or
+    // the generator's mix
+    char size_name[sizeof(gen_sizes.name)];
+    int flows = gen_enabled ? gen_flows : relay_workers * BENCH_FLOWS_PER_SENDER;
+    int packet_size = gen_enabled ? (int)(gen_sizes.mean + 0.5) : bench_size;
+    if (gen_enabled)
+        snprintf(size_name, sizeof(size_name), "%s", gen_sizes.name);
+    else
+        snprintf(size_name, sizeof(size_name), "fixed:%d", bench_size);
+
+    printf("topology=%s hop=%s engine=%s offload=%s mtu=%d/%d workers=%d batch=%d flush=%ldus size=%s flows=%d: sent %.0f pps, received %.0f pps (%.1f%% delivered), "
+           "%.0f B/packet on the wire, %.2f Mbps, one-way p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           bench_topology(), fused_hop ? "fused" : parallel_paths ? "parallel" : "udp",
+           io_engine == ENGINE_URING ? "uring" : "epoll", udp_offload ? "on" : "off", sixrd_mtu.link_mtu,
+           teredo_mtu.link_mtu, relay_workers, batch_size, flush_timeout_us, size_name, flows, sent_pps, received_pps,
+           bench_sent > 0 ? 100.0 * bench_received / bench_sent : 0.0, wire_bytes, throughput,
+           p50_us, p99_us, max_us);
+
+    if (bench_csv != NULL) {
+        FILE *file = fopen(bench_csv, "a");
+        if (file == NULL) {
+            perror("Failed to open benchmark CSV");
+            return;
+        }
+        if (ftell(file) == 0)
+            fprintf(file, "Workers,Batch,FlushUs,PacketSize,SentPps,ReceivedPps,WireBytesPerPacket,Throughput(Mbps),"
+                          "OneWayP50Us,OneWayP99Us,OneWayMaxUs,Hop,Engine,Offload,Mtu6rd,MtuTeredo,"
+                          "ReassemblyHitPct,ReassemblyEvictPct,Topology,Flows,SizeMix,RatePps,Pacing\n");
+        fprintf(file, "%d,%d,%ld,%d,%.0f,%.0f,%.0f,%.2f,%.3f,%.3f,%.3f,%s,%s,%s,%d,%d,%.1f,%.1f,%s,%d,%s,%.0f,%s\n",
+                relay_workers, batch_size, flush_timeout_us, packet_size, sent_pps, received_pps, wire_bytes, throughput, p50_us,
+                p99_us, max_us, fused_hop ? "fused" : parallel_paths ? "parallel" : "udp", io_engine == ENGINE_URING ? "uring" : "epoll",
+                udp_offload ? "on" : "off", sixrd_mtu.link_mtu, teredo_mtu.link_mtu, frag_hit_pct(&reassembly),
+                frag_evict_pct(&reassembly), bench_topology(), flows, size_name, gen_enabled ? gen_rate : 0.0,
+                gen_enabled ? gen_pacing_name(gen_pacing) : "none");
+        fclose(file);
+    }
+}
+
+// Deliveries of one flow at the receiver, keyed by IPv6 destination. With
+// a steady sender the longest gap between two packets is the flow's
+// longest outage, such as the time a path failover took.
+struct receiver_flow {
+    struct in6_addr dst;
+    uint64_t last_ns;       // last delivery, 0 = slot free
+    uint64_t max_gap_ns;
+    unsigned long packets;
+};
+
+// Receiver state for its event loop handler
+struct receiver {
     int sockfd;
-    struct sockaddr_in server_addr;
-    int packet_count = 0;
+    int packet_count;
+    struct metrics_stream *metrics;
+    struct log_stats *stats;
+    struct frag_cache *reassembly;  // fragments from a relay's tunnel MTU
+    int expire_budget;
+    struct packet *pkts[RECEIVER_BATCH];
+    union rx_control controls[RECEIVER_BATCH];
+    struct mmsghdr msgs[RECEIVER_BATCH];
+    struct iovec iovs[RECEIVER_BATCH];
+    struct receiver_flow flows[RECEIVER_FLOWS];
+    unsigned long long_gaps;      // gaps of RECEIVER_GAP_REPORT_MS or more
+    unsigned long probes_echoed;
+};
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) 
-        handle_error("Teredo Socket creation failed");
+// Send a path probe back to the sender it names, straight rather than
+// through the relays, so its round trip times the forward path
+static void receiver_echo(struct receiver *r, const struct packet *pkt, int length) {
+    struct path_probe probe;
+    struct sockaddr_in to;
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(TEREDO_PORT);
+    if (length < (int)sizeof(probe))
+        return;
+    memcpy(&probe, pkt->data, sizeof(probe));
+    if (ntohl(probe.magic) != PATH_PROBE_MAGIC)
+        return;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = probe.reply_ipv4;
+    to.sin_port = probe.reply_port;
+    if (sendto(r->sockfd, pkt, packet_wire_len(pkt), 0, (struct sockaddr *)&to, sizeof(to)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("probe echo failed");
+        return;
+    }
+    r->probes_echoed++;
+}
 
-    int opt = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) 
-        handle_error("Teredo setsockopt failed");
+// Note a delivery of an IPv6 packet at rx_ns to its flow's gap record.
+// A flow silent for longer than the flow idle timeout (-T) starts over
+// rather than counting an outage.
+static void receiver_track(struct receiver *r, const unsigned char *payload, long len, uint64_t rx_ns) {
+    struct in6_addr dst;
+    uint32_t words[4];
 
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-        handle_error("Teredo Bind failed");
+    if (ipv6_parse_header(payload, (size_t)len) < 0)
+        return;
+    memcpy(&dst, payload + 24, sizeof(dst));
+    memcpy(words, &dst, sizeof(words));
+    uint32_t h = 0;
+    for (int i = 0; i < 4; i++)
+        h = (h ^ words[i]) * 0x9e3779b1u;
+    h ^= h >> 16;  // the low bits of a product see only the low bits of its inputs
+
+    for (int i = 0; i < RECEIVER_FLOW_PROBE; i++) {
+        struct receiver_flow *f = &r->flows[(h + i) % RECEIVER_FLOWS];
+        if (f->last_ns == 0) {
+            f->dst = dst;
+            f->last_ns = rx_ns;
+            f->packets = 1;
+            return;
+        }
+        if (memcmp(&f->dst, &dst, sizeof(dst)) != 0)
+            continue;
+
+        uint64_t gap = rx_ns > f->last_ns ? rx_ns - f->last_ns : 0;
+        if (gap < flow_idle_timeout * 1000000000ULL) {
+            if (gap > f->max_gap_ns)
+                f->max_gap_ns = gap;
+            if (gap >= RECEIVER_GAP_REPORT_MS * 1000000ULL) {
+                char name[INET6_ADDRSTRLEN];
+                inet_ntop(AF_INET6, &dst, name, sizeof(name));
+                r->long_gaps++;
+                log_msg(LOG_SUMMARY, "Receiver: no packets to %s for %.1f ms\n", name, gap / 1e6);
+            }
+        }
+        if (rx_ns > f->last_ns)
+            f->last_ns = rx_ns;
+        f->packets++;
+        return;
+    }
+}
+
+// Longest delivery gap of any flow, for the receiver's closing lines
+static void print_delivery_gaps(const struct receiver *r) {
+    const struct receiver_flow *worst = NULL;
+    int flows = 0;
+
+    for (int i = 0; i < RECEIVER_FLOWS; i++) {
+        const struct receiver_flow *f = &r->flows[i];
+        if (f->last_ns == 0)
+            continue;
+        flows++;
+        if (worst == NULL || f->max_gap_ns > worst->max_gap_ns)
+            worst = f;
+    }
+    if (worst != NULL) {
+        char name[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &worst->dst, name, sizeof(name));
+        printf("Receiver delivery gaps over %d flows: longest %.1f ms (to %s), %lu of %d ms or more\n", flows,
+               worst->max_gap_ns / 1e6, name, r->long_gaps, RECEIVER_GAP_REPORT_MS);
+    }
+    if (r->probes_echoed > 0)
+        printf("Receiver echoed %lu path probes\n", r->probes_echoed);
+}
 
-    printf("Teredo Server is running on port %d...\n", TEREDO_PORT);
+// Receiver socket readable: drain it RECEIVER_BATCH datagrams at a time.
+// ForwardUs in the receiver's metrics is the time a datagram sat in the
+// socket before we read it; OneWayUs is end to end from the sender.
+// Fragments are recorded once, as the packet they reassemble to.
+static void receiver_readable(void *arg) {
+    struct receiver *r = arg;
 
     while (1) {
-        struct packet pkt;
-        struct sockaddr_in client_addr;
-        socklen_t len = sizeof(client_addr);
-        struct timeval start, end;
+        for (int i = 0; i < RECEIVER_BATCH; i++)
+            r->msgs[i].msg_hdr.msg_controllen = sizeof(union rx_control);
+
+        int n = recvmmsg(r->sockfd, r->msgs, RECEIVER_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("recvmmsg failed");
+            return;
+        }
+
+        uint64_t now_ns = packet_now_ns();
+        for (int i = 0; i < n; i++) {
+            struct packet *pkt = r->pkts[i];
+            int length = packet_validate(pkt, r->msgs[i].msg_len);
+            if (length < 0)
+                continue;
+            if (pkt->hdr.flags & PKT_FLAG_PROBE) {
+                receiver_echo(r, pkt, length);
+                continue;
+            }
+
+            uint64_t rx_ns = rx_timestamp(&r->msgs[i].msg_hdr);
+            const unsigned char *payload;
+            uint64_t sent;
+            long whole = packet_reassemble(r->reassembly, pkt, length, rx_ns, &payload, &sent);
+            if (whole <= 0)
+                continue;
+            long queued_ns = elapsed_ns(rx_ns, now_ns);
+            long oneway = sent != 0 ? elapsed_ns(sent, rx_ns) : -1;
+
+            receiver_track(r, payload, whole, rx_ns);
+            r->packet_count++;
+            metrics_record(r->metrics, r->packet_count, (int)whole, queued_ns, oneway);
+            log_packet(r->stats, (int)whole, oneway >= 0 ? oneway / 1000 : 0);
+            if (LOG_ENABLED(LOG_PACKET) && log_ratelimit(r->stats)) {
+                log_msg(LOG_PACKET, "Received %ld bytes (One-way: %.1f us)\n", whole, oneway / 1e3);
+                if (LOG_ENABLED(LOG_DEBUG))
+                    log_hexdump(payload, (int)whole);
+            }
+        }
+    }
+}
+
+// Reassembly expiry timer of the receiver
+static void receiver_expire(void *arg) {
+    struct receiver *r = arg;
+
+    frag_expire(r->reassembly, packet_now_ns() / 1000000, r->expire_budget);
+}
+
+// Mode 3: count and time what arrives at the receiver port until
+// SIGINT/SIGTERM
+static void run_receiver(void) {
+    static struct receiver r;
+    struct sockaddr_in receiver_addr;
+    struct pbuf *bufs[RECEIVER_BATCH];
+    struct pool_cache *cache = pool_cache_create(pkt_pool, "Receiver");
+
+    r.sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (r.sockfd < 0)
+        handle_error("Receiver socket creation failed");
+
+    memset(&receiver_addr, 0, sizeof(receiver_addr));
+    receiver_addr.sin_family = AF_INET;
+    receiver_addr.sin_addr.s_addr = INADDR_ANY;
+    receiver_addr.sin_port = htons(RECEIVER_PORT);
+
+    int opt = 1;
+    if (setsockopt(r.sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+        handle_error("Receiver setsockopt failed");
+
+    if (bind(r.sockfd, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) < 0)
+        handle_error("Receiver Bind failed");
+
+    enable_rx_timestamps(r.sockfd);
+    r.reassembly = frag_cache_create(FRAG_DEFAULT_PACKETS, BUFFER_SIZE, FRAG_DEFAULT_TIMEOUT_MS);
+    if (r.reassembly == NULL)
+        handle_error("Receiver reassembly cache allocation failed");
+    r.expire_budget = frag_expire_budget(r.reassembly, FLOW_EXPIRE_MS);
+
+    for (int i = 0; i < RECEIVER_BATCH; i++) {
+        bufs[i] = alloc_rx_buffer(cache);
+        r.pkts[i] = pbuf_packet(bufs[i]);
+        r.iovs[i].iov_base = r.pkts[i];
+        r.iovs[i].iov_len = sizeof(struct packet);
+        r.msgs[i].msg_hdr.msg_iov = &r.iovs[i];
+        r.msgs[i].msg_hdr.msg_iovlen = 1;
+        r.msgs[i].msg_hdr.msg_control = &r.controls[i];
+    }
+
+    printf("Receiver is waiting for packets on port %d...\n", RECEIVER_PORT);
+
+    if (metrics_start() < 0)
+        handle_error("Failed to start metrics writer");
+    r.metrics = metrics_open("metrics_receiver.csv");
+    r.stats = log_register("Receiver");
+
+    struct evloop *loop = create_main_loop();
+    if (evloop_add_fd(loop, r.sockfd, receiver_readable, &r) < 0)
+        handle_error("Receiver event registration failed");
+    if (evloop_add_timer(loop, FLOW_EXPIRE_MS * 1000L, receiver_expire, &r) < 0)
+        handle_error("Receiver expiry timer failed");
+    evloop_run(loop);
+
+    evloop_destroy(loop);
+    close(r.sockfd);
+    metrics_stop();
+    for (int i = 0; i < RECEIVER_BATCH; i++)
+        pbuf_free(cache, bufs[i]);
+    pool_cache_flush(cache);
+    printf("Receiver stopped after %d packets\n", r.packet_count);
+    print_delivery_gaps(&r);
+
+    struct frag_stats reassembly;
+    frag_cache_stats(r.reassembly, &reassembly);
+    if (reassembly.fragments > 0)
+        print_reassembly_stats("Receiver", &reassembly);
+    frag_cache_destroy(r.reassembly);
+}
+
+// Mode 5: tunnelled traffic for the capture front-end (-C). Sends
+// bench_size-byte IPv6 packets to tunnel_target for bench_seconds,
+// alternating batches of 6RD (protocol 41, between the 6RD prefixes our
+// IPv4 address and the target's delegate) and Teredo (UDP to port 3544,
+// the inner source our Teredo address). We are the 6RD CE: every packet
+// is encapsulated in place, its IPv4 header pushed into the pool buffer's
+// headroom, and goes out as is on a raw socket, which needs CAP_NET_RAW.
+static void run_tunnel_sender(void) {
+    struct sockaddr_in target, local;
+    socklen_t local_len = sizeof(local);
+    struct in6_addr src, dst;
+    int src_len;
+    static unsigned char teredo_pkt[BUFFER_SIZE];
+    int size = bench_size < IPV6_HEADER_LEN ? IPV6_HEADER_LEN : bench_size;
+    struct pool_cache *cache = pool_cache_create(pkt_pool, "Tunnel");
+    struct pbuf *bufs[BENCH_TX_BATCH];
+    struct iovec iovs[2][BENCH_TX_BATCH];
+    struct mmsghdr msgs[2][BENCH_TX_BATCH];
+    long sent[2] = { 0, 0 };
+
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_port = htons(TEREDO_PORT);
+    if (inet_pton(AF_INET, tunnel_target, &target.sin_addr) != 1) {
+        fprintf(stderr, "Invalid tunnel target: %s\n", tunnel_target);
+        return;
+    }
+
+    // Connecting the Teredo socket picks our source address and port. It is
+    // disconnected again, or ICMP errors from the target would fail sends.
+    struct sockaddr unspec = { .sa_family = AF_UNSPEC };
+    int socks[2];
+    socks[1] = socket(AF_INET, SOCK_DGRAM, 0);
+    if (socks[1] < 0 || connect(socks[1], (struct sockaddr *)&target, sizeof(target)) < 0 ||
+        getsockname(socks[1], (struct sockaddr *)&local, &local_len) < 0 ||
+        connect(socks[1], &unspec, sizeof(unspec)) < 0)
+        handle_error("Teredo socket setup failed");
+    // IPPROTO_RAW sends our own IPv4 header (IP_HDRINCL)
+    socks[0] = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+    if (socks[0] < 0)
+        handle_error("6RD raw socket creation failed");
+
+    // Both ends inside the 6RD domain, so that encapsulation picks the
+    // target as the outer destination and our address as the source
+    struct sixrd_config ce = sixrd_domain;
+    ce.ce_ipv4 = local.sin_addr.s_addr;
+    sixrd_delegated_prefix(&ce, local.sin_addr.s_addr, &src, &src_len);
+    src.s6_addr[15] = 1;
+    sixrd_delegated_prefix(&ce, target.sin_addr.s_addr, &dst, &src_len);
+    dst.s6_addr[15] = 1;
+    for (int i = 0; i < BENCH_TX_BATCH; i++) {
+        bufs[i] = cache != NULL ? pbuf_alloc(cache, (uint32_t)size) : NULL;
+        if (bufs[i] == NULL)
+            fatal_error("Tunnel sender buffer allocation failed");
+        ipv6_build_header(bufs[i]->data, &src, &dst, IPV6_NEXT_NONE, (uint16_t)(size - IPV6_HEADER_LEN), 64);
+        memset(bufs[i]->data + IPV6_HEADER_LEN, 'A', size - IPV6_HEADER_LEN);
+        bufs[i]->len = (uint32_t)size;
+    }
+
+    inet_pton(AF_INET6, "2001:db8::1", &dst);
+    struct teredo_addr mapped = { target.sin_addr.s_addr, 0, local.sin_port, local.sin_addr.s_addr };
+    teredo_addr_encode(&mapped, &src);
+    ipv6_build_header(teredo_pkt, &src, &dst, IPV6_NEXT_NONE, (uint16_t)(size - IPV6_HEADER_LEN), 64);
+    memset(teredo_pkt + IPV6_HEADER_LEN, 'A', size - IPV6_HEADER_LEN);
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int k = 0; k < 2; k++) {
+        for (int i = 0; i < BENCH_TX_BATCH; i++) {
+            iovs[k][i].iov_base = teredo_pkt;
+            iovs[k][i].iov_len = (size_t)size;
+            msgs[k][i].msg_hdr.msg_iov = &iovs[k][i];
+            msgs[k][i].msg_hdr.msg_iovlen = 1;
+            msgs[k][i].msg_hdr.msg_name = &target;
+            msgs[k][i].msg_hdr.msg_namelen = sizeof(target);
+        }
+    }
+
+    printf("Sending %d-byte IPv6 packets over 6RD and Teredo to %s for %d s...\n", size, tunnel_target,
+           bench_seconds);
+    long start = now_us();
+    long end = start + bench_seconds * 1000000L;
+    while (!evloop_shutting_down() && now_us() < end) {
+        for (int i = 0; i < BENCH_TX_BATCH; i++) {
+            unsigned char *ipv6 = bufs[i]->data;
+            pbuf_push(bufs[i], IPV4_HEADER_LEN);
+            iovs[0][i].iov_base = bufs[i]->data;
+            iovs[0][i].iov_len = (size_t)sixrd_encap(&ce, ipv6, (size_t)size);
+        }
+        for (int k = 0; k < 2; k++) {
+            int n = sendmmsg(socks[k], msgs[k], BENCH_TX_BATCH, 0);
+            if (n > 0)
+                sent[k] += n;
+        }
+        for (int i = 0; i < BENCH_TX_BATCH; i++)
+            pbuf_pull(bufs[i], IPV4_HEADER_LEN);
+    }
+    double elapsed = (now_us() - start) / 1e6;
+    printf("Sent %ld 6RD and %ld Teredo packets in %.1f s (%.0f pps)\n", sent[0], sent[1], elapsed,
+           (sent[0] + sent[1]) / elapsed);
+
+    for (int i = 0; i < BENCH_TX_BATCH; i++)
+        pbuf_free(cache, bufs[i]);
+    close(socks[0]);
+    close(socks[1]);
+}
+
+// Send a probe for path down it, asking the receiver to echo it to local
+static void path_send_probe(int sockfd, struct path_selector *sel, int path, const struct sockaddr_in *relay,
+                            const struct sockaddr_in *local, uint64_t now) {
+    static struct packet pkt;
+    struct path_probe probe;
+
+    memset(&probe, 0, sizeof(probe));
+    probe.magic = htonl(PATH_PROBE_MAGIC);
+    probe.path = (uint8_t)path;
+    probe.reply_port = local->sin_port;
+    probe.reply_ipv4 = local->sin_addr.s_addr;
+    probe.seq = htonl(path_probe_sent(sel, path, now));
+    memcpy(pkt.data, &probe, sizeof(probe));
+    packet_set_header(&pkt, sizeof(probe), PKT_TYPE_IPV6);
+    pkt.hdr.flags = PKT_FLAG_PROBE;
+    if (sendto(sockfd, &pkt, packet_wire_len(&pkt), 0, (const struct sockaddr *)relay, sizeof(*relay)) < 0 &&
+        errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("probe send failed");
+}
+
+// Take every probe echo waiting on sockfd
+static void path_read_echoes(int sockfd, struct path_selector *sel) {
+    static struct packet pkt;
+    struct path_probe probe;
+    long n;
+
+    while ((n = recv(sockfd, &pkt, sizeof(pkt), MSG_DONTWAIT)) > 0) {
+        int length = packet_validate(&pkt, n);
+        if (length < (int)sizeof(probe) || !(pkt.hdr.flags & PKT_FLAG_PROBE))
+            continue;
+        memcpy(&probe, pkt.data, sizeof(probe));
+        if (ntohl(probe.magic) == PATH_PROBE_MAGIC)
+            path_probe_answered(sel, probe.path, ntohl(probe.seq), (uint64_t)now_us());
+    }
+}
+
+// Print the verdict changes path_update() just made and where they left
+// the flows. A path that failed on lost probes also says how long after
+// the first of them that was noticed: the failover latency, give or take
+// a probe interval.
+static void path_report(struct path_selector *sel, struct path_flow *flows, int *usable, long start) {
+    int on[PATH_COUNT] = { 0 };
+
+    for (int i = 0; i < PATH_SENDER_FLOWS; i++)
+        on[path_select(sel, &flows[i])]++;
+    for (int p = 0; p < PATH_COUNT; p++) {
+        const struct path_state *ps = &sel->paths[p];
+        double at = ((long)ps->changed_us - start) / 1e6;
+        if (ps->usable == usable[p])
+            continue;
+        usable[p] = ps->usable;
+        if (ps->usable) {
+            printf("[%7.3f s] %s path usable again: srtt %.2f ms, loss %.0f%%\n", at, path_name(p),
+                   ps->srtt_us / 1e3, ps->loss * 100);
+            continue;
+        }
+        printf("[%7.3f s] %s path failed (%s): srtt %.2f ms, loss %.0f%%", at, path_name(p),
+               !ps->up ? "probes lost" : ps->degraded ? "loss" : "RTT", ps->srtt_us / 1e3, ps->loss * 100);
+        if (ps->lost_run > 0)
+            printf(", detected %.1f ms after its first lost probe", (ps->changed_us - ps->first_lost_us) / 1e3);
+        printf("\n");
+    }
+    printf("            flows: %d on 6RD, %d on Teredo\n", on[PATH_6RD], on[PATH_TEREDO]);
+}
+
+// Mode 2 with -P: PATH_SENDER_FLOWS flows of bench_size-byte IPv6 packets
+// for bench_seconds, one packet per flow every PATH_SEND_INTERVAL_US. Each
+// flow goes to the 6RD or the Teredo relay at tunnel_target as the path
+// selector decides, so this wants -H parallel, where both relays lead to
+// the receiver. Probes go down both paths every PATH_PROBE_INTERVAL_US and
+// come back from the receiver; each verdict change is printed as it
+// happens. An outage injected into a relay (-X) shows the failover: here
+// as the detection time, at the receiver as the flows' delivery gaps.
+static void run_path_sender(void) {
+    static struct packet pkts[PATH_SENDER_FLOWS];
+    struct path_flow flows[PATH_SENDER_FLOWS];
+    struct sockaddr_in relays[PATH_COUNT], local;
+    socklen_t local_len = sizeof(local);
+    struct path_selector sel;
+    int usable[PATH_COUNT];
+    unsigned long sent[PATH_COUNT] = { 0 }, failed = 0;
+    int size = bench_size < IPV6_HEADER_LEN + PKT_TIMESTAMP_LEN ? IPV6_HEADER_LEN + PKT_TIMESTAMP_LEN : bench_size;
+    static const char *policies[] = { "hybrid", "6rd", "teredo" };
 
-        // Receive data
-        gettimeofday(&start, NULL);
-        int n = recvfrom(sockfd, &pkt, sizeof(pkt), 0, (struct sockaddr *)&client_addr, &len);
-        gettimeofday(&end, NULL);
+    for (int p = 0; p < PATH_COUNT; p++) {
+        memset(&relays[p], 0, sizeof(relays[p]));
+        relays[p].sin_family = AF_INET;
+        if (inet_pton(AF_INET, tunnel_target, &relays[p].sin_addr) != 1) {
+            fprintf(stderr, "Invalid relay address: %s\n", tunnel_target);
+            return;
+        }
+    }
+    relays[PATH_6RD].sin_port = htons(SIXRD_PORT);
+    relays[PATH_TEREDO].sin_port = htons(TEREDO_RELAY_PORT);
 
-        if (n < 0) continue;
+    // The receiver echoes probes to our port, at the address a connected
+    // socket would send from. Disconnecting would give up an ephemeral
+    // port, so that is taken from a second socket bound to its own port.
+    struct sockaddr_in bound = { .sin_family = AF_INET };
+    socklen_t bound_len = sizeof(bound);
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int routed = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0 || routed < 0 || bind(sockfd, (struct sockaddr *)&bound, sizeof(bound)) < 0 ||
+        getsockname(sockfd, (struct sockaddr *)&bound, &bound_len) < 0 ||
+        connect(routed, (struct sockaddr *)&relays[PATH_6RD], sizeof(relays[PATH_6RD])) < 0 ||
+        getsockname(routed, (struct sockaddr *)&local, &local_len) < 0)
+        handle_error("Sender socket setup failed");
+    close(routed);
+    local.sin_port = bound.sin_port;
+
+    // Teredo peers behind 203.0.113.0/24 first, then native destinations
+    for (int i = 0; i < PATH_SENDER_FLOWS; i++) {
+        struct in6_addr dst;
+        if (i < PATH_SENDER_TEREDO_FLOWS) {
+            struct teredo_addr peer = { inet_addr(SIXRD_DOMAIN_BR), 0, htons((uint16_t)(40000 + i)),
+                                        htonl(0xcb007100u + (uint32_t)i + 1) };
+            teredo_addr_encode(&peer, &dst);
+        } else {
+            inet_pton(AF_INET6, "2001:db8:1::2", &dst);
+            dst.s6_addr[5] = (uint8_t)i;
+        }
+        packet_fill(&pkts[i], size);
+        memcpy(pkts[i].data + 24, &dst, sizeof(dst));
+        path_flow_init(&flows[i], &dst);
+    }
 
-        // Calculate latency
-        long latency = calculate_latency(start, end);
+    path_selector_init(&sel, path_policy);
+    for (int p = 0; p < PATH_COUNT; p++)
+        usable[p] = sel.paths[p].usable;
+    printf("Sending %d flows (%d to Teredo peers) of %d-byte packets, one per flow every %d us, for %d s "
+           "(%s path selection)...\n", PATH_SENDER_FLOWS, PATH_SENDER_TEREDO_FLOWS, size, PATH_SEND_INTERVAL_US,
+           bench_seconds, policies[path_policy]);
 
-        // Calculate throughput in KBps
-        double throughput = (pkt.length / (latency / 1e6)) / 1024.0;  // in KBps
+    long start = now_us();
+    long end = start + bench_seconds * 1000000L;
+    long next_send = start, next_probe = start;
+    for (long now = start; !evloop_shutting_down() && now < end; now = now_us()) {
+        if (now >= next_probe) {
+            for (int p = 0; p < PATH_COUNT; p++)
+                path_send_probe(sockfd, &sel, p, &relays[p], &local, (uint64_t)now);
+            next_probe += PATH_PROBE_INTERVAL_US;
+        }
+        if (now >= next_send) {
+            uint64_t stamp = packet_now_ns();
+            for (int i = 0; i < PATH_SENDER_FLOWS; i++) {
+                int p = path_select(&sel, &flows[i]);
+                packet_stamp_payload(&pkts[i], stamp);
+                if (sendto(sockfd, &pkts[i], packet_wire_len(&pkts[i]), 0, (struct sockaddr *)&relays[p],
+                           sizeof(relays[p])) < 0)
+                    failed++;
+                else
+                    sent[p]++;
+            }
+            // Ticks missed while descheduled are skipped, not sent in a burst
+            while (next_send <= now)
+                next_send += PATH_SEND_INTERVAL_US;
+        }
 
-        packet_count++;
-        printf("Teredo Server received and forwarding: %s (Latency: %ld us, Throughput: %.2f KBps)\n", 
-               pkt.data, latency, throughput);
-        log_metrics("metrics.txt", packet_count, latency, throughput);
+        path_read_echoes(sockfd, &sel);
+        if (path_update(&sel, (uint64_t)now_us()) > 0)
+            path_report(&sel, flows, usable, start);
 
-        // Forward to receiver
-        struct sockaddr_in receiver_addr;
-        memset(&receiver_addr, 0, sizeof(receiver_addr));
-        receiver_addr.sin_family = AF_INET;
-        receiver_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-        receiver_addr.sin_port = htons(RECEIVER_PORT);
+        // Sleep until the next tick or an echo
+        long wait = (next_send < next_probe ? next_send : next_probe) - now_us();
+        struct timespec timeout = { 0, wait > 0 ? wait * 1000 : 0 };
+        struct pollfd pfd = { sockfd, POLLIN, 0 };
+        ppoll(&pfd, 1, &timeout, NULL);
+    }
 
-        sendto(sockfd, &pkt, sizeof(pkt), 0, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr));
+    double elapsed = (now_us() - start) / 1e6;
+    printf("Sent %lu packets over 6RD and %lu over Teredo in %.1f s (%lu failed)\n", sent[PATH_6RD],
+           sent[PATH_TEREDO], elapsed, failed);
+    for (int p = 0; p < PATH_COUNT; p++) {
+        const struct path_state *ps = &sel.paths[p];
+        printf("%s probes: %lu sent, %lu answered, %lu lost, %lu late; srtt %.3f ms, rttvar %.3f ms, "
+               "loss %.0f%%\n", path_name(p), ps->probes_sent, ps->probes_answered, ps->probes_lost, ps->late,
+               ps->srtt_us / 1e3, ps->rttvar_us / 1e3, ps->loss * 100);
     }
+    printf("Path verdict changes: %lu, flows moved: %lu\n", sel.changes, sel.switches);
     close(sockfd);
-    return NULL;
+}
+
+// Size the packet pool for this run: every thread (relay workers, benchmark
+// senders and sinks, the receiver) may hold its receive buffers plus up to
+// three cache batches of each class. In fused mode each ring may also hold
+// FUSED_RING_SIZE packets of any class; with io_uring every stage hands
+// URING_BUFFERS receive buffers to the kernel.
+static void create_pool(void) {
+    uint32_t threads = 3 * relay_workers + 1;
+    uint32_t spare = threads * 3 * POOL_CACHE_BATCH;
+    uint32_t rx_buffers = batch_size > BENCH_TX_BATCH ? batch_size : BENCH_TX_BATCH;
+    uint32_t queued = fused_hop ? relay_workers * FUSED_RING_SIZE : 0;
+    uint32_t uring = io_engine == ENGINE_URING ? 2 * relay_workers * URING_BUFFERS : 0;
+    uint32_t counts[POOL_CLASSES] = { spare + 1024 + queued, spare + 256 + queued,
+                                      threads * rx_buffers + spare + queued + uring };
+
+    pkt_pool = pool_create(counts);
+    if (pkt_pool == NULL)
+        handle_error("Failed to create packet pool");
+}
+
+// Point each stage's default route at the next stage on loopback
+static void init_routes(void) {
+    struct sockaddr_in hop;
+
+    memset(&hop, 0, sizeof(hop));
+    hop.sin_family = AF_INET;
+    hop.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    hop.sin_port = htons(TEREDO_RELAY_PORT);
+    route_init(&sixrd_routes, &hop);
+    hop.sin_port = htons(RECEIVER_PORT);
+    route_init(&teredo_routes, &hop);
+}
+
+// Parse "-M <6rd|teredo>:<link mtu>". The tunnel must still carry the
+// IPv6 minimum MTU after its own headers.
+static int parse_mtu(const char *arg) {
+    struct tunnel_mtu *t;
+    char *end;
+
+    if (strncmp(arg, "6rd:", 4) == 0) {
+        t = &sixrd_mtu;
+        arg += 4;
+    } else if (strncmp(arg, "teredo:", 7) == 0) {
+        t = &teredo_mtu;
+        arg += 7;
+    } else {
+        return -1;
+    }
+    long mtu = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || mtu - t->overhead < IPV6_MIN_MTU || mtu > 65535)
+        return -1;
+    t->link_mtu = (int)mtu;
+    return 0;
+}
+
+// Parse "-R <6rd|teredo>:<prefix>/<len>=<ip>:<port>"
+static int parse_route(const char *arg) {
+    if (strncmp(arg, "6rd:", 4) == 0)
+        return route_add(&sixrd_routes, arg + 4);
+    if (strncmp(arg, "teredo:", 7) == 0)
+        return route_add(&teredo_routes, arg + 7);
+    return -1;
+}
+
+// Parse "-X <6rd|teredo>:<after s>:<for s>"
+static int parse_outage(const char *arg) {
+    struct stage_outage *o;
+    char *end;
+
+    if (strncmp(arg, "6rd:", 4) == 0) {
+        o = &sixrd_outage;
+        arg += 4;
+    } else if (strncmp(arg, "teredo:", 7) == 0) {
+        o = &teredo_outage;
+        arg += 7;
+    } else {
+        return -1;
+    }
+    double after = strtod(arg, &end);
+    if (end == arg || *end != ':' || after < 0)
+        return -1;
+    arg = end + 1;
+    double length = strtod(arg, &end);
+    if (end == arg || *end != '\0' || length <= 0)
+        return -1;
+    o->after_us = (long)(after * 1e6);
+    o->for_us = (long)(length * 1e6);
+    return 0;
+}
+
+void usage(const char *prog) {
+    printf("Usage: %s [options] <mode>\n", prog);
+    printf("Modes:\n");
+    printf("1 - Run servers\n");
+    printf("2 - Run sender (with -P: flows over 6RD and Teredo for -d seconds, see -H parallel)\n");
+    printf("3 - Run receiver\n");
+    printf("4 - Run benchmark (servers, load generator and sink in one process)\n");
+    printf("5 - Run tunnel sender (6RD and Teredo encapsulated packets of -s bytes for -d\n"
+           "    seconds to -A, for a relay capturing with -C)\n");
+    printf("6 - Run traffic generator (-n flows from -w threads to the -I stage at -A for -d\n"
+           "    seconds, sizes from -z, paced by -r and -p)\n");
+    printf("Options:\n");
+    printf("-b <n>   relay batch size for recvmmsg/sendmmsg, 1-%d (default 1 = forward each datagram)\n", MAX_BATCH);
+    printf("-w <n>   SO_REUSEPORT workers per relay stage, 1-%d (default 1)\n", MAX_WORKERS);
+    printf("-f <us>  flush timeout for a partial batch (default %d us)\n", DEFAULT_FLUSH_US);
+    printf("-d <s>   benchmark duration in seconds (default 5)\n");
+    printf("-s <n>   benchmark payload size in bytes (default 64)\n");
+    printf("-o <csv> append benchmark results to a CSV file\n");
+    printf("-v <n>   verbosity: 0 off, 1 summary (default), 2 per packet, 3 per packet + hexdump\n");
+    printf("-i <s>   seconds between summary lines (default 1)\n");
+    printf("-R <r>   add a route, <6rd|teredo>:<prefix>/<len>=<ip>:<port>, matched on the\n"
+           "         flow's source IPv4 (defaults: 6rd -> 127.0.0.1:%d, teredo -> 127.0.0.1:%d)\n",
+           TEREDO_RELAY_PORT, RECEIVER_PORT);
+    printf("-F <n>   max flows per worker flow table (default %d)\n", FLOW_DEFAULT_MAX);
+    printf("-T <s>   flow idle timeout (default %d s)\n", FLOW_DEFAULT_IDLE_TIMEOUT);
+    printf("-k       key flows by tunnel endpoint (source IPv4) instead of 5-tuple\n");
+    printf("-H <h>   hop between the relays: udp (default, loopback socket), fused\n"
+           "         (in-process ring, %d packets per worker pair) or parallel (no hop: both\n"
+           "         relays forward to the receiver, as two paths for the sender's -P)\n", FUSED_RING_SIZE);
+    printf("-S       serve each 6RD/Teredo worker pair from one thread (not with -H fused)\n");
+    printf("-E <e>   relay I/O engine: epoll (default, recvmmsg/sendmmsg) or uring (multishot\n"
+           "         recvmsg into %d provided buffers; falls back to epoll if unavailable)\n", URING_BUFFERS);
+    printf("-G       UDP offload: relay and sink sockets take UDP_GRO trains of same-size\n"
+           "         datagrams and pass them on as UDP_SEGMENT sends; the load generator sends\n"
+           "         trains of up to %d datagrams (not with -E uring)\n", GSO_MAX_SEGMENTS);
+    printf("-C <c>   also take tunnelled traffic straight off an interface, <packet|xdp>:<ifname>:\n"
+           "         AF_PACKET TPACKET_V3 ring, or AF_XDP (with -S; falls back to AF_PACKET).\n"
+           "         Protocol 41 goes to 6RD, UDP to port %d to Teredo.\n", TEREDO_PORT);
+    printf("-A <ip>  tunnel sender destination, and the relays of the -P sender (default 127.0.0.1)\n");
+    printf("-M <m>   tunnel MTU, <6rd|teredo>:<link mtu>: IPv6 packets over the MTU less the\n"
+           "         tunnel's headers (%d for 6RD, %d for Teredo) are sent as fragments, which\n"
+           "         the receiver and the sink reassemble. At least %d + headers.\n",
+           TUNNEL_6RD_OVERHEAD, TUNNEL_TEREDO_OVERHEAD, IPV6_MIN_MTU);
+    printf("-P <p>   sender path selection: hybrid (each flow over 6RD, or Teredo for a Teredo\n"
+           "         destination, failing over on probe loss and RTT), 6rd or teredo (every flow)\n");
+    printf("-I <i>   benchmark ingress stage: 6rd (default) or teredo (the load generator\n"
+           "         feeds Teredo directly; not with -H fused). Topologies: 6RD only = -H parallel,\n"
+           "         Teredo only = -I teredo, chain = -H udp, fused = -H fused\n");
+    printf("-X <x>   inject an outage, <6rd|teredo>:<after s>:<for s>: the stage drops everything\n"
+           "         it receives in that window\n");
+    printf("Traffic generator (mode 6; any of these also makes mode 4 use it, without -G trains):\n");
+    printf("-n <n>   flows, one socket and source port each, split over the threads, at most %d\n"
+           "         (default %d)\n", GEN_MAX_FLOWS, GEN_DEFAULT_FLOWS);
+    printf("-z <z>   size mix: fixed[:<bytes>] (default, -s bytes), imix (7:4:1 of 40, 576 and\n"
+           "         1500 B) or cdf:<file> (lines of \"<bytes> <cumulative probability>\")\n");
+    printf("-r <pps> total send rate (default 0 = as fast as possible)\n");
+    printf("-p <p>   pacing at -r: constant (default) or poisson (exponential gaps)\n");
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <mode>\n", argv[0]);
-        printf("Modes:\n");
-        printf("1 - Run servers\n");
-        printf("2 - Run sender\n");
-        printf("3 - Run receiver\n");
+    int opt;
+
+    init_routes();
+    while ((opt = getopt(argc, argv, "b:w:f:d:s:o:v:i:R:F:T:kH:SE:GC:A:M:P:X:I:n:z:r:p:")) != -1) {
+        switch (opt) {
+        case 'b': batch_size = atoi(optarg); break;
+        case 'w': relay_workers = atoi(optarg); break;
+        case 'f': flush_timeout_us = atol(optarg); break;
+        case 'd': bench_seconds = atoi(optarg); break;
+        case 's': bench_size = atoi(optarg); break;
+        case 'o': bench_csv = optarg; break;
+        case 'v': log_level = atoi(optarg); break;
+        case 'i': summary_interval = atoi(optarg); break;
+        case 'R':
+            if (parse_route(optarg) < 0) {
+                fprintf(stderr, "Invalid route: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'F': max_flows = (uint32_t)atol(optarg); break;
+        case 'T': flow_idle_timeout = (uint32_t)atol(optarg); break;
+        case 'k': flow_key_mode = FLOW_KEY_ENDPOINT; break;
+        case 'H':
+            if (strcmp(optarg, "fused") == 0) {
+                fused_hop = 1;
+            } else if (strcmp(optarg, "parallel") == 0) {
+                // 6RD no longer hands over to Teredo: both reach the receiver
+                parallel_paths = 1;
+                sixrd_routes.routes[0].next_hop.sin_port = htons(RECEIVER_PORT);
+            } else if (strcmp(optarg, "udp") != 0) {
+                fprintf(stderr, "Invalid hop: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'S': shared_threads = 1; break;
+        case 'E':
+            if (strcmp(optarg, "uring") == 0) {
+                io_engine = ENGINE_URING;
+            } else if (strcmp(optarg, "epoll") != 0) {
+                fprintf(stderr, "Invalid engine: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'G': udp_offload = 1; break;
+        case 'C':
+            if (capture_parse(optarg, &capture_mode, capture_ifname, sizeof(capture_ifname)) < 0) {
+                fprintf(stderr, "Invalid capture: %s\n", optarg);
+                return 1;
+            }
+            capture_enabled = 1;
+            break;
+        case 'A': tunnel_target = optarg; break;
+        case 'M':
+            if (parse_mtu(optarg) < 0) {
+                fprintf(stderr, "Invalid tunnel MTU: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'P':
+            path_sender = 1;
+            if (strcmp(optarg, "6rd") == 0) {
+                path_policy = PATH_POLICY_6RD;
+            } else if (strcmp(optarg, "teredo") == 0) {
+                path_policy = PATH_POLICY_TEREDO;
+            } else if (strcmp(optarg, "hybrid") != 0) {
+                fprintf(stderr, "Invalid path selection: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'I':
+            if (strcmp(optarg, "teredo") == 0) {
+                bench_ingress_port = TEREDO_RELAY_PORT;
+            } else if (strcmp(optarg, "6rd") != 0) {
+                fprintf(stderr, "Invalid ingress: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'X':
+            if (parse_outage(optarg) < 0) {
+                fprintf(stderr, "Invalid outage: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'n': gen_flows = atoi(optarg); gen_enabled = 1; break;
+        case 'z': gen_size_spec = optarg; gen_enabled = 1; break;
+        case 'r': gen_rate = atof(optarg); gen_enabled = 1; break;
+        case 'p':
+            if (gen_pacing_parse(optarg, &gen_pacing) < 0) {
+                fprintf(stderr, "Invalid pacing: %s\n", optarg);
+                return 1;
+            }
+            gen_enabled = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1 || batch_size < 1 || batch_size > MAX_BATCH ||
+        relay_workers < 1 || relay_workers > MAX_WORKERS || max_flows < 1 ||
+        flush_timeout_us < 0 || bench_size < 1 || bench_size > BUFFER_SIZE ||
+        log_level < LOG_OFF || log_level > LOG_DEBUG || summary_interval < 1 ||
+        (shared_threads && fused_hop) || (parallel_paths && fused_hop) ||
+        (fused_hop && bench_ingress_port == TEREDO_RELAY_PORT) || (udp_offload && io_engine == ENGINE_URING) ||
+        gen_flows < relay_workers || gen_flows > GEN_MAX_FLOWS || gen_rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int mode = atoi(argv[optind]);
+    if (mode == 6 || (mode == 4 && gen_enabled)) {
+        gen_enabled = 1;
+        if (gen_sizes_parse(&gen_sizes, gen_size_spec, bench_size, 1, BUFFER_SIZE) < 0)
+            return 1;
+        if (gen_reserve_fds(gen_flows) < 0) {
+            fprintf(stderr, "Cannot open %d sockets: raise the open file limit (ulimit -n)\n", gen_flows);
+            return 1;
+        }
+    }
+    create_pool();
+    if (sixrd_config_init(&sixrd_domain, SIXRD_DOMAIN_PREFIX, SIXRD_DOMAIN_PREFIX_LEN, 0,
+                          SIXRD_DOMAIN_BR, SIXRD_DOMAIN_BR) < 0) {
+        fprintf(stderr, "Invalid 6RD domain\n");
         return 1;
     }
 
-    int mode = atoi(argv[1]);
+    if ((mode != 2 || path_sender) && evloop_init_signals() < 0)
+        handle_error("Failed to install signal handlers");
 
     if (mode == 1) {
-        // Run both servers
-        pthread_t sixrd_thread, teredo_thread;
-        
-        if (pthread_create(&sixrd_thread, NULL, sixrd_server, NULL) != 0)
-            handle_error("Failed to create 6RD thread");
-            
-        if (pthread_create(&teredo_thread, NULL, teredo_server, NULL) != 0)
-            handle_error("Failed to create Teredo thread");
+        // Run both servers until SIGINT/SIGTERM
+        if (metrics_start() < 0)
+            handle_error("Failed to start metrics writer");
+        struct evloop *loop = create_main_loop();
 
-        pthread_join(sixrd_thread, NULL);
-        pthread_join(teredo_thread, NULL);
+        start_relays();
+        evloop_run(loop);
+
+        stop_relays();
+        evloop_destroy(loop);
+        metrics_stop();
+    }
+    else if (mode == 2 && path_sender) {
+        run_path_sender();
     }
     else if (mode == 2) {
         // Sender
@@ -231,48 +3007,28 @@ int main(int argc, char *argv[]) {
         // }
         int size = 50;
     while (size <= 9000) {
-    // Fill the packet with 'A' for the current size
-    memset(pkt.data, 'A', size);  // Fill pkt.data with 'A' characters
-    
-    pkt.length = size;  // Set the length of the packet based on current size
-    pkt.type = 1;  // IPv6
+    // An IPv6 packet of the current size, padded with 'A'
+    packet_fill(&pkt, size);                     // Header carries the current size
+    packet_stamp_payload(&pkt, packet_now_ns()); // Send time for the one-way latency
 
-    // Send the packet to the 6RD server
-    sendto(sockfd, &pkt, size, 0, (struct sockaddr *)&sixrd_addr, sizeof(sixrd_addr));
+    // Send the header and exactly `size` payload bytes to the 6RD server
+    sendto(sockfd, &pkt, packet_wire_len(&pkt), 0, (struct sockaddr *)&sixrd_addr, sizeof(sixrd_addr));
 
     size += 10;  // Increase the size by 10 bytes
 }
 
     }
     else if (mode == 3) {
-        // Receiver
-        int sockfd;
-        struct sockaddr_in receiver_addr;
-        struct packet pkt;
-
-        sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-        if (sockfd < 0) 
-            handle_error("Receiver socket creation failed");
-
-        memset(&receiver_addr, 0, sizeof(receiver_addr));
-        receiver_addr.sin_family = AF_INET;
-        receiver_addr.sin_addr.s_addr = INADDR_ANY;
-        receiver_addr.sin_port = htons(RECEIVER_PORT);
-
-        int opt = 1;
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) 
-            handle_error("Receiver setsockopt failed");
-
-        if (bind(sockfd, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) < 0)
-            handle_error("Receiver Bind failed");
-
-        printf("Receiver is waiting for packets on port %d...\n", RECEIVER_PORT);
-
-        while (1) {
-            int n = recvfrom(sockfd, &pkt, sizeof(pkt), 0, NULL, NULL);
-            if (n < 0) continue;
-            printf("Received: %s\n", pkt.data);
-        }
+        run_receiver();
+    }
+    else if (mode == 4) {
+        run_benchmark();
+    }
+    else if (mode == 5) {
+        run_tunnel_sender();
+    }
+    else if (mode == 6) {
+        run_generator();
     }
 
     return 0;
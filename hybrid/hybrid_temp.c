@@ -9,7 +9,10 @@
 #include <errno.h>
 #include <sys/time.h>
 
-#define BUFFER_SIZE 1024
+// This prototype sends PACKET_LIMIT bytes as CHUNK_SIZE-byte datagrams.
+// hybrid.c carries whole payloads of up to BUFFER_SIZE (packet.h) and
+// fragments them to a tunnel MTU with frag.c instead.
+#define CHUNK_SIZE 1024
 #define SIXRD_PORT 8001
 #define TEREDO_PORT 8002
 #define RECEIVER_PORT 8003
@@ -17,7 +20,7 @@
 
 // Structure for packet data
 struct packet {
-    char data[BUFFER_SIZE];
+    char data[CHUNK_SIZE];
     int length;
     int type; // 0 for IPv4, 1 for IPv6
 };
@@ -190,18 +193,18 @@ void sender() {
     int bytes_sent = 0;
     int total_packets = 0;
 
-    for (int i = 0; i < PACKET_LIMIT; i += BUFFER_SIZE) {
+    for (int i = 0; i < PACKET_LIMIT; i += CHUNK_SIZE) {
         struct packet pkt;
-        strncpy(pkt.data, message + i, BUFFER_SIZE);
-        pkt.length = BUFFER_SIZE;
+        strncpy(pkt.data, message + i, CHUNK_SIZE);
+        pkt.length = CHUNK_SIZE;
 
         gettimeofday(&start, NULL);
         sendto(sockfd, &pkt, sizeof(pkt), 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
         gettimeofday(&end, NULL);
 
         long latency = calculate_latency(start, end);
-        double throughput = (BUFFER_SIZE / (latency / 1e6)) / 1024.0; // KBps
-        bytes_sent += BUFFER_SIZE;
+        double throughput = (CHUNK_SIZE / (latency / 1e6)) / 1024.0; // KBps
+        bytes_sent += CHUNK_SIZE;
         total_packets++;
 
         printf("Sent packet %d: Latency %ld us, Throughput %.2f KBps\n", total_packets, latency, throughput);
@@ -0,0 +1,166 @@
+// ip.c - IPv6 header build/parse, IPv4 header checks and the ICMPv6 checksum
+#include <string.h>
+#include <immintrin.h>
+#include <arpa/inet.h>
+
+#include "ip.h"
+#include "checksum.h"
+
+size_t ipv6_build_header(void *buf, const struct in6_addr *src, const struct in6_addr *dst,
+                         uint8_t next_header, uint16_t payload_len, uint8_t hop_limit) {
+    unsigned char *p = buf;
+    uint32_t vtf = htonl(6u << 28);  // version 6, traffic class and flow label 0
+    uint16_t plen = htons(payload_len);
+
+    memcpy(p, &vtf, 4);
+    memcpy(p + 4, &plen, 2);
+    p[6] = next_header;
+    p[7] = hop_limit;
+    memcpy(p + 8, src, 16);
+    memcpy(p + 24, dst, 16);
+    return IPV6_HEADER_LEN;
+}
+
+long ipv6_parse_header(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+
+    if (len < IPV6_HEADER_LEN)
+        return -1;
+    size_t total = IPV6_HEADER_LEN + (((size_t)p[4] << 8) | p[5]);
+    if ((p[0] >> 4) != 6 || total > len)
+        return -1;
+    return (long)total;
+}
+
+size_t ipv4_header_valid(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+
+    if (len < IPV4_HEADER_LEN)
+        return 0;
+    size_t header_len = (size_t)(p[0] & 0x0f) * 4;
+    size_t total = ((size_t)p[2] << 8) | p[3];
+    if ((p[0] >> 4) != 4 || header_len < IPV4_HEADER_LEN || total < header_len || total > len ||
+        ((p[6] & 0x3f) | p[7]) != 0)
+        return 0;
+    uint16_t check = header_len == IPV4_HEADER_LEN ? ipv4_header_checksum(p) : inet_checksum(p, header_len);
+    return check == 0 ? header_len : 0;
+}
+
+// The vector kernels take the first 20 bytes of each header as five 32-bit
+// words, transposed so that a register holds the same word of every
+// header, and check lanes as ipv4_header_valid() would an option-less
+// header. They return a bit per header that passed; headers that fail,
+// including any with options, are checked again one by one.
+__attribute__((target("sse4.2")))
+static unsigned ipv4_check4_sse42(const unsigned char *const *p, const size_t *lens) {
+    const __m128i low16 = _mm_set1_epi32(0xffff);
+    __m128i h0 = _mm_loadu_si128((const __m128i *)p[0]), h1 = _mm_loadu_si128((const __m128i *)p[1]);
+    __m128i h2 = _mm_loadu_si128((const __m128i *)p[2]), h3 = _mm_loadu_si128((const __m128i *)p[3]);
+    uint32_t tail[4];
+
+    for (int i = 0; i < 4; i++)
+        memcpy(&tail[i], p[i] + 16, 4);
+
+    // 4x4 transpose: w[k] holds word k of the four headers
+    __m128i t0 = _mm_unpacklo_epi32(h0, h1), t1 = _mm_unpacklo_epi32(h2, h3);
+    __m128i t2 = _mm_unpackhi_epi32(h0, h1), t3 = _mm_unpackhi_epi32(h2, h3);
+    __m128i w[5] = {
+        _mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+        _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3),
+        _mm_loadu_si128((const __m128i *)tail),
+    };
+
+    // Ten 16-bit halves per header fit a 32-bit lane; fold twice
+    __m128i sum = _mm_setzero_si128();
+    for (int k = 0; k < 5; k++)
+        sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_and_si128(w[k], low16), _mm_srli_epi32(w[k], 16)));
+    sum = _mm_add_epi32(_mm_and_si128(sum, low16), _mm_srli_epi32(sum, 16));
+    sum = _mm_add_epi32(_mm_and_si128(sum, low16), _mm_srli_epi32(sum, 16));
+    __m128i ok = _mm_cmpeq_epi32(sum, low16);
+
+    // Version 4 with no options, and neither MF nor a fragment offset
+    ok = _mm_and_si128(ok, _mm_cmpeq_epi32(_mm_and_si128(w[0], _mm_set1_epi32(0xff)), _mm_set1_epi32(0x45)));
+    ok = _mm_and_si128(ok, _mm_cmpeq_epi32(_mm_and_si128(w[1], _mm_set1_epi32((int)0xff3f0000)),
+                                           _mm_setzero_si128()));
+
+    // Header length <= total length <= captured length
+    __m128i total = _mm_or_si128(_mm_srli_epi32(w[0], 24), _mm_and_si128(_mm_srli_epi32(w[0], 8),
+                                                                         _mm_set1_epi32(0xff00)));
+    __m128i len = _mm_setr_epi32((int)lens[0], (int)lens[1], (int)lens[2], (int)lens[3]);
+    ok = _mm_andnot_si128(_mm_cmpgt_epi32(total, len), ok);
+    ok = _mm_andnot_si128(_mm_cmplt_epi32(total, _mm_set1_epi32(IPV4_HEADER_LEN)), ok);
+    return (unsigned)_mm_movemask_ps(_mm_castsi128_ps(ok));
+}
+
+__attribute__((target("avx2")))
+static unsigned ipv4_check8_avx2(const unsigned char *const *p, const size_t *lens) {
+    const __m256i low16 = _mm256_set1_epi32(0xffff);
+    __m256i h[4];
+    uint32_t tail[8];
+
+    // Headers i and i + 4 share a register, one per 128-bit lane, so the
+    // in-lane unpacks transpose both groups of four at once
+    for (int i = 0; i < 4; i++)
+        h[i] = _mm256_setr_m128i(_mm_loadu_si128((const __m128i *)p[i]),
+                                 _mm_loadu_si128((const __m128i *)p[i + 4]));
+    for (int i = 0; i < 8; i++)
+        memcpy(&tail[i], p[i] + 16, 4);
+
+    __m256i t0 = _mm256_unpacklo_epi32(h[0], h[1]), t1 = _mm256_unpacklo_epi32(h[2], h[3]);
+    __m256i t2 = _mm256_unpackhi_epi32(h[0], h[1]), t3 = _mm256_unpackhi_epi32(h[2], h[3]);
+    __m256i w[5] = {
+        _mm256_unpacklo_epi64(t0, t1), _mm256_unpackhi_epi64(t0, t1),
+        _mm256_unpacklo_epi64(t2, t3), _mm256_unpackhi_epi64(t2, t3),
+        _mm256_loadu_si256((const __m256i *)tail),
+    };
+
+    __m256i sum = _mm256_setzero_si256();
+    for (int k = 0; k < 5; k++)
+        sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_and_si256(w[k], low16), _mm256_srli_epi32(w[k], 16)));
+    sum = _mm256_add_epi32(_mm256_and_si256(sum, low16), _mm256_srli_epi32(sum, 16));
+    sum = _mm256_add_epi32(_mm256_and_si256(sum, low16), _mm256_srli_epi32(sum, 16));
+    __m256i ok = _mm256_cmpeq_epi32(sum, low16);
+
+    ok = _mm256_and_si256(ok, _mm256_cmpeq_epi32(_mm256_and_si256(w[0], _mm256_set1_epi32(0xff)),
+                                                 _mm256_set1_epi32(0x45)));
+    ok = _mm256_and_si256(ok, _mm256_cmpeq_epi32(_mm256_and_si256(w[1], _mm256_set1_epi32((int)0xff3f0000)),
+                                                 _mm256_setzero_si256()));
+
+    __m256i total = _mm256_or_si256(_mm256_srli_epi32(w[0], 24),
+                                    _mm256_and_si256(_mm256_srli_epi32(w[0], 8), _mm256_set1_epi32(0xff00)));
+    __m256i len = _mm256_setr_epi32((int)lens[0], (int)lens[1], (int)lens[2], (int)lens[3],
+                                    (int)lens[4], (int)lens[5], (int)lens[6], (int)lens[7]);
+    ok = _mm256_andnot_si256(_mm256_cmpgt_epi32(total, len), ok);
+    ok = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(IPV4_HEADER_LEN), total), ok);
+    return (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(ok));
+}
+
+void ipv4_header_valid_batch(const unsigned char *const *pkts, const size_t *lens, int n, uint8_t *header_len) {
+    enum csum_impl impl = csum_get_impl();
+    int width = impl == CSUM_AVX2 ? 8 : impl == CSUM_SSE42 ? 4 : 1;
+    int i = 0;
+
+    while (width > 1 && i + width <= n) {
+        // The kernels read 20 bytes of every header, so short packets go
+        // one by one, as do lengths too large for a signed lane
+        int fits = 1;
+        for (int k = 0; k < width; k++)
+            fits &= lens[i + k] >= IPV4_HEADER_LEN && lens[i + k] <= 0x7fffffff;
+        unsigned passed = !fits ? 0 : width == 8 ? ipv4_check8_avx2(pkts + i, lens + i)
+                                                 : ipv4_check4_sse42(pkts + i, lens + i);
+        for (int k = 0; k < width; k++, i++)
+            header_len[i] = (uint8_t)(passed & (1u << k) ? IPV4_HEADER_LEN : ipv4_header_valid(pkts[i], lens[i]));
+    }
+    for (; i < n; i++)
+        header_len[i] = (uint8_t)ipv4_header_valid(pkts[i], lens[i]);
+}
+
+uint16_t icmpv6_checksum(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint32_t upper_len = htonl((uint32_t)(len - IPV6_HEADER_LEN));
+    uint32_t next_header = htonl(IPV6_NEXT_ICMPV6);
+
+    // Pseudo-header: both addresses, upper-layer length and next header
+    uint64_t sum = csum_partial(p + 8, 32, 0) + upper_len + next_header;
+    return csum_fold(csum_partial_bulk(p + IPV6_HEADER_LEN, len - IPV6_HEADER_LEN, sum));
+}
@@ -0,0 +1,37 @@
+// ip.h - IPv4/IPv6 header helpers shared by the tunnel engines
+#ifndef IP_H
+#define IP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define IPV4_HEADER_LEN 20
+#define IPV6_HEADER_LEN 40
+#define IPV6_NEXT_NONE 59  // "No Next Header", used by Teredo bubbles
+#define IPV6_NEXT_ICMPV6 58
+
+// Write a 40-byte IPv6 header to buf. Returns IPV6_HEADER_LEN.
+size_t ipv6_build_header(void *buf, const struct in6_addr *src, const struct in6_addr *dst,
+                         uint8_t next_header, uint16_t payload_len, uint8_t hop_limit);
+
+// Check that buf holds a complete IPv6 packet: version 6 and a payload
+// length consistent with len. Returns the packet length, or -1.
+long ipv6_parse_header(const void *buf, size_t len);
+
+// Check the IPv4 header of a packet of len bytes: version 4, a header and
+// total length that fit in len, not a fragment (neither MF nor an offset),
+// and an intact header checksum. Returns the header length, or 0.
+size_t ipv4_header_valid(const void *buf, size_t len);
+
+// ipv4_header_valid() of n packets, e.g. a batch of captured frames, into
+// header_len. Option-less headers are checked 8 (AVX2) or 4 (SSE4.2) at a
+// time with the checksum kernels' instruction set (checksum.h).
+void ipv4_header_valid_batch(const unsigned char *const *pkts, const size_t *lens, int n, uint8_t *header_len);
+
+// ICMPv6 checksum (RFC 4443) of the IPv6 packet at buf (len bytes), whose
+// payload is one ICMPv6 message: the value to store with the checksum
+// field zeroed, or 0 over a received message that is intact
+uint16_t icmpv6_checksum(const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,161 @@
+// log.c - summary lines, rate limiter and output helpers for log.h
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "log.h"
+
+int log_level = LOG_SUMMARY;
+int log_rate_limit = LOG_DEFAULT_RATE_LIMIT;
+int log_hexdump_bytes = LOG_DEFAULT_HEXDUMP_BYTES;
+
+static struct log_stats stats_blocks[LOG_MAX_STATS];
+static _Atomic int stats_count = 0;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct timespec summary_last;  // time of the previous log_summary()
+
+struct log_stats *log_register(const char *name) {
+    struct log_stats *stats = NULL;
+
+    pthread_mutex_lock(&registry_lock);
+    int n = atomic_load(&stats_count);
+    if (n < LOG_MAX_STATS) {
+        stats = &stats_blocks[n];
+        memset(stats, 0, sizeof(*stats));
+        stats->name = name;
+        atomic_store_explicit(&stats_count, n + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return stats;
+}
+
+int log_ratelimit(struct log_stats *stats) {
+    struct timespec ts;
+
+    if (stats == NULL)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    if (ts.tv_sec != stats->window) {
+        if (stats->suppressed > 0)
+            printf("%s: %lu per-packet messages suppressed\n", stats->name, stats->suppressed);
+        stats->window = ts.tv_sec;
+        stats->window_lines = 0;
+        stats->suppressed = 0;
+    }
+    if (stats->window_lines >= log_rate_limit) {
+        stats->suppressed++;
+        return 0;
+    }
+    stats->window_lines++;
+    return 1;
+}
+
+void log_msg(int level, const char *fmt, ...) {
+    va_list ap;
+
+    if (!LOG_ENABLED(level))
+        return;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+void log_hexdump(const void *data, int length) {
+    const unsigned char *bytes = data;
+    int shown = length < log_hexdump_bytes ? length : log_hexdump_bytes;
+
+    for (int offset = 0; offset < shown; offset += 16) {
+        char hex[16 * 3 + 1] = "", ascii[17];
+        int n = shown - offset < 16 ? shown - offset : 16;
+
+        for (int i = 0; i < n; i++) {
+            unsigned char c = bytes[offset + i];
+            snprintf(hex + i * 3, 4, "%02x ", c);
+            ascii[i] = (c >= 0x20 && c < 0x7f) ? (char)c : '.';
+        }
+        ascii[n] = '\0';
+        printf("  %04x  %-48s |%s|\n", offset, hex, ascii);
+    }
+    if (shown < length)
+        printf("  ... %d more bytes\n", length - shown);
+}
+
+// Lower bound in microseconds of a latency bucket (inverse of
+// log_latency_bucket)
+static long bucket_floor(int bucket) {
+    if (bucket < 16)
+        return bucket;
+    int msb = (bucket - 16) / 4 + 4;
+    return (1L << msb) + (long)((bucket - 16) % 4) * (1L << (msb - 2));
+}
+
+static long percentile(const unsigned long *hist, unsigned long total, double p) {
+    unsigned long target = (unsigned long)(total * p);
+    unsigned long seen = 0;
+
+    for (int i = 0; i < LOG_LATENCY_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > target)
+            return bucket_floor(i);
+    }
+    return bucket_floor(LOG_LATENCY_BUCKETS - 1);
+}
+
+// Previous snapshot of every stats block, log_summary() caller only
+struct stats_snapshot {
+    unsigned long packets;
+    unsigned long bytes;
+    unsigned long latency_hist[LOG_LATENCY_BUCKETS];
+};
+static struct stats_snapshot snapshots[LOG_MAX_STATS];
+
+static void print_summary(double seconds) {
+    int n = atomic_load_explicit(&stats_count, memory_order_acquire);
+
+    for (int i = 0; i < n; i++) {
+        struct log_stats *stats = &stats_blocks[i];
+        struct stats_snapshot *prev = &snapshots[i];
+        unsigned long hist[LOG_LATENCY_BUCKETS];
+
+        unsigned long packets = atomic_load_explicit(&stats->packets, memory_order_relaxed);
+        unsigned long bytes = atomic_load_explicit(&stats->bytes, memory_order_relaxed);
+        for (int b = 0; b < LOG_LATENCY_BUCKETS; b++) {
+            unsigned long count = atomic_load_explicit(&stats->latency_hist[b], memory_order_relaxed);
+            hist[b] = count - prev->latency_hist[b];
+            prev->latency_hist[b] = count;
+        }
+
+        unsigned long delta_packets = packets - prev->packets;
+        unsigned long delta_bytes = bytes - prev->bytes;
+        prev->packets = packets;
+        prev->bytes = bytes;
+        if (delta_packets == 0)
+            continue;
+
+        printf("[%s] %.0f pps, %.2f MB/s, latency p50 %ld us, p99 %ld us (%lu packets total)\n",
+               stats->name, delta_packets / seconds, delta_bytes / seconds / 1e6,
+               percentile(hist, delta_packets, 0.50), percentile(hist, delta_packets, 0.99), packets);
+    }
+    fflush(stdout);
+}
+
+void log_summary(void) {
+    struct timespec now;
+
+    if (!LOG_ENABLED(LOG_SUMMARY))
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (summary_last.tv_sec == 0 && summary_last.tv_nsec == 0) {
+        // First call only takes the baseline
+        summary_last = now;
+        return;
+    }
+    double seconds = (now.tv_sec - summary_last.tv_sec) + (now.tv_nsec - summary_last.tv_nsec) / 1e9;
+    summary_last = now;
+    if (seconds > 0)
+        print_summary(seconds);
+}
@@ -0,0 +1,87 @@
+// log.h - leveled, rate-limited logging for the forwarding paths
+//
+// At the default level (LOG_SUMMARY) the per-packet cost is a few counter
+// increments in a per-thread stats block; log_summary(), called from a
+// timer, turns them into one summary line per interval. Per-packet lines
+// (LOG_PACKET) are rate limited, and LOG_DEBUG adds a length-limited
+// hexdump of the payload.
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+
+enum log_level {
+    LOG_OFF = 0,
+    LOG_SUMMARY = 1,
+    LOG_PACKET = 2,
+    LOG_DEBUG = 3,
+};
+
+#define LOG_LATENCY_BUCKETS 160
+#define LOG_DEFAULT_RATE_LIMIT 100   // per-packet lines per second per thread
+#define LOG_DEFAULT_HEXDUMP_BYTES 64
+#define LOG_MAX_STATS 256            // stats blocks per process
+
+extern int log_level;
+extern int log_rate_limit;
+extern int log_hexdump_bytes;
+
+#define LOG_ENABLED(level) (log_level >= (level))
+
+// Per-thread packet statistics. Only the owning thread writes the counters;
+// log_summary() reads them, so relaxed single-writer updates suffice.
+struct log_stats {
+    const char *name;
+    _Atomic unsigned long packets;
+    _Atomic unsigned long bytes;
+    _Atomic unsigned long latency_hist[LOG_LATENCY_BUCKETS];
+    // Rate limiter state, owner thread only
+    long window;
+    int window_lines;
+    unsigned long suppressed;
+};
+
+// Log-linear bucket for a latency in microseconds: exact below 16 us, then
+// four buckets per power of two (within 25%)
+static inline int log_latency_bucket(long us) {
+    if (us < 16)
+        return us < 0 ? 0 : (int)us;
+    int msb = 63 - __builtin_clzl((unsigned long)us);
+    int bucket = 16 + (msb - 4) * 4 + (int)((us >> (msb - 2)) & 3);
+    return bucket < LOG_LATENCY_BUCKETS ? bucket : LOG_LATENCY_BUCKETS - 1;
+}
+
+#define LOG_COUNTER_ADD(counter, n) \
+    atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), \
+                          memory_order_relaxed)
+
+// Account one forwarded packet. This is all the logger costs per packet
+// unless LOG_PACKET or higher is enabled.
+static inline void log_packet(struct log_stats *stats, int bytes, long latency_us) {
+    if (stats == NULL)
+        return;
+    LOG_COUNTER_ADD(stats->packets, 1);
+    LOG_COUNTER_ADD(stats->bytes, bytes);
+    LOG_COUNTER_ADD(stats->latency_hist[log_latency_bucket(latency_us)], 1);
+}
+
+// Register a stats block for the calling thread. Returns NULL when
+// LOG_MAX_STATS blocks already exist.
+struct log_stats *log_register(const char *name);
+
+// Returns 1 if another per-packet line may be printed this second, else
+// counts it as suppressed and returns 0. Without a stats block (NULL)
+// nothing is printed.
+int log_ratelimit(struct log_stats *stats);
+
+void log_msg(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Dump at most log_hexdump_bytes of data, 16 bytes per line
+void log_hexdump(const void *data, int length);
+
+// Print one summary line per active stats block (pps, bytes/s, p50/p99
+// latency) covering the time since the previous call; the first call only
+// starts the interval. Call from one thread only. No-op below LOG_SUMMARY.
+void log_summary(void);
+
+#endif
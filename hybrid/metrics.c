@@ -0,0 +1,186 @@
+// metrics.c - background writer for the per-thread metrics rings
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "ring.h"
+
+#define MAX_METRIC_FILES 16
+#define WRITER_BATCH 1024          // records drained from one ring per pass
+#define WRITER_IDLE_NS 10000000L   // 10 ms nap when every ring is empty
+#define FILE_BUFFER_SIZE (64 * 1024)
+
+struct metric_record {
+    int packet_count;
+    int bytes;
+    long forward_ns;
+    long oneway_ns;  // -1 when the packet carried no send timestamp
+};
+
+struct metrics_file {
+    char name[256];
+    FILE *file;
+};
+
+struct metrics_stream {
+    struct spsc_ring ring;
+    _Atomic unsigned long dropped;
+    unsigned long written;         // writer thread only
+    struct metrics_file *out;
+};
+
+static struct metrics_stream streams[METRICS_MAX_STREAMS];
+static _Atomic int stream_count = 0;
+static struct metrics_file files[MAX_METRIC_FILES];
+static int file_count = 0;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t writer_thread;
+static _Atomic int writer_running = 0;
+
+// Find or open the shared output file for filename (registry_lock held)
+static struct metrics_file *open_file(const char *filename) {
+    for (int i = 0; i < file_count; i++) {
+        if (strcmp(files[i].name, filename) == 0)
+            return &files[i];
+    }
+    if (file_count == MAX_METRIC_FILES)
+        return NULL;
+
+    FILE *file = fopen(filename, "a");
+    if (file == NULL) {
+        perror("Failed to open metrics file");
+        return NULL;
+    }
+    setvbuf(file, NULL, _IOFBF, FILE_BUFFER_SIZE);
+    if (ftell(file) == 0)
+        fprintf(file, "PacketCount,Bytes,ForwardUs,OneWayUs\n");
+
+    struct metrics_file *mf = &files[file_count++];
+    snprintf(mf->name, sizeof(mf->name), "%s", filename);
+    mf->file = file;
+    return mf;
+}
+
+struct metrics_stream *metrics_open(const char *filename) {
+    struct metrics_stream *stream = NULL;
+
+    pthread_mutex_lock(&registry_lock);
+    int n = atomic_load(&stream_count);
+    if (n == METRICS_MAX_STREAMS) {
+        fprintf(stderr, "Too many metrics streams\n");
+        goto out;
+    }
+
+    stream = &streams[n];
+    stream->out = open_file(filename);
+    if (stream->out == NULL ||
+        spsc_ring_init(&stream->ring, METRICS_RING_SIZE, sizeof(struct metric_record)) < 0) {
+        stream = NULL;
+        goto out;
+    }
+    atomic_init(&stream->dropped, 0);
+    stream->written = 0;
+
+    // Publish only once the stream is fully set up
+    atomic_store_explicit(&stream_count, n + 1, memory_order_release);
+out:
+    pthread_mutex_unlock(&registry_lock);
+    return stream;
+}
+
+void metrics_record(struct metrics_stream *stream, int packet_count, int bytes, long forward_ns, long oneway_ns) {
+    struct metric_record rec = { packet_count, bytes, forward_ns, oneway_ns };
+
+    if (stream == NULL)
+        return;
+    if (spsc_ring_push(&stream->ring, &rec) < 0)
+        atomic_fetch_add_explicit(&stream->dropped, 1, memory_order_relaxed);
+}
+
+unsigned long metrics_dropped(const struct metrics_stream *stream) {
+    return atomic_load_explicit(&stream->dropped, memory_order_relaxed);
+}
+
+unsigned long metrics_dropped_total(void) {
+    unsigned long total = 0;
+    int n = atomic_load_explicit(&stream_count, memory_order_acquire);
+    for (int i = 0; i < n; i++)
+        total += metrics_dropped(&streams[i]);
+    return total;
+}
+
+// One pass over every ring; returns the number of records written
+static long drain_all(void) {
+    struct metric_record rec;
+    long total = 0;
+    int n = atomic_load_explicit(&stream_count, memory_order_acquire);
+
+    for (int i = 0; i < n; i++) {
+        struct metrics_stream *stream = &streams[i];
+        int batch = 0;
+        while (batch < WRITER_BATCH && spsc_ring_pop(&stream->ring, &rec) == 0) {
+            // Microseconds with ns resolution; no one-way column value if unknown
+            if (rec.oneway_ns >= 0)
+                fprintf(stream->out->file, "%d,%d,%.3f,%.3f\n", rec.packet_count, rec.bytes,
+                        rec.forward_ns / 1e3, rec.oneway_ns / 1e3);
+            else
+                fprintf(stream->out->file, "%d,%d,%.3f,\n", rec.packet_count, rec.bytes,
+                        rec.forward_ns / 1e3);
+            batch++;
+        }
+        stream->written += batch;
+        total += batch;
+    }
+    return total;
+}
+
+static void flush_files(void) {
+    pthread_mutex_lock(&registry_lock);
+    for (int i = 0; i < file_count; i++)
+        fflush(files[i].file);
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void *metrics_writer(void *arg) {
+    (void)arg;
+    struct timespec idle = { 0, WRITER_IDLE_NS };
+
+    while (atomic_load(&writer_running)) {
+        if (drain_all() == 0) {
+            // Nothing queued: push buffered output to disk and nap
+            flush_files();
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    while (drain_all() > 0)
+        ;
+    flush_files();
+    return NULL;
+}
+
+int metrics_start(void) {
+    atomic_store(&writer_running, 1);
+    if (pthread_create(&writer_thread, NULL, metrics_writer, NULL) != 0) {
+        atomic_store(&writer_running, 0);
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_stop(void) {
+    if (!atomic_exchange(&writer_running, 0))
+        return;
+    pthread_join(writer_thread, NULL);
+
+    int n = atomic_load(&stream_count);
+    for (int i = 0; i < n; i++) {
+        fprintf(stderr, "metrics: %s stream %d: %lu records written, %lu dropped\n",
+                streams[i].out->name, i, streams[i].written, metrics_dropped(&streams[i]));
+    }
+}
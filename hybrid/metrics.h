@@ -0,0 +1,37 @@
+// metrics.h - asynchronous per-packet metrics logging
+//
+// Each forwarding thread opens its own stream and pushes records into a
+// private lock-free ring. A single background writer drains every ring and
+// appends the records, batched, to the stream's CSV file. Producers never
+// block: when a ring is full the record is dropped and counted.
+#ifndef METRICS_H
+#define METRICS_H
+
+#define METRICS_RING_SIZE 8192  // records buffered per stream (power of two)
+#define METRICS_MAX_STREAMS 256 // streams per process
+
+struct metrics_stream;
+
+// Start the background writer thread. Returns 0 on success, -1 on failure.
+int metrics_start(void);
+
+// Flush everything still buffered, stop the writer and print per-stream
+// record/drop totals to stderr.
+void metrics_stop(void);
+
+// Register a new stream appending to filename. Streams that name the same
+// file share it. Call once per producing thread. Returns NULL on failure,
+// with a message on stderr.
+struct metrics_stream *metrics_open(const char *filename);
+
+// Queue one record. Never blocks. Columns: packet count, payload bytes,
+// forward_ns (kernel receive timestamp to egress) and oneway_ns (sender's
+// send time to kernel receive timestamp, -1 if the packet was not stamped),
+// both written in microseconds. New files start with a header row.
+void metrics_record(struct metrics_stream *stream, int packet_count, int bytes, long forward_ns, long oneway_ns);
+
+// Records lost to ring overflow, on one stream or across all of them
+unsigned long metrics_dropped(const struct metrics_stream *stream);
+unsigned long metrics_dropped_total(void);
+
+#endif
@@ -0,0 +1,917 @@
+// microbench.c - per-packet cost of the relay and Teredo data-plane functions
+//
+// Every function a packet goes through on its way through a relay or the
+// Teredo server is timed on its own, in the manner of Google Benchmark:
+// each benchmark's iteration count grows until a run takes at least the
+// minimum time (-t), then the run is repeated (-r) and the median, mean and
+// standard deviation are reported. Next to the time per operation come the
+// cycles, instructions, IPC, branch misses and cache misses per operation
+// from perf_event_open (perf.h) where the CPU and perf_event_paranoid allow
+// it; without perf, cycles are TSC ticks and the rest is left out.
+//
+//   microbench [-f regex] [-t seconds] [-r repetitions] [-n iterations]
+//              [-o file] [-F json|csv] [-l] [iterations]
+//
+// -f runs only the benchmarks whose name matches the extended regex, -l
+// lists them, -n (or a bare number) fixes the iteration count, and -o also
+// writes every result to a JSON or CSV file.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <regex.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include "sixrd.h"
+#include "teredo.h"
+#include "flow.h"
+#include "checksum.h"
+#include "pool.h"
+#include "frag.h"
+#include "peer.h"
+#include "ip.h"
+#include "packet.h"
+#include "hist.h"
+#include "log.h"
+#include "metrics.h"
+#include "ring.h"
+#include "path.h"
+#include "perf.h"
+
+#define DEFAULT_MIN_TIME 0.5       // seconds per measured run
+#define MAX_REPETITIONS 64
+#define MAX_CALIBRATION_GROWTH 10  // a calibration run is at most 10x the previous
+#define PAYLOAD_SIZE 64
+#define MUTATED_INPUTS 1024
+#define BENCH_FLOWS 1000000
+#define FRAG_PACKET_SIZE 9000
+#define FRAG_MTU 1280
+#define FRAG_MAX 8
+#define PEER_SIZES 3
+#define RING_BENCH_SIZE 512        // FUSED_RING_SIZE in hybrid.c
+#define RING_BENCH_BURST 32
+#define PATH_BENCH_FLOWS 16
+#define CHECKSUM_BATCH 32
+
+// Keep the compiler from discarding or hoisting benchmarked work
+#define KEEP(value) __asm__ volatile("" : : "r"(value) : "memory")
+
+// One reported line: a single run, or an aggregate over the repetitions.
+// Per-operation values; a counter that was not read is negative.
+struct bench_result {
+    char name[64];
+    const char *aggregate;      // NULL, "mean", "median" or "stddev"
+    long iterations;
+    int repetitions;
+    double ns;
+    double cycles;
+    double counter[PERF_COUNTERS];
+};
+
+static struct {
+    // Options
+    regex_t filter;
+    int filtered;
+    int list;
+    double min_time;
+    int repetitions;
+    long fixed_iterations;      // 0: calibrate
+    // Counters
+    struct perf_group perf;
+    int core_cycles;            // cycles come from perf, not the TSC
+    double tsc_ghz;
+    // The benchmark being run
+    const char *name;
+    long iterations;
+    int calibrating;
+    int done;                   // repetitions measured so far
+    struct perf_sample start;
+    double ns[MAX_REPETITIONS];
+    double cycles[MAX_REPETITIONS];
+    double counter[MAX_REPETITIONS][PERF_COUNTERS];
+    // Everything reported, for -o
+    struct bench_result *results;
+    int result_count;
+    int result_capacity;
+} bench;
+
+// Run body in a loop of bench.iterations, calibrating and repeating as
+// bench_stop() decides. i_ is the iteration within the run. scale divides
+// a fixed iteration count (-n) for benchmarks whose operation is a burst
+// or a 9 KB packet, so that every benchmark takes about as long.
+#define BENCH_SCALED(name, scale, body)                                            \
+    do {                                                                           \
+        if (!bench_begin(name, scale))                                             \
+            break;                                                                 \
+        while (bench.calibrating || bench.done < bench.repetitions) {              \
+            long n_ = bench.iterations;                                            \
+            bench_start();                                                         \
+            for (long i_ = 0; i_ < n_; i_++) {                                     \
+                body;                                                              \
+            }                                                                      \
+            bench_stop(n_);                                                        \
+        }                                                                          \
+        bench_end();                                                               \
+    } while (0)
+
+#define BENCH(name, body) BENCH_SCALED(name, 1, body)
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int bench_begin(const char *name, long scale) {
+    if (bench.filtered && regexec(&bench.filter, name, 0, NULL, 0) != 0)
+        return 0;
+    if (bench.list) {
+        printf("%s\n", name);
+        return 0;
+    }
+    bench.name = name;
+    bench.done = 0;
+    bench.calibrating = bench.fixed_iterations == 0;
+    bench.iterations = bench.calibrating ? 1 : bench.fixed_iterations / scale;
+    if (bench.iterations < 1)
+        bench.iterations = 1;
+    return 1;
+}
+
+static void bench_start(void) {
+    perf_read(&bench.perf, &bench.start);
+}
+
+// Account a run of n iterations. While calibrating, a run shorter than the
+// minimum time only sets the next iteration count; the first long enough
+// run is the first repetition.
+static void bench_stop(long n) {
+    struct perf_sample end;
+
+    perf_read(&bench.perf, &end);
+    double elapsed = (double)(end.ns - bench.start.ns);
+    if (bench.calibrating) {
+        double target = bench.min_time * 1e9;
+        if (elapsed < target) {
+            // Aim 40% past the target, as the estimate from a short run is rough
+            double growth = elapsed > 0 ? target * 1.4 / elapsed : MAX_CALIBRATION_GROWTH;
+            if (growth > MAX_CALIBRATION_GROWTH)
+                growth = MAX_CALIBRATION_GROWTH;
+            long next = (long)(n * growth);
+            bench.iterations = next > n ? next : n + 1;
+            return;
+        }
+        bench.calibrating = 0;
+    }
+
+    int r = bench.done++;
+    bench.ns[r] = elapsed / n;
+    if (bench.core_cycles)
+        bench.cycles[r] = (double)(end.value[PERF_CYCLES] - bench.start.value[PERF_CYCLES]) / n;
+    else
+        bench.cycles[r] = bench.tsc_ghz > 0 ? (double)(end.tsc - bench.start.tsc) / n : -1.0;
+    for (int c = 0; c < PERF_COUNTERS; c++)
+        bench.counter[r][c] = perf_available(&bench.perf, c) ?
+            (double)(end.value[c] - bench.start.value[c]) / n : -1.0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Mean, median or standard deviation of n per-run values; negative (not
+// read) stays negative
+static double aggregate(const double *values, int n, const char *kind) {
+    double sorted[MAX_REPETITIONS], mean = 0.0, var = 0.0;
+
+    if (values[0] < 0)
+        return -1.0;
+    for (int i = 0; i < n; i++)
+        mean += values[i] / n;
+    if (strcmp(kind, "mean") == 0)
+        return mean;
+    if (strcmp(kind, "median") == 0) {
+        memcpy(sorted, values, n * sizeof(double));
+        qsort(sorted, n, sizeof(double), compare_double);
+        return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    }
+    for (int i = 0; i < n; i++)
+        var += (values[i] - mean) * (values[i] - mean);
+    return n > 1 ? sqrt(var / (n - 1)) : 0.0;
+}
+
+static void print_value(double v) {
+    if (v < 0)
+        printf(" %12s", "-");
+    else
+        printf(" %12.2f", v);
+}
+
+static void report(const struct bench_result *res) {
+    char name[80];
+    double instructions = res->counter[PERF_INSTRUCTIONS];
+
+    snprintf(name, sizeof(name), "%s%s%s", res->name, res->aggregate ? "_" : "",
+             res->aggregate ? res->aggregate : "");
+    printf("%-44s", name);
+    print_value(res->ns);
+    print_value(res->cycles);
+    print_value(instructions);
+    // IPC only over core cycles, and meaningless for a spread
+    if (bench.core_cycles && instructions >= 0 && res->cycles > 0 &&
+        (res->aggregate == NULL || strcmp(res->aggregate, "stddev") != 0))
+        printf(" %6.2f", instructions / res->cycles);
+    else
+        printf(" %6s", "-");
+    print_value(res->counter[PERF_BRANCH_MISSES]);
+    print_value(res->counter[PERF_CACHE_MISSES]);
+    printf(" %12ld\n", res->iterations);
+
+    if (bench.result_count == bench.result_capacity) {
+        int capacity = bench.result_capacity ? 2 * bench.result_capacity : 64;
+        struct bench_result *results = realloc(bench.results, capacity * sizeof(*results));
+        if (results == NULL)
+            return;  // still printed, just not in the output file
+        bench.results = results;
+        bench.result_capacity = capacity;
+    }
+    bench.results[bench.result_count++] = *res;
+}
+
+static void bench_end(void) {
+    static const char *kinds[] = { "mean", "median", "stddev" };
+    struct bench_result res;
+    int n = bench.done;
+
+    memset(&res, 0, sizeof(res));
+    snprintf(res.name, sizeof(res.name), "%s", bench.name);
+    res.iterations = bench.iterations;
+    res.repetitions = n;
+    for (int k = n > 1 ? 0 : 1; k < (n > 1 ? 3 : 2); k++) {
+        res.aggregate = n > 1 ? kinds[k] : NULL;
+        res.ns = aggregate(bench.ns, n, kinds[k]);
+        res.cycles = aggregate(bench.cycles, n, kinds[k]);
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            double values[MAX_REPETITIONS];
+            for (int r = 0; r < n; r++)
+                values[r] = bench.counter[r][c];
+            res.counter[c] = aggregate(values, n, kinds[k]);
+        }
+        report(&res);
+    }
+    fflush(stdout);
+}
+
+static void print_context(void) {
+    char date[64];
+    time_t now = time(NULL);
+
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+    printf("%s\n", date);
+    printf("Run on %ld CPUs, TSC at %.2f GHz\n", sysconf(_SC_NPROCESSORS_ONLN), bench.tsc_ghz);
+    if (bench.perf.opened > 0) {
+        printf("Counters:");
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            if (perf_available(&bench.perf, c))
+                printf(" %s", perf_counter_name(c));
+        }
+        printf("%s\n", bench.core_cycles ? "" : " (cycles are TSC ticks)");
+    } else {
+        printf("Counters: unavailable (perf_event_open: %s); cycles are TSC ticks\n",
+               strerror(bench.perf.error));
+    }
+    printf("Per operation; %s\n", bench.fixed_iterations ? "fixed iteration count" : "iterations calibrated");
+    printf("%-44s %12s %12s %12s %6s %12s %12s %12s\n", "Benchmark", "Time (ns)", "Cycles",
+           "Instructions", "IPC", "Branch miss", "Cache miss", "Iterations");
+    for (int i = 0; i < 44 + 13 * 6 + 7; i++)
+        putchar('-');
+    putchar('\n');
+}
+
+static void write_number(FILE *out, double v, int json) {
+    if (v >= 0)
+        fprintf(out, "%.4f", v);
+    else if (json)
+        fprintf(out, "null");
+}
+
+// Every reported line, in the JSON layout of Google Benchmark's --benchmark_out
+// (plus the counters), or as CSV
+static int write_results(const char *path, const char *format, const char *executable) {
+    static const char *columns[PERF_COUNTERS] = { "cycles", "instructions", "branch_misses", "cache_misses" };
+    int json = strcmp(format, "json") == 0;
+    FILE *out = fopen(path, "w");
+
+    if (out == NULL) {
+        perror("Failed to open the output file");
+        return -1;
+    }
+    if (json) {
+        fprintf(out, "{\n  \"context\": {\n    \"executable\": \"%s\",\n    \"num_cpus\": %ld,\n"
+                "    \"tsc_ghz\": %.3f,\n    \"cycles\": \"%s\",\n    \"min_time_s\": %.3f,\n"
+                "    \"repetitions\": %d\n  },\n  \"benchmarks\": [",
+                executable, sysconf(_SC_NPROCESSORS_ONLN), bench.tsc_ghz, bench.core_cycles ? "core" : "tsc",
+                bench.min_time, bench.repetitions);
+    } else {
+        fprintf(out, "name,aggregate,iterations,repetitions,ns_per_op,cycles_per_op");
+        for (int c = PERF_INSTRUCTIONS; c < PERF_COUNTERS; c++)
+            fprintf(out, ",%s_per_op", columns[c]);
+        fprintf(out, "\n");
+    }
+
+    for (int i = 0; i < bench.result_count; i++) {
+        const struct bench_result *res = &bench.results[i];
+        if (json) {
+            fprintf(out, "%s\n    {\"name\": \"%s\", \"run_type\": \"%s\", ", i ? "," : "", res->name,
+                    res->aggregate ? "aggregate" : "iteration");
+            if (res->aggregate)
+                fprintf(out, "\"aggregate_name\": \"%s\", ", res->aggregate);
+            fprintf(out, "\"repetitions\": %d, \"iterations\": %ld, \"time_unit\": \"ns\", \"real_time\": ",
+                    res->repetitions, res->iterations);
+            write_number(out, res->ns, 1);
+            fprintf(out, ", \"cycles\": ");
+            write_number(out, res->cycles, 1);
+            for (int c = PERF_INSTRUCTIONS; c < PERF_COUNTERS; c++) {
+                fprintf(out, ", \"%s\": ", columns[c]);
+                write_number(out, res->counter[c], 1);
+            }
+            fprintf(out, "}");
+        } else {
+            fprintf(out, "\"%s\",%s,%ld,%d,", res->name, res->aggregate ? res->aggregate : "", res->iterations,
+                    res->repetitions);
+            write_number(out, res->ns, 0);
+            fprintf(out, ",");
+            write_number(out, res->cycles, 0);
+            for (int c = PERF_INSTRUCTIONS; c < PERF_COUNTERS; c++) {
+                fprintf(out, ",");
+                write_number(out, res->counter[c], 0);
+            }
+            fprintf(out, "\n");
+        }
+    }
+    if (json)
+        fprintf(out, "\n  ]\n}\n");
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+static void bench_sixrd(void) {
+    struct sixrd_config cfg;
+    struct in6_addr src, dst, delegated;
+    unsigned char buf[IPV4_HEADER_LEN + IPV6_HEADER_LEN + PAYLOAD_SIZE];
+    unsigned char *ipv6 = buf + IPV4_HEADER_LEN;  // headroom for the outer header
+    const unsigned char *inner;
+    char text[INET6_ADDRSTRLEN];
+    int delegated_len;
+
+    // RFC 5969 style domain: 2001:db8::/32, CEs in 10.0.0.0/8 -> /56 per CE
+    if (sixrd_config_init(&cfg, "2001:db8::", 32, 8, "10.0.0.1", "10.100.100.1") < 0) {
+        fprintf(stderr, "Invalid 6RD configuration\n");
+        exit(1);
+    }
+    sixrd_delegated_prefix(&cfg, cfg.ce_ipv4, &delegated, &delegated_len);
+    inet_ntop(AF_INET6, &delegated, text, sizeof(text));
+    printf("6RD CE 10.100.100.1 delegated prefix %s/%d\n", text, delegated_len);
+
+    // A packet from this CE's prefix to a host behind CE 10.1.2.3
+    src = delegated;
+    src.s6_addr[15] = 1;
+    inet_pton(AF_INET6, "2001:db8:102:300::1", &dst);
+    memset(ipv6 + IPV6_HEADER_LEN, 'A', PAYLOAD_SIZE);
+    ipv6_build_header(ipv6, &src, &dst, IPPROTO_UDP, PAYLOAD_SIZE, 64);
+
+    long outer = sixrd_encap(&cfg, ipv6, IPV6_HEADER_LEN + PAYLOAD_SIZE);
+    uint32_t endpoint = sixrd_ipv4_endpoint(&cfg, &dst);
+    inet_ntop(AF_INET, &endpoint, text, sizeof(text));
+    printf("6RD endpoint for 2001:db8:102:300::1 is %s, encapsulated length %ld\n", text, outer);
+
+    // Decap runs as the receiving CE, which sees this CE as the inner source
+    struct sixrd_config peer;
+    sixrd_config_init(&peer, "2001:db8::", 32, 8, "10.0.0.1", "10.1.2.3");
+    if (outer < 0 || sixrd_decap(&peer, buf, outer, &inner) != IPV6_HEADER_LEN + PAYLOAD_SIZE) {
+        fprintf(stderr, "6RD encap/decap round trip failed\n");
+        exit(1);
+    }
+
+    BENCH("ipv6_build_header",
+          KEEP(ipv6_build_header(ipv6, &src, &dst, IPPROTO_UDP, PAYLOAD_SIZE, 64)));
+    BENCH("ipv6_parse_header", KEEP(ipv6_parse_header(ipv6, IPV6_HEADER_LEN + PAYLOAD_SIZE)));
+    BENCH("sixrd_ipv4_endpoint",
+          dst.s6_addr[5] = (unsigned char)i_; KEEP(sixrd_ipv4_endpoint(&cfg, &dst)));
+    BENCH("ipv4_header_checksum", KEEP(ipv4_header_checksum(buf)));
+    BENCH("sixrd_encap",
+          KEEP(sixrd_encap(&cfg, ipv6, IPV6_HEADER_LEN + PAYLOAD_SIZE)));
+    BENCH("sixrd_decap", KEEP(sixrd_decap(&peer, buf, outer, &inner)));
+}
+
+static void bench_teredo(void) {
+    struct teredo_addr info = { htonl(0x41424344), TEREDO_FLAG_CONE, htons(40000), htonl(0xc0000201) };
+    struct teredo_addr decoded;
+    struct teredo_packet pkt;
+    struct in6_addr addr;
+    unsigned char plain[IPV6_HEADER_LEN + PAYLOAD_SIZE];
+    unsigned char framed[64 + sizeof(plain)];
+    unsigned char nonce[TEREDO_NONCE_LEN] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    unsigned char origin[TEREDO_ORIGIN_LEN];
+    char text[INET6_ADDRSTRLEN];
+
+    teredo_addr_encode(&info, &addr);
+    inet_ntop(AF_INET6, &addr, text, sizeof(text));
+    if (!teredo_addr_decode(&addr, &decoded) || memcmp(&decoded, &info, sizeof(info)) != 0) {
+        fprintf(stderr, "Teredo address round trip failed\n");
+        exit(1);
+    }
+    printf("Teredo address for 192.0.2.1:40000 via 65.66.67.68 is %s\n", text);
+
+    // A data packet, and the same packet behind auth + origin indication
+    ipv6_build_header(plain, &addr, &addr, 253, PAYLOAD_SIZE, 64);
+    memset(plain + IPV6_HEADER_LEN, 'A', PAYLOAD_SIZE);
+    size_t framed_len = teredo_build_auth(framed, "client", 6, "0123456789abcdef", 16, nonce, 0);
+    framed_len += teredo_build_origin(framed + framed_len, info.client_port, info.client_ipv4);
+    memcpy(framed + framed_len, plain, sizeof(plain));
+    framed_len += sizeof(plain);
+    if (teredo_parse(framed, framed_len, &pkt) < 0 || !pkt.has_origin || pkt.auth == NULL ||
+        pkt.origin_port != info.client_port || pkt.ipv6_len != sizeof(plain)) {
+        fprintf(stderr, "Teredo framing round trip failed\n");
+        exit(1);
+    }
+
+    // Random corruptions of the framed packet, to time the reject paths
+    static unsigned char mutated[MUTATED_INPUTS][sizeof(framed)];
+    size_t mutated_len[MUTATED_INPUTS];
+    long accepted = 0;
+    srand(1);
+    for (int i = 0; i < MUTATED_INPUTS; i++) {
+        memcpy(mutated[i], framed, framed_len);
+        for (int flips = rand() % 4 + 1; flips > 0; flips--)
+            mutated[i][rand() % framed_len] = (unsigned char)rand();
+        mutated_len[i] = (size_t)(rand() % (int)framed_len + 1);
+        accepted += teredo_parse(mutated[i], mutated_len[i], &pkt) == 0;
+    }
+    printf("Teredo parser accepted %ld of %d mutated inputs\n", accepted, MUTATED_INPUTS);
+
+    BENCH("teredo_addr_encode",
+          info.client_port = (uint16_t)i_; teredo_addr_encode(&info, &addr); KEEP(addr.s6_addr[11]));
+    BENCH("teredo_addr_decode", KEEP(teredo_addr_decode(&addr, &decoded)); KEEP(decoded.client_port));
+    BENCH("teredo_parse (plain)", KEEP(teredo_parse(plain, sizeof(plain), &pkt)));
+    BENCH("teredo_parse (auth+origin)", KEEP(teredo_parse(framed, framed_len, &pkt)));
+    BENCH("teredo_parse (mutated)",
+          KEEP(teredo_parse(mutated[i_ & (MUTATED_INPUTS - 1)], mutated_len[i_ & (MUTATED_INPUTS - 1)], &pkt)));
+
+    // What the server adds to and checks on every relayed packet
+    teredo_parse(framed, framed_len, &pkt);
+    BENCH("teredo_build_origin",
+          KEEP(teredo_build_origin(origin, (uint16_t)i_, info.client_ipv4)); KEEP(origin[2]));
+    BENCH("teredo_is_bubble", KEEP(teredo_is_bubble(&pkt)));
+}
+
+static void bench_flow(void) {
+    struct route_table routes;
+    struct sockaddr_in hop = { .sin_family = AF_INET, .sin_port = htons(8002) };
+    struct flow_key key = { 0, htonl(0x7f000001), 0, htons(8001), IPPROTO_UDP };
+
+    route_init(&routes, &hop);
+    route_add(&routes, "10.0.0.0/8=127.0.0.1:9002");
+    struct flow_table *t = flow_table_create(BENCH_FLOWS, FLOW_DEFAULT_IDLE_TIMEOUT, FLOW_KEY_5TUPLE, &routes);
+    if (t == NULL) {
+        fprintf(stderr, "Flow table allocation failed\n");
+        exit(1);
+    }
+
+    // Fill the table with a million distinct 5-tuples
+    uint32_t now = flow_now();
+    long start = now_ns();
+    for (uint32_t i = 0; i < BENCH_FLOWS; i++) {
+        key.src_ip = htonl(0x0a000000 | (i >> 6));
+        key.src_port = htons((uint16_t)(1024 + (i & 63)));
+        flow_lookup(t, &key, now);
+    }
+    double insert_ns = (double)(now_ns() - start) / BENCH_FLOWS;
+    printf("Flow table: %u flows in %zu MB (%.1f B/flow), %.2f ns/insert, %lu uncached\n",
+           t->count, t->bytes >> 20, (double)t->bytes / t->count, insert_ns, t->stats.insert_failed);
+
+    // Hits spread over the whole table, and one hot flow
+    BENCH("flow_lookup (1M flows, spread)",
+          uint32_t f_ = (uint32_t)(i_ * 2654435761u) % BENCH_FLOWS;
+          key.src_ip = htonl(0x0a000000 | (f_ >> 6));
+          key.src_port = htons((uint16_t)(1024 + (f_ & 63)));
+          struct flow_entry *e_ = flow_lookup(t, &key, now);
+          flow_account(e_, 64); KEEP(flow_next_hop(t, e_, key.src_ip)));
+    BENCH("flow_lookup (hot flow)",
+          struct flow_entry *e_ = flow_lookup(t, &key, now);
+          flow_account(e_, 64); KEEP(flow_next_hop(t, e_, key.src_ip)));
+
+    // Everything idle: sweep the whole table
+    start = now_ns();
+    long evicted = 0;
+    while (t->count > 0)
+        evicted += flow_expire(t, now + FLOW_DEFAULT_IDLE_TIMEOUT + 1, FLOW_EXPIRE_BUDGET);
+    printf("Flow table: expired %ld idle flows in %.1f ms, %u left\n",
+           evicted, (now_ns() - start) / 1e6, t->count);
+    flow_table_destroy(t);
+}
+
+static void bench_pool(void) {
+    uint32_t counts[POOL_CLASSES] = { 4 * POOL_CACHE_BATCH, 4 * POOL_CACHE_BATCH, 4 * POOL_CACHE_BATCH };
+    struct pool *pool = pool_create(counts);
+    struct pool_cache *cache = pool != NULL ? pool_cache_create(pool, "bench") : NULL;
+    struct pbuf *held[2 * POOL_CACHE_BATCH];
+
+    if (cache == NULL) {
+        fprintf(stderr, "Pool allocation failed\n");
+        exit(1);
+    }
+
+    // Steady state: the cache satisfies everything
+    BENCH("pbuf_alloc+free (64 B)",
+          struct pbuf *b_ = pbuf_alloc(cache, PAYLOAD_SIZE); KEEP(b_); pbuf_free(cache, b_));
+    BENCH("pbuf_alloc+free (9000 B)",
+          struct pbuf *b_ = pbuf_alloc(cache, 9000); KEEP(b_); pbuf_free(cache, b_));
+
+    // Bursts larger than the cache go to the shared lists every batch
+    BENCH_SCALED("pbuf_alloc+free (burst of 64)", 64,
+          for (int j_ = 0; j_ < 2 * POOL_CACHE_BATCH; j_++) held[j_] = pbuf_alloc(cache, PAYLOAD_SIZE);
+          for (int j_ = 0; j_ < 2 * POOL_CACHE_BATCH; j_++) pbuf_free(cache, held[j_]));
+
+    // Prepending and stripping an outer header is a pointer move
+    struct pbuf *buf = pbuf_alloc(cache, PAYLOAD_SIZE);
+    buf->len = PAYLOAD_SIZE;
+    BENCH("pbuf_push+pull (IPv4+UDP)",
+          KEEP(pbuf_push(buf, 28)); KEEP(pbuf_pull(buf, 28)));
+    pbuf_free(cache, buf);
+    pool_destroy(pool);
+}
+
+static void bench_frag(void) {
+    static unsigned char pkt[FRAG_PACKET_SIZE], frags[FRAG_MAX][FRAG_MTU];
+    struct frag_cache *c = frag_cache_create(FRAG_DEFAULT_PACKETS, FRAG_PACKET_SIZE, FRAG_DEFAULT_TIMEOUT_MS);
+    struct in6_addr src, dst;
+    const unsigned char *out = NULL;
+    size_t lens[FRAG_MAX];
+    long len = 0;
+
+    if (c == NULL) {
+        fprintf(stderr, "Reassembly cache allocation failed\n");
+        exit(1);
+    }
+    inet_pton(AF_INET6, "2001:db8::1", &src);
+    inet_pton(AF_INET6, "2001:db8::2", &dst);
+    for (int i = IPV6_HEADER_LEN; i < FRAG_PACKET_SIZE; i++)
+        pkt[i] = (unsigned char)i;
+    ipv6_build_header(pkt, &src, &dst, IPV6_NEXT_NONE, FRAG_PACKET_SIZE - IPV6_HEADER_LEN, 64);
+
+    // Round trip, last fragment first
+    int count = frag_split(pkt, sizeof(pkt), FRAG_MTU, frag_next_id(), frags[0], FRAG_MTU, lens, FRAG_MAX);
+    for (int k = count - 1; k >= 0; k--)
+        len = frag_reassemble(c, frags[k], lens[k], 0, &out);
+    if (count <= 0 || len != FRAG_PACKET_SIZE || memcmp(out, pkt, FRAG_PACKET_SIZE) != 0) {
+        fprintf(stderr, "Fragmentation round trip failed\n");
+        exit(1);
+    }
+    printf("IPv6 fragmentation: %d B packet in %d fragments at MTU %d\n", FRAG_PACKET_SIZE, count, FRAG_MTU);
+
+    // Per packet, so mostly the cost of copying 9 KB twice
+    BENCH_SCALED("frag_split (9000 B)", 64,
+          KEEP(frag_split(pkt, sizeof(pkt), FRAG_MTU, (uint32_t)i_, frags[0], FRAG_MTU, lens, FRAG_MAX)));
+    BENCH_SCALED("frag_reassemble (9000 B)", 64,
+          uint32_t id_ = htonl((uint32_t)i_);
+          for (int k_ = 0; k_ < count; k_++) {
+              memcpy(frags[k_] + IPV6_HEADER_LEN + 4, &id_, sizeof(id_));
+              KEEP(frag_reassemble(c, frags[k_], lens[k_], 0, &out));
+          });
+    BENCH("frag_reassemble (not a fragment)",
+          KEEP(frag_reassemble(c, pkt, sizeof(pkt), 0, &out)));
+
+    struct frag_stats stats;
+    frag_cache_stats(c, &stats);
+    printf("Reassembly: %lu packets reassembled, %lu evicted, %lu invalid\n", stats.reassembled,
+           stats.evicted, stats.invalid);
+    frag_cache_destroy(c);
+}
+
+// Teredo address of client i of server 192.0.2.1, each behind its own mapping
+static void peer_addr(uint32_t i, struct in6_addr *addr) {
+    struct teredo_addr info = { htonl(0xc0000201), 0, htons((uint16_t)(1024 + (i & 0x3fff))),
+                                htonl(0x0a000000 | (i >> 14)) };
+    teredo_addr_encode(&info, addr);
+}
+
+static void bench_peer(void) {
+    static const uint32_t sizes[PEER_SIZES] = { 1000, 100000, PEER_DEFAULT_MAX };
+    struct peer_info info;
+    struct in6_addr addr;
+
+    // The same lookups at 1k, 100k and 512k cached peers: the per-packet
+    // cost should not grow with the client count beyond cache misses
+    for (int s = 0; s < PEER_SIZES; s++) {
+        uint32_t n = sizes[s], now = peer_now();
+        struct peer_cache *c = peer_cache_create(n, PEER_DEFAULT_TIMEOUT);
+        struct in6_addr *addrs = malloc(MUTATED_INPUTS * sizeof(*addrs));
+        struct peer_stats stats;
+        char name[48];
+
+        if (c == NULL || addrs == NULL) {
+            fprintf(stderr, "Peer cache allocation failed\n");
+            exit(1);
+        }
+        long start = now_ns();
+        for (uint32_t i = 0; i < n; i++) {
+            peer_addr(i, &addr);
+            peer_update(c, &addr, PEER_QUALIFIED, 0, now);
+        }
+        double insert_ns = (double)(now_ns() - start) / n;
+        peer_cache_stats(c, &stats);
+        printf("Peer cache: %u peers in %zu MB (%.1f B/peer), %.2f ns/insert, %lu evicted\n",
+               stats.peers, stats.bytes >> 20, (double)stats.bytes / stats.peers, insert_ns, stats.evicted);
+
+        // Random cached peers, as a server sees them: look up and refresh
+        for (uint32_t i = 0; i < MUTATED_INPUTS; i++)
+            peer_addr((uint32_t)(i * 2654435761u) % n, &addrs[i]);
+        snprintf(name, sizeof(name), "peer_lookup+touch (%uk peers)", n / 1000);
+        BENCH(name,
+              uint32_t slot_ = peer_lookup(c, &addrs[i_ & (MUTATED_INPUTS - 1)], &info);
+              if (slot_ != PEER_NONE) peer_touch(c, slot_, now); KEEP(slot_));
+        snprintf(name, sizeof(name), "peer_lookup miss (%uk peers)", n / 1000);
+        peer_addr(n, &addr);
+        BENCH(name, KEEP(peer_lookup(c, &addr, &info)));
+
+        // Everything idle: one wheel pass past the timeout forgets them all
+        start = now_ns();
+        int expired = peer_expire(c, now + PEER_DEFAULT_TIMEOUT + 1);
+        peer_cache_stats(c, &stats);
+        printf("Peer cache: expired %d idle peers in %.1f ms, %u left\n",
+               expired, (now_ns() - start) / 1e6, stats.peers);
+        free(addrs);
+        peer_cache_destroy(c);
+    }
+}
+
+// The wire header and timestamps, on every datagram a relay or the
+// receiver handles
+static void bench_packet(void) {
+    static struct packet pkt;
+    uint64_t ns = packet_now_ns();
+    int length = PAYLOAD_SIZE;
+
+    memset(pkt.data, 'A', sizeof(pkt.data));
+    packet_set_header(&pkt, length, PKT_TYPE_IPV6);
+    packet_stamp(&pkt, ns);
+
+    BENCH("packet_set_header+validate",
+          packet_set_header(&pkt, length, PKT_TYPE_IPV6);
+          KEEP(packet_validate(&pkt, (long)sizeof(struct wire_header) + length)));
+    BENCH("packet_stamp", packet_stamp(&pkt, ns + (uint64_t)i_); KEEP(pkt.hdr.flags));
+    BENCH("packet_timestamp", KEEP(packet_timestamp(&pkt, length)));
+    BENCH("packet_now_ns (CLOCK_REALTIME)", KEEP(packet_now_ns()));
+    BENCH("flow_now (CLOCK_MONOTONIC_COARSE)", KEEP(flow_now()));
+}
+
+// Address conversions done per packet when the per-packet log is on, and
+// on the capture and benchmark paths
+static void bench_addr(void) {
+    struct in_addr v4 = { htonl(0xc0a80101) };
+    struct in6_addr v6;
+    char text[INET6_ADDRSTRLEN];
+    static const char *v4_text[] = { "127.0.0.1", "192.168.1.1", "10.100.100.1", "203.0.113.254" };
+
+    inet_pton(AF_INET6, "2001:0:4136:e378:8000:63bf:3fff:fdd2", &v6);
+    BENCH("inet_ntop (IPv4)",
+          v4.s_addr ^= (in_addr_t)i_; KEEP(inet_ntop(AF_INET, &v4, text, sizeof(text))));
+    BENCH("inet_ntop (IPv6)",
+          v6.s6_addr[15] = (unsigned char)i_; KEEP(inet_ntop(AF_INET6, &v6, text, sizeof(text))));
+    BENCH("inet_addr", KEEP(inet_addr(v4_text[i_ & 3])));
+    BENCH("inet_pton (IPv4)", KEEP(inet_pton(AF_INET, v4_text[i_ & 3], &v4)); KEEP(v4.s_addr));
+    BENCH("inet_pton (IPv6)",
+          KEEP(inet_pton(AF_INET6, "2001:0:4136:e378:8000:63bf:3fff:fdd2", &v6)); KEEP(v6.s6_addr[15]));
+}
+
+// Checksums with each kernel the CPU has, then the batch forms and the
+// incremental update
+static void bench_checksum(void) {
+    static const size_t sizes[] = { 20, 64, 1500, 9000 };
+    static unsigned char data[CHECKSUM_BATCH * 1500];
+    static unsigned char headers[CHECKSUM_BATCH][64];
+    const unsigned char *pkts[CHECKSUM_BATCH];
+    size_t lens[CHECKSUM_BATCH];
+    struct iovec iov[CHECKSUM_BATCH];
+    uint16_t sums[CHECKSUM_BATCH];
+    uint8_t header_len[CHECKSUM_BATCH];
+    enum csum_impl best = csum_get_impl();
+    struct in6_addr src, dst;
+    char name[48];
+
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (unsigned char)(i * 7);
+    for (int impl = CSUM_SCALAR; impl <= CSUM_AVX2; impl++) {
+        if (csum_set_impl(impl) < 0)
+            continue;
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            size_t len = sizes[s];
+            snprintf(name, sizeof(name), "inet_checksum (%zu B, %s)", len, csum_impl_name(impl));
+            BENCH(name, KEEP(inet_checksum(data, len)));
+        }
+
+        // A recvmmsg batch of 1500 B datagrams
+        for (int i = 0; i < CHECKSUM_BATCH; i++) {
+            iov[i].iov_base = data + i * 1500;
+            iov[i].iov_len = 1500;
+        }
+        snprintf(name, sizeof(name), "inet_checksum_batch (32x1500 B, %s)", csum_impl_name(impl));
+        BENCH_SCALED(name, CHECKSUM_BATCH, inet_checksum_batch(iov, CHECKSUM_BATCH, sums); KEEP(sums[0]));
+
+        // Captured 6RD frames: outer IPv4 headers one by one, then at once
+        for (int i = 0; i < CHECKSUM_BATCH; i++) {
+            unsigned char *h = headers[i];
+            memset(h, 0, sizeof(headers[i]));
+            h[0] = 0x45;
+            h[3] = sizeof(headers[i]);
+            h[8] = 64;
+            h[9] = 41;
+            memcpy(h + 12, &(uint32_t){ htonl(0x0a000001u + (uint32_t)i) }, 4);
+            memcpy(h + 16, &(uint32_t){ htonl(0x0a640001u) }, 4);
+            uint16_t check = ipv4_header_checksum(h);
+            memcpy(h + 10, &check, 2);
+            pkts[i] = h;
+            lens[i] = sizeof(headers[i]);
+        }
+        snprintf(name, sizeof(name), "ipv4_header_valid_batch (32, %s)", csum_impl_name(impl));
+        BENCH_SCALED(name, CHECKSUM_BATCH,
+                     ipv4_header_valid_batch(pkts, lens, CHECKSUM_BATCH, header_len); KEEP(header_len[0]));
+    }
+    csum_set_impl(best);
+    printf("Checksum kernels: %s\n", csum_impl_name(best));
+
+    BENCH("ipv4_header_valid", KEEP(ipv4_header_valid(pkts[i_ & (CHECKSUM_BATCH - 1)], lens[0])));
+
+    // Rewriting an address: patch the checksum, or sum the header again
+    unsigned char *h = headers[0];
+    uint16_t check;
+    memcpy(&check, h + 10, 2);
+    BENCH("csum_replace4 (IPv4 address)",
+          uint32_t old_; uint32_t new_ = (uint32_t)i_; memcpy(&old_, h + 16, 4); memcpy(h + 16, &new_, 4);
+          check = csum_replace4(check, old_, new_); KEEP(check));
+    memcpy(h + 10, &check, 2);
+    if (ipv4_header_checksum(h) != 0) {
+        fprintf(stderr, "Incremental checksum update failed\n");
+        exit(1);
+    }
+    BENCH("ipv4_header_checksum (IPv4 address)",
+          uint32_t new_ = (uint32_t)i_; memcpy(h + 16, &new_, 4); memset(h + 10, 0, 2);
+          check = ipv4_header_checksum(h); memcpy(h + 10, &check, 2); KEEP(check));
+
+    // An echo request as the Teredo server sees one
+    inet_pton(AF_INET6, "2001:0:4136:e378:8000:63bf:3fff:fdd2", &src);
+    inet_pton(AF_INET6, "2001:0:4136:e378:8000:63bf:3fff:fdd3", &dst);
+    ipv6_build_header(data, &src, &dst, IPV6_NEXT_ICMPV6, PAYLOAD_SIZE, 64);
+    BENCH("icmpv6_checksum (64 B)", KEEP(icmpv6_checksum(data, IPV6_HEADER_LEN + PAYLOAD_SIZE)));
+}
+
+// What every forwarded packet costs the metrics and the log
+static void bench_metrics(void) {
+    static struct hist h;
+    struct log_stats *stats = log_register("bench");
+    struct metrics_stream *stream;
+
+    hist_reset(&h);
+    BENCH("hist_record", hist_record(&h, (uint64_t)(i_ & 0xfffff)); KEEP(h.count));
+    if (stats == NULL) {
+        fprintf(stderr, "Log stats registration failed\n");
+        exit(1);
+    }
+    BENCH("log_packet", log_packet(stats, PAYLOAD_SIZE, i_ & 0x3ff));
+
+    // The writer thread drains the ring into /dev/null; on few CPUs it runs
+    // less often than the producer, so some records are dropped
+    if (metrics_start() < 0 || (stream = metrics_open("/dev/null")) == NULL) {
+        fprintf(stderr, "Metrics stream setup failed\n");
+        exit(1);
+    }
+    int reported = bench.result_count;
+    BENCH("metrics_record", metrics_record(stream, (int)i_, PAYLOAD_SIZE, 12345, 67890));
+    if (bench.result_count > reported)
+        printf("Metrics: %lu records dropped on a full ring\n", metrics_dropped(stream));
+    metrics_stop();
+}
+
+// The fused 6RD -> Teredo hop: one ring slot per packet, as in hybrid.c
+static void bench_ring(void) {
+    struct fused_entry {
+        void *buf;
+        struct sockaddr_in client;
+        uint64_t enqueue_ns;
+    } entry = { 0 }, burst[RING_BENCH_BURST];
+    struct spsc_ring ring;
+
+    if (spsc_ring_init(&ring, RING_BENCH_SIZE, sizeof(entry)) < 0) {
+        fprintf(stderr, "Ring allocation failed\n");
+        exit(1);
+    }
+    memset(burst, 0, sizeof(burst));
+    BENCH("spsc_ring_push+pop",
+          entry.enqueue_ns = (uint64_t)i_; spsc_ring_push(&ring, &entry);
+          KEEP(spsc_ring_pop(&ring, &entry)));
+    BENCH_SCALED("spsc_ring push+pop (burst of 32)", RING_BENCH_BURST,
+                 KEEP(spsc_ring_push_burst(&ring, burst, RING_BENCH_BURST));
+                 KEEP(spsc_ring_pop_burst(&ring, burst, RING_BENCH_BURST)));
+    spsc_ring_free(&ring);
+}
+
+// The path choice made for every packet the path sender sends
+static void bench_path(void) {
+    struct path_selector s;
+    struct path_flow flows[PATH_BENCH_FLOWS];
+    struct in6_addr dst;
+
+    path_selector_init(&s, PATH_POLICY_HYBRID);
+    inet_pton(AF_INET6, "2001:db8:1::2", &dst);
+    for (int f = 0; f < PATH_BENCH_FLOWS; f++) {
+        dst.s6_addr[15] = (unsigned char)f;
+        path_flow_init(&flows[f], &dst);
+    }
+    BENCH("path_select (cached)", KEEP(path_select(&s, &flows[i_ & (PATH_BENCH_FLOWS - 1)])));
+    // Every call after a verdict change, the slow path
+    BENCH("path_decide", KEEP(path_decide(&s, &flows[i_ & (PATH_BENCH_FLOWS - 1)])));
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-f regex] [-t min seconds] [-r repetitions] [-n iterations] [-o file] [-F json|csv] [-l] "
+           "[iterations]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *out_path = NULL, *out_format = "json";
+    int opt;
+
+    bench.min_time = DEFAULT_MIN_TIME;
+    bench.repetitions = 1;
+    while ((opt = getopt(argc, argv, "f:t:r:n:o:F:l")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (regcomp(&bench.filter, optarg, REG_EXTENDED | REG_NOSUB) != 0) {
+                fprintf(stderr, "Invalid filter: %s\n", optarg);
+                return 1;
+            }
+            bench.filtered = 1;
+            break;
+        case 't':
+            bench.min_time = atof(optarg);
+            break;
+        case 'r':
+            bench.repetitions = atoi(optarg);
+            break;
+        case 'n':
+            bench.fixed_iterations = atol(optarg);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'F':
+            out_format = optarg;
+            break;
+        case 'l':
+            bench.list = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    // A bare count, as before the options existed
+    if (optind < argc)
+        bench.fixed_iterations = atol(argv[optind]);
+    if (bench.min_time <= 0 || bench.repetitions < 1 || bench.repetitions > MAX_REPETITIONS ||
+        bench.fixed_iterations < 0 || (strcmp(out_format, "json") != 0 && strcmp(out_format, "csv") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!bench.list) {
+        perf_open(&bench.perf);
+        bench.core_cycles = perf_available(&bench.perf, PERF_CYCLES);
+        bench.tsc_ghz = perf_tsc_ghz();
+        print_context();
+    }
+    bench_packet();
+    bench_addr();
+    bench_checksum();
+    bench_sixrd();
+    bench_teredo();
+    bench_path();
+    bench_flow();
+    bench_pool();
+    bench_ring();
+    bench_frag();
+    bench_peer();
+    bench_metrics();
+    perf_close(&bench.perf);
+
+    if (out_path != NULL && !bench.list) {
+        if (write_results(out_path, out_format, argv[0]) < 0)
+            return 1;
+        printf("Wrote %d results to %s\n", bench.result_count, out_path);
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+// packet.h - wire format shared by the sender, relays and receiver
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+#define BUFFER_SIZE 9000
+
+#define PKT_TYPE_IPV4 0
+#define PKT_TYPE_IPV6 1
+
+// Header flags
+#define PKT_FLAG_TIMESTAMP 0x01       // payload starts with the sender's send time
+#define PKT_FLAG_TIMESTAMP_TAIL 0x02  // payload ends with the sender's send time
+#define PKT_FLAG_PROBE 0x04           // payload is a path probe for the receiver to echo (path.h)
+
+#define PKT_TIMESTAMP_LEN 8
+
+// Compact header that precedes every payload on the wire. Multi-byte
+// fields are in network byte order.
+struct wire_header {
+    uint16_t length;  // payload bytes that follow the header
+    uint8_t type;     // PKT_TYPE_IPV4 or PKT_TYPE_IPV6
+    uint8_t flags;    // PKT_FLAG_*
+} __attribute__((packed));
+
+// Receive/transmit buffer: the header followed by room for the largest
+// payload. Only packet_wire_len() bytes of it are ever put on the wire.
+struct packet {
+    struct wire_header hdr;
+    char data[BUFFER_SIZE];
+};
+
+// Fill in the header for a payload already placed in pkt->data
+static inline void packet_set_header(struct packet *pkt, int length, int type) {
+    pkt->hdr.length = htons((uint16_t)length);
+    pkt->hdr.type = (uint8_t)type;
+    pkt->hdr.flags = 0;
+}
+
+static inline int packet_payload_len(const struct packet *pkt) {
+    return ntohs(pkt->hdr.length);
+}
+
+// Number of bytes to hand to sendto() for this packet
+static inline int packet_wire_len(const struct packet *pkt) {
+    return (int)sizeof(struct wire_header) + packet_payload_len(pkt);
+}
+
+// Wall-clock time in nanoseconds. CLOCK_REALTIME, so that it can be
+// compared with SO_TIMESTAMPNS receive timestamps and across processes.
+static inline uint64_t packet_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Stamp the send time into the first payload bytes, big-endian. Payloads
+// shorter than PKT_TIMESTAMP_LEN are left unstamped.
+static inline void packet_stamp(struct packet *pkt, uint64_t ns) {
+    if (packet_payload_len(pkt) < PKT_TIMESTAMP_LEN)
+        return;
+    uint64_t be = htobe64(ns);
+    memcpy(pkt->data, &be, sizeof(be));
+    pkt->hdr.flags |= PKT_FLAG_TIMESTAMP;
+}
+
+// Stamp it into the last payload bytes instead, for a payload that starts
+// with a header of its own (an IPv6 packet that may be fragmented on the
+// way; the stamp then travels in the last fragment)
+static inline void packet_stamp_tail(struct packet *pkt, uint64_t ns) {
+    int length = packet_payload_len(pkt);
+    if (length < PKT_TIMESTAMP_LEN)
+        return;
+    uint64_t be = htobe64(ns);
+    memcpy(pkt->data + length - PKT_TIMESTAMP_LEN, &be, sizeof(be));
+    pkt->hdr.flags |= PKT_FLAG_TIMESTAMP_TAIL;
+}
+
+// Sender's send time of a validated packet, or 0 if it is not stamped
+static inline uint64_t packet_timestamp(const struct packet *pkt, int length) {
+    uint64_t be;
+    if (length < PKT_TIMESTAMP_LEN)
+        return 0;
+    if (pkt->hdr.flags & PKT_FLAG_TIMESTAMP)
+        memcpy(&be, pkt->data, sizeof(be));
+    else if (pkt->hdr.flags & PKT_FLAG_TIMESTAMP_TAIL)
+        memcpy(&be, pkt->data + length - PKT_TIMESTAMP_LEN, sizeof(be));
+    else
+        return 0;
+    return be64toh(be);
+}
+
+// Check a datagram of n bytes received into pkt. Returns the payload
+// length, or -1 if the datagram is truncated or its header lies about
+// the payload size.
+static inline int packet_validate(const struct packet *pkt, long n) {
+    if (n < (long)sizeof(struct wire_header))
+        return -1;
+    int length = packet_payload_len(pkt);
+    if (length > BUFFER_SIZE || n != (long)sizeof(struct wire_header) + length)
+        return -1;
+    return length;
+}
+
+#endif
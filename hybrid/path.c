@@ -0,0 +1,175 @@
+// path.c - probe measurements and the per-flow 6RD/Teredo choice
+#include <string.h>
+
+#include "path.h"
+#include "teredo.h"
+
+static const char *path_names[PATH_COUNT] = { "6RD", "Teredo" };
+
+const char *path_name(int path) {
+    return path >= 0 && path < PATH_COUNT ? path_names[path] : "?";
+}
+
+void path_selector_init(struct path_selector *s, enum path_policy policy) {
+    memset(s, 0, sizeof(*s));
+    s->policy = policy;
+    s->generation = 1;
+    // Both paths start out usable, so flows take their preferred path
+    // straight away; a dead one is found out within PATH_DOWN_PROBES probes
+    for (int p = 0; p < PATH_COUNT; p++) {
+        s->paths[p].up = 1;
+        s->paths[p].usable = 1;
+    }
+}
+
+void path_flow_init(struct path_flow *f, const struct in6_addr *dst) {
+    struct teredo_addr mapped;
+
+    memset(f, 0, sizeof(*f));
+    f->dst = *dst;
+    f->preferred = teredo_addr_decode(dst, &mapped) ? PATH_TEREDO : PATH_6RD;
+    f->path = f->preferred;
+}
+
+int path_decide(struct path_selector *s, struct path_flow *f) {
+    int path = f->preferred;
+
+    if (s->policy == PATH_POLICY_6RD) {
+        path = PATH_6RD;
+    } else if (s->policy == PATH_POLICY_TEREDO) {
+        path = PATH_TEREDO;
+    } else if (!s->paths[path].usable) {
+        int fallback = path == PATH_6RD ? PATH_TEREDO : PATH_6RD;
+        if (s->paths[fallback].usable)
+            path = fallback;
+    }
+
+    if (path != f->path && f->generation != 0) {
+        f->switches++;
+        s->switches++;
+    }
+    f->path = (uint8_t)path;
+    f->generation = s->generation;
+    return path;
+}
+
+static uint64_t path_rto(const struct path_state *p) {
+    uint64_t rto = (uint64_t)p->srtt_us + 4ULL * p->rttvar_us;
+    return rto > PATH_RTO_MIN_US ? rto : PATH_RTO_MIN_US;
+}
+
+// Fold one probe outcome into the loss rate and the up/down runs
+static void path_outcome(struct path_state *p, int lost, uint64_t sent_us) {
+    p->loss += ((lost ? 1.0 : 0.0) - p->loss) / PATH_LOSS_WEIGHT;
+    if (lost) {
+        if (p->lost_run++ == 0)
+            p->first_lost_us = sent_us;
+        p->answered_run = 0;
+        p->probes_lost++;
+        if (p->lost_run >= PATH_DOWN_PROBES)
+            p->up = 0;
+    } else {
+        p->answered_run++;
+        p->lost_run = 0;
+        p->probes_answered++;
+        if (p->answered_run >= PATH_UP_PROBES)
+            p->up = 1;
+    }
+
+    if (p->loss > PATH_LOSS_DEGRADED)
+        p->degraded = 1;
+    else if (p->loss < PATH_LOSS_RECOVERED)
+        p->degraded = 0;
+}
+
+uint32_t path_probe_sent(struct path_selector *s, int path, uint64_t now_us) {
+    struct path_state *p = &s->paths[path];
+
+    // A full window settles its oldest probe without waiting for the RTO
+    if (p->next_seq - p->oldest_seq == PATH_INFLIGHT) {
+        uint32_t slot = p->oldest_seq++ % PATH_INFLIGHT;
+        path_outcome(p, !p->answered[slot], p->sent_us[slot]);
+    }
+    uint32_t seq = p->next_seq++;
+    p->sent_us[seq % PATH_INFLIGHT] = now_us;
+    p->answered[seq % PATH_INFLIGHT] = 0;
+    p->probes_sent++;
+    return seq;
+}
+
+void path_probe_answered(struct path_selector *s, int path, uint32_t seq, uint64_t now_us) {
+    if (path < 0 || path >= PATH_COUNT)
+        return;
+    struct path_state *p = &s->paths[path];
+
+    // Only probes still in the window whose outcome is open
+    if (seq - p->oldest_seq >= p->next_seq - p->oldest_seq) {
+        p->late++;
+        return;
+    }
+    if (p->answered[seq % PATH_INFLIGHT])
+        return;
+    p->answered[seq % PATH_INFLIGHT] = 1;
+
+    // RFC 6298 section 2: alpha 1/8, beta 1/4
+    uint64_t sent = p->sent_us[seq % PATH_INFLIGHT];
+    uint32_t rtt = now_us > sent ? (uint32_t)(now_us - sent) : 1;
+    if (p->srtt_us == 0) {
+        p->srtt_us = rtt;
+        p->rttvar_us = rtt / 2;
+    } else {
+        uint32_t delta = p->srtt_us > rtt ? p->srtt_us - rtt : rtt - p->srtt_us;
+        p->rttvar_us = (3 * p->rttvar_us + delta) / 4;
+        p->srtt_us = (7 * p->srtt_us + rtt) / 8;
+    }
+}
+
+int path_update(struct path_selector *s, uint64_t now_us) {
+    for (int i = 0; i < PATH_COUNT; i++) {
+        struct path_state *p = &s->paths[i];
+        uint64_t rto = path_rto(p);
+
+        while (p->oldest_seq != p->next_seq) {
+            uint32_t slot = p->oldest_seq % PATH_INFLIGHT;
+            if (p->answered[slot]) {
+                path_outcome(p, 0, p->sent_us[slot]);
+            } else if (now_us - p->sent_us[slot] > rto) {
+                path_outcome(p, 1, p->sent_us[slot]);
+            } else {
+                break;
+            }
+            p->oldest_seq++;
+        }
+    }
+
+    // RTT verdicts compare the paths, so they wait until both have answered
+    for (int i = 0; i < PATH_COUNT; i++) {
+        struct path_state *p = &s->paths[i];
+        const struct path_state *other = &s->paths[i == PATH_6RD ? PATH_TEREDO : PATH_6RD];
+        if (p->srtt_us == 0 || other->srtt_us == 0 || !other->up) {
+            p->slow = 0;
+            continue;
+        }
+        uint64_t limit = (uint64_t)PATH_RTT_FACTOR * other->srtt_us;
+        if (p->srtt_us > limit + PATH_RTT_MARGIN_US)
+            p->slow = 1;
+        else if (p->srtt_us < limit + PATH_RTT_MARGIN_US / 2)
+            p->slow = 0;
+    }
+
+    int changed = 0;
+    for (int i = 0; i < PATH_COUNT; i++) {
+        struct path_state *p = &s->paths[i];
+        int usable = p->up && !p->degraded && !p->slow;
+        if (usable != p->usable) {
+            p->usable = usable;
+            p->changed_us = now_us;
+            changed++;
+        }
+    }
+    if (changed > 0) {
+        s->generation++;
+        s->changes += changed;
+    }
+    return changed;
+}
@@ -0,0 +1,142 @@
+// path.h - per-flow choice between the 6RD and Teredo paths
+//
+// A host with both a 6RD delegation from its ISP and a Teredo address can
+// reach an IPv6 destination over either tunnel. Each flow is classified
+// once by its destination: a Teredo peer (2001::/32) is best reached over
+// Teredo, where the bubbles open the NATs on the way; anything else over
+// 6RD, the native path. The other tunnel is the flow's fallback.
+//
+// Both paths are measured continuously with probes sent through them and
+// echoed straight back by the far end: a smoothed RTT and RTT variance
+// (RFC 6298), and a loss rate, an EWMA of probe outcomes. A probe counts as
+// lost once it has been out longer than the RTO. A path is usable unless
+//   - PATH_DOWN_PROBES probes in a row were lost (it comes back after
+//     PATH_UP_PROBES answered in a row),
+//   - its loss rate is over PATH_LOSS_DEGRADED (until it falls below
+//     PATH_LOSS_RECOVERED), or
+//   - its RTT is more than PATH_RTT_FACTOR times the other path's plus
+//     PATH_RTT_MARGIN_US (until it is back within half the margin).
+// The gaps between the enter and leave thresholds keep a path that is on
+// the edge from flapping.
+//
+// The verdicts change at probe rate, not packet rate. Every change bumps
+// the selector's generation. A flow caches the path it was given and the
+// generation it was decided in, so the per-packet cost is one compare; it
+// is decided again only after a verdict changed: its preferred path if
+// usable, else the fallback if usable, else the preferred path anyway.
+//
+// A selector belongs to one thread; nothing here is locked. Times are in
+// microseconds of any monotonic clock.
+#ifndef PATH_H
+#define PATH_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define PATH_PROBE_INTERVAL_US 10000  // probes per path, 100 a second
+#define PATH_RTO_MIN_US 20000         // a probe is lost after max(this, srtt + 4 * rttvar)
+#define PATH_INFLIGHT 64              // probes tracked per path, a power of two
+#define PATH_DOWN_PROBES 3
+#define PATH_UP_PROBES 3
+#define PATH_LOSS_WEIGHT 16           // loss EWMA takes 1/16 of each outcome
+#define PATH_LOSS_DEGRADED 0.10
+#define PATH_LOSS_RECOVERED 0.05
+#define PATH_RTT_FACTOR 2
+#define PATH_RTT_MARGIN_US 1000
+
+#define PATH_PROBE_MAGIC 0x50524f42  // "PROB"
+
+enum path_id {
+    PATH_6RD,
+    PATH_TEREDO,
+    PATH_COUNT,
+};
+
+enum path_policy {
+    PATH_POLICY_HYBRID,  // per flow, from the measurements
+    PATH_POLICY_6RD,     // every flow over 6RD
+    PATH_POLICY_TEREDO,  // every flow over Teredo
+};
+
+// A probe as it goes out and comes back. The far end echoes it to
+// reply_ipv4:reply_port. Multi-byte fields are in network byte order.
+struct path_probe {
+    uint32_t magic;
+    uint8_t path;         // enum path_id
+    uint8_t pad;
+    uint16_t reply_port;
+    uint32_t reply_ipv4;
+    uint32_t seq;
+} __attribute__((packed));
+
+// Measurements and verdict of one path
+struct path_state {
+    uint32_t srtt_us;      // 0 until the first answer
+    uint32_t rttvar_us;
+    double loss;           // EWMA of probe outcomes, 1 = lost
+    int up;                // not PATH_DOWN_PROBES lost in a row
+    int degraded;          // loss over PATH_LOSS_DEGRADED
+    int slow;              // RTT far above the other path's
+    int usable;            // up, not degraded and not slow
+    int lost_run;          // consecutive probe outcomes of each kind
+    int answered_run;
+    uint64_t first_lost_us;  // send time of the first probe of the current losing run
+    uint64_t changed_us;     // when usable last changed
+    // Probes in flight, by seq % PATH_INFLIGHT
+    uint32_t next_seq;
+    uint32_t oldest_seq;   // first probe whose outcome is not yet counted
+    uint64_t sent_us[PATH_INFLIGHT];
+    uint8_t answered[PATH_INFLIGHT];
+    unsigned long probes_sent;
+    unsigned long probes_answered;
+    unsigned long probes_lost;
+    unsigned long late;    // answers to probes already counted lost
+};
+
+struct path_selector {
+    enum path_policy policy;
+    uint32_t generation;       // bumped by every verdict change
+    struct path_state paths[PATH_COUNT];
+    unsigned long changes;     // verdict changes
+    unsigned long switches;    // flows moved to another path
+};
+
+// The cached decision of one flow
+struct path_flow {
+    struct in6_addr dst;
+    uint8_t preferred;         // enum path_id, from the destination
+    uint8_t path;              // where its packets go now
+    uint32_t generation;       // of the selector when path was decided
+    unsigned long switches;
+};
+
+void path_selector_init(struct path_selector *s, enum path_policy policy);
+
+const char *path_name(int path);
+
+// Classify a flow to dst; it is decided on its first path_select()
+void path_flow_init(struct path_flow *f, const struct in6_addr *dst);
+
+// Slow path of path_select: decide the flow's path from the verdicts
+int path_decide(struct path_selector *s, struct path_flow *f);
+
+// Path for the flow's next packet
+static inline int path_select(struct path_selector *s, struct path_flow *f) {
+    if (f->generation != s->generation)
+        return path_decide(s, f);
+    return f->path;
+}
+
+// Record a probe sent on path at now. Returns its sequence number.
+uint32_t path_probe_sent(struct path_selector *s, int path, uint64_t now_us);
+
+// An echo of probe seq on path came back at now: take an RTT sample. Late
+// or unknown answers are ignored.
+void path_probe_answered(struct path_selector *s, int path, uint32_t seq, uint64_t now_us);
+
+// Count the outcome of every probe that was answered or has run past the
+// RTO, in the order they were sent, and update the verdicts. Returns the
+// number of paths whose verdict changed.
+int path_update(struct path_selector *s, uint64_t now_us);
+
+#endif
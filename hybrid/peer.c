@@ -0,0 +1,298 @@
+// peer.c - Teredo peer cache with seqlocked buckets and timer-wheel expiry
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+
+#include "peer.h"
+#include "teredo.h"
+
+#define PEER_ENTRIES 3   // entries per bucket
+#define PEER_PROBE 8     // buckets from its home bucket a peer may sit in
+#define PEER_WHEEL 64    // timer wheel slots, one second each (a power of two)
+#define PEER_META_SERVER 0xffffffffull
+#define PEER_META_USED ((uint64_t)1 << 63)
+
+// One cache line. A writer makes seq odd, changes the entries and makes
+// it even again; a reader that saw an odd or changed seq reads again.
+struct peer_bucket {
+    _Atomic uint32_t seq;
+    uint32_t pad[3];
+    struct {
+        _Atomic uint64_t iid;   // address bytes 8-15: flags, mapped port and IPv4
+        _Atomic uint64_t meta;  // address bytes 4-7 (server IPv4), state << 32, bubbles << 40, used
+    } entries[PEER_ENTRIES];
+} __attribute__((aligned(64)));
+
+struct peer_cache {
+    struct peer_bucket *buckets;
+    _Atomic uint32_t *last_seen;  // per slot (bucket * PEER_ENTRIES + entry)
+    // Timer wheel: circular lists threaded through next/prev, one sentinel
+    // per wheel slot at index slots + wheel slot
+    uint32_t *next;
+    uint32_t *prev;
+    uint32_t mask;        // bucket count - 1
+    uint32_t slots;
+    uint32_t timeout;
+    uint32_t wheel_now;   // last second the wheel was advanced to
+    size_t bucket_bytes;
+    pthread_mutex_t lock; // writers
+    struct peer_stats stats;
+};
+
+static inline uint32_t peer_hash(uint64_t iid, uint32_t server) {
+    uint64_t h = iid * 0x9e3779b97f4a7c15ull ^ (uint64_t)server * 0xc2b2ae3d27d4eb4full;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 32;
+    return (uint32_t)h;
+}
+
+static inline void peer_key(const struct in6_addr *addr, uint64_t *iid, uint32_t *server) {
+    memcpy(iid, addr->s6_addr + 8, sizeof(*iid));
+    memcpy(server, addr->s6_addr + 4, sizeof(*server));
+}
+
+static void bucket_write_begin(struct peer_bucket *b) {
+    uint32_t seq = atomic_load_explicit(&b->seq, memory_order_relaxed);
+    atomic_store_explicit(&b->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void bucket_write_end(struct peer_bucket *b) {
+    uint32_t seq = atomic_load_explicit(&b->seq, memory_order_relaxed);
+    atomic_store_explicit(&b->seq, seq + 1, memory_order_release);
+}
+
+static void wheel_link(struct peer_cache *c, uint32_t slot, uint32_t deadline) {
+    uint32_t head = c->slots + (deadline & (PEER_WHEEL - 1));
+
+    c->prev[slot] = c->prev[head];
+    c->next[slot] = head;
+    c->next[c->prev[head]] = slot;
+    c->prev[head] = slot;
+}
+
+static void wheel_unlink(struct peer_cache *c, uint32_t slot) {
+    c->next[c->prev[slot]] = c->next[slot];
+    c->prev[c->next[slot]] = c->prev[slot];
+}
+
+// Empty the entry in slot; the caller unlinks it from the wheel
+static void peer_clear(struct peer_cache *c, uint32_t slot) {
+    struct peer_bucket *b = &c->buckets[slot / PEER_ENTRIES];
+
+    bucket_write_begin(b);
+    atomic_store_explicit(&b->entries[slot % PEER_ENTRIES].meta, 0, memory_order_relaxed);
+    atomic_store_explicit(&b->entries[slot % PEER_ENTRIES].iid, 0, memory_order_relaxed);
+    bucket_write_end(b);
+    c->stats.peers--;
+}
+
+struct peer_cache *peer_cache_create(uint32_t max_peers, uint32_t timeout) {
+    struct peer_cache *c = calloc(1, sizeof(*c));
+    uint64_t buckets = PEER_PROBE;
+
+    if (c == NULL || max_peers == 0)
+        goto fail;
+    // Keep the load factor at or below 3/4 so probe windows rarely fill
+    while (buckets * PEER_ENTRIES * 3 < (uint64_t)max_peers * 4)
+        buckets <<= 1;
+    if (buckets * PEER_ENTRIES > ((uint64_t)1 << 31))
+        goto fail;
+
+    c->mask = (uint32_t)(buckets - 1);
+    c->slots = (uint32_t)(buckets * PEER_ENTRIES);
+    c->timeout = timeout;
+    c->wheel_now = peer_now();
+
+    // Zeroed lazily by the kernel, so the cache costs only the pages peers touch
+    c->bucket_bytes = buckets * sizeof(struct peer_bucket);
+    c->buckets = mmap(NULL, c->bucket_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (c->buckets == MAP_FAILED) {
+        c->buckets = NULL;
+        goto fail;
+    }
+    madvise(c->buckets, c->bucket_bytes, MADV_HUGEPAGE);
+    c->last_seen = calloc(c->slots, sizeof(*c->last_seen));
+    c->next = malloc((c->slots + PEER_WHEEL) * sizeof(*c->next));
+    c->prev = malloc((c->slots + PEER_WHEEL) * sizeof(*c->prev));
+    if (c->last_seen == NULL || c->next == NULL || c->prev == NULL)
+        goto fail;
+    for (uint32_t i = c->slots; i < c->slots + PEER_WHEEL; i++)
+        c->next[i] = c->prev[i] = i;
+
+    c->stats.bytes = c->bucket_bytes +
+                     (size_t)c->slots * (sizeof(*c->last_seen) + sizeof(*c->next) + sizeof(*c->prev));
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+
+fail:
+    peer_cache_destroy(c);
+    return NULL;
+}
+
+void peer_cache_destroy(struct peer_cache *c) {
+    if (c == NULL)
+        return;
+    if (c->buckets != NULL) {
+        munmap(c->buckets, c->bucket_bytes);
+        pthread_mutex_destroy(&c->lock);
+    }
+    free((void *)c->last_seen);
+    free(c->next);
+    free(c->prev);
+    free(c);
+}
+
+uint32_t peer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
+uint32_t peer_lookup(struct peer_cache *c, const struct in6_addr *addr, struct peer_info *info) {
+    uint64_t iid;
+    uint32_t server;
+
+    peer_key(addr, &iid, &server);
+    uint32_t home = peer_hash(iid, server);
+    for (int p = 0; p < PEER_PROBE; p++) {
+        uint32_t index = (home + p) & c->mask;
+        struct peer_bucket *b = &c->buckets[index];
+        uint64_t meta = 0;
+        int found;
+
+        for (;;) {
+            uint32_t seq = atomic_load_explicit(&b->seq, memory_order_acquire);
+            if (seq & 1)
+                continue;
+            found = -1;
+            for (int e = 0; e < PEER_ENTRIES; e++) {
+                uint64_t m = atomic_load_explicit(&b->entries[e].meta, memory_order_relaxed);
+                if ((m & PEER_META_USED) && (uint32_t)(m & PEER_META_SERVER) == server &&
+                    atomic_load_explicit(&b->entries[e].iid, memory_order_relaxed) == iid) {
+                    found = e;
+                    meta = m;
+                }
+            }
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&b->seq, memory_order_relaxed) == seq)
+                break;
+        }
+
+        if (found >= 0) {
+            uint32_t slot = index * PEER_ENTRIES + (uint32_t)found;
+            info->state = (uint8_t)(meta >> 32);
+            info->bubbles = (uint8_t)(meta >> 40);
+            info->last_seen = atomic_load_explicit(&c->last_seen[slot], memory_order_relaxed);
+            return slot;
+        }
+    }
+    return PEER_NONE;
+}
+
+void peer_touch(struct peer_cache *c, uint32_t slot, uint32_t now) {
+    // Stored only when the second changes, so threads hitting a busy peer
+    // do not keep pulling its cache line away from each other
+    if (atomic_load_explicit(&c->last_seen[slot], memory_order_relaxed) != now)
+        atomic_store_explicit(&c->last_seen[slot], now, memory_order_relaxed);
+}
+
+uint32_t peer_update(struct peer_cache *c, const struct in6_addr *addr, uint8_t state,
+                     uint8_t bubbles, uint32_t now) {
+    uint64_t iid;
+    uint32_t server, prefix = htonl(TEREDO_PREFIX);
+    uint32_t slot = PEER_NONE, free_slot = PEER_NONE, oldest = PEER_NONE;
+
+    if (memcmp(addr->s6_addr, &prefix, sizeof(prefix)) != 0)
+        return PEER_NONE;
+    peer_key(addr, &iid, &server);
+    uint32_t home = peer_hash(iid, server);
+    uint64_t meta = server | ((uint64_t)state << 32) | ((uint64_t)bubbles << 40) | PEER_META_USED;
+
+    pthread_mutex_lock(&c->lock);
+    // Writers hold the lock, so the window can be read without the seqlock
+    for (int p = 0; p < PEER_PROBE && slot == PEER_NONE; p++) {
+        uint32_t index = (home + p) & c->mask;
+        struct peer_bucket *b = &c->buckets[index];
+        for (int e = 0; e < PEER_ENTRIES; e++) {
+            uint32_t s = index * PEER_ENTRIES + (uint32_t)e;
+            uint64_t m = atomic_load_explicit(&b->entries[e].meta, memory_order_relaxed);
+            if (!(m & PEER_META_USED)) {
+                if (free_slot == PEER_NONE)
+                    free_slot = s;
+            } else if ((uint32_t)(m & PEER_META_SERVER) == server &&
+                       atomic_load_explicit(&b->entries[e].iid, memory_order_relaxed) == iid) {
+                slot = s;
+                break;
+            } else if (oldest == PEER_NONE ||
+                       (int32_t)(atomic_load_explicit(&c->last_seen[s], memory_order_relaxed) -
+                                 atomic_load_explicit(&c->last_seen[oldest], memory_order_relaxed)) < 0) {
+                oldest = s;
+            }
+        }
+    }
+
+    if (slot == PEER_NONE) {
+        if (free_slot == PEER_NONE) {
+            peer_clear(c, oldest);
+            wheel_unlink(c, oldest);
+            c->stats.evicted++;
+            free_slot = oldest;
+        }
+        slot = free_slot;
+        wheel_link(c, slot, now + c->timeout);
+        c->stats.peers++;
+        c->stats.inserted++;
+    }
+
+    struct peer_bucket *b = &c->buckets[slot / PEER_ENTRIES];
+    bucket_write_begin(b);
+    atomic_store_explicit(&b->entries[slot % PEER_ENTRIES].iid, iid, memory_order_relaxed);
+    atomic_store_explicit(&b->entries[slot % PEER_ENTRIES].meta, meta, memory_order_relaxed);
+    bucket_write_end(b);
+    atomic_store_explicit(&c->last_seen[slot], now, memory_order_relaxed);
+    pthread_mutex_unlock(&c->lock);
+    return slot;
+}
+
+int peer_expire(struct peer_cache *c, uint32_t now) {
+    int expired = 0;
+
+    pthread_mutex_lock(&c->lock);
+    // After a long gap every wheel slot is visited once
+    if ((int32_t)(now - c->wheel_now) > PEER_WHEEL)
+        c->wheel_now = now - PEER_WHEEL;
+    while ((int32_t)(now - c->wheel_now) > 0) {
+        uint32_t head = c->slots + (++c->wheel_now & (PEER_WHEEL - 1));
+        uint32_t slot = c->next[head];
+
+        // Detach the due list, then forget each entry or move it on to the
+        // slot its refreshed timeout falls in
+        c->next[head] = c->prev[head] = head;
+        while (slot != head) {
+            uint32_t following = c->next[slot];
+            uint32_t deadline = atomic_load_explicit(&c->last_seen[slot], memory_order_relaxed) + c->timeout;
+            if ((int32_t)(deadline - now) <= 0) {
+                peer_clear(c, slot);
+                expired++;
+            } else {
+                wheel_link(c, slot, deadline);
+            }
+            slot = following;
+        }
+    }
+    c->stats.expired += expired;
+    pthread_mutex_unlock(&c->lock);
+    return expired;
+}
+
+void peer_cache_stats(struct peer_cache *c, struct peer_stats *stats) {
+    pthread_mutex_lock(&c->lock);
+    *stats = c->stats;
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,85 @@
+// peer.h - Teredo peer cache: Teredo address to NAT mapping and state
+//
+// A Teredo server or relay remembers every client it has heard from: the
+// address is the key, and what it knows about the client's NAT mapping
+// (qualified through this server, trusted after direct traffic, bubbles
+// sent while hole punching) is the value. The mapped port and IPv4 are
+// the ones embedded in the address, checked against the UDP source before
+// an entry is made, so an entry holds no copy of them.
+//
+// Entries are 16 bytes, three to a cache-line bucket with a sequence
+// counter in front. A lookup hashes to one bucket and scans at most
+// PEER_PROBE neighbours, so its cost does not depend on how many peers are
+// cached. Lookups take no lock: they retry if a writer changed the bucket
+// under them (a seqlock), and any number of threads may look up at once.
+// Traffic from a peer refreshes it with one relaxed store to a separate
+// last-seen array, also without a lock. Inserts, updates and expiry
+// serialise on a mutex.
+//
+// Idle peers are forgotten by a timer wheel of one-second slots. Each
+// entry sits on the list of the slot its timeout falls in; when a slot
+// comes due, entries seen since are moved on to a later slot instead of
+// being removed, so refreshing a peer never touches the wheel.
+#ifndef PEER_H
+#define PEER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define PEER_DEFAULT_MAX 524288  // peers per cache
+#define PEER_DEFAULT_TIMEOUT 30  // s; RFC 4380 clients refresh their mapping every 30 s
+#define PEER_NONE UINT32_MAX
+
+enum peer_state {
+    PEER_QUALIFIED = 1,  // qualified through this server (router solicitation)
+    PEER_PENDING,        // bubbles sent, no direct traffic yet
+    PEER_TRUSTED,        // direct traffic seen from its mapped address
+};
+
+struct peer_info {
+    uint8_t state;       // enum peer_state
+    uint8_t bubbles;     // bubbles sent since the last direct traffic
+    uint32_t last_seen;  // seconds, peer_now()
+};
+
+struct peer_stats {
+    uint32_t peers;          // currently cached
+    unsigned long inserted;
+    unsigned long expired;   // idle past the timeout
+    unsigned long evicted;   // pushed out of a full probe window, oldest first
+    size_t bytes;            // buckets, last-seen and wheel links
+};
+
+struct peer_cache;
+
+// A cache for about max_peers peers, forgotten timeout seconds after they
+// were last seen. Returns NULL if allocation fails.
+struct peer_cache *peer_cache_create(uint32_t max_peers, uint32_t timeout);
+void peer_cache_destroy(struct peer_cache *c);
+
+// Coarse monotonic clock in seconds, for last_seen
+uint32_t peer_now(void);
+
+// Find the peer with Teredo address addr. Returns its slot and fills *info
+// if it is cached, PEER_NONE if not. Lock-free; any thread.
+uint32_t peer_lookup(struct peer_cache *c, const struct in6_addr *addr, struct peer_info *info);
+
+// Note traffic from the peer in slot (from peer_lookup or peer_update).
+// Lock-free; if the slot has since been reused, another peer is kept a
+// little longer and nothing else happens.
+void peer_touch(struct peer_cache *c, uint32_t slot, uint32_t now);
+
+// Insert the peer or change its state, and mark it seen at now. When its
+// probe window is full, the peer seen longest ago is evicted. Returns the
+// slot, or PEER_NONE if addr is not a Teredo address.
+uint32_t peer_update(struct peer_cache *c, const struct in6_addr *addr, uint8_t state,
+                     uint8_t bubbles, uint32_t now);
+
+// Advance the timer wheel to now, forgetting peers idle for the timeout.
+// Returns the number forgotten.
+int peer_expire(struct peer_cache *c, uint32_t now);
+
+void peer_cache_stats(struct peer_cache *c, struct peer_stats *stats);
+
+#endif
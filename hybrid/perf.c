@@ -0,0 +1,100 @@
+// perf.c - perf_event_open counter group and TSC calibration for perf.h
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf.h"
+
+#define TSC_CALIBRATION_NS 50000000L  // 50 ms against CLOCK_MONOTONIC
+
+static const struct {
+    const char *name;
+    uint64_t config;
+} counters[PERF_COUNTERS] = {
+    [PERF_CYCLES] = { "cycles", PERF_COUNT_HW_CPU_CYCLES },
+    [PERF_INSTRUCTIONS] = { "instructions", PERF_COUNT_HW_INSTRUCTIONS },
+    [PERF_BRANCH_MISSES] = { "branch-misses", PERF_COUNT_HW_BRANCH_MISSES },
+    [PERF_CACHE_MISSES] = { "cache-misses", PERF_COUNT_HW_CACHE_MISSES },
+};
+
+const char *perf_counter_name(int counter) {
+    return counter >= 0 && counter < PERF_COUNTERS ? counters[counter].name : "?";
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+int perf_open(struct perf_group *g) {
+    memset(g, 0, sizeof(*g));
+    g->leader = -1;
+
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = counters[c].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // The first counter that opens leads the group; they count from here on
+        g->fd[c] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, g->leader, 0);
+        if (g->fd[c] < 0) {
+            if (g->error == 0)
+                g->error = errno;
+            continue;
+        }
+        if (g->leader < 0)
+            g->leader = g->fd[c];
+        g->slot[c] = g->opened++;
+    }
+    return g->opened;
+}
+
+void perf_close(struct perf_group *g) {
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+        if (g->fd[c] >= 0)
+            close(g->fd[c]);
+        g->fd[c] = -1;
+    }
+    g->leader = -1;
+    g->opened = 0;
+}
+
+void perf_read(const struct perf_group *g, struct perf_sample *s) {
+    uint64_t buf[3 + PERF_COUNTERS];  // nr, time enabled, time running, values
+
+    memset(s->value, 0, sizeof(s->value));
+    if (g->leader >= 0 && read(g->leader, buf, sizeof(buf)) >= (ssize_t)(3 * sizeof(uint64_t))) {
+        // Scale up if the kernel had to multiplex the group with other events
+        double scale = buf[2] > 0 && buf[2] < buf[1] ? (double)buf[1] / (double)buf[2] : 1.0;
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            if (g->fd[c] >= 0 && (uint64_t)g->slot[c] < buf[0])
+                s->value[c] = (uint64_t)((double)buf[3 + g->slot[c]] * scale);
+        }
+    }
+    s->ns = monotonic_ns();
+    s->tsc = perf_tsc();
+}
+
+double perf_tsc_ghz(void) {
+    static double ghz = -1.0;
+
+    if (ghz >= 0.0)
+        return ghz;
+    uint64_t start_ns = monotonic_ns(), start_tsc = perf_tsc(), ns;
+    do {
+        ns = monotonic_ns();
+    } while (ns - start_ns < (uint64_t)TSC_CALIBRATION_NS);
+    uint64_t ticks = perf_tsc() - start_tsc;
+    ghz = (double)ticks / (double)(ns - start_ns);
+    return ghz;
+}
@@ -0,0 +1,65 @@
+// perf.h - cycle and hardware counter readings for the microbenchmarks
+//
+// perf_open() asks perf_event_open(2) for a group of user-space counters on
+// the calling thread: cycles, instructions, branch misses and last-level
+// cache misses. The group is read in one read(2), so the values of one
+// sample belong together. Counters the CPU or the hypervisor does not
+// offer, or that perf_event_paranoid forbids, are left out and read as
+// unavailable. The TSC is read alongside, so every sample has a cycle
+// count (reference cycles at the TSC rate, not core cycles) even without
+// perf.
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+
+enum perf_counter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_CACHE_MISSES,
+    PERF_COUNTERS,
+};
+
+struct perf_group {
+    int leader;                 // -1 when no counter could be opened
+    int fd[PERF_COUNTERS];      // -1 for a counter that is unavailable
+    int slot[PERF_COUNTERS];    // position of each counter in a group read
+    int opened;
+    int error;                  // errno of the first counter that failed
+};
+
+struct perf_sample {
+    uint64_t tsc;
+    uint64_t ns;                // CLOCK_MONOTONIC
+    uint64_t value[PERF_COUNTERS];
+};
+
+// Open the group on the calling thread. Returns the number of counters
+// that are available, 0 when perf is not (the TSC still works).
+int perf_open(struct perf_group *g);
+
+void perf_close(struct perf_group *g);
+
+static inline int perf_available(const struct perf_group *g, int counter) {
+    return g->fd[counter] >= 0;
+}
+
+// Read the clocks and every available counter
+void perf_read(const struct perf_group *g, struct perf_sample *s);
+
+const char *perf_counter_name(int counter);
+
+// TSC ticks per nanosecond, measured once against CLOCK_MONOTONIC; 0 on
+// CPUs without a usable TSC
+double perf_tsc_ghz(void);
+
+static inline uint64_t perf_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+#endif
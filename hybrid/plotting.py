@@ -1,24 +1,26 @@
+import sys
 import matplotlib.pyplot as plt
 import pandas as pd
 
-# Load metrics data
-data = pd.read_csv('metrics.txt', names=['Packet Count', 'Latency (us)', 'Throughput (KBps)'])
+# Load metrics data (one file per relay: metrics_6rd.csv or metrics_teredo.csv)
+metrics_file = sys.argv[1] if len(sys.argv) > 1 else 'metrics_6rd.csv'
+data = pd.read_csv(metrics_file)
 
-# Plot Latency vs Packet Count
+# Plot forwarding time (kernel receive to egress) vs Packet Count
 plt.figure(figsize=(10, 5))
 plt.subplot(1, 2, 1)
-plt.plot(data['Packet Count'], data['Latency (us)'], label='Latency')
+plt.plot(data['PacketCount'], data['ForwardUs'], label='Forwarding')
 plt.xlabel('Packet Count')
-plt.ylabel('Latency (us)')
-plt.title('Latency vs Packet Count')
+plt.ylabel('Forwarding time (us)')
+plt.title('Forwarding Time vs Packet Count')
 plt.grid(True)
 
-# Plot Throughput vs Packet Count
+# Plot one-way latency from the sender vs Packet Count
 plt.subplot(1, 2, 2)
-plt.plot(data['Packet Count'], data['Throughput (KBps)'], label='Throughput', color='orange')
+plt.plot(data['PacketCount'], data['OneWayUs'], label='One-way', color='orange')
 plt.xlabel('Packet Count')
-plt.ylabel('Throughput (KBps)')
-plt.title('Throughput vs Packet Count')
+plt.ylabel('One-way latency (us)')
+plt.title('One-way Latency vs Packet Count')
 plt.grid(True)
 
 plt.tight_layout()
@@ -2,6 +2,20 @@ import pandas as pd
 import matplotlib.pyplot as plt
 import seaborn as sns
 
+def plot_hop_metrics(df, output_prefix):
+    # Time inside the hop (kernel receive to egress) and one-way latency
+    # from the sender's timestamp, against packet size
+    plt.figure(figsize=(10, 6))
+    plt.scatter(df['Bytes'], df['ForwardUs'], s=8, label='Forwarding')
+    plt.scatter(df['Bytes'], df['OneWayUs'], s=8, color='green', label='One-way from sender')
+    plt.title('Per-hop Latency vs Packet Size')
+    plt.xlabel('Packet Size (bytes)')
+    plt.ylabel('Latency (us)')
+    plt.legend()
+    plt.grid(True)
+    plt.savefig(f'{output_prefix}_hop_latency.png')
+    plt.close()
+
 def plot_performance_metrics(input_file, output_prefix):
     # Read the CSV file
     df = pd.read_csv(input_file)
@@ -9,6 +23,11 @@ def plot_performance_metrics(input_file, output_prefix):
     # Set the style
     plt.style.use('ggplot')
     sns.set_palette("husl")
+
+    # Relay/receiver metrics (metrics_*.csv) rather than teredo_client output
+    if 'ForwardUs' in df.columns:
+        plot_hop_metrics(df, output_prefix)
+        return
     
     # Create latency plot
     plt.figure(figsize=(10, 6))
@@ -30,6 +49,28 @@ def plot_performance_metrics(input_file, output_prefix):
     plt.savefig(f'{output_prefix}_throughput.png')
     plt.close()
 
+    # Offered load against achieved throughput, and loss (windowed client only)
+    if 'OfferedLoad(Mbps)' in df.columns:
+        plt.figure(figsize=(10, 6))
+        plt.plot(df['PacketSize'], df['OfferedLoad(Mbps)'], marker='o', label='Offered')
+        plt.plot(df['PacketSize'], df['Throughput(Mbps)'], marker='o', color='green', label='Achieved')
+        plt.title('Offered Load vs Achieved Throughput')
+        plt.xlabel('Packet Size (bytes)')
+        plt.ylabel('Rate (Mbps)')
+        plt.legend()
+        plt.grid(True)
+        plt.savefig(f'{output_prefix}_load.png')
+        plt.close()
+
+        plt.figure(figsize=(10, 6))
+        plt.plot(df['PacketSize'], df['Loss(%)'], marker='o', color='red')
+        plt.title('Loss vs Packet Size')
+        plt.xlabel('Packet Size (bytes)')
+        plt.ylabel('Loss (%)')
+        plt.grid(True)
+        plt.savefig(f'{output_prefix}_loss.png')
+        plt.close()
+
 if __name__ == "__main__":
     import sys
     if len(sys.argv) != 3:
@@ -0,0 +1,247 @@
+// pool.c - packet buffer pool: hugepage-backed carving, shared free lists
+// and per-thread caches
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+static const uint32_t class_sizes[POOL_CLASSES] = POOL_CLASS_SIZES;
+
+// Shared free list of one size class
+struct pool_class {
+    pthread_mutex_t lock;
+    struct pbuf *free;
+    uint32_t free_count;
+    uint32_t total;
+    uint32_t peak_in_use;   // highest total - free_count seen, under lock
+};
+
+struct pool {
+    struct pool_class classes[POOL_CLASSES];
+    void *mem;
+    size_t bytes;
+    struct pool_cache caches[POOL_MAX_CACHES];
+    _Atomic int cache_count;
+    pthread_mutex_t registry_lock;
+};
+
+#define COUNTER_ADD(counter, n) \
+    atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), \
+                          memory_order_relaxed)
+
+// Bytes one buffer of a class occupies, header included, in whole cache lines
+static size_t class_stride(int cls) {
+    size_t bytes = sizeof(struct pbuf) + POOL_HEADROOM + class_sizes[cls];
+    return (bytes + 63) & ~(size_t)63;
+}
+
+// Try explicit hugepages first; without a hugetlbfs reservation fall back
+// to ordinary pages and ask for transparent hugepages
+static void *map_memory(size_t bytes) {
+    void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED)
+        return mem;
+    mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+    madvise(mem, bytes, MADV_HUGEPAGE);
+    return mem;
+}
+
+struct pool *pool_create(const uint32_t counts[POOL_CLASSES]) {
+    struct pool *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+
+    size_t bytes = 0;
+    for (int c = 0; c < POOL_CLASSES; c++)
+        bytes += class_stride(c) * counts[c];
+    bytes = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+    pool->mem = map_memory(bytes);
+    if (pool->mem == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pool->bytes = bytes;
+    pthread_mutex_init(&pool->registry_lock, NULL);
+
+    // Carve each class out of its own contiguous region, building the free
+    // list back to front so buffers are handed out in address order
+    unsigned char *base = pool->mem;
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        struct pool_class *pc = &pool->classes[c];
+        size_t stride = class_stride(c);
+
+        pthread_mutex_init(&pc->lock, NULL);
+        for (uint32_t i = counts[c]; i-- > 0;) {
+            struct pbuf *buf = (struct pbuf *)(base + i * stride);
+            buf->size = POOL_HEADROOM + class_sizes[c];
+            buf->cls = (uint8_t)c;
+            buf->next = pc->free;
+            pc->free = buf;
+        }
+        pc->free_count = pc->total = counts[c];
+        base += stride * counts[c];
+    }
+    return pool;
+}
+
+void pool_destroy(struct pool *pool) {
+    if (pool == NULL)
+        return;
+    munmap(pool->mem, pool->bytes);
+    free(pool);
+}
+
+struct pool_cache *pool_cache_create(struct pool *pool, const char *name) {
+    struct pool_cache *cache = NULL;
+
+    pthread_mutex_lock(&pool->registry_lock);
+    int n = atomic_load(&pool->cache_count);
+    if (n < POOL_MAX_CACHES) {
+        cache = &pool->caches[n];
+        memset(cache, 0, sizeof(*cache));
+        cache->pool = pool;
+        snprintf(cache->name, sizeof(cache->name), "%s", name);
+        atomic_store_explicit(&pool->cache_count, n + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&pool->registry_lock);
+    return cache;
+}
+
+// Move up to n buffers of a class from the pool into the cache
+static void cache_refill(struct pool_cache *cache, int cls, uint32_t n) {
+    struct pool_class *pc = &cache->pool->classes[cls];
+
+    pthread_mutex_lock(&pc->lock);
+    while (n-- > 0 && pc->free != NULL) {
+        struct pbuf *buf = pc->free;
+        pc->free = buf->next;
+        pc->free_count--;
+        buf->next = cache->free[cls];
+        cache->free[cls] = buf;
+        cache->count[cls]++;
+    }
+    if (pc->total - pc->free_count > pc->peak_in_use)
+        pc->peak_in_use = pc->total - pc->free_count;
+    pthread_mutex_unlock(&pc->lock);
+}
+
+// Move up to n buffers of a class from the cache back to the pool
+static void cache_drain(struct pool_cache *cache, int cls, uint32_t n) {
+    struct pool_class *pc = &cache->pool->classes[cls];
+
+    pthread_mutex_lock(&pc->lock);
+    while (n-- > 0 && cache->free[cls] != NULL) {
+        struct pbuf *buf = cache->free[cls];
+        cache->free[cls] = buf->next;
+        cache->count[cls]--;
+        buf->next = pc->free;
+        pc->free = buf;
+        pc->free_count++;
+    }
+    pthread_mutex_unlock(&pc->lock);
+}
+
+void pool_cache_flush(struct pool_cache *cache) {
+    for (int c = 0; c < POOL_CLASSES; c++)
+        cache_drain(cache, c, cache->count[c]);
+}
+
+struct pbuf *pbuf_alloc(struct pool_cache *cache, uint32_t size) {
+    int cls = 0;
+    while (cls < POOL_CLASSES && class_sizes[cls] < size)
+        cls++;
+    if (cls == POOL_CLASSES)
+        return NULL;
+
+    if (cache->free[cls] == NULL) {
+        cache_refill(cache, cls, POOL_CACHE_BATCH);
+        if (cache->free[cls] == NULL) {
+            COUNTER_ADD(cache->stats[cls].failures, 1);
+            return NULL;
+        }
+    }
+
+    struct pbuf *buf = cache->free[cls];
+    cache->free[cls] = buf->next;
+    cache->count[cls]--;
+    COUNTER_ADD(cache->stats[cls].allocs, 1);
+
+    buf->next = NULL;
+    buf->data = buf->room + POOL_HEADROOM;
+    buf->len = 0;
+    return buf;
+}
+
+void pbuf_free(struct pool_cache *cache, struct pbuf *buf) {
+    int cls = buf->cls;
+
+    buf->next = cache->free[cls];
+    cache->free[cls] = buf;
+    cache->count[cls]++;
+    COUNTER_ADD(cache->stats[cls].frees, 1);
+
+    // Keep a thread that only frees (the consumer end of a pipeline) from
+    // hoarding the class
+    if (cache->count[cls] > 2 * POOL_CACHE_BATCH)
+        cache_drain(cache, cls, POOL_CACHE_BATCH);
+}
+
+uint32_t pool_max_size(void) {
+    return class_sizes[POOL_CLASSES - 1];
+}
+
+void pool_stats(struct pool *pool, struct pool_class_stats stats[POOL_CLASSES]) {
+    int n = atomic_load_explicit(&pool->cache_count, memory_order_acquire);
+
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        struct pool_class *pc = &pool->classes[c];
+
+        pthread_mutex_lock(&pc->lock);
+        stats[c].size = class_sizes[c];
+        stats[c].total = pc->total;
+        stats[c].in_use = pc->total - pc->free_count;
+        stats[c].peak_in_use = pc->peak_in_use;
+        pthread_mutex_unlock(&pc->lock);
+
+        stats[c].allocs = stats[c].failures = 0;
+        for (int i = 0; i < n; i++) {
+            stats[c].allocs += atomic_load_explicit(&pool->caches[i].stats[c].allocs, memory_order_relaxed);
+            stats[c].failures += atomic_load_explicit(&pool->caches[i].stats[c].failures, memory_order_relaxed);
+        }
+    }
+}
+
+void pool_print_stats(struct pool *pool, FILE *out) {
+    struct pool_class_stats stats[POOL_CLASSES];
+    int n = atomic_load_explicit(&pool->cache_count, memory_order_acquire);
+
+    pool_stats(pool, stats);
+    fprintf(out, "pool: %zu KB mapped, %d B headroom per buffer\n", pool->bytes / 1024, POOL_HEADROOM);
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        fprintf(out, "pool: class %5u B: %u buffers, %u in use (peak %u), %lu allocs, %lu failed\n",
+                stats[c].size, stats[c].total, stats[c].in_use, stats[c].peak_in_use,
+                stats[c].allocs, stats[c].failures);
+    }
+    // Held is allocs - frees through this cache; it goes negative for a
+    // cache that frees buffers another thread allocated
+    for (int i = 0; i < n; i++) {
+        struct pool_cache *cache = &pool->caches[i];
+        fprintf(out, "pool: cache %-10s", cache->name);
+        for (int c = 0; c < POOL_CLASSES; c++) {
+            unsigned long allocs = atomic_load_explicit(&cache->stats[c].allocs, memory_order_relaxed);
+            unsigned long frees = atomic_load_explicit(&cache->stats[c].frees, memory_order_relaxed);
+            unsigned long failures = atomic_load_explicit(&cache->stats[c].failures, memory_order_relaxed);
+            fprintf(out, "  %u B: %ld held, %lu failed", class_sizes[c], (long)(allocs - frees), failures);
+        }
+        fprintf(out, "\n");
+    }
+}
@@ -0,0 +1,123 @@
+// pool.h - preallocated, size-classed packet buffer pool
+//
+// All buffers are carved out of one hugepage-backed mapping at start-up;
+// nothing is allocated on the packet path. Buffers come in a few size
+// classes so a small packet does not pin a jumbo-sized buffer. Every
+// buffer reserves POOL_HEADROOM bytes in front of the packet, so an outer
+// IPv4/UDP/Teredo header is prepended by moving the data pointer back
+// (pbuf_push) rather than by moving the packet.
+//
+// Each thread allocates through its own pool_cache, which keeps private
+// free lists and only takes the pool lock to move POOL_CACHE_BATCH buffers
+// at a time to or from the shared lists. A buffer may be freed through a
+// different cache than the one that allocated it.
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define POOL_CLASSES 3
+#define POOL_CLASS_SIZES { 256, 2048, 9216 }  // packet bytes per buffer, per class
+#define POOL_HEADROOM 64         // in front of every packet: IPv4+UDP+origin indication, one cache line
+#define POOL_CACHE_BATCH 32      // buffers moved between a cache and the pool at once
+#define POOL_MAX_CACHES 256
+
+struct pool;
+
+// A packet buffer. data/len describe the packet; the bytes between room
+// and data are headroom.
+struct pbuf {
+    struct pbuf *next;     // free list link
+    unsigned char *data;   // first byte of the packet
+    uint32_t len;          // packet bytes at data
+    uint32_t size;         // bytes in room[] (headroom + class size)
+    uint8_t cls;           // size class
+    unsigned char room[] __attribute__((aligned(64)));
+};
+
+// Per-class counters of one cache. Written by the owning thread only, read
+// by pool_stats(), so relaxed single-writer updates suffice.
+struct pool_cache_stats {
+    _Atomic unsigned long allocs;
+    _Atomic unsigned long frees;
+    _Atomic unsigned long failures;   // allocations that found the class empty
+};
+
+// Occupancy of one size class. Buffers sitting in a cache's free list
+// count as in use: they are unavailable to other threads.
+struct pool_class_stats {
+    uint32_t size;           // packet bytes per buffer
+    uint32_t total;
+    uint32_t in_use;
+    uint32_t peak_in_use;
+    unsigned long allocs;    // summed over every cache
+    unsigned long failures;
+};
+
+// Per-thread front end of the pool
+struct pool_cache {
+    struct pool *pool;
+    char name[16];
+    struct pbuf *free[POOL_CLASSES];
+    uint32_t count[POOL_CLASSES];
+    struct pool_cache_stats stats[POOL_CLASSES];
+};
+
+// Create a pool with counts[i] buffers of class i. Returns NULL on failure.
+struct pool *pool_create(const uint32_t counts[POOL_CLASSES]);
+void pool_destroy(struct pool *pool);
+
+// Register a cache for the calling thread; name labels it in the stats.
+// Returns NULL when POOL_MAX_CACHES caches already exist.
+struct pool_cache *pool_cache_create(struct pool *pool, const char *name);
+
+// Return every buffer the cache holds to the pool. The cache stays
+// registered (its counters remain visible) and may be used again.
+void pool_cache_flush(struct pool_cache *cache);
+
+// A buffer that can hold size packet bytes behind the headroom, from the
+// smallest class that fits, with data at the end of the headroom and len
+// 0. Returns NULL if that class is exhausted or size exceeds every class.
+struct pbuf *pbuf_alloc(struct pool_cache *cache, uint32_t size);
+void pbuf_free(struct pool_cache *cache, struct pbuf *buf);
+
+// Largest packet any class can hold
+uint32_t pool_max_size(void);
+
+// Snapshot of the per-class counters
+void pool_stats(struct pool *pool, struct pool_class_stats stats[POOL_CLASSES]);
+
+// Print per-class occupancy and per-cache allocation/failure counters
+void pool_print_stats(struct pool *pool, FILE *out);
+
+static inline uint32_t pbuf_headroom(const struct pbuf *buf) {
+    return (uint32_t)(buf->data - buf->room);
+}
+
+static inline uint32_t pbuf_tailroom(const struct pbuf *buf) {
+    return buf->size - pbuf_headroom(buf) - buf->len;
+}
+
+// Prepend n bytes of outer header. Returns the new start of the packet, or
+// NULL if the headroom is too small.
+static inline unsigned char *pbuf_push(struct pbuf *buf, uint32_t n) {
+    if (n > pbuf_headroom(buf))
+        return NULL;
+    buf->data -= n;
+    buf->len += n;
+    return buf->data;
+}
+
+// Strip n bytes of outer header. Returns the new start of the packet, or
+// NULL if the packet is shorter than n.
+static inline unsigned char *pbuf_pull(struct pbuf *buf, uint32_t n) {
+    if (n > buf->len)
+        return NULL;
+    buf->data += n;
+    buf->len -= n;
+    return buf->data;
+}
+
+#endif
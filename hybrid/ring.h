@@ -0,0 +1,112 @@
+// ring.h - lock-free single-producer/single-consumer ring of fixed-size slots
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LINE 64
+
+// head is only written by the producer and tail only by the consumer, each
+// on its own cache line so the two sides do not false-share. Every side
+// also keeps a cached copy of the other side's index and only re-reads the
+// shared one when the cached value says the ring is full/empty.
+struct spsc_ring {
+    _Alignas(CACHE_LINE) _Atomic uint32_t head;  // next slot to write
+    uint32_t cached_tail;                        // producer's view of tail
+    _Alignas(CACHE_LINE) _Atomic uint32_t tail;  // next slot to read
+    uint32_t cached_head;                        // consumer's view of head
+    _Alignas(CACHE_LINE) uint32_t mask;
+    uint32_t elem_size;
+    unsigned char *slots;
+};
+
+// capacity must be a power of two. Returns 0 on success, -1 on failure.
+static inline int spsc_ring_init(struct spsc_ring *r, uint32_t capacity, uint32_t elem_size) {
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+        return -1;
+    r->slots = aligned_alloc(CACHE_LINE, ((size_t)capacity * elem_size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1));
+    if (r->slots == NULL)
+        return -1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->cached_tail = 0;
+    r->cached_head = 0;
+    r->mask = capacity - 1;
+    r->elem_size = elem_size;
+    return 0;
+}
+
+static inline void spsc_ring_free(struct spsc_ring *r) {
+    free(r->slots);
+    r->slots = NULL;
+}
+
+// Producer side. Copies elem into the ring; returns -1 without blocking
+// if the ring is full.
+static inline int spsc_ring_push(struct spsc_ring *r, const void *elem) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - r->cached_tail > r->mask) {
+        r->cached_tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (head - r->cached_tail > r->mask)
+            return -1;
+    }
+    memcpy(r->slots + (size_t)(head & r->mask) * r->elem_size, elem, r->elem_size);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return 0;
+}
+
+// Consumer side. Copies the oldest element out; returns -1 if empty.
+static inline int spsc_ring_pop(struct spsc_ring *r, void *elem) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail == r->cached_head) {
+        r->cached_head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail == r->cached_head)
+            return -1;
+    }
+    memcpy(elem, r->slots + (size_t)(tail & r->mask) * r->elem_size, r->elem_size);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+// Producer side, batched. Copies up to n elements in and publishes them
+// with a single store; returns how many fitted.
+static inline uint32_t spsc_ring_push_burst(struct spsc_ring *r, const void *elems, uint32_t n) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t space = r->mask + 1 - (head - r->cached_tail);
+    if (space < n) {
+        r->cached_tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        space = r->mask + 1 - (head - r->cached_tail);
+    }
+    if (n > space)
+        n = space;
+    for (uint32_t i = 0; i < n; i++)
+        memcpy(r->slots + (size_t)((head + i) & r->mask) * r->elem_size,
+               (const unsigned char *)elems + (size_t)i * r->elem_size, r->elem_size);
+    if (n > 0)
+        atomic_store_explicit(&r->head, head + n, memory_order_release);
+    return n;
+}
+
+// Consumer side, batched. Copies out up to max elements and releases their
+// slots with a single store; returns how many were taken.
+static inline uint32_t spsc_ring_pop_burst(struct spsc_ring *r, void *elems, uint32_t max) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t avail = r->cached_head - tail;
+    if (avail < max) {
+        r->cached_head = atomic_load_explicit(&r->head, memory_order_acquire);
+        avail = r->cached_head - tail;
+    }
+    if (max > avail)
+        max = avail;
+    for (uint32_t i = 0; i < max; i++)
+        memcpy((unsigned char *)elems + (size_t)i * r->elem_size,
+               r->slots + (size_t)((tail + i) & r->mask) * r->elem_size, r->elem_size);
+    if (max > 0)
+        atomic_store_explicit(&r->tail, tail + max, memory_order_release);
+    return max;
+}
+
+#endif
@@ -0,0 +1,124 @@
+// sixrd.c - 6RD address mapping and IPv6-in-IPv4 encapsulation
+#include <string.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+#include "sixrd.h"
+#include "checksum.h"
+
+// Upper half of an IPv6 address as a host-order integer, so prefix math
+// is plain shifts and masks
+static inline uint64_t load_upper64(const struct in6_addr *addr) {
+    uint64_t hi;
+    memcpy(&hi, addr->s6_addr, 8);
+    return be64toh(hi);
+}
+
+static inline void store_prefix64(struct in6_addr *addr, uint64_t upper) {
+    uint64_t hi = htobe64(upper);
+    memset(addr, 0, sizeof(*addr));
+    memcpy(addr->s6_addr, &hi, 8);
+}
+
+int sixrd_config_init(struct sixrd_config *cfg, const char *prefix, int prefix_len,
+                      int ipv4_mask_len, const char *br, const char *ce) {
+    struct in_addr br_addr, ce_addr;
+
+    memset(cfg, 0, sizeof(*cfg));
+    if (prefix_len < 1 || ipv4_mask_len < 0 || ipv4_mask_len > 32 ||
+        prefix_len + 32 - ipv4_mask_len > 64)
+        return -1;
+    if (inet_pton(AF_INET6, prefix, &cfg->prefix) != 1 ||
+        inet_pton(AF_INET, br, &br_addr) != 1 || inet_pton(AF_INET, ce, &ce_addr) != 1)
+        return -1;
+
+    int suffix_len = 32 - ipv4_mask_len;
+    cfg->prefix_len = prefix_len;
+    cfg->ipv4_mask_len = ipv4_mask_len;
+    cfg->br_ipv4 = br_addr.s_addr;
+    cfg->ce_ipv4 = ce_addr.s_addr;
+
+    cfg->prefix_mask = ~(uint64_t)0 << (64 - prefix_len);
+    cfg->prefix_bits = load_upper64(&cfg->prefix) & cfg->prefix_mask;
+    cfg->suffix_shift = 64 - prefix_len - suffix_len;
+    cfg->suffix_mask = suffix_len == 32 ? 0xffffffffu : (1u << suffix_len) - 1;
+    cfg->common_bits = ntohl(cfg->ce_ipv4) & ~cfg->suffix_mask;
+    store_prefix64(&cfg->prefix, cfg->prefix_bits);
+    return 0;
+}
+
+void sixrd_delegated_prefix(const struct sixrd_config *cfg, uint32_t ce_ipv4,
+                            struct in6_addr *out, int *out_len) {
+    uint64_t suffix = ntohl(ce_ipv4) & cfg->suffix_mask;
+
+    store_prefix64(out, cfg->prefix_bits | (suffix << cfg->suffix_shift));
+    *out_len = cfg->prefix_len + 32 - cfg->ipv4_mask_len;
+}
+
+uint32_t sixrd_ipv4_endpoint(const struct sixrd_config *cfg, const struct in6_addr *dst) {
+    uint64_t addr = load_upper64(dst);
+    uint32_t suffix = (uint32_t)(addr >> cfg->suffix_shift) & cfg->suffix_mask;
+    uint32_t ce = htonl(cfg->common_bits | suffix);
+    int in_domain = ((addr ^ cfg->prefix_bits) & cfg->prefix_mask) == 0;
+
+    return in_domain ? ce : cfg->br_ipv4;
+}
+
+// IPv4 identification for the non-DF packets we emit (RFC 4213 3.2.1)
+static __thread uint16_t next_ip_id;
+
+long sixrd_encap(const struct sixrd_config *cfg, unsigned char *ipv6, size_t len) {
+    struct in6_addr dst;
+    uint32_t w[5];
+
+    long inner = ipv6_parse_header(ipv6, len);
+    if (inner < 0 || inner + IPV4_HEADER_LEN > 0xffff)
+        return -1;
+    memcpy(&dst, ipv6 + 24, sizeof(dst));
+
+    // Built as five words: version/IHL/TOS/length, ID/flags, TTL/protocol/
+    // checksum, source, destination
+    w[0] = htonl((0x45u << 24) | (uint32_t)(inner + IPV4_HEADER_LEN));
+    w[1] = htonl((uint32_t)next_ip_id++ << 16);
+    w[2] = htonl(((uint32_t)SIXRD_DEFAULT_TTL << 24) | (IPPROTO_6RD << 16));
+    w[3] = cfg->ce_ipv4;
+    w[4] = sixrd_ipv4_endpoint(cfg, &dst);
+    uint16_t check = ipv4_header_checksum(w);
+    memcpy((unsigned char *)w + 10, &check, 2);
+
+    memcpy(ipv6 - IPV4_HEADER_LEN, w, IPV4_HEADER_LEN);
+    return inner + IPV4_HEADER_LEN;
+}
+
+long sixrd_decap(const struct sixrd_config *cfg, const unsigned char *ipv4, size_t len,
+                 const unsigned char **inner) {
+    size_t header_len = ipv4_header_valid(ipv4, len);
+
+    if (header_len == 0)
+        return -1;
+    return sixrd_decap_valid(cfg, ipv4, header_len, inner);
+}
+
+long sixrd_decap_valid(const struct sixrd_config *cfg, const unsigned char *ipv4, size_t header_len,
+                       const unsigned char **inner) {
+    struct in6_addr src;
+    uint32_t saddr;
+    size_t total = ((size_t)ipv4[2] << 8) | ipv4[3];
+
+    // Fragments were turned away with the header; they are not reassembled here
+    if (ipv4[9] != IPPROTO_6RD || total < header_len + IPV6_HEADER_LEN)
+        return -1;
+    long n = ipv6_parse_header(ipv4 + header_len, total - header_len);
+    if (n < 0)
+        return -1;
+
+    // The outer source must be the tunnel endpoint of the inner source:
+    // the CE it embeds, or the BR for sources outside the 6RD domain
+    memcpy(&src, ipv4 + header_len + 8, sizeof(src));
+    memcpy(&saddr, ipv4 + 12, sizeof(saddr));
+    if (sixrd_ipv4_endpoint(cfg, &src) != saddr)
+        return -1;
+
+    *inner = ipv4 + header_len;
+    return n;
+}
@@ -0,0 +1,72 @@
+// sixrd.h - 6RD (RFC 5969) IPv6-in-IPv4 data plane
+//
+// Address mapping between a 6RD domain's IPv6 prefixes and its CE IPv4
+// addresses, and protocol-41 encapsulation and decapsulation. Nothing here
+// allocates; encapsulation writes the outer IPv4 header into headroom the
+// caller leaves in front of the IPv6 packet.
+#ifndef SIXRD_H
+#define SIXRD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "ip.h"
+
+#define IPPROTO_6RD 41  // IPv6-in-IPv4 (same value as IPPROTO_IPV6)
+#define SIXRD_DEFAULT_TTL 64
+
+// 6RD domain parameters (the OPTION_6RD contents) plus values derived from
+// them once at configuration time so the per-packet paths stay branch-light
+struct sixrd_config {
+    struct in6_addr prefix;  // 6rdPrefix
+    int prefix_len;          // 6rdPrefixLen
+    int ipv4_mask_len;       // IPv4MaskLen: high bits shared by every CE address
+    uint32_t br_ipv4;        // 6rdBRIPv4Address, network order
+    uint32_t ce_ipv4;        // this CE's IPv4 address, network order
+
+    // Derived. The delegated prefix is at most /64, so the 6RD prefix and
+    // the embedded IPv4 bits always sit in the upper 64 bits of an address.
+    uint64_t prefix_bits;    // upper 64 bits of the prefix, host order
+    uint64_t prefix_mask;    // top prefix_len bits set
+    int suffix_shift;        // where the embedded IPv4 bits end
+    uint32_t suffix_mask;    // low 32 - ipv4_mask_len bits set
+    uint32_t common_bits;    // shared high IPv4 bits, host order
+};
+
+// Validate and precompute a 6RD domain. prefix/br/ce are textual addresses.
+// Returns 0 on success, -1 if the parameters are invalid (for example the
+// delegated prefix would be longer than /64).
+int sixrd_config_init(struct sixrd_config *cfg, const char *prefix, int prefix_len,
+                      int ipv4_mask_len, const char *br, const char *ce);
+
+// The 6RD delegated prefix of the CE with IPv4 address ce_ipv4 (network
+// order). Its length is prefix_len + 32 - ipv4_mask_len.
+void sixrd_delegated_prefix(const struct sixrd_config *cfg, uint32_t ce_ipv4,
+                            struct in6_addr *out, int *out_len);
+
+// IPv4 tunnel endpoint for an IPv6 destination: the CE address embedded in
+// it when it lies inside the 6RD prefix, otherwise the border relay.
+// Returns the address in network order.
+uint32_t sixrd_ipv4_endpoint(const struct sixrd_config *cfg, const struct in6_addr *dst);
+
+// Encapsulate the IPv6 packet at ipv6 (len bytes) in IPv4. The outer header
+// is written to the IPV4_HEADER_LEN bytes before ipv6, which the caller
+// must own. Returns the length of the IPv4 packet starting at
+// ipv6 - IPV4_HEADER_LEN, or -1 if the inner packet is not valid IPv6.
+long sixrd_encap(const struct sixrd_config *cfg, unsigned char *ipv6, size_t len);
+
+// Decapsulate the IPv4 packet at ipv4 (len bytes). Verifies the outer
+// header (version, checksum, protocol 41, lengths), the inner IPv6 header,
+// and that the outer source matches the inner source per RFC 5969 section
+// 12. On success sets *inner to the IPv6 packet and returns its length;
+// returns -1 if the packet must be dropped.
+long sixrd_decap(const struct sixrd_config *cfg, const unsigned char *ipv4, size_t len,
+                 const unsigned char **inner);
+
+// sixrd_decap() of a packet whose outer header ipv4_header_valid() (or its
+// batch form) already accepted as header_len bytes long
+long sixrd_decap_valid(const struct sixrd_config *cfg, const unsigned char *ipv4, size_t header_len,
+                       const unsigned char **inner);
+
+#endif
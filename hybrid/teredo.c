@@ -0,0 +1,240 @@
+// teredo.c - Teredo address and packet codec
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "teredo.h"
+
+int teredo_addr_decode(const struct in6_addr *addr, struct teredo_addr *out) {
+    const unsigned char *p = addr->s6_addr;
+    uint32_t prefix;
+
+    memcpy(&prefix, p, 4);
+    if (prefix != htonl(TEREDO_PREFIX))
+        return 0;
+
+    memcpy(&out->server_ipv4, p + 4, 4);
+    out->flags = (uint16_t)((p[8] << 8) | p[9]);
+    memcpy(&out->client_port, p + 10, 2);
+    memcpy(&out->client_ipv4, p + 12, 4);
+    out->client_port ^= 0xffff;
+    out->client_ipv4 ^= 0xffffffffu;
+    return 1;
+}
+
+void teredo_addr_encode(const struct teredo_addr *in, struct in6_addr *out) {
+    unsigned char *p = out->s6_addr;
+    uint32_t prefix = htonl(TEREDO_PREFIX);
+    uint16_t port = in->client_port ^ 0xffff;
+    uint32_t ipv4 = in->client_ipv4 ^ 0xffffffffu;
+
+    memcpy(p, &prefix, 4);
+    memcpy(p + 4, &in->server_ipv4, 4);
+    p[8] = (unsigned char)(in->flags >> 8);
+    p[9] = (unsigned char)in->flags;
+    memcpy(p + 10, &port, 2);
+    memcpy(p + 12, &ipv4, 4);
+}
+
+int teredo_parse(const unsigned char *buf, size_t len, struct teredo_packet *pkt) {
+    size_t off = 0;
+
+    pkt->auth = NULL;
+    pkt->has_origin = 0;
+
+    // Authentication encapsulation: 0x00 0x01 ID-len AU-len ID AU nonce conf
+    if (len >= 2 && buf[0] == 0x00 && buf[1] == 0x01) {
+        if (len < TEREDO_AUTH_MIN_LEN)
+            return -1;
+        size_t id_len = buf[2], auth_len = buf[3];
+        size_t auth_total = TEREDO_AUTH_MIN_LEN + id_len + auth_len;
+        if (auth_total > len)
+            return -1;
+
+        pkt->auth = buf;
+        pkt->id_len = (uint8_t)id_len;
+        pkt->auth_len = (uint8_t)auth_len;
+        pkt->client_id = buf + 4;
+        pkt->auth_value = pkt->client_id + id_len;
+        pkt->nonce = pkt->auth_value + auth_len;
+        pkt->confirmation = pkt->nonce[TEREDO_NONCE_LEN];
+        off = auth_total;
+    }
+
+    // Origin indication: 0x00 0x00 port IPv4, both obfuscated
+    if (len - off >= TEREDO_ORIGIN_LEN && buf[off] == 0x00 && buf[off + 1] == 0x00) {
+        memcpy(&pkt->origin_port, buf + off + 2, 2);
+        memcpy(&pkt->origin_ipv4, buf + off + 4, 4);
+        pkt->origin_port ^= 0xffff;
+        pkt->origin_ipv4 ^= 0xffffffffu;
+        pkt->has_origin = 1;
+        off += TEREDO_ORIGIN_LEN;
+    }
+
+    long n = ipv6_parse_header(buf + off, len - off);
+    if (n < 0)
+        return -1;
+    pkt->ipv6 = buf + off;
+    pkt->ipv6_len = (size_t)n;
+    return 0;
+}
+
+int teredo_is_bubble(const struct teredo_packet *pkt) {
+    return pkt->ipv6_len == IPV6_HEADER_LEN && pkt->ipv6[6] == IPV6_NEXT_NONE;
+}
+
+size_t teredo_build_origin(unsigned char *buf, uint16_t port, uint32_t ipv4) {
+    uint16_t obfuscated_port = port ^ 0xffff;
+    uint32_t obfuscated_ipv4 = ipv4 ^ 0xffffffffu;
+
+    buf[0] = 0x00;
+    buf[1] = 0x00;
+    memcpy(buf + 2, &obfuscated_port, 2);
+    memcpy(buf + 4, &obfuscated_ipv4, 4);
+    return TEREDO_ORIGIN_LEN;
+}
+
+size_t teredo_build_auth(unsigned char *buf, const void *client_id, uint8_t id_len,
+                         const void *auth_value, uint8_t auth_len,
+                         const unsigned char nonce[TEREDO_NONCE_LEN], uint8_t confirmation) {
+    unsigned char *p = buf;
+
+    *p++ = 0x00;
+    *p++ = 0x01;
+    *p++ = id_len;
+    *p++ = auth_len;
+    memcpy(p, client_id, id_len);
+    p += id_len;
+    memcpy(p, auth_value, auth_len);
+    p += auth_len;
+    memcpy(p, nonce, TEREDO_NONCE_LEN);
+    p += TEREDO_NONCE_LEN;
+    *p++ = confirmation;
+    return (size_t)(p - buf);
+}
+
+#define ICMPV6_RS_LEN 8
+#define ICMPV6_RA_LEN 16
+#define ND_OPT_PREFIX_INFO 3
+#define ND_OPT_PREFIX_INFO_LEN 32
+#define ND_OPT_MTU 5
+#define ND_OPT_MTU_LEN 8
+#define TEREDO_RA_BODY_LEN (ICMPV6_RA_LEN + ND_OPT_PREFIX_INFO_LEN + ND_OPT_MTU_LEN)
+
+// RFC 4380 section 5.2.1: the client solicits from fe80::ffff:ffff:ffff:ffff,
+// or fe80::8000:ffff:ffff:ffff to say it is behind a cone NAT
+static const struct in6_addr rs_source = { { { 0xfe, 0x80, 0, 0, 0, 0, 0, 0,
+                                               0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff } } };
+static const struct in6_addr all_routers = { { { 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2 } } };
+static const struct in6_addr server_link_local = { { { 0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 } } };
+
+size_t teredo_build_rs(unsigned char *buf, const unsigned char nonce[TEREDO_NONCE_LEN], int cone) {
+    size_t off = teredo_build_auth(buf, "", 0, "", 0, nonce, 0);
+    unsigned char *ip = buf + off;
+    struct in6_addr src = rs_source;
+
+    if (cone) {
+        src.s6_addr[8] = 0x80;
+        src.s6_addr[9] = 0x00;
+    }
+    ipv6_build_header(ip, &src, &all_routers, IPV6_NEXT_ICMPV6, ICMPV6_RS_LEN, 255);
+    memset(ip + IPV6_HEADER_LEN, 0, ICMPV6_RS_LEN);
+    ip[IPV6_HEADER_LEN] = ICMPV6_ROUTER_SOLICIT;
+    uint16_t checksum = icmpv6_checksum(ip, IPV6_HEADER_LEN + ICMPV6_RS_LEN);
+    memcpy(ip + IPV6_HEADER_LEN + 2, &checksum, 2);
+    return off + IPV6_HEADER_LEN + ICMPV6_RS_LEN;
+}
+
+int teredo_is_rs(const struct teredo_packet *pkt, int *cone) {
+    const unsigned char *ip = pkt->ipv6;
+
+    if (pkt->ipv6_len < IPV6_HEADER_LEN + ICMPV6_RS_LEN || ip[6] != IPV6_NEXT_ICMPV6 ||
+        ip[IPV6_HEADER_LEN] != ICMPV6_ROUTER_SOLICIT || ip[7] != 255)
+        return 0;
+    // Link-local source (fe80::/10)
+    if (ip[8] != 0xfe || (ip[9] & 0xc0) != 0x80 || icmpv6_checksum(ip, pkt->ipv6_len) != 0)
+        return 0;
+    *cone = ip[16] == 0x80 && ip[17] == 0x00;
+    return 1;
+}
+
+size_t teredo_build_ra(unsigned char *buf, const struct teredo_packet *rs, uint32_t server_ipv4,
+                       uint16_t port, uint32_t ipv4) {
+    size_t off = 0;
+    struct in6_addr dst;
+
+    if (rs->auth != NULL)
+        off = teredo_build_auth(buf, "", 0, "", 0, rs->nonce, 0);
+    off += teredo_build_origin(buf + off, port, ipv4);
+
+    unsigned char *ip = buf + off;
+    memcpy(&dst, rs->ipv6 + 8, sizeof(dst));
+    ipv6_build_header(ip, &server_link_local, &dst, IPV6_NEXT_ICMPV6, TEREDO_RA_BODY_LEN, 255);
+
+    // Hop limit, flags, router lifetime (not a default router), reachable
+    // and retransmit times all 0
+    unsigned char *ra = ip + IPV6_HEADER_LEN;
+    memset(ra, 0, TEREDO_RA_BODY_LEN);
+    ra[0] = ICMPV6_ROUTER_ADVERT;
+
+    // The Teredo prefix of this server. The client forms its own address,
+    // so neither the on-link nor the autonomous flag is set.
+    unsigned char *opt = ra + ICMPV6_RA_LEN;
+    uint32_t lifetime = 0xffffffffu;
+    uint32_t prefix = htonl(TEREDO_PREFIX);
+    opt[0] = ND_OPT_PREFIX_INFO;
+    opt[1] = ND_OPT_PREFIX_INFO_LEN / 8;
+    opt[2] = 64;
+    memcpy(opt + 4, &lifetime, 4);
+    memcpy(opt + 8, &lifetime, 4);
+    memcpy(opt + 16, &prefix, 4);
+    memcpy(opt + 20, &server_ipv4, 4);
+
+    opt += ND_OPT_PREFIX_INFO_LEN;
+    uint32_t mtu = htonl(TEREDO_RA_MTU);
+    opt[0] = ND_OPT_MTU;
+    opt[1] = ND_OPT_MTU_LEN / 8;
+    memcpy(opt + 4, &mtu, 4);
+
+    uint16_t checksum = icmpv6_checksum(ip, IPV6_HEADER_LEN + TEREDO_RA_BODY_LEN);
+    memcpy(ra + 2, &checksum, 2);
+    return off + IPV6_HEADER_LEN + TEREDO_RA_BODY_LEN;
+}
+
+int teredo_parse_ra(const struct teredo_packet *pkt, const unsigned char nonce[TEREDO_NONCE_LEN],
+                    struct teredo_qualification *q) {
+    const unsigned char *ip = pkt->ipv6;
+    int have_prefix = 0;
+
+    if (pkt->auth == NULL || memcmp(pkt->nonce, nonce, TEREDO_NONCE_LEN) != 0 || !pkt->has_origin)
+        return -1;
+    if (pkt->ipv6_len < IPV6_HEADER_LEN + ICMPV6_RA_LEN || ip[6] != IPV6_NEXT_ICMPV6 ||
+        ip[IPV6_HEADER_LEN] != ICMPV6_ROUTER_ADVERT || icmpv6_checksum(ip, pkt->ipv6_len) != 0)
+        return -1;
+
+    q->mapped_port = pkt->origin_port;
+    q->mapped_ipv4 = pkt->origin_ipv4;
+    q->mtu = 0;
+
+    // Options: type, length in units of 8 bytes, body
+    size_t off = IPV6_HEADER_LEN + ICMPV6_RA_LEN;
+    while (off + 2 <= pkt->ipv6_len) {
+        const unsigned char *opt = ip + off;
+        size_t opt_len = (size_t)opt[1] * 8;
+        if (opt_len == 0 || off + opt_len > pkt->ipv6_len)
+            return -1;
+
+        uint32_t prefix;
+        if (opt[0] == ND_OPT_PREFIX_INFO && opt_len == ND_OPT_PREFIX_INFO_LEN && opt[2] == 64) {
+            memcpy(&prefix, opt + 16, 4);
+            if (prefix == htonl(TEREDO_PREFIX)) {
+                memcpy(&q->server_ipv4, opt + 20, 4);
+                have_prefix = 1;
+            }
+        } else if (opt[0] == ND_OPT_MTU && opt_len == ND_OPT_MTU_LEN) {
+            memcpy(&q->mtu, opt + 4, 4);
+            q->mtu = ntohl(q->mtu);
+        }
+        off += opt_len;
+    }
+    return have_prefix ? 0 : -1;
+}
@@ -0,0 +1,115 @@
+// teredo.h - Teredo (RFC 4380) address and packet codec
+//
+// Teredo addresses live in 2001::/32 and carry the server IPv4 address,
+// flags, and the client's mapped UDP port and IPv4 address, the last two
+// obfuscated by XOR with all ones. A Teredo UDP payload is an optional
+// authentication encapsulation, an optional origin indication, then an
+// IPv6 packet. Parsing is zero-copy: struct teredo_packet points into the
+// receive buffer.
+#ifndef TEREDO_H
+#define TEREDO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "ip.h"
+
+#define TEREDO_PORT 3544
+#define TEREDO_PREFIX 0x20010000u  // 2001::/32
+#define TEREDO_FLAG_CONE 0x8000    // "C" flag: client behind a cone NAT
+#define TEREDO_ORIGIN_LEN 8
+#define TEREDO_AUTH_MIN_LEN 13     // header, nonce and confirmation byte
+#define TEREDO_NONCE_LEN 8
+#define TEREDO_RA_MTU 1280         // link MTU a server advertises to its clients
+
+#define ICMPV6_ROUTER_SOLICIT 133
+#define ICMPV6_ROUTER_ADVERT 134
+
+// What a client learns from its server's router advertisement: the
+// server's IPv4 address (from the advertised prefix) and its own mapped
+// port and IPv4 (from the origin indication), all in network order
+struct teredo_qualification {
+    uint32_t server_ipv4;
+    uint16_t mapped_port;
+    uint32_t mapped_ipv4;
+    uint32_t mtu;  // from the MTU option, host order, 0 if none
+};
+
+// Fields embedded in a Teredo address, deobfuscated. IPv4 addresses and
+// the port are in network byte order, as in a sockaddr_in.
+struct teredo_addr {
+    uint32_t server_ipv4;
+    uint16_t flags;
+    uint16_t client_port;
+    uint32_t client_ipv4;
+};
+
+// A parsed Teredo packet; every pointer refers to the original buffer
+struct teredo_packet {
+    // Authentication encapsulation, present if auth != NULL
+    const unsigned char *auth;
+    const unsigned char *client_id;
+    const unsigned char *auth_value;
+    const unsigned char *nonce;       // TEREDO_NONCE_LEN bytes
+    uint8_t id_len;
+    uint8_t auth_len;
+    uint8_t confirmation;
+
+    // Origin indication, deobfuscated, present if has_origin
+    int has_origin;
+    uint16_t origin_port;
+    uint32_t origin_ipv4;
+
+    // The encapsulated IPv6 packet
+    const unsigned char *ipv6;
+    size_t ipv6_len;
+};
+
+// Returns 1 if addr is a Teredo address, filling *out, else 0
+int teredo_addr_decode(const struct in6_addr *addr, struct teredo_addr *out);
+void teredo_addr_encode(const struct teredo_addr *in, struct in6_addr *out);
+
+// Parse a UDP payload of len bytes. Returns 0 on success, -1 if it is not
+// a well-formed Teredo packet.
+int teredo_parse(const unsigned char *buf, size_t len, struct teredo_packet *pkt);
+
+// A bubble is an IPv6 header with no payload and next header 59
+int teredo_is_bubble(const struct teredo_packet *pkt);
+
+// Write an origin indication for a mapped port/IPv4 (network order) to
+// buf. Returns TEREDO_ORIGIN_LEN.
+size_t teredo_build_origin(unsigned char *buf, uint16_t port, uint32_t ipv4);
+
+// Write an authentication encapsulation to buf. Returns its length,
+// TEREDO_AUTH_MIN_LEN + id_len + auth_len.
+size_t teredo_build_auth(unsigned char *buf, const void *client_id, uint8_t id_len,
+                         const void *auth_value, uint8_t auth_len,
+                         const unsigned char nonce[TEREDO_NONCE_LEN], uint8_t confirmation);
+
+// Qualification (RFC 4380 section 5.2.1). A client sends a router
+// solicitation from a link-local address to all-routers, behind an
+// authentication encapsulation with a fresh nonce. The server answers with
+// a router advertisement to that address carrying the nonce, an origin
+// indication of the client's mapped address and the prefix 2001:0:<server
+// IPv4>::/64, from which the client forms its Teredo address.
+
+// Write a router solicitation to buf. The link-local source carries the
+// cone flag if cone is set. Returns its length.
+size_t teredo_build_rs(unsigned char *buf, const unsigned char nonce[TEREDO_NONCE_LEN], int cone);
+
+// Returns 1 if pkt is a router solicitation with a valid checksum, else 0.
+// *cone is set from the cone flag in its source address.
+int teredo_is_rs(const struct teredo_packet *pkt, int *cone);
+
+// Write the router advertisement answering the solicitation rs, which came
+// from mapped port/IPv4 (network order), to buf. Returns its length.
+size_t teredo_build_ra(unsigned char *buf, const struct teredo_packet *rs, uint32_t server_ipv4,
+                       uint16_t port, uint32_t ipv4);
+
+// Check that pkt is a router advertisement answering the solicitation sent
+// with nonce, and fill *q. Returns 0 on success, -1 if not.
+int teredo_parse_ra(const struct teredo_packet *pkt, const unsigned char nonce[TEREDO_NONCE_LEN],
+                    struct teredo_qualification *q);
+
+#endif
@@ -1,138 +1,728 @@
 // teredo_client.c
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
 #include <arpa/inet.h>
+#include <poll.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
 #include <netinet/in.h>
 
-#define PORT 3544
+#include "teredo.h"
+#include "hist.h"
+#include "pool.h"
+#include "gen.h"
+
+#define PORT TEREDO_PORT
 #define MAX_PACKET_SIZE 9000
 #define MIN_PACKET_SIZE 64
 #define STEP_SIZE 10
 #define NUM_PACKETS 100
+#define DEFAULT_WINDOW 32
+#define DEFAULT_TIMEOUT_MS 1000
+#define IPV6_NEXT_EXPERIMENT 253  // RFC 3692 experimental protocol number
+#define REPLY_OVERHEAD (TEREDO_ORIGIN_LEN + IPV6_HEADER_LEN)
+#define SOCKET_BUFFER (4 * 1024 * 1024)
+#define QUALIFY_ATTEMPTS 3
+#define QUALIFY_TIMEOUT_MS 1000
+#define GEN_DEFAULT_FLOWS 1024
+#define GEN_MAX_FLOWS 65536
+#define GEN_MAX_THREADS 64
+#define GEN_SEND_BURST 32       // due packets sent before looking for echoes
+#define GEN_EVENTS 64
+
+// Load generator settings (see usage())
+static int window = DEFAULT_WINDOW;      // packets in flight at most
+static long send_rate = 0;               // target packets/s, 0 = as fast as the window allows
+static int num_packets = NUM_PACKETS;    // packets per size step
+static long timeout_ms = DEFAULT_TIMEOUT_MS;  // after this an unanswered packet counts as lost
+static int repeats = 1;                  // runs per packet size, merged into one histogram
+static const char *server_ipv4 = "127.0.0.1";  // Teredo runs over IPv4
+// Generator mode (-g): many qualified clients at once
+static int gen_seconds = 0;              // 0 = the size sweep instead
+static int gen_flows = GEN_DEFAULT_FLOWS;
+static int gen_threads = 1;
+static const char *gen_size_spec = GEN_IMIX_NAME;
+static enum gen_pacing gen_pacing = GEN_PACE_CONSTANT;
+
+// Carried at the start of every test payload and echoed back by the
+// server. send_ns is the sender's CLOCK_MONOTONIC, so it is only
+// meaningful to this process.
+struct probe_header {
+    uint32_t seq;     // network byte order
+    uint32_t size;    // payload size of the step, network byte order
+    uint64_t send_ns;
+} __attribute__((packed));
+
+// State shared by the sender and receiver threads for one size step
+struct load_step {
+    int sockfd;
+    int size;
+    _Atomic uint8_t *acked;       // acked[seq] set once by the receiver
+    int wake_fd;                  // eventfd, written once the step is over
+    struct pbuf *rx_buf;          // receive buffer, used by the receiver only
+    _Atomic uint32_t received;
 
-// Teredo header structure
-struct teredo_header {
-    uint8_t version;
-    uint8_t type;
-    uint16_t length;
-    uint32_t client_port;
-    uint32_t client_ip;
+    // Receiver-only until the thread is joined
+    struct hist *rtt;
+    uint64_t last_recv_ns;
 };
 
-void test_performance(int sockfd, struct sockaddr_in6 *server_addr, const char *output_file) {
+// Accumulated over all runs of one packet size
+struct step_totals {
+    int sent;
+    int received;
+    uint64_t send_ns;    // first to last send, summed over runs
+    uint64_t active_ns;  // first send to last echo, summed over runs
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Sleep for the bulk of the wait, then yield until the deadline so the
+// receiver keeps running on a shared core
+static void wait_until(uint64_t deadline) {
+    uint64_t now = now_ns();
+    if (deadline > now + 100000) {
+        uint64_t wake = deadline - 50000;
+        struct timespec ts = { (time_t)(wake / 1000000000ULL), (long)(wake % 1000000000ULL) };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+    while (now_ns() < deadline)
+        sched_yield();
+}
+
+static void *receiver_thread(void *arg) {
+    struct load_step *step = arg;
+    unsigned char *buffer = step->rx_buf->data;
+    size_t buffer_size = pbuf_tailroom(step->rx_buf);
+    size_t expected = (size_t)step->size + IPV6_HEADER_LEN;
+
+    struct pollfd fds[2] = {
+        { .fd = step->sockfd, .events = POLLIN },
+        { .fd = step->wake_fd, .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll failed");
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t value;
+            if (read(step->wake_fd, &value, sizeof(value)) < 0)
+                perror("eventfd read failed");
+            break;
+        }
+
+        ssize_t received = recv(step->sockfd, buffer, buffer_size, MSG_DONTWAIT);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("recv failed");
+            continue;
+        }
+        uint64_t now = now_ns();
+
+        // Expect our IPv6 packet back, intact, behind an origin indication.
+        // Replies left over from an earlier size step fail the length or
+        // size check and are dropped.
+        struct teredo_packet reply;
+        if (teredo_parse(buffer, received, &reply) != 0 || reply.ipv6_len != expected)
+            continue;
+
+        struct probe_header probe;
+        memcpy(&probe, reply.ipv6 + IPV6_HEADER_LEN, sizeof(probe));
+        uint32_t seq = ntohl(probe.seq);
+        if (ntohl(probe.size) != (uint32_t)step->size || seq >= (uint32_t)num_packets)
+            continue;
+        if (atomic_exchange_explicit(&step->acked[seq], 1, memory_order_relaxed))
+            continue;  // duplicate
+
+        hist_record(step->rtt, now - probe.send_ns);
+        step->last_recv_ns = now;
+        atomic_fetch_add_explicit(&step->received, 1, memory_order_release);
+    }
+    return NULL;
+}
+
+// Send num_packets of one size, paced to send_rate and never more than
+// window unanswered at once. Returns the number sent and the first/last
+// send times.
+static int send_step(struct load_step *step, unsigned char *send_buffer,
+                     uint64_t *send_ns, uint64_t *first_send, uint64_t *last_send) {
+    int size = step->size;
+    uint64_t timeout_ns = (uint64_t)timeout_ms * 1000000ULL;
+    uint64_t interval_ns = send_rate > 0 ? 1000000000ULL / (uint64_t)send_rate : 0;
+    uint64_t start = now_ns();
+    int oldest = 0;  // first packet that may still be in flight
+    int sent = 0;
+
+    for (int seq = 0; seq < num_packets; seq++) {
+        if (interval_ns)
+            wait_until(start + (uint64_t)seq * interval_ns);
+
+        // Window full: retire packets that were answered or timed out
+        while (seq - oldest >= window) {
+            uint64_t now = now_ns();
+            while (oldest < seq &&
+                   (atomic_load_explicit(&step->acked[oldest], memory_order_relaxed) ||
+                    now - send_ns[oldest] > timeout_ns))
+                oldest++;
+            if (seq - oldest >= window)
+                sched_yield();
+        }
+
+        struct probe_header probe;
+        probe.seq = htonl((uint32_t)seq);
+        probe.size = htonl((uint32_t)size);
+        probe.send_ns = now_ns();
+        memcpy(send_buffer + IPV6_HEADER_LEN, &probe, sizeof(probe));
+        send_ns[seq] = probe.send_ns;
+
+        if (send(step->sockfd, send_buffer, size + IPV6_HEADER_LEN, 0) < 0) {
+            perror("send failed");
+            continue;
+        }
+        if (sent == 0)
+            *first_send = probe.send_ns;
+        *last_send = probe.send_ns;
+        sent++;
+    }
+    return sent;
+}
+
+// One run of num_packets at one size: start the receiver, send, wait for
+// the echoes (or the timeout), then add the run to totals. The run's RTTs
+// are left in rtt. Returns -1 if the receiver could not be started.
+static int run_step(int sockfd, int wake_fd, struct pbuf *rx_buf, int size,
+                    unsigned char *send_buffer, uint64_t *send_ns,
+                    _Atomic uint8_t *acked, struct hist *rtt, struct step_totals *totals) {
+    struct load_step step;
+    memset(&step, 0, sizeof(step));
+    step.sockfd = sockfd;
+    step.size = size;
+    step.acked = acked;
+    step.wake_fd = wake_fd;
+    step.rx_buf = rx_buf;
+    step.rtt = rtt;
+    for (int i = 0; i < num_packets; i++)
+        atomic_init(&acked[i], 0);
+    hist_reset(rtt);
+
+    pthread_t receiver;
+    if (pthread_create(&receiver, NULL, receiver_thread, &step) != 0) {
+        perror("pthread_create failed");
+        return -1;
+    }
+
+    uint64_t first_send = 0, last_send = 0;
+    int sent = send_step(&step, send_buffer, send_ns, &first_send, &last_send);
+
+    // Drain: wait for the stragglers, or for the timeout to call them lost
+    uint64_t drain_deadline = last_send + (uint64_t)timeout_ms * 1000000ULL;
+    while (atomic_load_explicit(&step.received, memory_order_acquire) < (uint32_t)sent &&
+           now_ns() < drain_deadline)
+        sched_yield();
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0)
+        perror("eventfd write failed");
+    pthread_join(receiver, NULL);
+
+    int received = (int)atomic_load(&step.received);
+    totals->sent += sent;
+    totals->received += received;
+    totals->send_ns += last_send - first_send;
+    if (received > 0 && step.last_recv_ns > first_send)
+        totals->active_ns += step.last_recv_ns - first_send;
+    return 0;
+}
+
+// Qualify with the server (RFC 4380 section 5.2.1): solicit a router
+// advertisement and form our Teredo address from the prefix and the
+// mapped address it reports. Returns 0 on success, -1 if no valid
+// advertisement came back.
+static int qualify(int sockfd, struct in6_addr *teredo_ip, int verbose) {
+    unsigned char nonce[TEREDO_NONCE_LEN], rs[128], buffer[1500];
+
+    for (int attempt = 0; attempt < QUALIFY_ATTEMPTS; attempt++) {
+        if (getrandom(nonce, sizeof(nonce), 0) != sizeof(nonce)) {
+            perror("getrandom failed");
+            return -1;
+        }
+        size_t len = teredo_build_rs(rs, nonce, 0);
+        if (send(sockfd, rs, len, 0) < 0) {
+            perror("send failed");
+            return -1;
+        }
+
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        while (poll(&pfd, 1, QUALIFY_TIMEOUT_MS) > 0) {
+            struct teredo_packet pkt;
+            struct teredo_qualification q;
+            ssize_t received = recv(sockfd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (received < 0 || teredo_parse(buffer, received, &pkt) != 0 ||
+                teredo_parse_ra(&pkt, nonce, &q) != 0)
+                continue;
+
+            struct teredo_addr self = { q.server_ipv4, 0, q.mapped_port, q.mapped_ipv4 };
+            char text[INET6_ADDRSTRLEN];
+            teredo_addr_encode(&self, teredo_ip);
+            if (verbose)
+                printf("Qualified: Teredo address %s (mapped port %u, MTU %u)\n",
+                       inet_ntop(AF_INET6, teredo_ip, text, sizeof(text)), ntohs(q.mapped_port), q.mtu);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void test_performance(int sockfd, const struct in6_addr *teredo_ip, const char *output_file) {
     FILE *fp = fopen(output_file, "w");
     if (!fp) {
         perror("Failed to open output file");
         return;
     }
 
-    fprintf(fp, "PacketSize,Latency(ms),Throughput(Mbps)\n");
+    // Latency is the round trip; throughput is the echoed payload
+    // rate actually achieved, against the offered load the sender put out
+    fprintf(fp, "PacketSize,Latency(ms),P50(us),P90(us),P99(us),P99.9(us),Max(us),"
+                "Throughput(Mbps),OfferedLoad(Mbps),Sent,Received,Loss(%%)\n");
+
+    // Tells the receiver thread a step is over
+    int wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        perror("eventfd failed");
+        fclose(fp);
+        return;
+    }
+
+    int bufsize = SOCKET_BUFFER;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
 
-    // Set receive timeout
-    struct timeval tv;
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    // Send buffers come from the size class that fits each step; the
+    // receive buffer holds the largest reply
+    uint32_t pool_counts[POOL_CLASSES] = { 2 * POOL_CACHE_BATCH, 2 * POOL_CACHE_BATCH, 2 * POOL_CACHE_BATCH };
+    struct pool *pool = pool_create(pool_counts);
+    struct pool_cache *cache = pool != NULL ? pool_cache_create(pool, "Client") : NULL;
+    struct pbuf *rx_buf = cache != NULL ? pbuf_alloc(cache, MAX_PACKET_SIZE + IPV6_HEADER_LEN + REPLY_OVERHEAD) : NULL;
+    uint64_t *send_ns = malloc(num_packets * sizeof(*send_ns));
+    _Atomic uint8_t *acked = malloc(num_packets * sizeof(*acked));
+    struct hist *run_rtt = malloc(sizeof(*run_rtt));
+    struct hist *size_rtt = malloc(sizeof(*size_rtt));
+    if (!rx_buf || !send_ns || !acked || !run_rtt || !size_rtt) {
+        printf("Memory allocation failed\n");
+        pool_destroy(pool);
+        free(send_ns);
+        free(acked);
+        free(run_rtt);
+        free(size_rtt);
+        close(wake_fd);
+        fclose(fp);
+        return;
+    }
 
     for (int size = MIN_PACKET_SIZE; size <= MAX_PACKET_SIZE; size += STEP_SIZE) {
-        char *send_buffer = malloc(size + sizeof(struct teredo_header));
-        char *recv_buffer = malloc(size + sizeof(struct teredo_header));
-        if (!send_buffer || !recv_buffer) {
-            printf("Memory allocation failed for size %d\n", size);
-            continue;
+        struct pbuf *tx_buf = pbuf_alloc(cache, size + IPV6_HEADER_LEN);
+        if (tx_buf == NULL) {
+            printf("Send buffer allocation failed for size %d\n", size);
+            break;
         }
+        unsigned char *send_buffer = tx_buf->data;
 
-        // Prepare Teredo header
-        struct teredo_header *header = (struct teredo_header *)send_buffer;
-        header->version = 1;
-        header->type = 0;
-        header->length = htons(size);
-        header->client_port = htons(PORT);
-        header->client_ip = 0;
+        // A plain Teredo data packet to ourselves, which the server
+        // forwards back to our mapped address: an IPv6 header followed by test data
+        ipv6_build_header(send_buffer, teredo_ip, teredo_ip, IPV6_NEXT_EXPERIMENT, size, 64);
+        memset(send_buffer + IPV6_HEADER_LEN, 'A', size);
 
-        // Fill the rest with test data
-        memset(send_buffer + sizeof(struct teredo_header), 'A', size);
+        printf("Testing with packet size: %d bytes\n", size);
 
-        double total_time = 0;
-        long total_bytes = 0;
-        int successful_packets = 0;
+        // Every run of this size merges into one histogram and one set of totals
+        struct step_totals totals;
+        memset(&totals, 0, sizeof(totals));
+        hist_reset(size_rtt);
+        for (int run = 0; run < repeats; run++) {
+            if (run_step(sockfd, wake_fd, rx_buf, size, send_buffer, send_ns, acked, run_rtt, &totals) < 0)
+                break;
+            hist_merge(size_rtt, run_rtt);
+        }
 
-        printf("Testing with packet size: %d bytes\n", size);
+        double loss = totals.sent > 0 ? 100.0 * (totals.sent - totals.received) / totals.sent : 0.0;
+        double offered = 0.0, throughput = 0.0;
+        if (totals.send_ns > 0)
+            offered = (double)totals.sent * size * 8.0 / (double)totals.send_ns * 1000.0;  // Mbps
+        if (totals.active_ns > 0)
+            throughput = (double)totals.received * size * 8.0 / (double)totals.active_ns * 1000.0;  // Mbps
 
-        for (int i = 0; i < NUM_PACKETS; i++) {
-            struct timeval start, end;
-            gettimeofday(&start, NULL);
-
-            ssize_t sent = sendto(sockfd, send_buffer, size + sizeof(struct teredo_header), 0,
-                                (struct sockaddr *)server_addr, sizeof(*server_addr));
-
-            if (sent > 0) {
-                socklen_t server_len = sizeof(*server_addr);
-                ssize_t received = recvfrom(sockfd, recv_buffer, size + sizeof(struct teredo_header), 0,
-                                          (struct sockaddr *)server_addr, &server_len);
-
-                if (received > sizeof(struct teredo_header)) {
-                    gettimeofday(&end, NULL);
-                    total_bytes += (sent - sizeof(struct teredo_header));
-                    successful_packets++;
-                    
-                    double time_ms = (end.tv_sec - start.tv_sec) * 1000.0 +
-                                   (end.tv_usec - start.tv_usec) / 1000.0;
-                    total_time += time_ms;
-                }
+        // Latency columns: mean RTT in ms, percentiles and max in us, all at ns resolution
+        fprintf(fp, "%d,%.6f,%.3f,%.3f,%.3f,%.3f,%.3f,%.2f,%.2f,%d,%d,%.2f\n",
+                size, hist_mean(size_rtt) / 1e6,
+                hist_percentile(size_rtt, 50) / 1e3, hist_percentile(size_rtt, 90) / 1e3,
+                hist_percentile(size_rtt, 99) / 1e3, hist_percentile(size_rtt, 99.9) / 1e3,
+                size_rtt->max / 1e3, throughput, offered, totals.sent, totals.received, loss);
+        if (totals.received > 0)
+            printf("Size: %d, RTT p50 %.1f us, p99 %.1f us, max %.1f us, Throughput: %.2f Mbps (offered %.2f Mbps), Loss: %.2f%%\n",
+                   size, hist_percentile(size_rtt, 50) / 1e3, hist_percentile(size_rtt, 99) / 1e3,
+                   size_rtt->max / 1e3, throughput, offered, loss);
+        else
+            printf("No successful packets for size %d\n", size);
+        pbuf_free(cache, tx_buf);
+    }
+
+    pbuf_free(cache, rx_buf);
+    pool_destroy(pool);
+    free(send_ns);
+    free(acked);
+    free(run_rtt);
+    free(size_rtt);
+    close(wake_fd);
+    fclose(fp);
+}
+
+// Generator mode: gen_flows clients, each a socket of its own qualified
+// with the server, so a Teredo address and a NAT mapping the server tracks
+// as a peer. Every thread sends open loop over its clients, picked at
+// random per packet, with sizes from the mix and paced to its share of
+// send_rate, and takes the echoes on the same thread through epoll.
+struct gen_client {
+    int id;
+    int flows;
+    int *socks;
+    struct in6_addr *addrs;     // each socket's Teredo address
+    int epfd;
+    double pps;
+    const struct gen_sizes *sizes;
+    pthread_t thread;
+    struct hist *rtt;
+    long sent;
+    long received;
+    long failed;                // sends the kernel refused
+    unsigned long sent_bytes;   // IPv6 packets, as offered to the server
+    unsigned long received_bytes;
+    uint64_t first_send_ns;
+    uint64_t last_send_ns;
+};
+
+// Take every queued echo on the ready sockets
+static void gen_receive(struct gen_client *c, unsigned char *buffer, size_t buffer_size, int timeout_ns) {
+    struct epoll_event events[GEN_EVENTS];
+    struct pollfd pfd = { .fd = c->epfd, .events = POLLIN };
+    struct timespec ts = { timeout_ns / 1000000000, timeout_ns % 1000000000 };
+
+    // ppoll on the epoll fd waits with nanosecond resolution
+    if (timeout_ns > 0 && ppoll(&pfd, 1, &ts, NULL) <= 0)
+        return;
+    int n = epoll_wait(c->epfd, events, GEN_EVENTS, 0);
+    for (int i = 0; i < n; i++) {
+        ssize_t received;
+        while ((received = recv(events[i].data.fd, buffer, buffer_size, MSG_DONTWAIT)) >= 0) {
+            struct teredo_packet reply;
+            struct probe_header probe;
+
+            if (teredo_parse(buffer, received, &reply) != 0 ||
+                reply.ipv6_len < IPV6_HEADER_LEN + sizeof(probe))
+                continue;
+            memcpy(&probe, reply.ipv6 + IPV6_HEADER_LEN, sizeof(probe));
+            if (ntohl(probe.size) != reply.ipv6_len)
+                continue;
+            hist_record(c->rtt, now_ns() - probe.send_ns);
+            c->received++;
+            c->received_bytes += reply.ipv6_len;
+        }
+    }
+}
+
+static void *gen_client_thread(void *arg) {
+    struct gen_client *c = arg;
+    size_t buffer_size = MAX_PACKET_SIZE + IPV6_HEADER_LEN + REPLY_OVERHEAD;
+    unsigned char *tx = malloc(c->sizes->max);
+    unsigned char *rx = malloc(buffer_size);
+    uint64_t rng = gen_seed(c->id);
+    struct gen_pacer pacer;
+    uint32_t seq = 0;
+
+    if (tx == NULL || rx == NULL) {
+        printf("Memory allocation failed\n");
+        free(tx);
+        free(rx);
+        return NULL;
+    }
+    memset(tx, 'A', c->sizes->max);
+
+    uint64_t start = now_ns(), end = start + (uint64_t)gen_seconds * 1000000000ULL, now = start;
+    gen_pacer_init(&pacer, gen_pacing, c->pps, start);
+    c->first_send_ns = start;
+    while (now < end) {
+        for (int burst = 0; burst < GEN_SEND_BURST && gen_pacer_due(&pacer) <= now; burst++) {
+            struct probe_header probe;
+            int size = gen_size(c->sizes, &rng);
+            int flow = (int)gen_pick(&rng, (uint32_t)c->flows);
+
+            // To our own Teredo address; the server forwards it back
+            ipv6_build_header(tx, &c->addrs[flow], &c->addrs[flow], IPV6_NEXT_EXPERIMENT,
+                              size - IPV6_HEADER_LEN, 64);
+            probe.seq = htonl(seq++);
+            probe.size = htonl((uint32_t)size);
+            probe.send_ns = now_ns();
+            memcpy(tx + IPV6_HEADER_LEN, &probe, sizeof(probe));
+            if (send(c->socks[flow], tx, size, 0) < 0) {
+                c->failed++;
+            } else {
+                c->sent++;
+                c->sent_bytes += size;
+                c->last_send_ns = probe.send_ns;
             }
+            gen_pacer_advance(&pacer, &rng);
         }
 
-        if (successful_packets > 0) {
-            double avg_latency = total_time / successful_packets;
-            double throughput = ((total_bytes * 8.0) / (total_time)) * 1000.0 / (1024*1024); // Mbps
-            fprintf(fp, "%d,%.2f,%.2f\n", size, avg_latency, throughput);
-            printf("Size: %d, Latency: %.2f ms, Throughput: %.2f Mbps\n",
-                   size, avg_latency, throughput);
-        } else {
-            fprintf(fp, "%d,0.00,0.00\n", size);
-            printf("No successful packets for size %d\n", size);
+        // Take echoes until the next packet is due
+        now = now_ns();
+        uint64_t due = gen_pacer_due(&pacer);
+        uint64_t wait = due > now ? due - now : 0;
+        if (wait > end - now)
+            wait = end - now;
+        gen_receive(c, rx, buffer_size, (int)(wait < 1000000000ULL ? wait : 999999999ULL));
+        now = now_ns();
+    }
+
+    // Stragglers, until everything is answered or timeout_ms has passed
+    uint64_t drain_end = now_ns() + (uint64_t)timeout_ms * 1000000ULL;
+    while (c->received < c->sent && now_ns() < drain_end)
+        gen_receive(c, rx, buffer_size, 10000000);
+    free(tx);
+    free(rx);
+    return NULL;
+}
+
+// Connected to the server, so a socket only sees replies from it
+static int client_socket(const struct sockaddr_in6 *server_addr) {
+    int sockfd = socket(AF_INET6, SOCK_DGRAM, 0);
+
+    if (sockfd < 0)
+        return -1;
+    if (connect(sockfd, (const struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+void run_generator(const struct sockaddr_in6 *server_addr, const char *output_file) {
+    static struct gen_client clients[GEN_MAX_THREADS];
+    static struct gen_sizes sizes;
+    static struct hist rtt;
+    long sent = 0, received = 0, failed = 0;
+    unsigned long sent_bytes = 0, received_bytes = 0;
+    uint64_t first_send = UINT64_MAX, last_send = 0;
+
+    // Sizes are of the IPv6 packet, which must carry the probe header
+    if (gen_sizes_parse(&sizes, gen_size_spec, MIN_PACKET_SIZE, IPV6_HEADER_LEN + (int)sizeof(struct probe_header),
+                        MAX_PACKET_SIZE + IPV6_HEADER_LEN) < 0)
+        return;
+    if (gen_reserve_fds(gen_flows + gen_threads) < 0) {
+        fprintf(stderr, "Cannot open %d sockets: raise the open file limit (ulimit -n)\n", gen_flows);
+        return;
+    }
+    FILE *fp = fopen(output_file, "w");
+    if (!fp) {
+        perror("Failed to open output file");
+        return;
+    }
+
+    printf("Qualifying %d clients...\n", gen_flows);
+    for (int t = 0; t < gen_threads; t++) {
+        struct gen_client *c = &clients[t];
+
+        c->id = t;
+        c->flows = gen_flows / gen_threads + (t < gen_flows % gen_threads);
+        c->pps = (double)send_rate / gen_threads;
+        c->sizes = &sizes;
+        c->socks = malloc(c->flows * sizeof(*c->socks));
+        c->addrs = malloc(c->flows * sizeof(*c->addrs));
+        c->rtt = malloc(sizeof(*c->rtt));
+        c->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (!c->socks || !c->addrs || !c->rtt || c->epfd < 0) {
+            printf("Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        hist_reset(c->rtt);
+        for (int i = 0; i < c->flows; i++) {
+            struct epoll_event ev = { .events = EPOLLIN };
+            c->socks[i] = client_socket(server_addr);
+            if (c->socks[i] < 0) {
+                perror("Client socket setup failed");
+                exit(EXIT_FAILURE);
+            }
+            if (qualify(c->socks[i], &c->addrs[i], 0) < 0) {
+                fprintf(stderr, "No router advertisement from %s\n", server_ipv4);
+                exit(EXIT_FAILURE);
+            }
+            ev.data.fd = c->socks[i];
+            if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->socks[i], &ev) < 0) {
+                perror("epoll_ctl failed");
+                exit(EXIT_FAILURE);
+            }
         }
+    }
+
+    printf("Generating from %d clients on %d threads for %d s: sizes %s (%d-%d B, mean %.0f B), "
+           "%s pacing at %ld pps (0 = as fast as possible)...\n", gen_flows, gen_threads, gen_seconds,
+           sizes.name, sizes.min, sizes.max, sizes.mean, gen_pacing_name(gen_pacing), send_rate);
+    for (int t = 0; t < gen_threads; t++) {
+        if (pthread_create(&clients[t].thread, NULL, gen_client_thread, &clients[t]) != 0) {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-        free(send_buffer);
-        free(recv_buffer);
+    hist_reset(&rtt);
+    for (int t = 0; t < gen_threads; t++) {
+        struct gen_client *c = &clients[t];
+
+        pthread_join(c->thread, NULL);
+        hist_merge(&rtt, c->rtt);
+        sent += c->sent;
+        received += c->received;
+        failed += c->failed;
+        sent_bytes += c->sent_bytes;
+        received_bytes += c->received_bytes;
+        if (c->sent > 0 && c->first_send_ns < first_send)
+            first_send = c->first_send_ns;
+        if (c->last_send_ns > last_send)
+            last_send = c->last_send_ns;
+        for (int i = 0; i < c->flows; i++)
+            close(c->socks[i]);
+        close(c->epfd);
+        free(c->socks);
+        free(c->addrs);
+        free(c->rtt);
     }
 
+    // Rates over the sending time: what was offered, and what came back of it
+    double seconds = last_send > first_send ? (last_send - first_send) / 1e9 : 0.0;
+    double loss = sent > 0 ? 100.0 * (sent - received) / sent : 0.0;
+    double sent_pps = seconds > 0 ? sent / seconds : 0.0, received_pps = seconds > 0 ? received / seconds : 0.0;
+    double offered = seconds > 0 ? sent_bytes * 8.0 / seconds / 1e6 : 0.0;
+    double throughput = seconds > 0 ? received_bytes * 8.0 / seconds / 1e6 : 0.0;
+
+    fprintf(fp, "Flows,Threads,SizeMix,MeanSize,Pacing,TargetPps,SentPps,ReceivedPps,Latency(ms),P50(us),P90(us),"
+                "P99(us),P99.9(us),Max(us),Throughput(Mbps),OfferedLoad(Mbps),Sent,Received,Loss(%%)\n");
+    fprintf(fp, "%d,%d,%s,%.1f,%s,%ld,%.0f,%.0f,%.6f,%.3f,%.3f,%.3f,%.3f,%.3f,%.2f,%.2f,%ld,%ld,%.2f\n",
+            gen_flows, gen_threads, sizes.name, sizes.mean, gen_pacing_name(gen_pacing), send_rate, sent_pps,
+            received_pps, hist_mean(&rtt) / 1e6, hist_percentile(&rtt, 50) / 1e3, hist_percentile(&rtt, 90) / 1e3,
+            hist_percentile(&rtt, 99) / 1e3, hist_percentile(&rtt, 99.9) / 1e3, rtt.max / 1e3, throughput,
+            offered, sent, received, loss);
     fclose(fp);
+    printf("Sent %.0f pps, received %.0f pps, RTT p50 %.1f us, p99 %.1f us, max %.1f us, "
+           "Throughput: %.2f Mbps (offered %.2f Mbps), Loss: %.2f%%, %ld sends failed\n",
+           sent_pps, received_pps, hist_percentile(&rtt, 50) / 1e3, hist_percentile(&rtt, 99) / 1e3,
+           rtt.max / 1e3, throughput, offered, loss, failed);
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-w window] [-r rate_pps] [-n packets] [-t timeout_ms] [-R repeats] [-s server_ipv4]\n"
+           "       [-g seconds [-F flows] [-T threads] [-z sizes] [-p pacing]] <output_file>\n", prog);
+    printf("  -w  packets in flight at most (default %d, 1 = stop-and-wait)\n", DEFAULT_WINDOW);
+    printf("  -r  target send rate in packets/s (default 0 = limited only by the window)\n");
+    printf("  -n  packets per packet size (default %d)\n", NUM_PACKETS);
+    printf("  -t  ms before an unanswered packet counts as lost (default %d)\n", DEFAULT_TIMEOUT_MS);
+    printf("  -R  runs per packet size, merged into one set of percentiles (default 1)\n");
+    printf("  -s  Teredo server to qualify with and send through (default 127.0.0.1)\n");
+    printf("  -g  generator mode for this many seconds: many clients, a size mix, open-loop pacing\n"
+           "      at -r in total; one CSV row (-w, -n and -R do not apply)\n");
+    printf("  -F  generator clients, one socket and Teredo address each (default %d, at most %d)\n",
+           GEN_DEFAULT_FLOWS, GEN_MAX_FLOWS);
+    printf("  -T  generator threads, the clients split between them (default 1, at most %d)\n", GEN_MAX_THREADS);
+    printf("  -z  IPv6 packet sizes: fixed[:<bytes>], imix (default; 7:4:1 of 40, 576 and 1500 B)\n"
+           "      or cdf:<file> (lines of \"<bytes> <cumulative probability>\"); at least %d B\n",
+           IPV6_HEADER_LEN + (int)sizeof(struct probe_header));
+    printf("  -p  pacing: constant (default) or poisson (exponential gaps)\n");
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <output_file>\n", argv[0]);
+    int opt;
+    while ((opt = getopt(argc, argv, "w:r:n:t:R:s:g:F:T:z:p:")) != -1) {
+        switch (opt) {
+        case 'w': window = atoi(optarg); break;
+        case 'r': send_rate = atol(optarg); break;
+        case 'n': num_packets = atoi(optarg); break;
+        case 't': timeout_ms = atol(optarg); break;
+        case 'R': repeats = atoi(optarg); break;
+        case 's': server_ipv4 = optarg; break;
+        case 'g': gen_seconds = atoi(optarg); break;
+        case 'F': gen_flows = atoi(optarg); break;
+        case 'T': gen_threads = atoi(optarg); break;
+        case 'z': gen_size_spec = optarg; break;
+        case 'p':
+            if (gen_pacing_parse(optarg, &gen_pacing) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || window < 1 || send_rate < 0 || num_packets < 1 || timeout_ms < 1 ||
+        repeats < 1 || gen_seconds < 0 || gen_flows < 1 || gen_flows > GEN_MAX_FLOWS || gen_threads < 1 ||
+        gen_threads > GEN_MAX_THREADS || gen_threads > gen_flows) {
+        usage(argv[0]);
         return 1;
     }
 
     int sockfd;
     struct sockaddr_in6 server_addr;
 
-    // Create IPv6 UDP socket
-    if ((sockfd = socket(AF_INET6, SOCK_DGRAM, 0)) < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
-
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin6_family = AF_INET6;
     server_addr.sin6_port = htons(PORT);
-    
-    // Convert localhost (::1) to binary form
-    if (inet_pton(AF_INET6, "::1", &server_addr.sin6_addr) <= 0) {
-        perror("Invalid address");
+
+    // The server's IPv4 address, v4-mapped for the dual-stack socket
+    struct in_addr ipv4;
+    if (inet_pton(AF_INET, server_ipv4, &ipv4) != 1) {
+        fprintf(stderr, "Invalid server address %s\n", server_ipv4);
+        exit(EXIT_FAILURE);
+    }
+    server_addr.sin6_addr.s6_addr[10] = 0xff;
+    server_addr.sin6_addr.s6_addr[11] = 0xff;
+    memcpy(&server_addr.sin6_addr.s6_addr[12], &ipv4, 4);
+
+    if (gen_seconds > 0) {
+        run_generator(&server_addr, argv[optind]);
+        return 0;
+    }
+
+    if ((sockfd = client_socket(&server_addr)) < 0) {
+        perror("Socket setup failed");
         exit(EXIT_FAILURE);
     }
 
-    printf("Starting performance test...\n");
-    test_performance(sockfd, &server_addr, argv[1]);
+    struct in6_addr teredo_ip;
+    if (qualify(sockfd, &teredo_ip, 1) < 0) {
+        fprintf(stderr, "No router advertisement from %s\n", server_ipv4);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Starting performance test (window %d, rate %ld pps, %d packets per size)...\n",
+           window, send_rate, num_packets);
+    test_performance(sockfd, &teredo_ip, argv[optind]);
 
     close(sockfd);
     return 0;
-}
\ No newline at end of file
+}
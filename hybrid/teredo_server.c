@@ -1,4 +1,9 @@
-// teredo_server.c
+// teredo_server.c - Teredo server (RFC 4380): qualification, forwarding
+// between its clients with origin indications, and relaying to other
+// servers' clients once a bubble exchange has opened their NAT. Worker
+// threads each serve their own SO_REUSEPORT socket in recvmmsg/sendmmsg
+// batches; the main thread expires peers and merges the workers' stats.
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,30 +11,482 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
-#define PORT 3544  // Standard Teredo port
-#define BUFFER_SIZE 9000
+#include "teredo.h"
+#include "peer.h"
+#include "evloop.h"
+#include "uring.h"
 
-// Teredo header structure
-struct teredo_header {
-    uint8_t version;
-    uint8_t type;
-    uint16_t length;
-    uint32_t client_port;
-    uint32_t client_ip;
+#define PORT TEREDO_PORT  // Standard Teredo port
+#define BUFFER_SIZE 65535  // largest UDP payload
+#define HEADROOM TEREDO_ORIGIN_LEN  // room to prepend the origin indication
+#define SLOT_SIZE (HEADROOM + BUFFER_SIZE)
+#define SERVE_BATCH 32     // datagrams per recvmmsg/sendmmsg
+#define SOCKET_BUFFER (4 * 1024 * 1024)  // default SO_RCVBUF/SO_SNDBUF, as the client's
+#define MAX_WORKERS 64
+#define URING_BUFFERS 64   // provided receive buffers for the io_uring path
+#define URING_BGID 0
+#define URING_RECV 1       // user_data kinds, above the 16-bit buffer id
+#define URING_SEND 2
+#define OVFL_CONTROL_LEN CMSG_SPACE(sizeof(uint32_t))  // the SO_RXQ_OVFL drop count
+// A multishot recvmsg buffer: kernel header, the client's address, the
+// drop count, payload
+#define URING_BUFFER_SIZE \
+    (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in6) + OVFL_CONTROL_LEN + BUFFER_SIZE)
+
+#define RA_MAX_LEN 128      // authentication, origin indication and the advertisement
+#define BUBBLE_RETRIES 3    // indirect bubbles sent to a peer before giving up on it
+#define BUBBLE_INTERVAL 2   // s between them (RFC 4380 section 5.2.6)
+#define EXPIRE_INTERVAL_US 1000000  // peer cache timer wheel tick
+#define DEFAULT_STATS_INTERVAL 1    // s between merged stats lines
+
+// Server and relay state, shared by every worker and both I/O paths. The
+// peer cache is the only shared mutable state, and it is thread safe.
+struct teredo_service {
+    uint32_t ipv4;              // our IPv4 address, advertised in the Teredo prefix (network order)
+    struct peer_cache *peers;
+};
+
+// Per-worker counters. Only the worker writes them; the stats timer on the
+// main thread reads them, so relaxed single-writer updates suffice.
+struct serve_stats {
+    _Atomic unsigned long received;
+    _Atomic unsigned long qualified;    // router advertisements sent
+    _Atomic unsigned long forwarded;    // packets forwarded to a client or a peer
+    _Atomic unsigned long bubbles;      // bubbles received (and forwarded like any packet)
+    _Atomic unsigned long bubbles_sent; // indirect bubbles sent while punching a hole to a peer
+    _Atomic unsigned long dropped;      // malformed, spoofed, from an unqualified client or not ours to route
+    _Atomic unsigned long overflows;    // dropped by the kernel on a full receive buffer (SO_RXQ_OVFL)
+};
+
+#define STAT_ADD(counter, n) \
+    atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), \
+                          memory_order_relaxed)
+#define STAT_GET(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+static struct teredo_service service;
+static int socket_buffer = SOCKET_BUFFER;
+
+static void mapped_sockaddr(struct sockaddr_in6 *sa, uint32_t ipv4, uint16_t port) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sin6_family = AF_INET6;
+    sa->sin6_port = port;
+    sa->sin6_addr.s6_addr[10] = 0xff;
+    sa->sin6_addr.s6_addr[11] = 0xff;
+    memcpy(&sa->sin6_addr.s6_addr[12], &ipv4, 4);
+}
+
+// Take the socket's drop count from a datagram's SO_RXQ_OVFL message. The
+// kernel reports its running total, and only once it is no longer 0.
+static void note_overflows(struct serve_stats *stats, struct msghdr *msg) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            atomic_store_explicit(&stats->overflows, drops, memory_order_relaxed);
+        }
+    }
+}
+
+// Handle the datagram of len bytes at payload, received from *from, with
+// HEADROOM writable bytes in front of it. Returns the length of the
+// datagram to send to *to, built in place at *reply, or 0 to send nothing.
+//
+// A router solicitation is answered with an advertisement, and the client
+// is cached under the Teredo address it will form. Any other packet must
+// come from the mapped address in its Teredo source. A packet for one of
+// our qualified clients goes to the client's mapped address behind an
+// origin indication of the sender; that is also how an indirect bubble
+// reaches it, telling it where to send the direct bubble that opens its
+// NAT. A packet from one of our clients to another server's client is
+// relayed: sent straight to the peer once the peer has sent us direct
+// traffic, and until then dropped while bubbles go to the peer through its
+// server.
+static size_t teredo_serve(struct teredo_service *svc, struct serve_stats *stats, unsigned char *payload,
+                           size_t len, const struct sockaddr_in6 *from, struct sockaddr_in6 *to,
+                           unsigned char **reply) {
+    struct teredo_packet pkt;
+    struct teredo_addr src, dst;
+    struct in6_addr src_addr, dst_addr;
+    struct peer_info info;
+    uint32_t from_ipv4, slot, now = peer_now();
+    int cone;
+
+    // Teredo runs over IPv4; the dual-stack socket shows IPv4 senders v4-mapped
+    if (!IN6_IS_ADDR_V4MAPPED(&from->sin6_addr) || teredo_parse(payload, len, &pkt) != 0)
+        goto drop;
+    memcpy(&from_ipv4, &from->sin6_addr.s6_addr[12], 4);
+
+    if (teredo_is_rs(&pkt, &cone)) {
+        unsigned char ra[RA_MAX_LEN];
+        struct teredo_addr client = { svc->ipv4, cone ? TEREDO_FLAG_CONE : 0, from->sin6_port, from_ipv4 };
+
+        teredo_addr_encode(&client, &src_addr);
+        peer_update(svc->peers, &src_addr, PEER_QUALIFIED, 0, now);
+        size_t n = teredo_build_ra(ra, &pkt, svc->ipv4, from->sin6_port, from_ipv4);
+        memcpy(payload, ra, n);
+        *to = *from;
+        *reply = payload;
+        STAT_ADD(stats->qualified, 1);
+        return n;
+    }
+
+    // Native IPv6 addresses are not routed: there is no IPv6 uplink here
+    memcpy(&src_addr, pkt.ipv6 + 8, sizeof(src_addr));
+    memcpy(&dst_addr, pkt.ipv6 + 24, sizeof(dst_addr));
+    if (!teredo_addr_decode(&src_addr, &src) || !teredo_addr_decode(&dst_addr, &dst) ||
+        src.client_port != from->sin6_port || src.client_ipv4 != from_ipv4)
+        goto drop;
+
+    slot = peer_lookup(svc->peers, &src_addr, &info);
+    if (src.server_ipv4 == svc->ipv4) {
+        if (slot == PEER_NONE)
+            goto drop;  // must qualify first
+        peer_touch(svc->peers, slot, now);
+    } else if (slot == PEER_NONE || info.state != PEER_TRUSTED) {
+        // Another server's client reached us directly: its mapping works
+        peer_update(svc->peers, &src_addr, PEER_TRUSTED, 0, now);
+    } else {
+        peer_touch(svc->peers, slot, now);
+    }
+    if (teredo_is_bubble(&pkt))
+        STAT_ADD(stats->bubbles, 1);
+
+    if (dst.server_ipv4 == svc->ipv4) {
+        if (peer_lookup(svc->peers, &dst_addr, &info) == PEER_NONE)
+            goto drop;
+        *reply = (unsigned char *)pkt.ipv6 - TEREDO_ORIGIN_LEN;
+        teredo_build_origin(*reply, from->sin6_port, from_ipv4);
+        mapped_sockaddr(to, dst.client_ipv4, dst.client_port);
+        STAT_ADD(stats->forwarded, 1);
+        return TEREDO_ORIGIN_LEN + pkt.ipv6_len;
+    }
+    if (src.server_ipv4 != svc->ipv4)
+        goto drop;  // between two other servers' clients
+
+    slot = peer_lookup(svc->peers, &dst_addr, &info);
+    if (slot != PEER_NONE && info.state == PEER_TRUSTED) {
+        *reply = (unsigned char *)pkt.ipv6;
+        mapped_sockaddr(to, dst.client_ipv4, dst.client_port);
+        STAT_ADD(stats->forwarded, 1);
+        return pkt.ipv6_len;
+    }
+    if (slot == PEER_NONE ||
+        (info.bubbles < BUBBLE_RETRIES && now - info.last_seen >= BUBBLE_INTERVAL)) {
+        // The packet is given up; its bytes become the bubble
+        uint8_t bubbles = slot == PEER_NONE ? 1 : info.bubbles + 1;
+        *reply = (unsigned char *)pkt.ipv6;
+        ipv6_build_header(*reply, &src_addr, &dst_addr, IPV6_NEXT_NONE, 0, 255);
+        mapped_sockaddr(to, dst.server_ipv4, htons(TEREDO_PORT));
+        peer_update(svc->peers, &dst_addr, PEER_PENDING, bubbles, now);
+        STAT_ADD(stats->bubbles_sent, 1);
+        STAT_ADD(stats->dropped, 1);
+        return IPV6_HEADER_LEN;
+    }
+
+drop:
+    STAT_ADD(stats->dropped, 1);
+    return 0;
+}
+
+static void serve_expire(void *arg) {
+    peer_expire(arg, peer_now());
+}
+
+// io_uring path: the reply is built in place in the receive buffer and
+// sent from there; the buffer goes back to the kernel when the send completes
+struct serve_uring {
+    int fd;
+    struct serve_stats *stats;  // the owning worker's
+    struct uring ring;
+    struct uring_buf_ring bufs;
+    struct msghdr recv_msg;
+    unsigned char *buffers;     // URING_BUFFERS * URING_BUFFER_SIZE
+    int recv_armed;
+    int recycled;
+    struct {
+        struct msghdr msg;
+        struct iovec iov;
+        struct sockaddr_in6 dest;
+    } slots[URING_BUFFERS];
+};
+
+static void serve_uring_recycle(struct serve_uring *u, uint16_t bid) {
+    uring_buf_ring_add(&u->bufs, u->buffers + (size_t)bid * URING_BUFFER_SIZE, URING_BUFFER_SIZE, bid);
+    u->recycled++;
+}
+
+static struct io_uring_sqe *serve_uring_sqe(struct serve_uring *u) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+
+    if (sqe == NULL && uring_submit(&u->ring) >= 0)
+        sqe = uring_get_sqe(&u->ring);
+    return sqe;
+}
+
+static void serve_uring_arm(struct serve_uring *u) {
+    struct io_uring_sqe *sqe = serve_uring_sqe(u);
+
+    if (sqe == NULL)
+        return;
+    uring_prep_recvmsg_multishot(sqe, u->fd, &u->recv_msg, URING_BGID, URING_RECV << 16);
+    u->recv_armed = 1;
+}
+
+// A datagram landed in buffer bid: queue its reply, or recycle the buffer
+static void serve_uring_received(struct serve_uring *u, uint16_t bid, int res) {
+    unsigned char *buf = u->buffers + (size_t)bid * URING_BUFFER_SIZE;
+    struct sockaddr_in6 client;
+    struct msghdr control;
+    unsigned char *reply;
+    void *name, *payload;
+
+    int received = uring_recvmsg_parse(buf, res, &u->recv_msg, &name, &control, &payload);
+    if (received < 0) {
+        serve_uring_recycle(u, bid);
+        return;
+    }
+
+    // A reply may overwrite the tail of the kernel's header, the address
+    // and the drop count, so take them first
+    memcpy(&client, name, sizeof(client));
+    note_overflows(u->stats, &control);
+    STAT_ADD(u->stats->received, 1);
+    size_t n = teredo_serve(&service, u->stats, payload, received, &client, &u->slots[bid].dest, &reply);
+    struct io_uring_sqe *sqe = n > 0 ? serve_uring_sqe(u) : NULL;
+    if (sqe == NULL) {
+        serve_uring_recycle(u, bid);
+        return;
+    }
+    u->slots[bid].iov.iov_base = reply;
+    u->slots[bid].iov.iov_len = n;
+    uring_prep_sendmsg(sqe, u->fd, &u->slots[bid].msg, (URING_SEND << 16) | bid);
+}
+
+// Ring fd readable: reap completions, then publish returned buffers and
+// submit the replies in one io_uring_enter
+static void serve_uring_ready(void *arg) {
+    struct serve_uring *u = arg;
+
+    while (1) {
+        struct io_uring_cqe *cqe;
+        int seen = 0;
+
+        u->recycled = 0;
+        while ((cqe = uring_peek_cqe(&u->ring)) != NULL) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+
+            uring_cqe_seen(&u->ring);
+            seen++;
+            if ((data >> 16) == URING_SEND) {
+                serve_uring_recycle(u, (uint16_t)data);
+                continue;
+            }
+            if (!(flags & IORING_CQE_F_MORE))
+                u->recv_armed = 0;
+            if (res < 0) {
+                if (res != -ENOBUFS)
+                    fprintf(stderr, "io_uring recvmsg failed: %s\n", strerror(-res));
+                continue;
+            }
+            if (flags & IORING_CQE_F_BUFFER)
+                serve_uring_received(u, (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT), res);
+        }
+        if (seen == 0)
+            break;
+
+        if (u->recycled > 0) {
+            uring_buf_ring_publish(&u->bufs);
+            if (!u->recv_armed)
+                serve_uring_arm(u);
+        }
+        if (uring_submit(&u->ring) < 0)
+            perror("io_uring submit failed");
+    }
+}
+
+// Set up the io_uring path on fd. Returns -1 if io_uring or provided
+// buffer rings are unavailable.
+static int serve_uring_setup(struct serve_uring *u, int fd, struct serve_stats *stats, struct evloop *loop) {
+    u->fd = fd;
+    u->stats = stats;
+    u->buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if (u->buffers == NULL || uring_init(&u->ring, 2 * URING_BUFFERS) < 0)
+        return -1;
+    if (uring_buf_ring_init(&u->ring, &u->bufs, URING_BUFFERS, URING_BGID) < 0) {
+        uring_exit(&u->ring);
+        return -1;
+    }
+
+    u->recv_msg.msg_namelen = sizeof(struct sockaddr_in6);
+    u->recv_msg.msg_controllen = OVFL_CONTROL_LEN;
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        u->slots[i].msg.msg_name = &u->slots[i].dest;
+        u->slots[i].msg.msg_namelen = sizeof(u->slots[i].dest);
+        u->slots[i].msg.msg_iov = &u->slots[i].iov;
+        u->slots[i].msg.msg_iovlen = 1;
+        serve_uring_recycle(u, (uint16_t)i);
+    }
+    uring_buf_ring_publish(&u->bufs);
+
+    if (evloop_add_fd(loop, u->ring.fd, serve_uring_ready, u) < 0)
+        return -1;
+    serve_uring_arm(u);
+    return uring_submit(&u->ring) < 0 ? -1 : 0;
+}
+
+// One worker per thread, each with its own socket on the port. The kernel
+// spreads clients across the sockets by 4-tuple hash (SO_REUSEPORT), so a
+// client's packets always reach the same worker; the peer cache is shared.
+struct serve_worker {
+    int id;
+    int cpu;                    // -1 when not pinned
+    int fd;
+    int use_uring;
+    pthread_t thread;
+    struct evloop *loop;
+    struct serve_uring uring;
+    // recvmmsg/sendmmsg path: replies are built in place in the receive slots
+    unsigned char *buffers;     // SERVE_BATCH * SLOT_SIZE
+    struct mmsghdr rx[SERVE_BATCH];
+    struct iovec rx_iov[SERVE_BATCH];
+    struct sockaddr_in6 rx_addr[SERVE_BATCH];
+    union {
+        char buf[OVFL_CONTROL_LEN];
+        struct cmsghdr align;
+    } rx_control[SERVE_BATCH];
+    struct mmsghdr tx[SERVE_BATCH];
+    struct iovec tx_iov[SERVE_BATCH];
+    struct sockaddr_in6 tx_addr[SERVE_BATCH];
+    // On a cache line of its own, away from the worker next door
+    _Alignas(64) struct serve_stats stats;
 };
 
-int main() {
-    int server_fd;
-    struct sockaddr_in6 server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    char buffer[BUFFER_SIZE];
+static struct serve_worker workers[MAX_WORKERS];
+static int worker_count = 1;
+
+// Pin the calling thread to one CPU
+static void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        fprintf(stderr, "Failed to pin thread to CPU %d\n", cpu);
+}
+
+// Send the batch's replies with sendmmsg, resuming where it stops short. A
+// full socket buffer drops the rest, as a lost datagram would.
+static void serve_send(struct serve_worker *w, int count) {
+    int sent = 0;
+
+    while (sent < count) {
+        int n = sendmmsg(w->fd, w->tx + sent, count - sent, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("sendmmsg failed");
+            return;
+        }
+        sent += n;
+    }
+}
+
+// Socket readable: serve recvmmsg batches until the socket is drained
+static void serve_readable(void *arg) {
+    struct serve_worker *w = arg;
+
+    while (1) {
+        int count = 0;
+
+        // The kernel shortens each name and control length to what it wrote
+        for (int i = 0; i < SERVE_BATCH; i++) {
+            w->rx[i].msg_hdr.msg_namelen = sizeof(w->rx_addr[i]);
+            w->rx[i].msg_hdr.msg_controllen = sizeof(w->rx_control[i]);
+        }
+        int received = recvmmsg(w->fd, w->rx, SERVE_BATCH, MSG_DONTWAIT, NULL);
+        if (received < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("recvmmsg failed");
+            return;
+        }
+
+        STAT_ADD(w->stats.received, received);
+        // The drop count only grows, so the batch's last datagram has it
+        note_overflows(&w->stats, &w->rx[received - 1].msg_hdr);
+        for (int i = 0; i < received; i++) {
+            unsigned char *reply;
+            size_t n = teredo_serve(&service, &w->stats, w->buffers + (size_t)i * SLOT_SIZE + HEADROOM,
+                                    w->rx[i].msg_len, &w->rx_addr[i], &w->tx_addr[count], &reply);
+            if (n == 0)
+                continue;
+            w->tx_iov[count].iov_base = reply;
+            w->tx_iov[count].iov_len = n;
+            count++;
+        }
+        if (count > 0)
+            serve_send(w, count);
+        if (received < SERVE_BATCH)
+            return;
+    }
+}
+
+// Open the worker's socket and loop. Errors are fatal: they happen before
+// any worker runs.
+static void serve_setup(struct serve_worker *w, int id, int cpu, int use_uring) {
+    struct sockaddr_in6 server_addr;
+    int opt = 1;
+
+    w->id = id;
+    w->cpu = cpu;
+    w->buffers = malloc((size_t)SERVE_BATCH * SLOT_SIZE);
+    if (w->buffers == NULL) {
+        fprintf(stderr, "Receive buffer allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < SERVE_BATCH; i++) {
+        w->rx_iov[i].iov_base = w->buffers + (size_t)i * SLOT_SIZE + HEADROOM;
+        w->rx_iov[i].iov_len = BUFFER_SIZE;
+        w->rx[i].msg_hdr.msg_name = &w->rx_addr[i];
+        w->rx[i].msg_hdr.msg_iov = &w->rx_iov[i];
+        w->rx[i].msg_hdr.msg_iovlen = 1;
+        w->rx[i].msg_hdr.msg_control = w->rx_control[i].buf;
+        w->tx[i].msg_hdr.msg_name = &w->tx_addr[i];
+        w->tx[i].msg_hdr.msg_namelen = sizeof(w->tx_addr[i]);
+        w->tx[i].msg_hdr.msg_iov = &w->tx_iov[i];
+        w->tx[i].msg_hdr.msg_iovlen = 1;
+    }
 
-    // Create IPv6 UDP socket
-    if ((server_fd = socket(AF_INET6, SOCK_DGRAM, 0)) < 0) {
+    // Create IPv6 UDP socket; IPv4 clients arrive v4-mapped
+    if ((w->fd = socket(AF_INET6, SOCK_DGRAM, 0)) < 0) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
+    // Every worker binds its own socket to the port
+    if (setsockopt(w->fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt SO_REUSEPORT failed");
+        exit(EXIT_FAILURE);
+    }
+    // Bursts from many clients outrun the default buffers long before the
+    // worker does; the kernel caps the size at net.core.rmem_max/wmem_max
+    if (setsockopt(w->fd, SOL_SOCKET, SO_RCVBUF, &socket_buffer, sizeof(socket_buffer)) < 0 ||
+        setsockopt(w->fd, SOL_SOCKET, SO_SNDBUF, &socket_buffer, sizeof(socket_buffer)) < 0)
+        perror("setsockopt SO_RCVBUF/SO_SNDBUF failed");
+    // Have the kernel tell us how many datagrams it dropped on a full buffer
+    if (setsockopt(w->fd, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof(opt)) < 0)
+        perror("setsockopt SO_RXQ_OVFL failed");
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin6_family = AF_INET6;
@@ -37,29 +494,198 @@ int main() {
     server_addr.sin6_port = htons(PORT);
 
     // Bind socket to port
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    if (bind(w->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("Bind failed");
         exit(EXIT_FAILURE);
     }
 
-    printf("Teredo Server listening on port %d...\n", PORT);
+    if ((w->loop = evloop_create()) == NULL) {
+        perror("Event loop setup failed");
+        exit(EXIT_FAILURE);
+    }
+    w->use_uring = use_uring;
+    if (use_uring && serve_uring_setup(&w->uring, w->fd, &w->stats, w->loop) < 0) {
+        perror("io_uring unavailable, using recvmmsg/sendmmsg");
+        w->use_uring = 0;
+    }
+    if (!w->use_uring && evloop_add_fd(w->loop, w->fd, serve_readable, w) < 0) {
+        perror("Event loop setup failed");
+        exit(EXIT_FAILURE);
+    }
+}
 
-    while (1) {
-        ssize_t received = recvfrom(server_fd, buffer, BUFFER_SIZE, 0,
-                                  (struct sockaddr *)&client_addr, &client_len);
-        
-        if (received > sizeof(struct teredo_header)) {
-            struct teredo_header *header = (struct teredo_header *)buffer;
-            
-            // Verify Teredo header
-            if (header->version == 1) {
-                // Echo back the payload
-                sendto(server_fd, buffer, received, 0,
-                      (struct sockaddr *)&client_addr, client_len);
+static void *serve_thread(void *arg) {
+    struct serve_worker *w = arg;
+
+    pin_to_cpu(w->cpu);
+    evloop_run(w->loop);
+    return NULL;
+}
+
+static void serve_cleanup(struct serve_worker *w) {
+    if (w->use_uring) {
+        uring_buf_ring_exit(&w->uring.ring, &w->uring.bufs);
+        uring_exit(&w->uring.ring);
+    }
+    free(w->uring.buffers);
+    evloop_destroy(w->loop);
+    close(w->fd);
+    free(w->buffers);
+}
+
+// Every worker's counters added up
+static void stats_merge(struct serve_stats *total) {
+    memset(total, 0, sizeof(*total));
+    for (int i = 0; i < worker_count; i++) {
+        struct serve_stats *s = &workers[i].stats;
+        STAT_ADD(total->received, STAT_GET(s->received));
+        STAT_ADD(total->qualified, STAT_GET(s->qualified));
+        STAT_ADD(total->forwarded, STAT_GET(s->forwarded));
+        STAT_ADD(total->bubbles, STAT_GET(s->bubbles));
+        STAT_ADD(total->bubbles_sent, STAT_GET(s->bubbles_sent));
+        STAT_ADD(total->dropped, STAT_GET(s->dropped));
+        STAT_ADD(total->overflows, STAT_GET(s->overflows));
+    }
+}
+
+static void print_stats(const char *who, struct serve_stats *s) {
+    printf("%s: %lu received, %lu qualified, %lu forwarded, %lu bubbles in, %lu bubbles sent, %lu dropped, "
+           "%lu dropped by the kernel\n",
+           who, STAT_GET(s->received), STAT_GET(s->qualified), STAT_GET(s->forwarded), STAT_GET(s->bubbles),
+           STAT_GET(s->bubbles_sent), STAT_GET(s->dropped), STAT_GET(s->overflows));
+}
+
+// Stats timer: one line per interval with the merged rates, skipped while
+// the server is idle
+static struct {
+    long interval;              // s
+    struct serve_stats last;
+} stats_timer;
+
+static void stats_tick(void *arg) {
+    struct serve_stats now, *last = &stats_timer.last;
+    long interval = stats_timer.interval;
+
+    (void)arg;
+    stats_merge(&now);
+    unsigned long received = STAT_GET(now.received) - STAT_GET(last->received);
+    unsigned long overflows = STAT_GET(now.overflows) - STAT_GET(last->overflows);
+    if (received > 0 || overflows > 0) {
+        unsigned long busiest = 0;
+        for (int i = 0; i < worker_count; i++) {
+            if (STAT_GET(workers[i].stats.received) > busiest)
+                busiest = STAT_GET(workers[i].stats.received);
+        }
+        printf("Teredo Server: %lu pps in, %lu pps forwarded, %lu qualified, %lu dropped, "
+               "%lu dropped by the kernel (%d workers, busiest %.0f%% of all received)\n",
+               received / interval, (STAT_GET(now.forwarded) - STAT_GET(last->forwarded)) / interval,
+               STAT_GET(now.qualified) - STAT_GET(last->qualified),
+               STAT_GET(now.dropped) - STAT_GET(last->dropped), overflows, worker_count,
+               STAT_GET(now.received) > 0 ? 100.0 * busiest / STAT_GET(now.received) : 0.0);
+        fflush(stdout);
+    }
+    *last = now;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-u] [-w workers] [-i seconds] [-a server_ipv4] [-P max_peers] [-B bytes]\n",
+            prog);
+    fprintf(stderr, "  -u  use io_uring (falls back to recvmmsg/sendmmsg)\n");
+    fprintf(stderr, "  -w  worker threads, each with its own SO_REUSEPORT socket (default 1, at most %d)\n",
+            MAX_WORKERS);
+    fprintf(stderr, "  -i  seconds between merged stats lines, 0 for none (default %d)\n", DEFAULT_STATS_INTERVAL);
+    fprintf(stderr, "  -a  IPv4 address advertised in the clients' Teredo prefix (default 127.0.0.1)\n");
+    fprintf(stderr, "  -P  peers cached at most (default %d)\n", PEER_DEFAULT_MAX);
+    fprintf(stderr, "  -B  receive and send buffer of each worker socket (default %d)\n", SOCKET_BUFFER);
+}
+
+int main(int argc, char *argv[]) {
+    struct in_addr server_ipv4 = { htonl(INADDR_LOOPBACK) };
+    struct peer_stats stats;
+    struct serve_stats total;
+    struct evloop *loop;
+    long max_peers = PEER_DEFAULT_MAX;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int use_uring = 0;
+    int opt;
+
+    stats_timer.interval = DEFAULT_STATS_INTERVAL;
+    while ((opt = getopt(argc, argv, "uw:i:a:P:B:")) != -1) {
+        switch (opt) {
+        case 'u': use_uring = 1; break;
+        case 'w': worker_count = atoi(optarg); break;
+        case 'i': stats_timer.interval = atol(optarg); break;
+        case 'a':
+            if (inet_pton(AF_INET, optarg, &server_ipv4) != 1) {
+                usage(argv[0]);
+                return 1;
             }
+            break;
+        case 'P': max_peers = atol(optarg); break;
+        case 'B': socket_buffer = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
         }
     }
+    if (max_peers < 1 || max_peers > 0x7fffffffL || worker_count < 1 || worker_count > MAX_WORKERS ||
+        stats_timer.interval < 0 || socket_buffer < 1) {
+        usage(argv[0]);
+        return 1;
+    }
 
-    close(server_fd);
+    service.ipv4 = server_ipv4.s_addr;
+    service.peers = peer_cache_create((uint32_t)max_peers, PEER_DEFAULT_TIMEOUT);
+    if (service.peers == NULL) {
+        fprintf(stderr, "Peer cache allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Serve until SIGINT/SIGTERM. The main thread expires peers and prints
+    // the stats; the workers only serve.
+    if (evloop_init_signals() < 0 || (loop = evloop_create()) == NULL ||
+        evloop_add_timer(loop, EXPIRE_INTERVAL_US, serve_expire, service.peers) < 0 ||
+        (stats_timer.interval > 0 &&
+         evloop_add_timer(loop, stats_timer.interval * 1000000L, stats_tick, NULL) < 0)) {
+        perror("Event loop setup failed");
+        exit(EXIT_FAILURE);
+    }
+    // With more than one worker, pin them round-robin across the online CPUs
+    for (int i = 0; i < worker_count; i++)
+        serve_setup(&workers[i], i, worker_count > 1 ? (int)(i % cpus) : -1, use_uring);
+    use_uring = workers[0].use_uring;
+
+    peer_cache_stats(service.peers, &stats);
+    printf("Teredo Server %s listening on port %d%s with %d worker%s, peer cache %ld peers (%zu MB)...\n",
+           inet_ntoa(server_ipv4), PORT, use_uring ? " (io_uring)" : "", worker_count,
+           worker_count > 1 ? "s" : "", max_peers, stats.bytes >> 20);
+    fflush(stdout);
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, serve_thread, &workers[i]) != 0) {
+            perror("Failed to create worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    evloop_run(loop);
+    evloop_shutdown();
+    for (int i = 0; i < worker_count; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    peer_cache_stats(service.peers, &stats);
+    if (worker_count > 1) {
+        for (int i = 0; i < worker_count; i++) {
+            char who[32];
+            snprintf(who, sizeof(who), "Worker %d (CPU %d)", i, workers[i].cpu);
+            print_stats(who, &workers[i].stats);
+        }
+    }
+    stats_merge(&total);
+    print_stats("Teredo Server stopped", &total);
+    printf("Peers: %u cached, %lu inserted, %lu expired, %lu evicted\n",
+           stats.peers, stats.inserted, stats.expired, stats.evicted);
+    for (int i = 0; i < worker_count; i++)
+        serve_cleanup(&workers[i]);
+    evloop_destroy(loop);
+    peer_cache_destroy(service.peers);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,151 @@
+// uring.c - io_uring setup, submission and provided-buffer rings for uring.h
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // One mapping covers both the SQ and CQ rings
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (r->cq_map_len > r->sq_map_len)
+        r->sq_map_len = r->cq_map_len;
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    r->cq_map = r->sq_map;
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(r->sq_map, r->sq_map_len);
+        close(r->fd);
+        return -1;
+    }
+
+    unsigned char *sq = r->sq_map;
+    r->sq_head = (_Atomic unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (_Atomic unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_local_tail = atomic_load(r->sq_tail);
+
+    unsigned char *cq = r->cq_map;
+    r->cq_head = (_Atomic unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (_Atomic unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // SQ slot i always holds SQE i
+    for (unsigned i = 0; i <= r->sq_mask; i++)
+        r->sq_array[i] = i;
+    return 0;
+}
+
+void uring_exit(struct uring *r) {
+    munmap(r->sqes, r->sqes_len);
+    munmap(r->sq_map, r->sq_map_len);
+    close(r->fd);
+    r->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r) {
+    unsigned head = atomic_load_explicit(r->sq_head, memory_order_acquire);
+    if (r->sq_local_tail - head > r->sq_mask)
+        return NULL;
+    struct io_uring_sqe *sqe = &r->sqes[r->sq_local_tail & r->sq_mask];
+    r->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit(struct uring *r) {
+    unsigned tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+    unsigned pending = r->sq_local_tail - tail;
+
+    if (pending == 0)
+        return 0;
+    atomic_store_explicit(r->sq_tail, r->sq_local_tail, memory_order_release);
+    int ret;
+    do {
+        ret = sys_io_uring_enter(r->fd, pending, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+int uring_wait(struct uring *r) {
+    int ret;
+    do {
+        ret = sys_io_uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+int uring_buf_ring_init(struct uring *r, struct uring_buf_ring *ring, unsigned entries, uint16_t bgid) {
+    struct io_uring_buf_reg reg;
+
+    memset(ring, 0, sizeof(*ring));
+    if (entries == 0 || (entries & (entries - 1)) != 0 || entries > 32768) {
+        errno = EINVAL;
+        return -1;
+    }
+    ring->map_len = entries * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->br == MAP_FAILED)
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int saved = errno;
+        munmap(ring->br, ring->map_len);
+        errno = saved;
+        return -1;
+    }
+    ring->entries = entries;
+    ring->bgid = bgid;
+    return 0;
+}
+
+void uring_buf_ring_exit(struct uring *r, struct uring_buf_ring *ring) {
+    struct io_uring_buf_reg reg;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = ring->bgid;
+    sys_io_uring_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(ring->br, ring->map_len);
+}
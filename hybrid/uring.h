@@ -0,0 +1,136 @@
+// uring.h - minimal io_uring wrapper on the raw system calls
+//
+// Just enough of io_uring for the UDP data paths: a submission/completion
+// ring pair, provided-buffer rings for multishot recvmsg, and helpers to
+// prepare recvmsg/sendmsg SQEs. SQEs are queued with uring_get_sqe() and
+// handed to the kernel in one io_uring_enter() by uring_submit(). The ring
+// fd is pollable, so a ring can be driven from an evloop handler.
+//
+// A ring belongs to one thread.
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    // Submission queue
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;     // SQEs handed out, published by uring_submit()
+    // Completion queue
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // Mappings, for uring_exit()
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+};
+
+// Provided buffers for IOSQE_BUFFER_SELECT. The kernel takes buffers from
+// the head; we return them at the tail, published in batches.
+struct uring_buf_ring {
+    struct io_uring_buf_ring *br;
+    size_t map_len;
+    unsigned entries;
+    uint16_t bgid;
+    uint16_t tail;              // local tail, published by uring_buf_ring_publish()
+};
+
+// Create a ring with at least entries SQEs (twice as many CQEs). Returns 0
+// on success, -1 with errno set if io_uring is unavailable.
+int uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+
+// Next free SQE, zeroed, or NULL if the SQ is full (submit, then retry)
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+
+// Hand every queued SQE to the kernel. Returns the number submitted, or
+// -1 with errno set.
+int uring_submit(struct uring *r);
+
+// Block until at least one completion is available
+int uring_wait(struct uring *r);
+
+// Oldest unconsumed completion, or NULL. Mark it consumed with uring_cqe_seen().
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring *r) {
+    unsigned head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(r->cq_tail, memory_order_acquire))
+        return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *r) {
+    unsigned head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+    atomic_store_explicit(r->cq_head, head + 1, memory_order_release);
+}
+
+// Register a provided-buffer ring of entries buffers (a power of two) as
+// group bgid. Returns 0 on success, -1 with errno set.
+int uring_buf_ring_init(struct uring *r, struct uring_buf_ring *ring, unsigned entries, uint16_t bgid);
+void uring_buf_ring_exit(struct uring *r, struct uring_buf_ring *ring);
+
+// Stage a buffer for the kernel; it becomes visible at the next publish
+static inline void uring_buf_ring_add(struct uring_buf_ring *ring, void *addr, unsigned len, uint16_t bid) {
+    struct io_uring_buf *buf = &ring->br->bufs[ring->tail & (ring->entries - 1)];
+    buf->addr = (uint64_t)(uintptr_t)addr;
+    buf->len = len;
+    buf->bid = bid;
+    ring->tail++;
+}
+
+static inline void uring_buf_ring_publish(struct uring_buf_ring *ring) {
+    atomic_store_explicit((_Atomic uint16_t *)&ring->br->tail, ring->tail, memory_order_release);
+}
+
+// Multishot recvmsg into buffers of group bgid. msg supplies only the
+// name and control lengths the kernel lays out in each buffer.
+static inline void uring_prep_recvmsg_multishot(struct io_uring_sqe *sqe, int fd, struct msghdr *msg,
+                                                uint16_t bgid, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+    sqe->user_data = user_data;
+}
+
+static inline void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg,
+                                      uint64_t user_data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->user_data = user_data;
+}
+
+// A multishot recvmsg buffer: io_uring_recvmsg_out, then the name, the
+// control data and the payload, laid out for the lengths in msg. Fills
+// name/control/payload pointers and returns the payload length, or -1 if
+// the buffer is malformed or the datagram was truncated.
+static inline int uring_recvmsg_parse(void *buf, int len, const struct msghdr *msg,
+                                      void **name, struct msghdr *control, void **payload) {
+    struct io_uring_recvmsg_out *out = buf;
+    size_t header = sizeof(*out) + msg->msg_namelen + msg->msg_controllen;
+
+    if (len < 0 || (size_t)len < header || (out->flags & MSG_TRUNC) ||
+        header + out->payloadlen > (size_t)len)
+        return -1;
+    *name = (unsigned char *)(out + 1);
+    control->msg_control = (unsigned char *)(out + 1) + msg->msg_namelen;
+    control->msg_controllen = out->controllen;
+    *payload = (unsigned char *)buf + header;
+    return (int)out->payloadlen;
+}
+
+#endif